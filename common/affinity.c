@@ -0,0 +1,387 @@
+/*****************************************************************************
+ * affinity.c: thread placement functions
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <malloc.h>
+#include <sys/mman.h>
+
+#include "common/common.h"
+#include "common/affinity.h"
+
+#define LINSYS_NUMA_NODE_FILE "/sys/class/sdivideo/sdivideorx%u/device/numa_node"
+#define NODE_CPULIST_FILE     "/sys/devices/system/node/node%i/cpulist"
+
+/* Parse a Linux-style cpu list e.g. "0-3,8". ':' is also accepted as a separator
+ * because the cli splits its options on commas */
+static int parse_cpu_list( const char *cpu_list, cpu_set_t *set )
+{
+    const char *p = cpu_list;
+    char *end;
+    long first, last;
+
+    CPU_ZERO( set );
+
+    while( *p && *p != '\n' )
+    {
+        first = last = strtol( p, &end, 10 );
+        if( end == p || first < 0 )
+            return -1;
+        p = end;
+
+        if( *p == '-' )
+        {
+            p++;
+            last = strtol( p, &end, 10 );
+            if( end == p || last < first )
+                return -1;
+            p = end;
+        }
+
+        if( last >= CPU_SETSIZE )
+            return -1;
+
+        for( long i = first; i <= last; i++ )
+            CPU_SET( i, set );
+
+        if( *p == ',' || *p == ':' )
+            p++;
+        else if( *p && *p != '\n' )
+            return -1;
+    }
+
+    return CPU_COUNT( set ) ? 0 : -1;
+}
+
+int obe_check_cpu_list( const char *cpu_list )
+{
+    cpu_set_t set;
+
+    return parse_cpu_list( cpu_list, &set );
+}
+
+static int read_sysfs_line( char *buf, int len, const char *fmt, int idx )
+{
+    char filename[100];
+    FILE *fp;
+
+    snprintf( filename, sizeof(filename), fmt, idx );
+    fp = fopen( filename, "r" );
+    if( !fp )
+        return -1;
+
+    if( !fgets( buf, len, fp ) )
+    {
+        fclose( fp );
+        return -1;
+    }
+
+    fclose( fp );
+
+    return 0;
+}
+
+/* Returns the NUMA node the capture card is attached to or -1 if unknown */
+int obe_detect_numa_node( obe_device_t *device )
+{
+    char buf[20];
+
+    if( device->user_opts.has_numa_node )
+        return device->user_opts.numa_node;
+
+    if( device->device_type == INPUT_DEVICE_LINSYS_SDI &&
+        !read_sysfs_line( buf, sizeof(buf), LINSYS_NUMA_NODE_FILE, device->user_opts.card_idx ) )
+        return atoi( buf );
+
+    /* The Decklink SDK does not report which PCI device a card index is, so the node has to be given */
+    if( device->device_type == INPUT_DEVICE_DECKLINK )
+        syslog( LOG_WARNING, "Decklink card %i: NUMA node unknown, set numa-node to keep capture on the card's node\n",
+                device->user_opts.card_idx );
+
+    return -1;
+}
+
+/* Union of the cpus explicitly given to stages of any channel */
+static int get_reserved_cpus( obe_t *h, cpu_set_t *reserved )
+{
+    obe_shared_t *shared = h->shared;
+    cpu_set_t set;
+
+    CPU_ZERO( reserved );
+
+    pthread_mutex_lock( &shared->mutex );
+    for( int i = 0; i < shared->num_channels; i++ )
+    {
+        for( int j = 0; j < OBE_NUM_STAGES; j++ )
+        {
+            if( shared->channels[i]->stage_cpus[j] && !parse_cpu_list( shared->channels[i]->stage_cpus[j], &set ) )
+                CPU_OR( reserved, reserved, &set );
+        }
+    }
+    pthread_mutex_unlock( &shared->mutex );
+
+    return CPU_COUNT( reserved ) ? 0 : -1;
+}
+
+/* All the cpus the process may use except the reserved ones */
+static int get_unreserved_cpus( obe_t *h, cpu_set_t *set )
+{
+    cpu_set_t reserved;
+
+    if( get_reserved_cpus( h, &reserved ) < 0 || sched_getaffinity( 0, sizeof(*set), set ) < 0 )
+        return -1;
+
+    for( int i = 0; i < CPU_SETSIZE; i++ )
+    {
+        if( CPU_ISSET( i, &reserved ) )
+            CPU_CLR( i, set );
+    }
+
+    return CPU_COUNT( set ) ? 0 : -1;
+}
+
+static int get_stage_cpus( obe_t *h, int stage, cpu_set_t *set )
+{
+    char buf[1000];
+
+    if( h->stage_cpus[stage] )
+        return parse_cpu_list( h->stage_cpus[stage], set );
+
+    /* Frames are first touched by the input thread so running it on the card's node keeps them local */
+    if( stage == OBE_STAGE_INPUT && h->num_devices && h->devices[0]->numa_node >= 0 &&
+        !read_sysfs_line( buf, sizeof(buf), NODE_CPULIST_FILE, h->devices[0]->numa_node ) )
+        return parse_cpu_list( buf, set );
+
+    if( h->rt_opts.isolate_cpus )
+        return get_unreserved_cpus( h, set );
+
+    return -1;
+}
+
+static void set_stage_status( int *status, int obtained )
+{
+    /* A stage with several threads only counts as obtained if all of them were */
+    if( *status != OBE_RT_FAILED )
+        *status = obtained ? OBE_RT_OBTAINED : OBE_RT_FAILED;
+}
+
+typedef struct
+{
+    int stage;
+    void *(*start_routine)( void* );
+    void *arg;
+} obe_stage_thread_t;
+
+/* Memory allocated by the thread is charged to its stage */
+static void *start_stage_thread( void *ptr )
+{
+    obe_stage_thread_t stage_thread = *(obe_stage_thread_t*)ptr;
+
+    free( ptr );
+    obe_set_thread_stage( stage_thread.stage );
+
+    return stage_thread.start_routine( stage_thread.arg );
+}
+
+/* Create a pipeline thread with the placement and priority of its stage.
+ * Threads created by the new thread (e.g. x264's pool) inherit both */
+int obe_thread_create( obe_t *h, int stage, pthread_t *thread, void *(*start_routine)( void* ), void *arg )
+{
+    pthread_attr_t attr;
+    struct sched_param param = {0};
+    cpu_set_t set;
+    int ret, has_cpus, priority = h->rt_opts.priority[stage];
+
+    pthread_attr_init( &attr );
+
+    has_cpus = !get_stage_cpus( h, stage, &set );
+    if( has_cpus )
+        set_stage_status( &h->affinity_stage_status[stage], !pthread_attr_setaffinity_np( &attr, sizeof(set), &set ) );
+
+    /* The mux has always been round robin */
+    if( priority > 0 )
+    {
+        param.sched_priority = priority;
+        if( pthread_attr_setinheritsched( &attr, PTHREAD_EXPLICIT_SCHED ) ||
+            pthread_attr_setschedpolicy( &attr, stage == OBE_STAGE_MUX ? SCHED_RR : SCHED_FIFO ) ||
+            pthread_attr_setschedparam( &attr, &param ) )
+            priority = 0;
+    }
+
+    obe_stage_thread_t *stage_thread = malloc( sizeof(*stage_thread) );
+    if( !stage_thread )
+    {
+        pthread_attr_destroy( &attr );
+        return ENOMEM;
+    }
+    stage_thread->stage = stage;
+    stage_thread->start_routine = start_routine;
+    stage_thread->arg = arg;
+
+    ret = pthread_create( thread, &attr, start_stage_thread, stage_thread );
+    /* Without CAP_SYS_NICE or a suitable RLIMIT_RTPRIO this fails so run the stage at normal priority */
+    if( ret == EPERM && priority > 0 )
+    {
+        pthread_attr_setinheritsched( &attr, PTHREAD_INHERIT_SCHED );
+        ret = pthread_create( thread, &attr, start_stage_thread, stage_thread );
+        priority = 0;
+    }
+
+    if( ret )
+        free( stage_thread );
+
+    if( h->rt_opts.priority[stage] > 0 && !ret )
+    {
+        set_stage_status( &h->rt_stage_status[stage], priority > 0 );
+        if( !priority )
+            syslog( LOG_WARNING, "Could not set real-time priority of pipeline stage %i\n", stage );
+    }
+
+    pthread_attr_destroy( &attr );
+
+    return ret;
+}
+
+void obe_default_rt_profile( obe_rt_opts_t *rt_opts )
+{
+    memset( rt_opts, 0, sizeof(*rt_opts) );
+    rt_opts->priority[OBE_STAGE_ENC_SMOOTHING] = 99;
+    rt_opts->priority[OBE_STAGE_MUX] = 99;
+    rt_opts->priority[OBE_STAGE_MUX_SMOOTHING] = 99;
+    rt_opts->priority[OBE_STAGE_OUTPUT] = 99;
+}
+
+/* Touch the heap reserve so later allocations don't page fault */
+static int prefault_heap( int megabytes )
+{
+    size_t size = (size_t)megabytes << 20;
+    long page_size = sysconf( _SC_PAGESIZE );
+    uint8_t *buf = malloc( size );
+
+    if( !buf )
+        return -1;
+
+    for( size_t i = 0; i < size; i += page_size )
+        buf[i] = 0;
+
+    /* With trimming disabled this stays in the heap */
+    free( buf );
+
+    return 0;
+}
+
+/* Process-wide part of the real-time profile. Called from obe_start() before anything is allocated.
+ * Memory is locked by the first channel to start */
+void obe_apply_rt_profile( obe_t *h )
+{
+    obe_shared_t *shared = h->shared;
+
+    pthread_mutex_lock( &shared->mutex );
+    if( h->rt_opts.lock_memory && !shared->rt_applied )
+    {
+        /* Freed memory stays in the heap and large allocations come from it rather than fresh mmaps */
+        mallopt( M_TRIM_THRESHOLD, -1 );
+        mallopt( M_MMAP_MAX, 0 );
+
+        /* MCL_FUTURE also faults in thread stacks and queue rings as they are created */
+        shared->memory_locked = !mlockall( MCL_CURRENT | MCL_FUTURE );
+        if( !shared->memory_locked )
+            syslog( LOG_WARNING, "Could not lock memory: %s\n", strerror( errno ) );
+        else if( h->rt_opts.heap_reserve > 0 && prefault_heap( h->rt_opts.heap_reserve ) < 0 )
+            syslog( LOG_WARNING, "Could not prefault heap reserve\n" );
+        shared->rt_applied = 1;
+    }
+    pthread_mutex_unlock( &shared->mutex );
+
+    if( h->rt_opts.huge_pages )
+    {
+        obe_frame_pool_set_huge_pages( shared->frame_pool, 1 );
+        obe_coded_pool_set_huge_pages( shared->coded_pool, 1 );
+    }
+}
+
+#define FREE_HUGE_PAGES_FILE  "/sys/kernel/mm/hugepages/hugepages-2048kB/free_hugepages"
+#define TRANSPARENT_HUGE_FILE "/sys/kernel/mm/transparent_hugepage/enabled"
+
+/* Reserved huge pages still free, or -1 if there is no 2 MB pool */
+static int get_free_huge_pages( void )
+{
+    char buf[20];
+
+    return read_sysfs_line( buf, sizeof(buf), FREE_HUGE_PAGES_FILE, 0 ) ? -1 : atoi( buf );
+}
+
+/* The selected transparent huge page mode e.g. "madvise" */
+static void get_transparent_huge_mode( char *buf, int len )
+{
+    char *start, *end;
+
+    if( read_sysfs_line( buf, len, TRANSPARENT_HUGE_FILE, 0 ) || !( start = strchr( buf, '[' ) ) || !( end = strchr( start, ']' ) ) )
+    {
+        snprintf( buf, len, "unavailable" );
+        return;
+    }
+
+    *end = 0;
+    memmove( buf, start + 1, end - start );
+}
+
+static const char *rt_status_name( int status )
+{
+    return status == OBE_RT_OBTAINED ? "yes" : status == OBE_RT_FAILED ? "FAILED" : "n/a";
+}
+
+const char *obe_stage_name( int stage )
+{
+    static const char *stage_names[] = { "input", "video filter", "audio filter", "video encoder", "audio encoder",
+                                         "encoder smoothing", "mux", "mux smoothing", "output" };
+
+    return stage_names[stage];
+}
+
+void obe_print_rt_report( obe_t *h )
+{
+    fprintf( stderr, "Real-time profile:\n" );
+    fprintf( stderr, "    memory locked: %s", h->rt_opts.lock_memory ? rt_status_name( h->shared->memory_locked ? OBE_RT_OBTAINED : OBE_RT_FAILED ) : "n/a" );
+    if( h->shared->memory_locked && h->rt_opts.heap_reserve > 0 )
+        fprintf( stderr, " (%i MB heap prefaulted)", h->rt_opts.heap_reserve );
+    fprintf( stderr, "\n" );
+    fprintf( stderr, "    cpu isolation: %s\n", h->rt_opts.isolate_cpus ? "yes" : "no" );
+    fprintf( stderr, "    huge pages: %s", h->rt_opts.huge_pages ? "yes" : "no" );
+    if( h->rt_opts.huge_pages )
+    {
+        int64_t hugetlb_pages, transparent_pages;
+        char thp_mode[100];
+
+        obe_get_huge_page_stats( &hugetlb_pages, &transparent_pages );
+        get_transparent_huge_mode( thp_mode, sizeof(thp_mode) );
+        fprintf( stderr, " (%"PRIi64" reserved and %"PRIi64" transparent in use, %i reserved free, transparent mode %s)",
+                 hugetlb_pages, transparent_pages, get_free_huge_pages(), thp_mode );
+    }
+    fprintf( stderr, "\n" );
+
+    for( int i = 0; i < OBE_NUM_STAGES; i++ )
+    {
+        fprintf( stderr, "    %-18s priority: %2i %-6s  affinity: %-6s %s\n", obe_stage_name( i ), h->rt_opts.priority[i],
+                 rt_status_name( h->rt_stage_status[i] ), rt_status_name( h->affinity_stage_status[i] ),
+                 h->stage_cpus[i] ? h->stage_cpus[i] : "" );
+    }
+}
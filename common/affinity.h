@@ -0,0 +1,43 @@
+/*****************************************************************************
+ * affinity.h: thread placement functions header
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef OBE_COMMON_AFFINITY_H
+#define OBE_COMMON_AFFINITY_H
+
+#include "common/common.h"
+
+enum obe_rt_status_e
+{
+    OBE_RT_NOT_REQUESTED,
+    OBE_RT_OBTAINED,
+    OBE_RT_FAILED,
+};
+
+int obe_check_cpu_list( const char *cpu_list );
+int obe_detect_numa_node( obe_device_t *device );
+int obe_thread_create( obe_t *h, int stage, pthread_t *thread, void *(*start_routine)( void* ), void *arg );
+
+void obe_default_rt_profile( obe_rt_opts_t *rt_opts );
+void obe_apply_rt_profile( obe_t *h );
+void obe_print_rt_report( obe_t *h );
+const char *obe_stage_name( int stage );
+
+#endif
@@ -0,0 +1,257 @@
+/*****************************************************************************
+ * clock.c: recovered input clock
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include "common/common.h"
+
+#include <math.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/* The estimator is a second-order PLL tracking the input clock against CLOCK_MONOTONIC.
+ * It starts with a wide loop to lock quickly and then narrows so that callback jitter is filtered out */
+#define CLOCK_DAMPING          0.707
+#define CLOCK_LOCK_BANDWIDTH   0.05 /* Hz */
+#define CLOCK_BANDWIDTH        0.01 /* Hz */
+#define CLOCK_LOCK_TICKS       250
+#define CLOCK_MAX_DRIFT        0.001
+/* Anything further off than this is a discontinuity in the input so start again */
+#define CLOCK_RESET_THRESHOLD  (OBE_CLOCK/10)
+
+/* TODO handle error conditions */
+int64_t get_wallclock_in_mpeg_ticks( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return ((int64_t)ts.tv_sec * (int64_t)27000000) + (int64_t)(ts.tv_nsec * 27 / 1000);
+}
+
+void sleep_mpeg_ticks( int64_t i_time )
+{
+    struct timespec ts;
+    ts.tv_sec = i_time / 27000000;
+    ts.tv_nsec = ((i_time % 27000000) * 1000) / 27;
+
+    clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, &ts );
+}
+
+void obe_init_clock( obe_clock_t *clock )
+{
+    memset( clock, 0, sizeof(*clock) );
+    clock->rate = 1.0;
+}
+
+/* Seqlock read of the published estimate. Returns the sequence number it was read at */
+static unsigned int read_clock( obe_clock_t *clock, obe_clock_t *snapshot )
+{
+    unsigned int seq;
+
+    while( 1 )
+    {
+        seq = __atomic_load_n( &clock->seq, __ATOMIC_ACQUIRE );
+        if( seq & 1 )
+            continue;
+
+        snapshot->base_pts = __atomic_load_n( &clock->base_pts, __ATOMIC_RELAXED );
+        snapshot->base_wallclock = __atomic_load_n( &clock->base_wallclock, __ATOMIC_RELAXED );
+        __atomic_load( &clock->rate, &snapshot->rate, __ATOMIC_RELAXED );
+        snapshot->last_pts = __atomic_load_n( &clock->last_pts, __ATOMIC_RELAXED );
+        snapshot->lock_ticks = __atomic_load_n( &clock->lock_ticks, __ATOMIC_RELAXED );
+        snapshot->num_ticks = __atomic_load_n( &clock->num_ticks, __ATOMIC_RELAXED );
+        snapshot->num_resets = __atomic_load_n( &clock->num_resets, __ATOMIC_RELAXED );
+        __atomic_load( &clock->jitter, &snapshot->jitter, __ATOMIC_RELAXED );
+        snapshot->max_jitter = __atomic_load_n( &clock->max_jitter, __ATOMIC_RELAXED );
+
+        __atomic_thread_fence( __ATOMIC_ACQUIRE );
+        if( __atomic_load_n( &clock->seq, __ATOMIC_RELAXED ) == seq )
+            return seq;
+    }
+}
+
+/* Seqlock write. Only the input thread writes */
+static void publish_clock( obe_clock_t *clock, int64_t base_pts, int64_t wallclock, double rate, int64_t value,
+                           int64_t lock_ticks, int64_t num_resets, double jitter, int64_t max_jitter )
+{
+    __atomic_store_n( &clock->seq, clock->seq + 1, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+
+    __atomic_store_n( &clock->base_pts, base_pts, __ATOMIC_RELAXED );
+    __atomic_store_n( &clock->base_wallclock, wallclock, __ATOMIC_RELAXED );
+    __atomic_store( &clock->rate, &rate, __ATOMIC_RELAXED );
+    __atomic_store_n( &clock->last_pts, value, __ATOMIC_RELAXED );
+    __atomic_store_n( &clock->lock_ticks, lock_ticks, __ATOMIC_RELAXED );
+    __atomic_store_n( &clock->num_ticks, clock->num_ticks + 1, __ATOMIC_RELAXED );
+    __atomic_store_n( &clock->num_resets, num_resets, __ATOMIC_RELAXED );
+    __atomic_store( &clock->jitter, &jitter, __ATOMIC_RELAXED );
+    __atomic_store_n( &clock->max_jitter, max_jitter, __ATOMIC_RELAXED );
+
+    __atomic_store_n( &clock->seq, clock->seq + 1, __ATOMIC_RELEASE );
+}
+
+/* Called by the input thread, the only writer, for every frame */
+void obe_clock_tick( obe_t *h, int64_t value )
+{
+    obe_clock_t *clock = &h->clock;
+    int64_t wallclock = get_wallclock_in_mpeg_ticks();
+    int64_t elapsed = wallclock - clock->base_wallclock;
+    int64_t predicted, error, max_jitter = clock->max_jitter;
+    int64_t base_pts = value, lock_ticks = clock->lock_ticks + 1, num_resets = clock->num_resets;
+    double rate = clock->rate, jitter = clock->jitter;
+    double bandwidth, wt;
+
+    /* Use this signal as the SDI clocksource */
+    predicted = clock->base_pts + llrint( rate * elapsed );
+    error = value - predicted;
+
+    if( clock->num_ticks && elapsed > 0 && llabs( error ) < CLOCK_RESET_THRESHOLD )
+    {
+        /* The phase takes a fraction of the error and the rate integrates it */
+        bandwidth = clock->lock_ticks < CLOCK_LOCK_TICKS ? CLOCK_LOCK_BANDWIDTH : CLOCK_BANDWIDTH;
+        wt = 2 * M_PI * bandwidth * elapsed / OBE_CLOCK;
+        base_pts = predicted + llrint( MIN( 2 * CLOCK_DAMPING * wt, 1.0 ) * error );
+        rate += wt * wt * error / elapsed;
+        rate = MIN( MAX( rate, 1.0 - CLOCK_MAX_DRIFT ), 1.0 + CLOCK_MAX_DRIFT );
+
+        if( clock->lock_ticks >= CLOCK_LOCK_TICKS )
+        {
+            jitter += ( llabs( error ) - jitter ) / 16;
+            max_jitter = MAX( max_jitter, llabs( error ) );
+        }
+    }
+    else
+    {
+        if( clock->num_ticks )
+        {
+            num_resets++;
+            syslog( LOG_WARNING, "Input clock discontinuity of %"PRIi64" ticks\n", error );
+        }
+        /* Lock again with the wide loop */
+        rate = 1.0;
+        lock_ticks = 1;
+    }
+
+    publish_clock( clock, base_pts, wallclock, rate, value, lock_ticks, num_resets, jitter, max_jitter );
+
+    obe_clock_wake( h, 0 );
+}
+
+/* For inputs that are not real-time (e.g. unpaced file replay). The clock runs in wallclock time and
+ * jumps forward to each value that is ahead of it. It never goes backwards */
+void obe_clock_step( obe_t *h, int64_t value )
+{
+    obe_clock_t *clock = &h->clock;
+    int64_t wallclock = get_wallclock_in_mpeg_ticks();
+    int64_t base_pts = value;
+
+    if( clock->num_ticks )
+        base_pts = MAX( value, clock->base_pts + llrint( clock->rate * ( wallclock - clock->base_wallclock ) ) );
+
+    publish_clock( clock, base_pts, wallclock, 1.0, value, clock->lock_ticks + 1, clock->num_resets, clock->jitter, clock->max_jitter );
+
+    obe_clock_wake( h, 0 );
+}
+
+int64_t get_input_clock_in_mpeg_ticks( obe_t *h )
+{
+    obe_clock_t snapshot;
+    read_clock( &h->clock, &snapshot );
+
+    return snapshot.base_pts + llrint( snapshot.rate * ( get_wallclock_in_mpeg_ticks() - snapshot.base_wallclock ) );
+}
+
+void sleep_input_clock( obe_t *h, int64_t i_time )
+{
+    obe_clock_t snapshot;
+    read_clock( &h->clock, &snapshot );
+
+    sleep_mpeg_ticks( snapshot.base_wallclock + llrint( ( i_time - snapshot.base_pts ) / snapshot.rate ) );
+}
+
+/* Last input tick. The returned sequence number is what obe_clock_wait_tick() waits to change */
+unsigned int obe_clock_last_tick( obe_t *h, int64_t *last_pts )
+{
+    obe_clock_t snapshot;
+    unsigned int seq = read_clock( &h->clock, &snapshot );
+
+    *last_pts = snapshot.last_pts;
+
+    return seq;
+}
+
+/* Wait for the tick after seq or until *cancel is set */
+void obe_clock_wait_tick( obe_t *h, unsigned int seq, int *cancel )
+{
+    obe_clock_t *clock = &h->clock;
+    int wake_seq;
+
+    while( 1 )
+    {
+        wake_seq = __atomic_load_n( &clock->wake_seq, __ATOMIC_ACQUIRE );
+        if( __atomic_load_n( &clock->seq, __ATOMIC_ACQUIRE ) != seq || __atomic_load_n( cancel, __ATOMIC_ACQUIRE ) )
+            break;
+
+        /* Recheck after announcing ourselves so a concurrent tick either sees us or we see it */
+        __atomic_add_fetch( &clock->num_waiters, 1, __ATOMIC_RELAXED );
+        __atomic_thread_fence( __ATOMIC_SEQ_CST );
+        if( __atomic_load_n( &clock->seq, __ATOMIC_ACQUIRE ) == seq && !__atomic_load_n( cancel, __ATOMIC_ACQUIRE ) )
+            syscall( SYS_futex, &clock->wake_seq, FUTEX_WAIT_PRIVATE, wake_seq, NULL, NULL, 0 );
+        __atomic_sub_fetch( &clock->num_waiters, 1, __ATOMIC_RELAXED );
+    }
+}
+
+/* Only enter the kernel if someone is waiting for a tick (or when forced e.g. on cancel) */
+void obe_clock_wake( obe_t *h, int force )
+{
+    obe_clock_t *clock = &h->clock;
+
+    __atomic_thread_fence( __ATOMIC_SEQ_CST );
+    if( force || __atomic_load_n( &clock->num_waiters, __ATOMIC_RELAXED ) )
+    {
+        __atomic_add_fetch( &clock->wake_seq, 1, __ATOMIC_RELEASE );
+        syscall( SYS_futex, &clock->wake_seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0 );
+    }
+}
+
+int obe_get_clock_stats( obe_t *h, obe_clock_stats_t *stats )
+{
+    obe_clock_t snapshot;
+    read_clock( &h->clock, &snapshot );
+
+    stats->locked = snapshot.lock_ticks >= CLOCK_LOCK_TICKS;
+    stats->drift_ppm = ( snapshot.rate - 1.0 ) * 1e6;
+    stats->jitter_us = snapshot.jitter / 27;
+    stats->max_jitter_us = (double)snapshot.max_jitter / 27;
+    stats->num_ticks = snapshot.num_ticks;
+    stats->num_resets = snapshot.num_resets;
+
+    return 0;
+}
+
+void obe_print_clock_stats( obe_t *h )
+{
+    obe_clock_stats_t stats;
+    obe_get_clock_stats( h, &stats );
+
+    fprintf( stderr, "Input clock: %s, drift %.2f ppm, jitter %.1f us (max %.1f us), %"PRIi64" ticks, %"PRIi64" discontinuities\n",
+             stats.locked ? "locked" : "unlocked", stats.drift_ppm, stats.jitter_us, stats.max_jitter_us,
+             stats.num_ticks, stats.num_resets );
+}
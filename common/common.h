@@ -44,11 +44,14 @@
 #include <time.h>
 #include "obe.h"
 
-#define MAX_DEVICES 1
+#define MAX_DEVICES 1 /* per channel */
 #define MAX_STREAMS 40
 #define MAX_CHANNELS 16
+#define MAX_CHANNELS_PER_PROCESS 8
 
 #define MAX_PROBE_TIME 20
+/* Once the first frame has been probed, how long to wait for audio (us). Not every signal carries any */
+#define PROBE_AUDIO_WAIT 1000000
 
 #define OBE_CLOCK 27000000LL
 
@@ -74,6 +77,14 @@
 
 /* Network output */
 #define TS_PACKETS_SIZE 1316
+#define TS_SLICE_PACKETS (TS_PACKETS_SIZE / 188)
+
+/* Queue capacities (rounded up to a power of two) */
+#define FRAME_QUEUE_CAPACITY 1024
+#define MUXED_QUEUE_CAPACITY 32768
+
+/* Default high-water mark of raw video queues (about two seconds of video) */
+#define RAW_VIDEO_HIGH_WATER 50
 
 /* Audio sample patterns */
 #define MAX_AUDIO_SAMPLE_PATTERN 5
@@ -188,6 +199,7 @@ typedef struct
 
     pthread_mutex_t device_mutex;
     pthread_t device_thread;
+    int numa_node; /* -1 if unknown */
 
     int num_input_streams;
     obe_int_input_stream_t *streams[MAX_STREAMS];
@@ -196,6 +208,7 @@ typedef struct
     obe_output_stream_t *output_streams;
 
     obe_input_stream_t *probed_streams;
+    char *probe_cache_file; /* NULL unless the streams were written to or read from the probe cache */
 } obe_device_t;
 
 typedef struct
@@ -227,6 +240,7 @@ typedef struct
     int      num_channels;
     int      num_samples;
     int      sample_fmt;
+    int      alloc_size; /* of the sample buffers, if the frame owns them */
 } obe_audio_frame_t;
 
 enum user_data_types_e
@@ -304,6 +318,17 @@ typedef struct
     uint8_t *data;
 } obe_user_data_t;
 
+/* Per-frame bump allocator for ancillary and user data.
+ * Nothing is freed individually; the whole arena goes with the frame */
+typedef struct obe_arena_chunk_t obe_arena_chunk_t;
+
+typedef struct
+{
+    obe_arena_chunk_t *chunks;
+    uint8_t *pos;
+    uint8_t *end;
+} obe_arena_t;
+
 typedef struct
 {
     int hours;
@@ -315,14 +340,33 @@ typedef struct
 
 typedef struct
 {
+    /* Preallocated ring of capacity entries, capacity is a power of two */
     void **queue;
+    int  capacity;
+    int  head;
     int  size;
 
     pthread_mutex_t mutex;
     pthread_cond_t  in_cv;
     pthread_cond_t  out_cv;
+
+    /* Lock-free single-producer/single-consumer mode.
+     * size is atomic, head belongs to the consumer and tail to the producer */
+    int  spsc;
+    int  tail;
+    int  consumer_parked;
+    int  wake_seq;
+
+    /* Overload shedding. Without drop_item a full queue refuses items and the producer keeps them */
+    int  high_water;
+    int  shed_policy;
+    void (*drop_item)( void *item );
+    int64_t *num_shed;
 } obe_queue_t;
 
+/* i-th oldest item in a queue. The queue mutex must be held */
+#define QUEUE_ITEM(q,i) ((q)->queue[((q)->head + (i)) & ((q)->capacity - 1)])
+
 typedef struct
 {
     int input_stream_id;
@@ -346,8 +390,10 @@ typedef struct
     int timebase_num;
     int timebase_den;
 
-    /* Ancillary / User-data */
+    /* Ancillary / User-data, allocated from the arena */
+    obe_arena_t arena;
     int num_user_data;
+    int max_user_data;
     obe_user_data_t *user_data;
 
     /* Audio */
@@ -358,7 +404,16 @@ typedef struct
     int valid_timecode;
     obe_timecode_t timecode;
 
+    /* Set on the first video frame after the input changed format, or on the very first frame if it does not
+     * match the probed streams. The filter and video encoders rebuild on it */
     int reset_obe;
+
+    /* Stage the frame is charged to */
+    int mem_tag;
+
+    /* Shared frames: a frame feeding several encoders is referenced by one child frame per encoder */
+    int refcount;
+    void *shared_parent;
 } obe_raw_frame_t;
 
 typedef struct
@@ -419,25 +474,126 @@ typedef struct
     uint8_t *data;
 } obe_coded_frame_t;
 
+/* A datagram's worth of TS packets inside a page */
 typedef struct
+{
+    struct obe_muxed_data_t *page;
+    uint8_t *data;  /* TS_PACKETS_SIZE bytes */
+    int64_t pcr;    /* of the first packet */
+} obe_ts_slice_t;
+
+/* TS page: a run of 188-byte packets with the PCR of each packet.
+ * Pages are reference counted so that smoothing and outputs pass slices of them around without copying.
+ * Up to TS_SLICE_PACKETS-1 packets of headroom in front of data and pcr_list take the end of the previous page */
+typedef struct obe_muxed_data_t
 {
     int len;
     uint8_t *data;
 
     /* MPEG-TS */
     int64_t *pcr_list;
+
+    int refcount;
+    int num_slices;
+    obe_ts_slice_t *slices;
 } obe_muxed_data_t;
 
+/* Pipeline graph built by obe_start(). Nodes are threads, edges are the queues between them */
+typedef struct
+{
+    int stage;
+    pthread_t *thread;
+    int *cancel;        /* NULL if the thread can only be stopped with pthread_cancel */
+    obe_queue_t *queue; /* input queue, NULL for the input */
+} obe_graph_node_t;
+
+typedef struct
+{
+    int src;
+    int dst;
+    int64_t num_items; /* items routed along the edge */
+} obe_graph_edge_t;
+
+typedef struct
+{
+    int num_nodes;
+    obe_graph_node_t *nodes;
+    int num_edges;
+    obe_graph_edge_t *edges;
+
+    /* Direct lookup by stream id. Edge indices are -1 where a stream is not routed */
+    int num_input_ids;
+    obe_int_input_stream_t **input_streams;
+    int *filter_edges;
+
+    int num_output_ids;
+    obe_output_stream_t **output_streams;
+    obe_encoder_t **encoders;
+    int *encoder_edges;
+} obe_graph_t;
+
+/* Recycled raw video buffers keyed by (csp, width, height, alignment), optionally on huge pages */
+typedef struct obe_frame_pool_t obe_frame_pool_t;
+
+/* Recycled coded frames and TS pages, header and payload together, by payload size class */
+typedef struct obe_coded_pool_t obe_coded_pool_t;
+
+/* Recovered input clock. The input thread is the only writer and publishes its
+ * estimate through a seqlock so that readers never block */
+typedef struct
+{
+    unsigned int seq;       /* odd while an update is in progress */
+    int64_t base_pts;       /* estimated input clock at base_wallclock */
+    int64_t base_wallclock;
+    double  rate;           /* input clock ticks per wallclock tick */
+    int64_t last_pts;       /* last raw tick from the input */
+    int64_t lock_ticks;     /* ticks since the loop last started, it is locked after CLOCK_LOCK_TICKS */
+
+    /* Statistics */
+    int64_t num_ticks;
+    int64_t num_resets;
+    double  jitter;         /* mean deviation of ticks from the estimate */
+    int64_t max_jitter;
+
+    /* Waiting for the next tick */
+    int wake_seq;
+    int num_waiters;
+} obe_clock_t;
+
+/* State shared by the channels of a process. Each channel is an obe_t with its own
+ * input device, clock domain, drop state and pipeline */
+typedef struct
+{
+    pthread_mutex_t mutex;
+    int num_channels;
+    obe_t *channels[MAX_CHANNELS_PER_PROCESS];
+
+    /* Process-wide part of the real-time profile, applied by the first channel that asks for it */
+    int rt_applied;
+    int memory_locked;
+
+    obe_frame_pool_t *frame_pool;
+    obe_coded_pool_t *coded_pool;
+} obe_shared_t;
+
 struct obe_t
 {
     int is_active;
     int obe_system;
 
-    /* OBE recovered clock */
-    pthread_mutex_t obe_clock_mutex;
-    pthread_cond_t  obe_clock_cv;
-    int64_t         obe_clock_last_pts; /* from sdi clock */
-    int64_t         obe_clock_last_wallclock; /* from cpu clock */
+    /* Channels of this process */
+    obe_shared_t *shared;
+
+    /* Thread placement (cpu lists, NULL for no restriction) */
+    char *stage_cpus[OBE_NUM_STAGES];
+
+    /* Real-time profile and what was actually obtained */
+    obe_rt_opts_t rt_opts;
+    int rt_stage_status[OBE_NUM_STAGES];
+    int affinity_stage_status[OBE_NUM_STAGES];
+
+    /* OBE recovered clock. Every channel is its own clock domain */
+    obe_clock_t clock;
 
     /* Devices */
     pthread_mutex_t device_list_mutex;
@@ -445,8 +601,7 @@ struct obe_t
     obe_device_t *devices[MAX_DEVICES];
     int cur_input_stream_id;
 
-    /* Frame drop flags
-     * TODO: make this work for multiple inputs and outputs */
+    /* Frame drop flags of this channel */
     pthread_mutex_t drop_mutex;
     int encoder_drop;
     int mux_drop;
@@ -494,7 +649,15 @@ struct obe_t
     /* Muxed frames in smoothing buffer */
     obe_queue_t mux_smoothing_queue;
 
+    /* Threads and queues of the running pipeline */
+    obe_graph_t graph;
+
+    /* Overload shedding */
+    int shed_policy[OBE_NUM_STAGES];
+    int high_water[OBE_NUM_STAGES]; /* 0 for the default */
+
     /* Statistics and Monitoring */
+    int64_t num_shed[OBE_NUM_STAGES];
 
 
 };
@@ -508,27 +671,64 @@ extern const obe_smoothing_func_t enc_smoothing;
 extern const obe_smoothing_func_t mux_smoothing;
 
 int64_t obe_mdate( void );
+void obe_timeout_to_timespec( int64_t usecs, struct timespec *ts );
 
 obe_device_t *new_device( void );
 void destroy_device( obe_device_t *device );
+void remove_probe_cache( obe_device_t *device );
 obe_raw_frame_t *new_raw_frame( void );
 void destroy_raw_frame( obe_raw_frame_t *raw_frame );
-obe_coded_frame_t *new_coded_frame( int stream_id, int len );
+obe_raw_frame_t *obe_share_raw_frame( obe_raw_frame_t *raw_frame );
+void obe_unref_raw_frame( obe_raw_frame_t *raw_frame );
+obe_coded_frame_t *new_coded_frame( obe_t *h, int stream_id, int len );
 void destroy_coded_frame( obe_coded_frame_t *coded_frame );
 void obe_release_video_data( void *ptr );
+int obe_alloc_audio_data( obe_raw_frame_t *raw_frame, int num_channels );
 void obe_release_audio_data( void *ptr );
 void obe_release_frame( void *ptr );
 
-obe_muxed_data_t *new_muxed_data( int len );
+obe_frame_pool_t *obe_new_frame_pool( void );
+void obe_frame_pool_set_huge_pages( obe_frame_pool_t *pool, int huge_pages );
+void obe_destroy_frame_pool( obe_frame_pool_t *pool );
+int obe_pool_reserve_images( obe_frame_pool_t *pool, int csp, int width, int height, int align, int count );
+int obe_pool_reserve_like_image( void *data, int count );
+int obe_pool_get_image( obe_frame_pool_t *pool, uint8_t *plane[4], int stride[4], int csp, int width, int height, int align );
+void obe_pool_ref_image( void *data );
+void obe_pool_unref_image( void *data );
+obe_coded_pool_t *obe_new_coded_pool( void );
+void obe_coded_pool_set_huge_pages( obe_coded_pool_t *pool, int huge_pages );
+void obe_destroy_coded_pool( obe_coded_pool_t *pool );
+int obe_pool_reserve_blocks( obe_coded_pool_t *pool, int len, int count );
+obe_coded_frame_t *obe_pool_get_coded_frame( obe_coded_pool_t *pool, int len );
+void obe_pool_put_coded_frame( obe_coded_frame_t *coded_frame );
+void *obe_pool_get_block( obe_coded_pool_t *pool, int len );
+void obe_pool_put_block( void *data );
+void obe_get_huge_page_stats( int64_t *hugetlb_pages, int64_t *transparent_pages );
+void *obe_arena_alloc( obe_arena_t *arena, int size );
+void obe_arena_free( obe_arena_t *arena );
+obe_user_data_t *obe_add_user_data( obe_raw_frame_t *raw_frame, int len );
+
+obe_muxed_data_t *new_muxed_data( obe_t *h, int len );
+void obe_ref_muxed_data( obe_muxed_data_t *muxed_data );
 void destroy_muxed_data( obe_muxed_data_t *muxed_data );
 
 void add_device( obe_t *h, obe_device_t *device );
 
+int obe_init_queue( obe_queue_t *queue, int capacity, int spsc );
+void obe_destroy_queue( obe_queue_t *queue );
+int obe_queue_wait( obe_queue_t *queue, int num_items, int *cancel );
+void obe_queue_cancel( obe_queue_t *queue, int *cancel );
+int obe_queue_drain( obe_queue_t *queue, void **batch );
+void obe_set_queue_shedding( obe_queue_t *queue, int high_water, int shed_policy, void (*drop_item)( void *item ), int64_t *num_shed );
+int obe_queue_above_high_water( obe_queue_t *queue );
+void obe_queue_count_shed( obe_queue_t *queue, int num_items );
+int obe_queue_shed( obe_queue_t *queue );
 int add_to_queue( obe_queue_t *queue, void *item );
 int remove_from_queue( obe_queue_t *queue );
 int remove_item_from_queue( obe_queue_t *queue, void *item );
 
 int add_to_filter_queue( obe_t *h, obe_raw_frame_t *raw_frame );
+int obe_pipeline_full( obe_t *h );
 int add_to_encode_queue( obe_t *h, obe_raw_frame_t *raw_frame, int output_stream_id );
 int remove_early_frames( obe_t *h, int64_t pts );
 int add_to_output_queue( obe_t *h, obe_muxed_data_t *muxed_data );
@@ -539,11 +739,26 @@ obe_encoder_t *get_encoder( obe_t *h, int stream_id );
 obe_output_stream_t *get_output_stream( obe_t *h, int stream_id );
 obe_output_stream_t *get_output_stream_by_format( obe_t *h, int format );
 
+void obe_set_avc_colorimetry( x264_param_t *param );
+
 int64_t get_wallclock_in_mpeg_ticks( void );
 void sleep_mpeg_ticks( int64_t i_delay );
+void obe_init_clock( obe_clock_t *clock );
 void obe_clock_tick( obe_t *h, int64_t value );
+void obe_clock_step( obe_t *h, int64_t value );
 int64_t get_input_clock_in_mpeg_ticks( obe_t *h );
 void sleep_input_clock( obe_t *h, int64_t i_delay );
+unsigned int obe_clock_last_tick( obe_t *h, int64_t *last_pts );
+void obe_clock_wait_tick( obe_t *h, unsigned int seq, int *cancel );
+void obe_clock_wake( obe_t *h, int force );
+void obe_print_clock_stats( obe_t *h );
+
+void obe_set_thread_stage( int stage );
+int obe_mem_alloc( int64_t size );
+void obe_mem_charge( int tag, int64_t size );
+void obe_mem_free( int tag, int64_t size );
+void obe_print_mem_stats( void );
+void obe_print_leak_report( void );
 
 int get_non_display_location( int type );
 
@@ -24,8 +24,10 @@
 #include "common/common.h"
 #include <libavcodec/avcodec.h>
 
+/* codec->opaque is the obe_t the decoded frames belong to */
 int obe_get_buffer( AVCodecContext *codec, AVFrame *pic )
 {
+    obe_t *obe = codec->opaque;
     int w = codec->width;
     int h = codec->height;
     int stride[4];
@@ -34,7 +36,7 @@ int obe_get_buffer( AVCodecContext *codec, AVFrame *pic )
 
     /* Only EDGE_EMU codecs are used
      * Allocate an extra line so that SIMD can modify the entire stride for every active line */
-    if( av_image_alloc( pic->data, pic->linesize, w, h + 1, codec->pix_fmt, 32 ) < 0 )
+    if( obe_pool_get_image( obe->shared->frame_pool, pic->data, pic->linesize, codec->pix_fmt, w, h + 1, 32 ) < 0 )
         return -1;
 
     pic->reordered_opaque = codec->reordered_opaque;
@@ -43,10 +45,20 @@ int obe_get_buffer( AVCodecContext *codec, AVFrame *pic )
     return 0;
 }
 
+/* Preallocate count buffers of the size obe_get_buffer() asks for at this resolution */
+int obe_reserve_buffers( AVCodecContext *codec, int width, int height, int count )
+{
+    obe_t *obe = codec->opaque;
+    int stride[4];
+
+    avcodec_align_dimensions2( codec, &width, &height, stride );
+
+    return obe_pool_reserve_images( obe->shared->frame_pool, codec->pix_fmt, width, height + 1, 32, count );
+}
+
 void obe_release_buffer( AVCodecContext *codec, AVFrame *pic )
 {
-     /* FIXME: need to release frame when both decoder and encoder are done */
-     //av_freep( &pic->data[0] );
+     /* The raw frame owns the buffer and gives it back to the pool through release_data */
      memset( pic->data, 0, sizeof(pic->data) );
 }
 
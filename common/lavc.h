@@ -27,6 +27,7 @@
 #include <libavcodec/avcodec.h>
 
 int obe_get_buffer( AVCodecContext *codec, AVFrame *pic );
+int obe_reserve_buffers( AVCodecContext *codec, int width, int height, int count );
 void obe_release_buffer( AVCodecContext *codec, AVFrame *pic );
 int obe_reget_buffer( AVCodecContext *codec, AVFrame *pic );
 int obe_lavc_lockmgr( void **mutex, enum AVLockOp op );
@@ -0,0 +1,139 @@
+/*****************************************************************************
+ * memory.c: per-stage memory accounting
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include "common/common.h"
+#include "common/affinity.h"
+
+/* Memory is charged to the stage of the thread that allocates it and credited back
+ * to the same stage wherever it is freed, so a stage's bytes are what it has produced
+ * and the rest of the pipeline has not yet released. Buffers sitting on the pools'
+ * free lists are charged to OBE_MEM_POOL. The counters are process-wide */
+typedef struct
+{
+    int64_t bytes;
+    int64_t peak_bytes;
+    int64_t num_allocs;
+
+    /* Snapshot for the allocation rate, protected by rate_mutex */
+    int64_t last_num_allocs;
+    int64_t last_query;
+} obe_mem_counter_t;
+
+static obe_mem_counter_t mem_counters[OBE_MEM_NUM_TAGS];
+static pthread_mutex_t rate_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread int thread_mem_tag = OBE_MEM_OTHER;
+
+void obe_set_thread_stage( int stage )
+{
+    thread_mem_tag = stage;
+}
+
+void obe_mem_charge( int tag, int64_t size )
+{
+    obe_mem_counter_t *counter = &mem_counters[tag];
+    int64_t bytes = __atomic_add_fetch( &counter->bytes, size, __ATOMIC_RELAXED );
+    int64_t peak_bytes = __atomic_load_n( &counter->peak_bytes, __ATOMIC_RELAXED );
+
+    while( bytes > peak_bytes && !__atomic_compare_exchange_n( &counter->peak_bytes, &peak_bytes, bytes, 1,
+                                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+        ;
+}
+
+int obe_mem_alloc( int64_t size )
+{
+    obe_mem_charge( thread_mem_tag, size );
+    __atomic_add_fetch( &mem_counters[thread_mem_tag].num_allocs, 1, __ATOMIC_RELAXED );
+
+    return thread_mem_tag;
+}
+
+void obe_mem_free( int tag, int64_t size )
+{
+    __atomic_sub_fetch( &mem_counters[tag].bytes, size, __ATOMIC_RELAXED );
+}
+
+const char *obe_get_mem_tag_name( int tag )
+{
+    if( tag == OBE_MEM_OTHER )
+        return "other";
+    if( tag == OBE_MEM_POOL )
+        return "pool free lists";
+    return obe_stage_name( tag );
+}
+
+int obe_get_mem_stats( int tag, obe_mem_stats_t *stats )
+{
+    obe_mem_counter_t *counter;
+    int64_t now = get_wallclock_in_mpeg_ticks();
+
+    if( tag < 0 || tag >= OBE_MEM_NUM_TAGS )
+        return -1;
+
+    counter = &mem_counters[tag];
+    stats->bytes = __atomic_load_n( &counter->bytes, __ATOMIC_RELAXED );
+    stats->peak_bytes = __atomic_load_n( &counter->peak_bytes, __ATOMIC_RELAXED );
+    stats->num_allocs = __atomic_load_n( &counter->num_allocs, __ATOMIC_RELAXED );
+
+    /* The rate covers the time since the previous query */
+    pthread_mutex_lock( &rate_mutex );
+    stats->allocs_per_sec = counter->last_query && now > counter->last_query ?
+                            (double)( stats->num_allocs - counter->last_num_allocs ) * OBE_CLOCK / ( now - counter->last_query ) : 0;
+    counter->last_num_allocs = stats->num_allocs;
+    counter->last_query = now;
+    pthread_mutex_unlock( &rate_mutex );
+
+    return 0;
+}
+
+void obe_print_mem_stats( void )
+{
+    obe_mem_stats_t stats;
+
+    fprintf( stderr, "Memory:\n" );
+    for( int i = 0; i < OBE_MEM_NUM_TAGS; i++ )
+    {
+        obe_get_mem_stats( i, &stats );
+        fprintf( stderr, "    %-18s %10"PRIi64" kB in use  %10"PRIi64" kB peak  %10"PRIi64" allocations  %8.1f/s\n",
+                 obe_get_mem_tag_name( i ), stats.bytes >> 10, stats.peak_bytes >> 10, stats.num_allocs, stats.allocs_per_sec );
+    }
+}
+
+/* Called once everything has been torn down. Anything still charged to a stage was never released */
+void obe_print_leak_report( void )
+{
+    int leaked = 0;
+    int64_t bytes;
+
+    for( int i = 0; i < OBE_MEM_NUM_TAGS; i++ )
+    {
+        bytes = __atomic_load_n( &mem_counters[i].bytes, __ATOMIC_RELAXED );
+        if( bytes )
+        {
+            if( !leaked )
+                fprintf( stderr, "Leak report:\n" );
+            fprintf( stderr, "    %-18s %"PRIi64" bytes not released\n", obe_get_mem_tag_name( i ), bytes );
+            leaked = 1;
+        }
+    }
+
+    if( !leaked )
+        fprintf( stderr, "Leak report: no leaks\n" );
+}
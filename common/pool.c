@@ -0,0 +1,790 @@
+/*****************************************************************************
+ * pool.c: raw frame, coded frame and TS page pools, per-frame arenas
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include "common/common.h"
+#include <libavutil/imgutils.h>
+#include <sys/mman.h>
+
+/* Huge pages. Explicitly reserved pages (vm.nr_hugepages) are tried first, then transparent huge pages */
+#define HUGE_PAGE_SIZE (2 << 20)
+
+enum huge_page_type_e
+{
+    HUGE_PAGES_NONE,
+    HUGE_PAGES_HUGETLB,
+    HUGE_PAGES_TRANSPARENT,
+};
+
+static int64_t num_huge_pages[3];
+
+/* size is rounded up to whole huge pages */
+static void *huge_alloc( size_t size, int *type )
+{
+    uint8_t *ptr, *aligned;
+
+    size = FFALIGN( size, HUGE_PAGE_SIZE );
+
+    ptr = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+    if( ptr != MAP_FAILED )
+        *type = HUGE_PAGES_HUGETLB;
+    else
+    {
+        /* Transparent huge pages only back aligned ranges so map an extra page and trim */
+        ptr = mmap( NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if( ptr == MAP_FAILED )
+            return NULL;
+
+        aligned = (uint8_t*)FFALIGN( (uintptr_t)ptr, HUGE_PAGE_SIZE );
+        if( aligned != ptr )
+            munmap( ptr, aligned - ptr );
+        munmap( aligned + size, ptr + HUGE_PAGE_SIZE - aligned );
+        ptr = aligned;
+
+        *type = madvise( ptr, size, MADV_HUGEPAGE ) ? HUGE_PAGES_NONE : HUGE_PAGES_TRANSPARENT;
+    }
+
+    __atomic_add_fetch( &num_huge_pages[*type], size / HUGE_PAGE_SIZE, __ATOMIC_RELAXED );
+
+    return ptr;
+}
+
+static void huge_free( void *ptr, size_t size, int type )
+{
+    size = FFALIGN( size, HUGE_PAGE_SIZE );
+    munmap( ptr, size );
+    __atomic_sub_fetch( &num_huge_pages[type], size / HUGE_PAGE_SIZE, __ATOMIC_RELAXED );
+}
+
+/* Huge pages currently mapped by the pools */
+void obe_get_huge_page_stats( int64_t *hugetlb_pages, int64_t *transparent_pages )
+{
+    *hugetlb_pages = __atomic_load_n( &num_huge_pages[HUGE_PAGES_HUGETLB], __ATOMIC_RELAXED );
+    *transparent_pages = __atomic_load_n( &num_huge_pages[HUGE_PAGES_TRANSPARENT], __ATOMIC_RELAXED );
+}
+
+/* Every buffer starts with a header so that it can be returned to its bucket from the image pointer alone.
+ * The header size keeps the image at the alignment av_image_alloc() would give it */
+#define POOL_HEADER_SIZE 64
+
+typedef struct obe_pool_buffer_t
+{
+    struct obe_pool_bucket_t *bucket;
+    int refcount;
+    struct obe_pool_buffer_t *next; /* free list */
+    int huge_pages; /* mapped with huge_alloc() rather than av_malloc() */
+    int mem_tag;
+} obe_pool_buffer_t;
+
+typedef struct obe_pool_bucket_t
+{
+    obe_frame_pool_t *pool;
+    int csp;
+    int width;
+    int height;
+    int align;
+
+    int stride[4];
+    int offset[4];
+    int size;
+
+    obe_pool_buffer_t *free_buffers;
+    int num_buffers; /* allocated, whether free or in use */
+
+    struct obe_pool_bucket_t *next;
+} obe_pool_bucket_t;
+
+struct obe_frame_pool_t
+{
+    pthread_mutex_t mutex;
+    obe_pool_bucket_t *buckets;
+    int64_t num_in_use;
+    int closing;
+    int huge_pages;
+};
+
+obe_frame_pool_t *obe_new_frame_pool( void )
+{
+    obe_frame_pool_t *pool = calloc( 1, sizeof(*pool) );
+    if( !pool )
+        return NULL;
+
+    pthread_mutex_init( &pool->mutex, NULL );
+
+    return pool;
+}
+
+/* Applies to buffers allocated from now on */
+void obe_frame_pool_set_huge_pages( obe_frame_pool_t *pool, int huge_pages )
+{
+    pthread_mutex_lock( &pool->mutex );
+    pool->huge_pages = huge_pages;
+    pthread_mutex_unlock( &pool->mutex );
+}
+
+static obe_pool_buffer_t *alloc_buffer( obe_frame_pool_t *pool, obe_pool_bucket_t *bucket )
+{
+    obe_pool_buffer_t *buffer = NULL;
+    int size = POOL_HEADER_SIZE + bucket->size + bucket->align, type;
+
+    if( pool->huge_pages )
+    {
+        buffer = huge_alloc( size, &type );
+        if( buffer )
+            buffer->huge_pages = type + 1;
+    }
+
+    if( !buffer )
+    {
+        buffer = av_malloc( size );
+        if( buffer )
+            buffer->huge_pages = 0;
+    }
+
+    return buffer;
+}
+
+static void free_buffer( obe_pool_buffer_t *buffer )
+{
+    obe_pool_bucket_t *bucket = buffer->bucket;
+
+    if( buffer->huge_pages )
+        huge_free( buffer, POOL_HEADER_SIZE + bucket->size + bucket->align, buffer->huge_pages - 1 );
+    else
+        av_free( buffer );
+}
+
+static void free_pool( obe_frame_pool_t *pool )
+{
+    obe_pool_bucket_t *bucket = pool->buckets, *next_bucket;
+    obe_pool_buffer_t *buffer, *next_buffer;
+
+    while( bucket )
+    {
+        for( buffer = bucket->free_buffers; buffer; buffer = next_buffer )
+        {
+            next_buffer = buffer->next;
+            obe_mem_free( OBE_MEM_POOL, bucket->size );
+            free_buffer( buffer );
+        }
+
+        next_bucket = bucket->next;
+        free( bucket );
+        bucket = next_bucket;
+    }
+
+    pthread_mutex_destroy( &pool->mutex );
+    free( pool );
+}
+
+/* Buffers still held by frames are freed as they come back */
+void obe_destroy_frame_pool( obe_frame_pool_t *pool )
+{
+    int in_use;
+
+    pthread_mutex_lock( &pool->mutex );
+    pool->closing = 1;
+    in_use = pool->num_in_use;
+    pthread_mutex_unlock( &pool->mutex );
+
+    if( !in_use )
+        free_pool( pool );
+}
+
+/* Same layout as av_image_alloc() */
+static obe_pool_bucket_t *new_bucket( obe_frame_pool_t *pool, int csp, int width, int height, int align )
+{
+    uint8_t *plane[4];
+    int stride[4];
+    int size;
+
+    if( av_image_fill_linesizes( stride, csp, align > 7 ? FFALIGN( width, 8 ) : width ) < 0 )
+        return NULL;
+
+    for( int i = 0; i < 4; i++ )
+        stride[i] = FFALIGN( stride[i], align );
+
+    size = av_image_fill_pointers( plane, csp, height, NULL, stride );
+    if( size < 0 )
+        return NULL;
+
+    obe_pool_bucket_t *bucket = calloc( 1, sizeof(*bucket) );
+    if( !bucket )
+        return NULL;
+
+    bucket->pool = pool;
+    bucket->csp = csp;
+    bucket->width = width;
+    bucket->height = height;
+    bucket->align = align;
+    bucket->size = size;
+    memcpy( bucket->stride, stride, sizeof(stride) );
+    for( int i = 0; i < 4; i++ )
+        bucket->offset[i] = !i || stride[i] ? (intptr_t)plane[i] - (intptr_t)plane[0] : -1;
+
+    bucket->next = pool->buckets;
+    pool->buckets = bucket;
+
+    return bucket;
+}
+
+/* The pool mutex must be held */
+static obe_pool_bucket_t *get_bucket( obe_frame_pool_t *pool, int csp, int width, int height, int align )
+{
+    obe_pool_bucket_t *bucket;
+
+    for( bucket = pool->buckets; bucket; bucket = bucket->next )
+    {
+        if( bucket->csp == csp && bucket->width == width && bucket->height == height && bucket->align == align )
+            return bucket;
+    }
+
+    return new_bucket( pool, csp, width, height, align );
+}
+
+/* Write to every page so that nothing faults once frames are flowing */
+static void prefault( void *data, size_t size )
+{
+    long page_size = sysconf( _SC_PAGESIZE );
+
+    for( size_t i = 0; i < size; i += page_size )
+        ((volatile uint8_t*)data)[i] = 0;
+}
+
+/* Top up a bucket with prefaulted buffers until it has count of them, free or in use. Called at startup and on
+ * format changes with the sizes the pipeline will ask for, so reserving the same size again allocates nothing */
+int obe_pool_reserve_images( obe_frame_pool_t *pool, int csp, int width, int height, int align, int count )
+{
+    obe_pool_bucket_t *bucket;
+    obe_pool_buffer_t *buffer;
+    int ret = -1;
+
+    if( align > POOL_HEADER_SIZE )
+        return -1;
+
+    pthread_mutex_lock( &pool->mutex );
+    bucket = get_bucket( pool, csp, width, height, align );
+    while( bucket && bucket->num_buffers < count )
+    {
+        buffer = alloc_buffer( pool, bucket );
+        if( !buffer )
+            break;
+
+        prefault( buffer, POOL_HEADER_SIZE + bucket->size + bucket->align );
+        buffer->bucket = bucket;
+        buffer->next = bucket->free_buffers;
+        bucket->free_buffers = buffer;
+        bucket->num_buffers++;
+        obe_mem_charge( OBE_MEM_POOL, bucket->size );
+    }
+    if( bucket && bucket->num_buffers >= count )
+        ret = 0;
+    pthread_mutex_unlock( &pool->mutex );
+
+    return ret;
+}
+
+/* Get an image buffer with a refcount of one. The planes are laid out as av_image_alloc() would */
+int obe_pool_get_image( obe_frame_pool_t *pool, uint8_t *plane[4], int stride[4], int csp, int width, int height, int align )
+{
+    obe_pool_bucket_t *bucket;
+    obe_pool_buffer_t *buffer = NULL;
+
+    if( align > POOL_HEADER_SIZE )
+        return -1;
+
+    pthread_mutex_lock( &pool->mutex );
+    bucket = get_bucket( pool, csp, width, height, align );
+    if( bucket )
+    {
+        buffer = bucket->free_buffers;
+        if( buffer )
+        {
+            bucket->free_buffers = buffer->next;
+            obe_mem_free( OBE_MEM_POOL, bucket->size );
+        }
+        else
+        {
+            /* First time this many buffers of this size are in flight */
+            buffer = alloc_buffer( pool, bucket );
+            if( buffer )
+            {
+                buffer->bucket = bucket;
+                bucket->num_buffers++;
+            }
+        }
+    }
+
+    if( buffer )
+        pool->num_in_use++;
+    pthread_mutex_unlock( &pool->mutex );
+
+    if( !buffer )
+        return -1;
+
+    buffer->bucket = bucket;
+    buffer->refcount = 1;
+    buffer->next = NULL;
+    buffer->mem_tag = obe_mem_alloc( bucket->size );
+
+    for( int i = 0; i < 4; i++ )
+    {
+        plane[i] = bucket->offset[i] >= 0 ? (uint8_t*)buffer + POOL_HEADER_SIZE + bucket->offset[i] : NULL;
+        stride[i] = bucket->stride[i];
+    }
+
+    return 0;
+}
+
+static obe_pool_buffer_t *get_pool_buffer( void *data )
+{
+    return (obe_pool_buffer_t*)((uint8_t*)data - POOL_HEADER_SIZE);
+}
+
+void obe_pool_ref_image( void *data )
+{
+    __atomic_add_fetch( &get_pool_buffer( data )->refcount, 1, __ATOMIC_RELAXED );
+}
+
+/* Top up the bucket a pooled image came from, given its first plane */
+int obe_pool_reserve_like_image( void *data, int count )
+{
+    obe_pool_bucket_t *bucket = get_pool_buffer( data )->bucket;
+
+    return obe_pool_reserve_images( bucket->pool, bucket->csp, bucket->width, bucket->height, bucket->align, count );
+}
+
+/* Return the first plane of a pooled image */
+void obe_pool_unref_image( void *data )
+{
+    obe_pool_buffer_t *buffer = get_pool_buffer( data );
+    obe_pool_bucket_t *bucket = buffer->bucket;
+    obe_frame_pool_t *pool = bucket->pool;
+    int free_pool_now = 0;
+
+    if( __atomic_sub_fetch( &buffer->refcount, 1, __ATOMIC_ACQ_REL ) )
+        return;
+
+    obe_mem_free( buffer->mem_tag, bucket->size );
+
+    pthread_mutex_lock( &pool->mutex );
+    if( pool->closing )
+    {
+        free_buffer( buffer );
+        bucket->num_buffers--;
+        free_pool_now = !--pool->num_in_use;
+    }
+    else
+    {
+        buffer->next = bucket->free_buffers;
+        bucket->free_buffers = buffer;
+        pool->num_in_use--;
+        obe_mem_charge( OBE_MEM_POOL, bucket->size );
+    }
+    pthread_mutex_unlock( &pool->mutex );
+
+    if( free_pool_now )
+        free_pool( pool );
+}
+
+/* Coded frames and TS pages. The header and payload share one block and blocks are recycled by payload size class.
+ * With huge pages, blocks up to a huge page are carved out of huge page slabs that live as long as the pool */
+#define CODED_POOL_MIN_SHIFT   10 /* 1 KB */
+#define CODED_POOL_NUM_CLASSES 13 /* up to 4 MB, anything larger is allocated on its own */
+#define CODED_BLOCK_HEADER_SIZE ((sizeof(obe_coded_block_t) + 63) & ~63)
+
+typedef struct obe_coded_block_t
+{
+    obe_coded_pool_t *pool;
+    int size_class;
+    int block_size;
+    int huge_pages; /* 0 if malloc'd, -1 if part of a slab, otherwise its own huge_alloc() mapping */
+    int mem_tag;
+    struct obe_coded_block_t *next; /* free list */
+    obe_coded_frame_t coded_frame;
+} obe_coded_block_t;
+
+typedef struct obe_coded_slab_t
+{
+    void *data;
+    int huge_pages;
+    struct obe_coded_slab_t *next;
+} obe_coded_slab_t;
+
+struct obe_coded_pool_t
+{
+    pthread_mutex_t mutex;
+    obe_coded_block_t *free_blocks[CODED_POOL_NUM_CLASSES];
+    obe_coded_slab_t *slabs;
+    int64_t num_in_use;
+    int closing;
+    int huge_pages;
+};
+
+obe_coded_pool_t *obe_new_coded_pool( void )
+{
+    obe_coded_pool_t *pool = calloc( 1, sizeof(*pool) );
+    if( !pool )
+        return NULL;
+
+    pthread_mutex_init( &pool->mutex, NULL );
+
+    return pool;
+}
+
+/* Applies to blocks allocated from now on */
+void obe_coded_pool_set_huge_pages( obe_coded_pool_t *pool, int huge_pages )
+{
+    pthread_mutex_lock( &pool->mutex );
+    pool->huge_pages = huge_pages;
+    pthread_mutex_unlock( &pool->mutex );
+}
+
+static int get_block_size( int size_class, int len )
+{
+    return CODED_BLOCK_HEADER_SIZE + ( size_class >= 0 ? 1 << (CODED_POOL_MIN_SHIFT + size_class) : len );
+}
+
+static void free_block( obe_coded_block_t *block )
+{
+    if( block->huge_pages > 0 )
+        huge_free( block, block->block_size, block->huge_pages - 1 );
+    else if( !block->huge_pages )
+        free( block );
+}
+
+static void free_coded_pool( obe_coded_pool_t *pool )
+{
+    obe_coded_block_t *block, *next;
+    obe_coded_slab_t *slab, *next_slab;
+
+    for( int i = 0; i < CODED_POOL_NUM_CLASSES; i++ )
+    {
+        for( block = pool->free_blocks[i]; block; block = next )
+        {
+            next = block->next;
+            obe_mem_free( OBE_MEM_POOL, block->block_size );
+            free_block( block );
+        }
+    }
+
+    for( slab = pool->slabs; slab; slab = next_slab )
+    {
+        next_slab = slab->next;
+        huge_free( slab->data, HUGE_PAGE_SIZE, slab->huge_pages );
+        free( slab );
+    }
+
+    pthread_mutex_destroy( &pool->mutex );
+    free( pool );
+}
+
+/* Frames and pages still queued are freed as they are destroyed */
+void obe_destroy_coded_pool( obe_coded_pool_t *pool )
+{
+    int64_t in_use;
+
+    pthread_mutex_lock( &pool->mutex );
+    pool->closing = 1;
+    in_use = pool->num_in_use;
+    pthread_mutex_unlock( &pool->mutex );
+
+    if( !in_use )
+        free_coded_pool( pool );
+}
+
+static int get_size_class( int len )
+{
+    int size_class = 0;
+
+    while( size_class < CODED_POOL_NUM_CLASSES && len > 1 << (CODED_POOL_MIN_SHIFT + size_class) )
+        size_class++;
+
+    return size_class < CODED_POOL_NUM_CLASSES ? size_class : -1;
+}
+
+/* Carve a huge page into blocks of one size class and put them on its free list. The pool mutex must be held */
+static int add_slab( obe_coded_pool_t *pool, int size_class )
+{
+    int block_size = get_block_size( size_class, 0 );
+    obe_coded_slab_t *slab = malloc( sizeof(*slab) );
+    if( !slab )
+        return -1;
+
+    slab->data = huge_alloc( HUGE_PAGE_SIZE, &slab->huge_pages );
+    if( !slab->data )
+    {
+        free( slab );
+        return -1;
+    }
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    for( int offset = 0; offset + block_size <= HUGE_PAGE_SIZE; offset += block_size )
+    {
+        obe_coded_block_t *block = (obe_coded_block_t*)((uint8_t*)slab->data + offset);
+        block->pool = pool;
+        block->size_class = size_class;
+        block->block_size = block_size;
+        block->huge_pages = -1;
+        block->next = pool->free_blocks[size_class];
+        pool->free_blocks[size_class] = block;
+        obe_mem_charge( OBE_MEM_POOL, block_size );
+    }
+
+    return 0;
+}
+
+static obe_coded_block_t *get_block( obe_coded_pool_t *pool, int len )
+{
+    obe_coded_block_t *block = NULL;
+    int size_class = get_size_class( len ), block_size = get_block_size( size_class, len ), huge_pages = 0;
+
+    pthread_mutex_lock( &pool->mutex );
+    if( size_class >= 0 && !pool->free_blocks[size_class] && pool->huge_pages && block_size <= HUGE_PAGE_SIZE )
+        add_slab( pool, size_class );
+
+    if( size_class >= 0 && pool->free_blocks[size_class] )
+    {
+        block = pool->free_blocks[size_class];
+        pool->free_blocks[size_class] = block->next;
+        obe_mem_free( OBE_MEM_POOL, block->block_size );
+    }
+    pool->num_in_use++;
+    huge_pages = pool->huge_pages;
+    pthread_mutex_unlock( &pool->mutex );
+
+    if( !block )
+    {
+        if( huge_pages && block_size > HUGE_PAGE_SIZE )
+        {
+            block = huge_alloc( block_size, &huge_pages );
+            if( block )
+                block->huge_pages = huge_pages + 1;
+        }
+
+        if( !block )
+        {
+            block = malloc( block_size );
+            if( !block )
+            {
+                pthread_mutex_lock( &pool->mutex );
+                pool->num_in_use--;
+                pthread_mutex_unlock( &pool->mutex );
+                return NULL;
+            }
+            block->huge_pages = 0;
+        }
+        block->pool = pool;
+        block->size_class = size_class;
+        block->block_size = block_size;
+    }
+
+    block->next = NULL;
+    block->mem_tag = obe_mem_alloc( block->block_size );
+    memset( &block->coded_frame, 0, sizeof(block->coded_frame) );
+    block->coded_frame.data = (uint8_t*)block + CODED_BLOCK_HEADER_SIZE;
+    block->coded_frame.len = len;
+
+    return block;
+}
+
+static void put_block( obe_coded_block_t *block )
+{
+    obe_coded_pool_t *pool = block->pool;
+    int free_pool_now = 0;
+
+    obe_mem_free( block->mem_tag, block->block_size );
+
+    pthread_mutex_lock( &pool->mutex );
+    /* Slab blocks always have a size class and stay on the free list until the slab goes */
+    if( ( pool->closing || block->size_class < 0 ) && block->huge_pages >= 0 )
+        free_block( block );
+    else
+    {
+        block->next = pool->free_blocks[block->size_class];
+        pool->free_blocks[block->size_class] = block;
+        obe_mem_charge( OBE_MEM_POOL, block->block_size );
+    }
+    free_pool_now = !--pool->num_in_use && pool->closing;
+    pthread_mutex_unlock( &pool->mutex );
+
+    if( free_pool_now )
+        free_coded_pool( pool );
+}
+
+/* Add count prefaulted blocks with room for len bytes to the free list of their size class.
+ * Blocks larger than the biggest size class are not recycled so are not reserved either */
+int obe_pool_reserve_blocks( obe_coded_pool_t *pool, int len, int count )
+{
+    int size_class = get_size_class( len ), block_size = get_block_size( size_class, len ), ret = 0;
+    obe_coded_block_t *block;
+
+    if( size_class < 0 )
+        return 0;
+
+    pthread_mutex_lock( &pool->mutex );
+    while( ret < count )
+    {
+        if( pool->huge_pages && block_size <= HUGE_PAGE_SIZE )
+        {
+            /* A slab adds a whole huge page worth of blocks */
+            obe_coded_block_t *first = pool->free_blocks[size_class];
+            if( add_slab( pool, size_class ) < 0 )
+                break;
+
+            for( block = pool->free_blocks[size_class]; block != first; block = block->next )
+                ret++;
+            prefault( pool->slabs->data, HUGE_PAGE_SIZE );
+            continue;
+        }
+
+        block = malloc( block_size );
+        if( !block )
+            break;
+
+        prefault( block, block_size );
+        block->pool = pool;
+        block->size_class = size_class;
+        block->block_size = block_size;
+        block->huge_pages = 0;
+        block->next = pool->free_blocks[size_class];
+        pool->free_blocks[size_class] = block;
+        obe_mem_charge( OBE_MEM_POOL, block_size );
+        ret++;
+    }
+    pthread_mutex_unlock( &pool->mutex );
+
+    return ret >= count ? 0 : -1;
+}
+
+/* A zeroed coded frame with room for at least len bytes of payload */
+obe_coded_frame_t *obe_pool_get_coded_frame( obe_coded_pool_t *pool, int len )
+{
+    obe_coded_block_t *block = get_block( pool, len );
+
+    return block ? &block->coded_frame : NULL;
+}
+
+void obe_pool_put_coded_frame( obe_coded_frame_t *coded_frame )
+{
+    put_block( (obe_coded_block_t*)((uint8_t*)coded_frame - offsetof( obe_coded_block_t, coded_frame )) );
+}
+
+/* Untyped blocks from the same size classes, used for TS pages */
+void *obe_pool_get_block( obe_coded_pool_t *pool, int len )
+{
+    obe_coded_block_t *block = get_block( pool, len );
+
+    return block ? block->coded_frame.data : NULL;
+}
+
+void obe_pool_put_block( void *data )
+{
+    put_block( (obe_coded_block_t*)((uint8_t*)data - CODED_BLOCK_HEADER_SIZE) );
+}
+
+/* Per-frame arenas. Most frames only need the first chunk */
+#define ARENA_CHUNK_SIZE  4096
+#define ARENA_ALIGN       16
+#define ARENA_HEADER_SIZE ((sizeof(obe_arena_chunk_t) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+struct obe_arena_chunk_t
+{
+    obe_arena_chunk_t *next;
+    int size;
+    int mem_tag;
+};
+
+void *obe_arena_alloc( obe_arena_t *arena, int size )
+{
+    obe_arena_chunk_t *chunk;
+    uint8_t *ptr;
+    int chunk_size;
+
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    if( arena->end - arena->pos < size )
+    {
+        /* Oversized allocations get a chunk of their own */
+        chunk_size = MAX( ARENA_CHUNK_SIZE, ARENA_HEADER_SIZE + size );
+        chunk = malloc( chunk_size );
+        if( !chunk )
+            return NULL;
+
+        chunk->next = arena->chunks;
+        chunk->size = chunk_size;
+        chunk->mem_tag = obe_mem_alloc( chunk_size );
+        arena->chunks = chunk;
+        arena->pos = (uint8_t*)chunk + ARENA_HEADER_SIZE;
+        arena->end = (uint8_t*)chunk + chunk_size;
+    }
+
+    ptr = arena->pos;
+    arena->pos += size;
+
+    return ptr;
+}
+
+void obe_arena_free( obe_arena_t *arena )
+{
+    obe_arena_chunk_t *chunk = arena->chunks, *next;
+
+    while( chunk )
+    {
+        next = chunk->next;
+        obe_mem_free( chunk->mem_tag, chunk->size );
+        free( chunk );
+        chunk = next;
+    }
+
+    memset( arena, 0, sizeof(*arena) );
+}
+
+/* Append a user data entry with len bytes of payload, both from the frame's arena */
+obe_user_data_t *obe_add_user_data( obe_raw_frame_t *raw_frame, int len )
+{
+    obe_user_data_t *user_data;
+
+    if( raw_frame->num_user_data == raw_frame->max_user_data )
+    {
+        int max_user_data = raw_frame->max_user_data ? raw_frame->max_user_data * 2 : 8;
+        user_data = obe_arena_alloc( &raw_frame->arena, max_user_data * sizeof(*user_data) );
+        if( !user_data )
+            return NULL;
+
+        if( raw_frame->num_user_data )
+            memcpy( user_data, raw_frame->user_data, raw_frame->num_user_data * sizeof(*user_data) );
+        raw_frame->user_data = user_data;
+        raw_frame->max_user_data = max_user_data;
+    }
+
+    user_data = &raw_frame->user_data[raw_frame->num_user_data];
+    memset( user_data, 0, sizeof(*user_data) );
+    user_data->len = len;
+    user_data->data = obe_arena_alloc( &raw_frame->arena, len );
+    if( !user_data->data )
+        return NULL;
+
+    raw_frame->num_user_data++;
+
+    return user_data;
+}
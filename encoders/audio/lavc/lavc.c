@@ -49,10 +49,9 @@ static void *start_encoder( void *ptr )
     obe_encoder_t *encoder = enc_params->encoder;
     obe_output_stream_t *stream = enc_params->stream;
     obe_raw_frame_t *raw_frame;
-    obe_coded_frame_t *coded_frame;
+    obe_coded_frame_t *coded_frame = NULL;
     int64_t cur_pts = -1, pts_increment;
-    int i, frame_size, ret, got_pkt, num_frames = 0, total_size = 0;
-    AVFifoBuffer *out_fifo = NULL;
+    int i, ret, got_pkt, num_frames = 0, total_size = 0, pes_size;
     AVAudioResampleContext *avr = NULL;
     AVPacket pkt;
     AVCodecContext *codec = NULL;
@@ -147,17 +146,11 @@ static void *start_encoder( void *ptr )
         pthread_mutex_unlock( &encoder->queue.mutex );
     }
 
-    frame_size = (double)codec->frame_size * 125 * stream->bitrate *
-                 enc_params->frames_per_pes / enc_params->sample_rate;
     /* NB: libfdk-aac already doubles the frame size appropriately */
     pts_increment = (double)codec->frame_size * OBE_CLOCK * enc_params->frames_per_pes / enc_params->sample_rate;
 
-    out_fifo = av_fifo_alloc( frame_size );
-    if( !out_fifo )
-    {
-        fprintf( stderr, "Malloc failed\n" );
-        goto finish;
-    }
+    /* Packets are encoded straight into the coded frame so leave room for the largest the encoder can produce */
+    pes_size = enc_params->frames_per_pes * FF_MIN_BUFFER_SIZE;
 
     frame = avcodec_alloc_frame();
     if( !frame )
@@ -175,19 +168,10 @@ static void *start_encoder( void *ptr )
     while( 1 )
     {
         /* TODO: detect bitrate or channel reconfig */
-        pthread_mutex_lock( &encoder->queue.mutex );
-
-        while( !encoder->queue.size && !encoder->cancel_thread )
-            pthread_cond_wait( &encoder->queue.in_cv, &encoder->queue.mutex );
-
-        if( encoder->cancel_thread )
-        {
-            pthread_mutex_unlock( &encoder->queue.mutex );
+        if( obe_queue_wait( &encoder->queue, 0, &encoder->cancel_thread ) < 0 )
             goto finish;
-        }
 
-        raw_frame = encoder->queue.queue[0];
-        pthread_mutex_unlock( &encoder->queue.mutex );
+        raw_frame = QUEUE_ITEM( &encoder->queue, 0 );
 
         if( cur_pts == -1 )
             cur_pts = raw_frame->pts;
@@ -211,9 +195,19 @@ static void *start_encoder( void *ptr )
             memcpy( frame->data, audio_planes, sizeof(frame->data) );
             avresample_read( avr, frame->data, codec->frame_size );
 
+            if( !coded_frame )
+            {
+                coded_frame = new_coded_frame( h, encoder->output_stream_id, pes_size );
+                if( !coded_frame )
+                {
+                    syslog( LOG_ERR, "Malloc failed\n" );
+                    goto finish;
+                }
+            }
+
             av_init_packet( &pkt );
-            pkt.data = NULL;
-            pkt.size = 0;
+            pkt.data = coded_frame->data + total_size;
+            pkt.size = pes_size - total_size;
 
             ret = avcodec_encode_audio2( codec, &pkt, frame, &got_pkt );
             if( ret < 0 )
@@ -228,29 +222,13 @@ static void *start_encoder( void *ptr )
             total_size += pkt.size;
             num_frames++;
 
-            if( av_fifo_realloc2( out_fifo, av_fifo_size( out_fifo ) + pkt.size ) < 0 )
-            {
-                syslog( LOG_ERR, "Malloc failed\n" );
-                break;
-            }
-
-            av_fifo_generic_write( out_fifo, pkt.data, pkt.size, NULL );
-            obe_free_packet( &pkt );
-
             if( num_frames == enc_params->frames_per_pes )
             {
-                coded_frame = new_coded_frame( encoder->output_stream_id, total_size );
-                if( !coded_frame )
-                {
-                    syslog( LOG_ERR, "Malloc failed\n" );
-                    goto finish;
-                }
-
-                av_fifo_generic_read( out_fifo, coded_frame->data, total_size, NULL );
-
+                coded_frame->len = total_size;
                 coded_frame->pts = cur_pts;
                 coded_frame->random_access = 1; /* Every frame output is a random access point */
                 add_to_queue( &h->mux_queue, coded_frame );
+                coded_frame = NULL;
 
                 /* We need to generate PTS because frame sizes have changed */
                 cur_pts += pts_increment;
@@ -266,8 +244,8 @@ finish:
     if( audio_planes[0] )
         av_free( audio_planes[0] );
 
-    if( out_fifo )
-        av_fifo_free( out_fifo );
+    if( coded_frame )
+        destroy_coded_frame( coded_frame );
 
     if( avr )
         avresample_free( &avr );
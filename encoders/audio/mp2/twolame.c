@@ -115,19 +115,10 @@ static void *start_encoder( void *ptr )
 
     while( 1 )
     {
-        pthread_mutex_lock( &encoder->queue.mutex );
-
-        while( !encoder->queue.size && !encoder->cancel_thread )
-            pthread_cond_wait( &encoder->queue.in_cv, &encoder->queue.mutex );
-
-        if( encoder->cancel_thread )
-        {
-            pthread_mutex_unlock( &encoder->queue.mutex );
+        if( obe_queue_wait( &encoder->queue, 0, &encoder->cancel_thread ) < 0 )
             break;
-        }
 
-        raw_frame = encoder->queue.queue[0];
-        pthread_mutex_unlock( &encoder->queue.mutex );
+        raw_frame = QUEUE_ITEM( &encoder->queue, 0 );
 
         if( cur_pts == -1 )
             cur_pts = raw_frame->pts;
@@ -174,7 +165,7 @@ static void *start_encoder( void *ptr )
 
         while( av_fifo_size( fifo ) >= frame_size )
         {
-            coded_frame = new_coded_frame( encoder->output_stream_id, frame_size );
+            coded_frame = new_coded_frame( h, encoder->output_stream_id, frame_size );
             if( !coded_frame )
             {
                 syslog( LOG_ERR, "Malloc failed\n" );
@@ -28,15 +28,13 @@ static void *start_smoothing( void *ptr )
     obe_t *h = ptr;
     int num_enc_smoothing_frames = 0, buffer_frames = 0;
     int64_t start_dts = -1, start_pts = -1, last_clock = -1;
+    unsigned int tick;
     obe_coded_frame_t *coded_frame = NULL;
 
-    struct sched_param param = {0};
-    param.sched_priority = 99;
-    pthread_setschedparam( pthread_self(), SCHED_FIFO, &param );
-
     /* FIXME: when we have soft pulldown this will need changing */
     if( h->obe_system == OBE_SYSTEM_TYPE_GENERIC )
     {
+        /* Frames from every video encoder share the buffer */
         for( int i = 0; i < h->num_encoders; i++ )
         {
             if( h->encoders[i]->is_video )
@@ -45,9 +43,8 @@ static void *start_smoothing( void *ptr )
                 while( !h->encoders[i]->is_ready )
                     pthread_cond_wait( &h->encoders[i]->queue.in_cv, &h->encoders[i]->queue.mutex );
                 x264_param_t *params = h->encoders[i]->encoder_params;
-                buffer_frames = params->sc.i_buffer_size;
+                buffer_frames += params->sc.i_buffer_size;
                 pthread_mutex_unlock( &h->encoders[i]->queue.mutex );
-                break;
             }
         }
     }
@@ -85,38 +82,32 @@ static void *start_smoothing( void *ptr )
 
 //        printf("\n smoothed frames %i \n", num_enc_smoothing_frames );
 
-        coded_frame = h->enc_smoothing_queue.queue[0];
+        coded_frame = QUEUE_ITEM( &h->enc_smoothing_queue, 0 );
         pthread_mutex_unlock( &h->enc_smoothing_queue.mutex );
 
         /* The terminology can be a cause for confusion:
          *   pts refers to the pts from the input which is monotonic
          *   dts refers to the dts out of the encoder which is monotonic */
 
-        pthread_mutex_lock( &h->obe_clock_mutex );
-
         //printf("\n dts gap %"PRIi64" \n", coded_frame->real_dts - start_dts );
-        //printf("\n pts gap %"PRIi64" \n", h->obe_clock_last_pts - start_pts );
+        //printf("\n pts gap %"PRIi64" \n", last_clock - start_pts );
 
-        last_clock = h->obe_clock_last_pts;
+        tick = obe_clock_last_tick( h, &last_clock );
 
         if( start_dts == -1 )
         {
             start_dts = coded_frame->real_dts;
             /* Wait until the next clock tick */
-            while( last_clock == h->obe_clock_last_pts && !h->cancel_enc_smoothing_thread )
-                pthread_cond_wait( &h->obe_clock_cv, &h->obe_clock_mutex );
-            start_pts = h->obe_clock_last_pts;
+            obe_clock_wait_tick( h, tick, &h->cancel_enc_smoothing_thread );
+            obe_clock_last_tick( h, &start_pts );
         }
-        else if( coded_frame->real_dts - start_dts > h->obe_clock_last_pts - start_pts )
+        else if( coded_frame->real_dts - start_dts > last_clock - start_pts )
         {
             //printf("\n waiting \n");
-            while( last_clock == h->obe_clock_last_pts && !h->cancel_enc_smoothing_thread )
-                pthread_cond_wait( &h->obe_clock_cv, &h->obe_clock_mutex );
+            obe_clock_wait_tick( h, tick, &h->cancel_enc_smoothing_thread );
         }
         /* otherwise, continue since the frame is late */
 
-        pthread_mutex_unlock( &h->obe_clock_mutex );
-
         add_to_queue( &h->mux_queue, coded_frame );
 
         //printf("\n send_delta %"PRIi64" \n", get_input_clock_in_mpeg_ticks( h ) - send_delta );
@@ -61,43 +61,123 @@ static int convert_obe_to_x264_pic( x264_picture_t *pic, obe_raw_frame_t *raw_fr
     if( pic->extra_sei.num_payloads )
     {
         pic->extra_sei.sei_free = free;
-        pic->extra_sei.payloads = malloc( pic->extra_sei.num_payloads * sizeof(*pic->extra_sei.payloads) );
+        pic->extra_sei.payloads = calloc( pic->extra_sei.num_payloads, sizeof(*pic->extra_sei.payloads) );
 
         if( !pic->extra_sei.payloads )
             return -1;
+    }
 
-        for( int i = 0; i < raw_frame->num_user_data; i++ )
+    for( int i = 0; i < raw_frame->num_user_data; i++ )
+    {
+        /* Only give correctly formatted data to the encoder */
+        if( raw_frame->user_data[i].type == USER_DATA_AVC_REGISTERED_ITU_T35 ||
+            raw_frame->user_data[i].type == USER_DATA_AVC_UNREGISTERED )
         {
-            /* Only give correctly formatted data to the encoder */
-            if( raw_frame->user_data[i].type == USER_DATA_AVC_REGISTERED_ITU_T35 ||
-                raw_frame->user_data[i].type == USER_DATA_AVC_UNREGISTERED )
-            {
-                pic->extra_sei.payloads[idx].payload_type = raw_frame->user_data[i].type;
-                pic->extra_sei.payloads[idx].payload_size = raw_frame->user_data[i].len;
-                pic->extra_sei.payloads[idx].payload = raw_frame->user_data[i].data;
-                idx++;
-            }
-            else
-            {
-                syslog( LOG_WARNING, "Invalid user data presented to encoder - type %i \n", raw_frame->user_data[i].type );
-                free( raw_frame->user_data[i].data );
-            }
-            /* Set the pointer to NULL so only x264 can free the data if necessary */
-            raw_frame->user_data[i].data = NULL;
+            /* x264 keeps the payload until the frame leaves the lookahead, long after the raw frame
+             * and its arena have gone, so it gets its own copy */
+            pic->extra_sei.payloads[idx].payload = malloc( raw_frame->user_data[i].len );
+            if( !pic->extra_sei.payloads[idx].payload )
+                return -1;
+
+            memcpy( pic->extra_sei.payloads[idx].payload, raw_frame->user_data[i].data, raw_frame->user_data[i].len );
+            pic->extra_sei.payloads[idx].payload_type = raw_frame->user_data[i].type;
+            pic->extra_sei.payloads[idx].payload_size = raw_frame->user_data[i].len;
+            idx++;
         }
+        else
+            syslog( LOG_WARNING, "Invalid user data presented to encoder - type %i \n", raw_frame->user_data[i].type );
+    }
+
+    return 0;
+}
+
+/* x264 restarts its HRD timestamps when it is reopened after an input format change. They are offset
+ * so that the mux sees them carry on, keeping the same mapping from input pts as before the change */
+typedef struct
+{
+    int64_t offset;
+    int     rebase;
+    int64_t pts_to_real;
+    int64_t last_dts;
+} obe_x264_timing_t;
+
+static int write_coded_frame( obe_t *h, obe_encoder_t *encoder, obe_x264_timing_t *timing, x264_nal_t *nal, int frame_size,
+                              x264_picture_t *pic_out, int64_t arrival_time, int64_t frame_duration )
+{
+    obe_coded_frame_t *coded_frame;
+    obe_queue_t *coded_queue;
+    int64_t *pts2 = pic_out->opaque;
+
+    coded_frame = new_coded_frame( h, encoder->output_stream_id, frame_size );
+    if( !coded_frame )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        return -1;
     }
-    else if( raw_frame->num_user_data )
+
+    if( timing->rebase )
     {
-        for( int i = 0; i < raw_frame->num_user_data; i++ )
-        {
-            syslog( LOG_WARNING, "Invalid user data presented to encoder - type %i \n", raw_frame->user_data[i].type );
-            free( raw_frame->user_data[i].data );
-        }
+        timing->offset = pts2[0] + timing->pts_to_real - pic_out->hrd_timing.dpb_output_time;
+        timing->offset = MAX( timing->offset, timing->last_dts + frame_duration - pic_out->hrd_timing.cpb_removal_time );
+        timing->rebase = 0;
     }
 
+    memcpy( coded_frame->data, nal[0].p_payload, frame_size );
+    coded_frame->is_video = 1;
+    coded_frame->len = frame_size;
+    coded_frame->cpb_initial_arrival_time = pic_out->hrd_timing.cpb_initial_arrival_time + timing->offset;
+    coded_frame->cpb_final_arrival_time = pic_out->hrd_timing.cpb_final_arrival_time + timing->offset;
+    coded_frame->real_dts = pic_out->hrd_timing.cpb_removal_time + timing->offset;
+    coded_frame->real_pts = pic_out->hrd_timing.dpb_output_time + timing->offset;
+    coded_frame->pts = pts2[0];
+    coded_frame->random_access = pic_out->b_keyframe;
+    coded_frame->priority = IS_X264_TYPE_I( pic_out->i_type );
+    free( pic_out->opaque );
+
+    timing->pts_to_real = coded_frame->real_pts - coded_frame->pts;
+    timing->last_dts = coded_frame->real_dts;
+
+    if( h->obe_system == OBE_SYSTEM_TYPE_LOWEST_LATENCY || h->obe_system == OBE_SYSTEM_TYPE_LOW_LATENCY )
+    {
+        coded_frame->arrival_time = arrival_time;
+        coded_queue = &h->mux_queue;
+        //printf("\n Encode Latency %"PRIi64" \n", obe_mdate() - coded_frame->arrival_time );
+    }
+    else
+        coded_queue = &h->enc_smoothing_queue;
+
+    /* Non-reference B-frames can be dropped without affecting the rest of the stream */
+    if( coded_queue->shed_policy == OBE_SHED_DROP_NON_REF && pic_out->i_type == X264_TYPE_B &&
+        obe_queue_above_high_water( coded_queue ) )
+    {
+        destroy_coded_frame( coded_frame );
+        obe_queue_count_shed( coded_queue, 1 );
+    }
+    else
+        add_to_queue( coded_queue, coded_frame );
+
     return 0;
 }
 
+/* Take the geometry and frame rate from the first frame in the new input format. The GOP keeps its duration */
+static void change_format( x264_param_t *param, obe_raw_frame_t *raw_frame, int ntsc_tff )
+{
+    int fps_num = param->i_fps_num, fps_den = param->i_fps_den;
+
+    param->i_width = raw_frame->img.width;
+    param->i_height = raw_frame->img.height;
+    param->i_fps_num = raw_frame->timebase_den;
+    param->i_fps_den = raw_frame->timebase_num;
+    param->i_keyint_max = MAX( (int64_t)param->i_keyint_max * param->i_fps_num * fps_den / ( (int64_t)param->i_fps_den * fps_num ), 1 );
+    param->b_interlaced = IS_INTERLACED( raw_frame->img.format );
+    /* Everything interlaced except NTSC is coded top field first */
+    param->b_tff = param->b_interlaced && ( raw_frame->img.format != INPUT_VIDEO_FORMAT_NTSC || ntsc_tff );
+    param->vui.i_sar_width = raw_frame->sar_width;
+    param->vui.i_sar_height = raw_frame->sar_height;
+
+    obe_set_avc_colorimetry( param );
+}
+
 static void *start_encoder( void *ptr )
 {
     obe_vid_enc_params_t *enc_params = ptr;
@@ -106,14 +186,12 @@ static void *start_encoder( void *ptr )
     x264_t *s = NULL;
     x264_picture_t pic, pic_out;
     x264_nal_t *nal;
-    int i_nal, frame_size = 0;
+    int i_nal, frame_size = 0, overloaded = 0, reset_speedcontrol, ntsc_tff = 1;
     int64_t pts = 0, arrival_time = 0, frame_duration, buffer_duration;
     int64_t *pts2;
     float buffer_fill;
     obe_raw_frame_t *raw_frame;
-    obe_coded_frame_t *coded_frame;
-
-    /* TODO: check for width, height changes */
+    obe_x264_timing_t timing = {0};
 
     /* Lock the mutex until we verify and fetch new parameters */
     pthread_mutex_lock( &encoder->queue.mutex );
@@ -149,21 +227,30 @@ static void *start_encoder( void *ptr )
 
     while( 1 )
     {
-        pthread_mutex_lock( &encoder->queue.mutex );
-
-        while( !encoder->queue.size && !encoder->cancel_thread )
-            pthread_cond_wait( &encoder->queue.in_cv, &encoder->queue.mutex );
+        if( obe_queue_wait( &encoder->queue, 0, &encoder->cancel_thread ) < 0 )
+            break;
 
-        if( encoder->cancel_thread )
+        /* Shed frames if x264 has fallen too far behind */
+        reset_speedcontrol = 0;
+        if( encoder->queue.shed_policy == OBE_SHED_SPEEDCONTROL_RESET )
         {
-            pthread_mutex_unlock( &encoder->queue.mutex );
-            break;
+            if( obe_queue_above_high_water( &encoder->queue ) )
+            {
+                if( !overloaded )
+                    syslog( LOG_WARNING, "Video encoder overloaded\n" );
+                reset_speedcontrol = !overloaded;
+                overloaded = 1;
+            }
+            else
+                overloaded = 0;
         }
+        else
+            reset_speedcontrol = obe_queue_shed( &encoder->queue ) > 0;
 
         /* Reset the speedcontrol buffer if the source has dropped frames. Otherwise speedcontrol
          * stays in an underflow state and is locked to the fastest preset */
         pthread_mutex_lock( &h->drop_mutex );
-        if( h->encoder_drop )
+        if( h->encoder_drop || reset_speedcontrol )
         {
             pthread_mutex_lock( &h->enc_smoothing_queue.mutex );
             h->enc_smoothing_buffer_complete = 0;
@@ -174,8 +261,54 @@ static void *start_encoder( void *ptr )
         }
         pthread_mutex_unlock( &h->drop_mutex );
 
-        raw_frame = encoder->queue.queue[0];
-        pthread_mutex_unlock( &encoder->queue.mutex );
+        raw_frame = QUEUE_ITEM( &encoder->queue, 0 );
+
+        /* NTSC field order depends on the input so remember what it was set to */
+        if( !pts && raw_frame->img.format == INPUT_VIDEO_FORMAT_NTSC )
+            ntsc_tff = enc_params->avc_param.b_tff;
+
+        /* The input has changed format. Drain the old encoder and open a new one, which starts on an IDR.
+         * The mux carries on and the timestamps are rebased to follow on */
+        if( raw_frame->reset_obe && ( raw_frame->img.width != enc_params->avc_param.i_width ||
+            raw_frame->img.height != enc_params->avc_param.i_height ||
+            IS_INTERLACED( raw_frame->img.format ) != enc_params->avc_param.b_interlaced ||
+            raw_frame->timebase_num != enc_params->avc_param.i_fps_den ||
+            raw_frame->timebase_den != enc_params->avc_param.i_fps_num ) )
+        {
+            while( x264_encoder_delayed_frames( s ) )
+            {
+                frame_size = x264_encoder_encode( s, &nal, &i_nal, NULL, &pic_out );
+                if( frame_size < 0 )
+                    break;
+
+                if( frame_size && write_coded_frame( h, encoder, &timing, nal, frame_size, &pic_out, arrival_time, frame_duration ) < 0 )
+                    goto end;
+            }
+            x264_encoder_close( s );
+
+            change_format( &enc_params->avc_param, raw_frame, ntsc_tff );
+            syslog( LOG_INFO, "[x264]: reopening encoder at %ix%i%c %i/%i fps\n", enc_params->avc_param.i_width,
+                    enc_params->avc_param.i_height, enc_params->avc_param.b_interlaced ? 'i' : 'p',
+                    enc_params->avc_param.i_fps_num, enc_params->avc_param.i_fps_den );
+
+            s = x264_encoder_open( &enc_params->avc_param );
+            if( !s )
+            {
+                syslog( LOG_ERR, "[x264]: encoder reconfiguration failed\n" );
+                break;
+            }
+            x264_encoder_parameters( s, &enc_params->avc_param );
+
+            /* The mux and smoothing read these for the current stream */
+            pthread_mutex_lock( &encoder->queue.mutex );
+            memcpy( encoder->encoder_params, &enc_params->avc_param, sizeof(enc_params->avc_param) );
+            pthread_mutex_unlock( &encoder->queue.mutex );
+
+            frame_duration = av_rescale_q( 1, (AVRational){enc_params->avc_param.i_fps_den, enc_params->avc_param.i_fps_num}, (AVRational){1, OBE_CLOCK} );
+            buffer_duration = frame_duration * enc_params->avc_param.sc.i_buffer_size;
+            /* Nothing has been output yet if the probed format was stale */
+            timing.rebase = !!pts;
+        }
 
         if( convert_obe_to_x264_pic( &pic, raw_frame ) < 0 )
         {
@@ -222,8 +355,8 @@ static void *start_encoder( void *ptr )
                 if( h->enc_smoothing_queue.size )
                 {
                     obe_coded_frame_t *first_frame, *last_frame;
-                    first_frame = h->enc_smoothing_queue.queue[0];
-                    last_frame = h->enc_smoothing_queue.queue[h->enc_smoothing_queue.size-1];
+                    first_frame = QUEUE_ITEM( &h->enc_smoothing_queue, 0 );
+                    last_frame = QUEUE_ITEM( &h->enc_smoothing_queue, h->enc_smoothing_queue.size-1 );
                     int64_t frame_durations = last_frame->real_dts - first_frame->real_dts + frame_duration;
                     buffer_fill = (float)(frame_durations - last_frame_delta)/buffer_duration;
                 }
@@ -249,37 +382,9 @@ static void *start_encoder( void *ptr )
             break;
         }
 
-        if( frame_size )
-        {
-            coded_frame = new_coded_frame( encoder->output_stream_id, frame_size );
-            if( !coded_frame )
-            {
-                syslog( LOG_ERR, "Malloc failed\n" );
-                break;
-            }
-            memcpy( coded_frame->data, nal[0].p_payload, frame_size );
-            coded_frame->is_video = 1;
-            coded_frame->len = frame_size;
-            coded_frame->cpb_initial_arrival_time = pic_out.hrd_timing.cpb_initial_arrival_time;
-            coded_frame->cpb_final_arrival_time = pic_out.hrd_timing.cpb_final_arrival_time;
-            coded_frame->real_dts = pic_out.hrd_timing.cpb_removal_time;
-            coded_frame->real_pts = pic_out.hrd_timing.dpb_output_time;
-            pts2 = pic_out.opaque;
-            coded_frame->pts = pts2[0];
-            coded_frame->random_access = pic_out.b_keyframe;
-            coded_frame->priority = IS_X264_TYPE_I( pic_out.i_type );
-            free( pic_out.opaque );
-
-            if( h->obe_system == OBE_SYSTEM_TYPE_LOWEST_LATENCY || h->obe_system == OBE_SYSTEM_TYPE_LOW_LATENCY )
-            {
-                coded_frame->arrival_time = arrival_time;
-                add_to_queue( &h->mux_queue, coded_frame );
-                //printf("\n Encode Latency %"PRIi64" \n", obe_mdate() - coded_frame->arrival_time );
-            }
-            else
-                add_to_queue( &h->enc_smoothing_queue, coded_frame );
-        }
-     }
+        if( frame_size && write_coded_frame( h, encoder, &timing, nal, frame_size, &pic_out, arrival_time, frame_duration ) < 0 )
+            break;
+    }
 
 end:
     if( s )
@@ -25,67 +25,79 @@
 
 static void *start_filter( void *ptr )
 {
-    obe_raw_frame_t *raw_frame, *split_raw_frame;
+    obe_raw_frame_t *raw_frame = NULL, *split_raw_frame;
     obe_aud_filter_params_t *filter_params = ptr;
     obe_t *h = filter_params->h;
     obe_filter_t *filter = filter_params->filter;
     obe_output_stream_t *output_stream;
-    int num_channels;
+    int num_channels, first_channel, planar;
 
     while( 1 )
     {
-        pthread_mutex_lock( &filter->queue.mutex );
-
-        while( !filter->queue.size && !filter->cancel_thread )
-            pthread_cond_wait( &filter->queue.in_cv, &filter->queue.mutex );
-
-        if( filter->cancel_thread )
-        {
-            pthread_mutex_unlock( &filter->queue.mutex );
+        if( obe_queue_wait( &filter->queue, 0, &filter->cancel_thread ) < 0 )
             break;
-        }
 
-        raw_frame = filter->queue.queue[0];
-        pthread_mutex_unlock( &filter->queue.mutex );
+        raw_frame = QUEUE_ITEM( &filter->queue, 0 );
+        remove_from_queue( &filter->queue );
+
+        /* Planar input is split without copying: each encoder gets a view of its channels
+         * and the captured samples are released when the last encoder is done with them */
+        planar = av_sample_fmt_is_planar( raw_frame->audio_frame.sample_fmt );
+        raw_frame->refcount = 1;
 
-        /* ignore the video track */
-        for( int i = 1; i < h->num_encoders; i++ )
+        /* ignore the video tracks */
+        for( int i = 0; i < h->num_encoders; i++ )
         {
+            if( h->encoders[i]->is_video )
+                continue;
+
             output_stream = get_output_stream( h, h->encoders[i]->output_stream_id );
             num_channels = av_get_channel_layout_nb_channels( output_stream->channel_layout );
+            first_channel = ((output_stream->sdi_audio_pair-1)<<1)+output_stream->mono_channel;
 
-            split_raw_frame = new_raw_frame();
+            split_raw_frame = obe_share_raw_frame( raw_frame );
             if( !split_raw_frame )
-            {
-                syslog( LOG_ERR, "Malloc failed\n" );
-                return NULL;
-            }
-            memcpy( split_raw_frame, raw_frame, sizeof(*split_raw_frame) );
+                goto end;
+
             memset( split_raw_frame->audio_frame.audio_data, 0, sizeof(split_raw_frame->audio_frame.audio_data) );
-            split_raw_frame->audio_frame.linesize = split_raw_frame->audio_frame.num_channels = 0;
+            split_raw_frame->audio_frame.num_channels = 0;
             split_raw_frame->audio_frame.channel_layout = output_stream->channel_layout;
 
-            if( av_samples_alloc( split_raw_frame->audio_frame.audio_data, &split_raw_frame->audio_frame.linesize, num_channels,
-                                  split_raw_frame->audio_frame.num_samples, split_raw_frame->audio_frame.sample_fmt, 0 ) < 0 )
+            if( planar )
             {
-                syslog( LOG_ERR, "Malloc failed\n" );
-                return NULL;
+                /* TODO: offset the channel pointers by the user's request */
+                for( int j = 0; j < num_channels; j++ )
+                    split_raw_frame->audio_frame.audio_data[j] = raw_frame->audio_frame.audio_data[first_channel+j];
             }
+            else
+            {
+                /* Packed input has to be copied out */
+                split_raw_frame->audio_frame.linesize = 0;
+                split_raw_frame->release_data( split_raw_frame );
+                split_raw_frame->release_data = obe_release_audio_data;
 
-            /* TODO: offset the channel pointers by the user's request */
-            av_samples_copy( split_raw_frame->audio_frame.audio_data,
-                             &raw_frame->audio_frame.audio_data[((output_stream->sdi_audio_pair-1)<<1)+output_stream->mono_channel], 0, 0,
-                             split_raw_frame->audio_frame.num_samples, num_channels, split_raw_frame->audio_frame.sample_fmt );
+                if( obe_alloc_audio_data( split_raw_frame, num_channels ) < 0 )
+                {
+                    syslog( LOG_ERR, "Malloc failed\n" );
+                    split_raw_frame->release_frame( split_raw_frame );
+                    goto end;
+                }
+
+                av_samples_copy( split_raw_frame->audio_frame.audio_data, &raw_frame->audio_frame.audio_data[first_channel], 0, 0,
+                                 split_raw_frame->audio_frame.num_samples, num_channels, split_raw_frame->audio_frame.sample_fmt );
+            }
 
             add_to_encode_queue( h, split_raw_frame, h->encoders[i]->output_stream_id );
         }
 
-        remove_from_queue( &filter->queue );
-        raw_frame->release_data( raw_frame );
-        raw_frame->release_frame( raw_frame );
+        obe_unref_raw_frame( raw_frame );
         raw_frame = NULL;
     }
 
+end:
+    if( raw_frame )
+        obe_unref_raw_frame( raw_frame );
+
     free( filter_params );
 
     return NULL;
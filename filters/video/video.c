@@ -43,6 +43,16 @@ typedef struct
     /* cpu flags */
     uint32_t avutil_cpu;
 
+    /* output images */
+    obe_frame_pool_t *frame_pool;
+    int passthrough; /* no conversion, the input's images go to the encoder */
+
+    /* encoded resolution and the input resolution it was chosen for */
+    int width;
+    int height;
+    int input_width;
+    int input_height;
+
     /* upscaling */
     void (*scale_plane)( uint16_t *src, int stride, int width, int height, int lshift, int rshift );
 
@@ -270,9 +280,14 @@ static void blank_lines( obe_raw_frame_t *raw_frame )
     blank_line( y, u, v, raw_frame->img.width / 2 );
 }
 
-static int resize_frame( obe_vid_filter_ctx_t *vfilt, obe_raw_frame_t *raw_frame, int width )
+/* Interlaced frames are scaled a field at a time so that the fields are not mixed vertically */
+static int resize_frame( obe_vid_filter_ctx_t *vfilt, obe_raw_frame_t *raw_frame, int width, int height )
 {
     obe_image_t tmp_image = {0};
+    const uint8_t *src[4];
+    uint8_t *dst[4];
+    int src_stride[4], dst_stride[4];
+    int fields = IS_INTERLACED( raw_frame->img.format ) ? 2 : 1;
 
     if( !vfilt->sws_ctx || raw_frame->reset_obe )
     {
@@ -283,8 +298,10 @@ static int resize_frame( obe_vid_filter_ctx_t *vfilt, obe_raw_frame_t *raw_frame
 
         vfilt->sws_ctx_flags |= SWS_FULL_CHR_H_INP | SWS_ACCURATE_RND | SWS_LANCZOS;
 
-        vfilt->sws_ctx = sws_getContext( raw_frame->img.width, raw_frame->img.height, raw_frame->img.csp,
-                                         width, raw_frame->img.height, vfilt->dst_pix_fmt,
+        if( vfilt->sws_ctx )
+            sws_freeContext( vfilt->sws_ctx );
+        vfilt->sws_ctx = sws_getContext( raw_frame->img.width, raw_frame->img.height / fields, raw_frame->img.csp,
+                                         width, height / fields, vfilt->dst_pix_fmt,
                                          vfilt->sws_ctx_flags, NULL, NULL, NULL );
         if( !vfilt->sws_ctx )
         {
@@ -294,22 +311,33 @@ static int resize_frame( obe_vid_filter_ctx_t *vfilt, obe_raw_frame_t *raw_frame
     }
 
     tmp_image.width = width;
-    tmp_image.height = raw_frame->img.height;
+    tmp_image.height = height;
     tmp_image.planes = av_pix_fmt_descriptors[vfilt->dst_pix_fmt].nb_components;
     tmp_image.csp = vfilt->dst_pix_fmt;
     tmp_image.format = raw_frame->img.format;
 
-    if( av_image_alloc( tmp_image.plane, tmp_image.stride, tmp_image.width, tmp_image.height+1,
-                        tmp_image.csp, 16 ) < 0 )
+    if( obe_pool_get_image( vfilt->frame_pool, tmp_image.plane, tmp_image.stride, tmp_image.csp,
+                            tmp_image.width, tmp_image.height+1, 16 ) < 0 )
     {
         syslog( LOG_ERR, "Malloc failed\n" );
         return -1;
     }
 
-    sws_scale( vfilt->sws_ctx, (const uint8_t* const*)raw_frame->img.plane, raw_frame->img.stride,
-               0, tmp_image.height, tmp_image.plane, tmp_image.stride );
+    for( int i = 0; i < fields; i++ )
+    {
+        for( int j = 0; j < 4; j++ )
+        {
+            src[j] = raw_frame->img.plane[j] ? raw_frame->img.plane[j] + i * raw_frame->img.stride[j] : NULL;
+            dst[j] = tmp_image.plane[j] ? tmp_image.plane[j] + i * tmp_image.stride[j] : NULL;
+            src_stride[j] = raw_frame->img.stride[j] * fields;
+            dst_stride[j] = tmp_image.stride[j] * fields;
+        }
+
+        sws_scale( vfilt->sws_ctx, src, src_stride, 0, raw_frame->img.height / fields, dst, dst_stride );
+    }
 
     raw_frame->release_data( raw_frame );
+    raw_frame->release_data = obe_release_video_data;
     memcpy( &raw_frame->alloc_img, &tmp_image, sizeof(obe_image_t) );
     memcpy( &raw_frame->img, &raw_frame->alloc_img, sizeof(obe_image_t) );
 
@@ -390,6 +418,7 @@ static int dither_image( obe_raw_frame_t *raw_frame, int16_t *error_buf )
     }
 
     raw_frame->release_data( raw_frame );
+    raw_frame->release_data = obe_release_video_data;
     memcpy( &raw_frame->alloc_img, out, sizeof(obe_image_t) );
     memcpy( &raw_frame->img, &raw_frame->alloc_img, sizeof(obe_image_t) );
 
@@ -411,8 +440,8 @@ static int downconvert_image_interlaced( obe_vid_filter_ctx_t *vfilt, obe_raw_fr
     tmp_image.planes = av_pix_fmt_descriptors[tmp_image.csp].nb_components;
     tmp_image.format = raw_frame->img.format;
 
-    if( av_image_alloc( tmp_image.plane, tmp_image.stride, tmp_image.width, tmp_image.height+1,
-                        tmp_image.csp, 16 ) < 0 )
+    if( obe_pool_get_image( vfilt->frame_pool, tmp_image.plane, tmp_image.stride, tmp_image.csp,
+                            tmp_image.width, tmp_image.height+1, 16 ) < 0 )
     {
         syslog( LOG_ERR, "Malloc failed\n" );
         return -1;
@@ -443,6 +472,7 @@ static int downconvert_image_interlaced( obe_vid_filter_ctx_t *vfilt, obe_raw_fr
     }
 
     raw_frame->release_data( raw_frame );
+    raw_frame->release_data = obe_release_video_data;
     memcpy( &raw_frame->alloc_img, out, sizeof(obe_image_t) );
     memcpy( &raw_frame->img, &raw_frame->alloc_img, sizeof(obe_image_t) );
 
@@ -461,8 +491,8 @@ static int dither_image( obe_vid_filter_ctx_t *vfilt, obe_raw_frame_t *raw_frame
     tmp_image.planes = av_pix_fmt_descriptors[tmp_image.csp].nb_components;
     tmp_image.format = raw_frame->img.format;
 
-    if( av_image_alloc( tmp_image.plane, tmp_image.stride, tmp_image.width, tmp_image.height+1,
-                        tmp_image.csp, 16 ) < 0 )
+    if( obe_pool_get_image( vfilt->frame_pool, tmp_image.plane, tmp_image.stride, tmp_image.csp,
+                            tmp_image.width, tmp_image.height+1, 16 ) < 0 )
     {
         syslog( LOG_ERR, "Malloc failed\n" );
         return -1;
@@ -494,6 +524,7 @@ static int dither_image( obe_vid_filter_ctx_t *vfilt, obe_raw_frame_t *raw_frame
     }
 
     raw_frame->release_data( raw_frame );
+    raw_frame->release_data = obe_release_video_data;
     memcpy( &raw_frame->alloc_img, &tmp_image, sizeof(obe_image_t) );
     memcpy( &raw_frame->img, &raw_frame->alloc_img, sizeof(obe_image_t) );
 
@@ -542,9 +573,7 @@ static int write_afd( obe_user_data_t *user_data, obe_raw_frame_t *raw_frame )
     user_data->type = USER_DATA_AVC_REGISTERED_ITU_T35;
     user_data->len = bs_pos( &r ) >> 3;
 
-    free( user_data->data );
-
-    user_data->data = malloc( user_data->len );
+    user_data->data = obe_arena_alloc( &raw_frame->arena, user_data->len );
     if( !user_data->data )
     {
         syslog( LOG_ERR, "Malloc failed\n" );
@@ -556,7 +585,7 @@ static int write_afd( obe_user_data_t *user_data, obe_raw_frame_t *raw_frame )
     return 0;
 }
 
-static int write_bar_data( obe_user_data_t *user_data )
+static int write_bar_data( obe_user_data_t *user_data, obe_raw_frame_t *raw_frame )
 {
     bs_t r;
     uint8_t temp[100];
@@ -610,9 +639,7 @@ static int write_bar_data( obe_user_data_t *user_data )
     user_data->type = USER_DATA_AVC_REGISTERED_ITU_T35;
     user_data->len = bs_pos( &r ) >> 3;
 
-    free( user_data->data );
-
-    user_data->data = malloc( user_data->len );
+    user_data->data = obe_arena_alloc( &raw_frame->arena, user_data->len );
     if( !user_data->data )
     {
         syslog( LOG_ERR, "Malloc failed\n" );
@@ -640,11 +667,11 @@ static int encapsulate_user_data( obe_raw_frame_t *raw_frame, obe_int_input_stre
         if( raw_frame->user_data[i].type == USER_DATA_CEA_608 )
             ret = write_608_cc( &raw_frame->user_data[i], raw_frame );
         else if( raw_frame->user_data[i].type == USER_DATA_CEA_708_CDP )
-            ret = read_cdp( &raw_frame->user_data[i] );
+            ret = read_cdp( &raw_frame->user_data[i], raw_frame );
         else if( raw_frame->user_data[i].type == USER_DATA_AFD )
             ret = write_afd( &raw_frame->user_data[i], raw_frame );
         else if( raw_frame->user_data[i].type == USER_DATA_BAR_DATA )
-            ret = write_bar_data( &raw_frame->user_data[i] );
+            ret = write_bar_data( &raw_frame->user_data[i], raw_frame );
         else if( raw_frame->user_data[i].type == USER_DATA_WSS )
             ret = convert_wss_to_afd( &raw_frame->user_data[i], raw_frame );
 
@@ -654,21 +681,152 @@ static int encapsulate_user_data( obe_raw_frame_t *raw_frame, obe_int_input_stre
 
         if( ret == 1 )
         {
-            free( raw_frame->user_data[i].data );
             memmove( &raw_frame->user_data[i], &raw_frame->user_data[i+1],
-                     sizeof(raw_frame->user_data) * (raw_frame->num_user_data-i-1) );
+                     sizeof(*raw_frame->user_data) * (raw_frame->num_user_data-i-1) );
             raw_frame->num_user_data--;
             i--;
         }
     }
 
-    if( !raw_frame->num_user_data )
+    return ret;
+}
+
+/* Preallocate the images filter_frame() will produce for this output stream. Only the last one
+ * is held until the encoder is done with it, the others are released by the next step */
+static int reserve_images( obe_vid_filter_ctx_t *vfilt, obe_output_stream_t *output_stream, int csp, int width, int height,
+                           int interlaced, int count )
+{
+    int target_csp = output_stream->avc_param.i_csp & X264_CSP_MASK;
+    int h_shift, v_shift, num_images = 0;
+    int image_csp[3], image_width[3];
+    const AVPixFmtDescriptor *pfd;
+
+    if( width != vfilt->width || height != vfilt->height || ( !interlaced && target_csp == X264_CSP_I420 ) )
     {
-        free( raw_frame->user_data );
-        raw_frame->user_data = NULL;
+        if( !interlaced )
+            csp = csp == PIX_FMT_YUV422P10 ? PIX_FMT_YUV420P10 : PIX_FMT_YUV420P;
+        width = vfilt->width;
+        height = vfilt->height;
+        image_csp[num_images] = csp;
+        image_width[num_images++] = width;
     }
 
-    return ret;
+    if( av_pix_fmt_get_chroma_sub_sample( csp, &h_shift, &v_shift ) < 0 )
+        return -1;
+
+    if( h_shift == 1 && v_shift == 0 && target_csp == X264_CSP_I420 )
+    {
+        csp = PIX_FMT_YUV420P10;
+        image_csp[num_images] = csp;
+        image_width[num_images++] = width;
+    }
+
+    pfd = av_pix_fmt_desc_get( csp );
+    if( pfd->comp[0].depth_minus1+1 == 10 && X264_BIT_DEPTH == 8 )
+    {
+        csp = csp == PIX_FMT_YUV422P10 ? PIX_FMT_YUV422P : PIX_FMT_YUV420P;
+        image_csp[num_images] = csp;
+        image_width[num_images++] = width;
+    }
+
+    vfilt->passthrough = !num_images;
+
+    for( int i = 0; i < num_images; i++ )
+    {
+        if( obe_pool_reserve_images( vfilt->frame_pool, image_csp[i], image_width[i], height+1, 16,
+                                     i == num_images-1 ? count : 1 ) < 0 )
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Rungs that pass the captured images to the encoder make the input's pool cover the encoder's delay too */
+static void reserve_input_images( obe_vid_filter_ctx_t **vfilt, int num_rungs, obe_raw_frame_t *raw_frame,
+                                  obe_vid_filter_params_t *filter_params )
+{
+    int count = filter_params->num_input_frames;
+
+    for( int i = 0; i < num_rungs; i++ )
+    {
+        if( vfilt[i]->passthrough )
+            count += filter_params->num_reserved_frames;
+    }
+
+    if( count > filter_params->num_input_frames && obe_pool_reserve_like_image( raw_frame->alloc_img.plane[0], count ) < 0 )
+        syslog( LOG_WARNING, "Could not preallocate captured video frames\n" );
+}
+
+/* The input has changed format. A rung encoded at the input resolution follows the new resolution, a scaled
+ * rung keeps the same ratio to it. The scaler is rebuilt by resize_frame() */
+static void change_input_format( obe_vid_filter_ctx_t *vfilt, obe_output_stream_t *output_stream, obe_raw_frame_t *raw_frame,
+                                 int count )
+{
+    if( vfilt->width == vfilt->input_width )
+        vfilt->width = raw_frame->img.width;
+    else
+        vfilt->width = FFALIGN( (int64_t)vfilt->width * raw_frame->img.width / vfilt->input_width, 16 );
+    vfilt->input_width = raw_frame->img.width;
+
+    if( vfilt->height == vfilt->input_height )
+        vfilt->height = raw_frame->img.height;
+    else
+        vfilt->height = FFALIGN( (int64_t)vfilt->height * raw_frame->img.height / vfilt->input_height, 4 );
+    vfilt->input_height = raw_frame->img.height;
+
+    syslog( LOG_INFO, "Video filter: input is now %ix%i, encoding at %ix%i\n", raw_frame->img.width, raw_frame->img.height,
+            vfilt->width, vfilt->height );
+
+    if( reserve_images( vfilt, output_stream, raw_frame->img.csp, raw_frame->img.width, raw_frame->img.height,
+                        IS_INTERLACED( raw_frame->img.format ), count ) < 0 )
+        syslog( LOG_WARNING, "Could not preallocate filtered video frames\n" );
+}
+
+/* Everything from the resize onwards is specific to the output stream */
+static int filter_frame( obe_vid_filter_ctx_t *vfilt, obe_raw_frame_t *raw_frame, obe_output_stream_t *output_stream,
+                         obe_int_input_stream_t *input_stream )
+{
+    int h_shift, v_shift;
+    const AVPixFmtDescriptor *pfd;
+    int target_csp = output_stream->avc_param.i_csp & X264_CSP_MASK;
+
+    /* Resize if necessary. Together with colourspace conversion if progressive */
+    if( raw_frame->img.width != vfilt->width || raw_frame->img.height != vfilt->height ||
+        (!IS_INTERLACED( raw_frame->img.format ) && target_csp == X264_CSP_I420 ) )
+    {
+        if( resize_frame( vfilt, raw_frame, vfilt->width, vfilt->height ) < 0 )
+            return -1;
+    }
+
+    if( av_pix_fmt_get_chroma_sub_sample( raw_frame->img.csp, &h_shift, &v_shift ) < 0 )
+        return -1;
+
+    /* Downconvert using interlaced scaling if input is 4:2:2 and target is 4:2:0 */
+    if( h_shift == 1 && v_shift == 0 && target_csp == X264_CSP_I420 )
+    {
+        if( downconvert_image_interlaced( vfilt, raw_frame ) < 0 )
+            return -1;
+    }
+
+    pfd = av_pix_fmt_desc_get( raw_frame->img.csp );
+    if( pfd->comp[0].depth_minus1+1 == 10 && X264_BIT_DEPTH == 8 )
+    {
+        if( dither_image( vfilt, raw_frame ) < 0 )
+            return -1;
+    }
+
+    if( encapsulate_user_data( raw_frame, input_stream ) < 0 )
+        return -1;
+
+    /* If SAR, on an SD stream, has not been updated by AFD or WSS, set to default 4:3
+     * TODO: make this user-choosable. OBE will prioritise any SAR information from AFD or WSS over any user settings */
+    if( raw_frame->sar_width == 1 && raw_frame->sar_height == 1 )
+    {
+        set_sar( raw_frame, IS_SD( raw_frame->img.format ) ? output_stream->is_wide : 1 );
+        raw_frame->sar_guess = 1;
+    }
+
+    return 0;
 }
 
 static void *start_filter( void *ptr )
@@ -677,92 +835,119 @@ static void *start_filter( void *ptr )
     obe_t *h = filter_params->h;
     obe_filter_t *filter = filter_params->filter;
     obe_int_input_stream_t *input_stream = filter_params->input_stream;
-    obe_raw_frame_t *raw_frame;
-    obe_output_stream_t *output_stream = get_output_stream( h, 0 ); /* FIXME when output_stream_id for video is not zero */
-    int h_shift, v_shift;
-    const AVPixFmtDescriptor *pfd;
+    obe_raw_frame_t *raw_frame, *rung_frame;
+    int input_reserved = 0;
+
+    /* One rung per video encoder. Each has its own resolution and resize context */
+    int num_rungs = 0;
+    obe_encoder_t *rung_encoders[MAX_STREAMS];
+    obe_output_stream_t *rung_streams[MAX_STREAMS];
+    obe_vid_filter_ctx_t *vfilt[MAX_STREAMS] = { NULL };
 
-    obe_vid_filter_ctx_t *vfilt = calloc( 1, sizeof(*vfilt) );
-    if( !vfilt )
+    for( int i = 0; i < h->num_encoders; i++ )
     {
-        fprintf( stderr, "Malloc failed\n" );
-        goto end;
-    }
+        if( h->encoders[i]->is_video )
+        {
+            rung_encoders[num_rungs] = h->encoders[i];
+            rung_streams[num_rungs] = get_output_stream( h, h->encoders[i]->output_stream_id );
 
-    init_filter( vfilt );
+            vfilt[num_rungs] = calloc( 1, sizeof(*vfilt[num_rungs]) );
+            if( !vfilt[num_rungs] )
+            {
+                fprintf( stderr, "Malloc failed\n" );
+                goto end;
+            }
+
+            init_filter( vfilt[num_rungs] );
+            vfilt[num_rungs]->frame_pool = h->shared->frame_pool;
+            vfilt[num_rungs]->width = rung_streams[num_rungs]->avc_param.i_width;
+            vfilt[num_rungs]->height = rung_streams[num_rungs]->avc_param.i_height;
+            vfilt[num_rungs]->input_width = input_stream->width;
+            vfilt[num_rungs]->input_height = input_stream->height;
+
+            if( reserve_images( vfilt[num_rungs], rung_streams[num_rungs], input_stream->csp, input_stream->width,
+                                input_stream->height, input_stream->interlaced, filter_params->num_reserved_frames ) < 0 )
+                syslog( LOG_WARNING, "Could not preallocate filtered video frames\n" );
+            num_rungs++;
+        }
+    }
 
     while( 1 )
     {
-        /* TODO: support resolution changes */
         /* TODO: support changes in pixel format */
 
-        pthread_mutex_lock( &filter->queue.mutex );
-
-        while( !filter->queue.size && !filter->cancel_thread )
-            pthread_cond_wait( &filter->queue.in_cv, &filter->queue.mutex );
+        if( obe_queue_wait( &filter->queue, 0, &filter->cancel_thread ) < 0 )
+            goto end;
 
-        if( filter->cancel_thread )
+        /* Shedding frames is a source drop as far as speedcontrol is concerned */
+        if( obe_queue_shed( &filter->queue ) )
         {
-            pthread_mutex_unlock( &filter->queue.mutex );
-            goto end;
+            pthread_mutex_lock( &h->drop_mutex );
+            h->encoder_drop = 1;
+            pthread_mutex_unlock( &h->drop_mutex );
         }
 
-        raw_frame = filter->queue.queue[0];
-        pthread_mutex_unlock( &filter->queue.mutex );
+        raw_frame = QUEUE_ITEM( &filter->queue, 0 );
 
         /* TODO: scale 8-bit to 10-bit
          * TODO: convert from 4:2:0 to 4:2:2 */
 
-        if( raw_frame->img.format == INPUT_VIDEO_FORMAT_PAL )
-            blank_lines( raw_frame );
-
-        /* Resize if necessary. Together with colourspace conversion if progressive */
-        if( raw_frame->img.width != output_stream->avc_param.i_width || (!IS_INTERLACED( raw_frame->img.format ) &&
-                                                                          filter_params->target_csp == X264_CSP_I420 ) )
+        if( raw_frame->reset_obe )
         {
-            if( resize_frame( vfilt, raw_frame, output_stream->avc_param.i_width ) < 0 )
-                goto end;
+            for( int i = 0; i < num_rungs; i++ )
+                change_input_format( vfilt[i], rung_streams[i], raw_frame, filter_params->num_reserved_frames );
+            input_reserved = 0;
         }
 
-        if( av_pix_fmt_get_chroma_sub_sample( raw_frame->img.csp, &h_shift, &v_shift ) < 0 )
-            goto end;
-
-        /* Downconvert using interlaced scaling if input is 4:2:2 and target is 4:2:0 */
-        if( h_shift == 1 && v_shift == 0 && filter_params->target_csp == X264_CSP_I420 )
+        /* The input's images are only known once they arrive */
+        if( !input_reserved )
         {
-            if( downconvert_image_interlaced( vfilt, raw_frame ) < 0 )
-                goto end;
+            reserve_input_images( vfilt, num_rungs, raw_frame, filter_params );
+            input_reserved = 1;
         }
 
-        pfd = av_pix_fmt_desc_get( raw_frame->img.csp );
-        if( pfd->comp[0].depth_minus1+1 == 10 && X264_BIT_DEPTH == 8 )
+        if( raw_frame->img.format == INPUT_VIDEO_FORMAT_PAL )
+            blank_lines( raw_frame );
+
+        if( num_rungs == 1 )
         {
-            if( dither_image( vfilt, raw_frame ) < 0 )
+            if( filter_frame( vfilt[0], raw_frame, rung_streams[0], input_stream ) < 0 )
                 goto end;
-        }
-
-        if( encapsulate_user_data( raw_frame, input_stream ) < 0 )
-            goto end;
 
-        /* If SAR, on an SD stream, has not been updated by AFD or WSS, set to default 4:3
-         * TODO: make this user-choosable. OBE will prioritise any SAR information from AFD or WSS over any user settings */
-        if( raw_frame->sar_width == 1 && raw_frame->sar_height == 1 )
-        {
-            set_sar( raw_frame, IS_SD( raw_frame->img.format ) ? output_stream->is_wide : 1 );
-            raw_frame->sar_guess = 1;
+            remove_from_queue( &filter->queue );
+            add_to_encode_queue( h, raw_frame, rung_encoders[0]->output_stream_id );
+            continue;
         }
 
+        /* The captured frame is shared by the rungs, which only diverge at the resize */
         remove_from_queue( &filter->queue );
-        add_to_encode_queue( h, raw_frame, 0 );
+        raw_frame->refcount = 1;
+        for( int i = 0; i < num_rungs; i++ )
+        {
+            rung_frame = obe_share_raw_frame( raw_frame );
+            if( !rung_frame )
+                continue;
+
+            /* Only this rung loses the frame */
+            if( filter_frame( vfilt[i], rung_frame, rung_streams[i], input_stream ) < 0 )
+            {
+                rung_frame->release_data( rung_frame );
+                rung_frame->release_frame( rung_frame );
+                continue;
+            }
+
+            add_to_encode_queue( h, rung_frame, rung_encoders[i]->output_stream_id );
+        }
+        obe_unref_raw_frame( raw_frame );
     }
 
 end:
-    if( vfilt )
+    for( int i = 0; i < num_rungs; i++ )
     {
-        if( vfilt->sws_ctx )
-            sws_freeContext( vfilt->sws_ctx );
+        if( vfilt[i] && vfilt[i]->sws_ctx )
+            sws_freeContext( vfilt[i]->sws_ctx );
 
-        free( vfilt );
+        free( vfilt[i] );
     }
 
     free( filter_params );
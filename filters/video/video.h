@@ -34,7 +34,8 @@ typedef struct
     obe_t *h;
     obe_filter_t *filter;
     obe_int_input_stream_t *input_stream;
-    int target_csp;
+    int num_input_frames;    /* captured frames the input preallocates */
+    int num_reserved_frames; /* filtered frames to preallocate per encoder */
 } obe_vid_filter_params_t;
 
 extern const obe_vid_filter_func_t video_filter;
@@ -0,0 +1,676 @@
+/*****************************************************************************
+ * file.c: replay of recorded SDI captures
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include "common/common.h"
+#include "common/lavc.h"
+#include "input/input.h"
+#include "input/sdi/sdi.h"
+#include "input/sdi/ancillary.h"
+#include "input/sdi/vbi.h"
+#include "input/sdi/capture.h"
+#include "input/sdi/unpack.h"
+
+#include <libavutil/intreadwrite.h>
+#include <libavutil/mathematics.h>
+
+/* Probing stops at the first video frame or after this many chunks */
+#define PROBE_CHUNKS 100
+
+/* How long an unpaced replay backs off while the pipeline is full (us) */
+#define UNPACED_BACKOFF 1000
+
+/* How long the pipeline is clocked after the end of the file so that everything buffered is output (s) */
+#define EOF_DRAIN_TIME 5
+
+typedef struct
+{
+    FILE *fp;
+    char *location;
+    int pacing;
+    int loop;
+    int probe;
+
+    /* Header */
+    int video_format;
+    int width;
+    int coded_height;
+    int height;
+    int timebase_num;
+    int timebase_den;
+    int interlaced;
+    int num_channels;
+    int sample_rate;
+
+    /* Current chunk */
+    int type;
+    int size;
+    int64_t pts;
+
+    /* Looping. Each pass is offset so that timestamps carry on from the previous one */
+    int64_t file_first_pts; /* as stored, -1 until the first chunk */
+    int64_t pts_offset;
+    int64_t last_video_pts;
+    uint8_t *buf;
+    unsigned int buf_size;
+
+    /* Video */
+    obe_v210_unpacker_t unpacker;
+    obe_raw_frame_t *raw_frame; /* Collects the VANC of the next video frame */
+
+    /* VANC */
+    void (*unpack_line)( uint32_t *src, uint16_t *dst, int width );
+    uint16_t *anc_buf;
+    unsigned int anc_buf_size;
+
+    /* Pacing */
+    int64_t first_pts;
+    int64_t start_time;
+    int64_t num_frames;
+
+    obe_sdi_non_display_data_t non_display_parser;
+    obe_device_t *device;
+    obe_t *h;
+} file_ctx_t;
+
+struct file_status
+{
+    obe_input_params_t *input;
+    file_ctx_t *file_ctx;
+};
+
+static int open_file( file_ctx_t *file_ctx )
+{
+    uint8_t header[CAPTURE_HEADER_SIZE];
+
+    file_ctx->fp = fopen( file_ctx->location, "rb" );
+    if( !file_ctx->fp )
+    {
+        fprintf( stderr, "[file] Could not open %s\n", file_ctx->location );
+        return -1;
+    }
+
+    if( fread( header, 1, sizeof(header), file_ctx->fp ) != sizeof(header) || memcmp( header, CAPTURE_MAGIC, 8 ) )
+    {
+        fprintf( stderr, "[file] %s is not an SDI capture\n", file_ctx->location );
+        return -1;
+    }
+
+    file_ctx->video_format = AV_RL32( &header[8] );
+    file_ctx->width        = AV_RL32( &header[12] );
+    file_ctx->coded_height = AV_RL32( &header[16] );
+    file_ctx->timebase_num = AV_RL32( &header[20] );
+    file_ctx->timebase_den = AV_RL32( &header[24] );
+    file_ctx->num_channels = AV_RL32( &header[28] );
+    file_ctx->sample_rate  = AV_RL32( &header[32] );
+
+    if( file_ctx->video_format < INPUT_VIDEO_FORMAT_PAL || file_ctx->video_format > INPUT_VIDEO_FORMAT_1080P_60 ||
+        file_ctx->width <= 0 || file_ctx->coded_height <= 0 || file_ctx->timebase_num <= 0 || file_ctx->timebase_den <= 0 ||
+        file_ctx->num_channels <= 0 || file_ctx->num_channels > MAX_CHANNELS || file_ctx->sample_rate <= 0 )
+    {
+        fprintf( stderr, "[file] Invalid capture header\n" );
+        return -1;
+    }
+
+    /* NTSC has 6 lines that are not coded */
+    file_ctx->height = file_ctx->video_format == INPUT_VIDEO_FORMAT_NTSC ? 480 : file_ctx->coded_height;
+    file_ctx->interlaced = IS_INTERLACED( file_ctx->video_format );
+    file_ctx->unpack_line = IS_SD( file_ctx->video_format ) ? obe_v210_line_to_uyvy_c : obe_v210_line_to_nv20_c;
+    file_ctx->first_pts = file_ctx->file_first_pts = -1;
+
+    return 0;
+}
+
+/* Returns 0 at the end of the file */
+static int read_chunk( file_ctx_t *file_ctx )
+{
+    uint8_t header[CHUNK_HEADER_SIZE];
+
+    if( fread( header, 1, sizeof(header), file_ctx->fp ) != sizeof(header) )
+        return 0;
+
+    file_ctx->type = AV_RL32( &header[0] );
+    file_ctx->size = AV_RL32( &header[4] );
+    file_ctx->pts  = AV_RL64( &header[8] );
+
+    if( file_ctx->file_first_pts == -1 )
+        file_ctx->file_first_pts = file_ctx->pts;
+    file_ctx->pts += file_ctx->pts_offset;
+
+    if( file_ctx->size < 0 || file_ctx->size > MAX_CHUNK_SIZE )
+    {
+        syslog( LOG_ERR, "[file] Invalid chunk size %i\n", file_ctx->size );
+        return -1;
+    }
+
+    /* Padded so that the line unpackers never read past the end of the buffer */
+    av_fast_malloc( &file_ctx->buf, &file_ctx->buf_size, file_ctx->size + FF_INPUT_BUFFER_PADDING_SIZE );
+    if( !file_ctx->buf )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        return -1;
+    }
+    memset( file_ctx->buf + file_ctx->size, 0, FF_INPUT_BUFFER_PADDING_SIZE );
+
+    if( fread( file_ctx->buf, 1, file_ctx->size, file_ctx->fp ) != file_ctx->size )
+        return 0;
+
+    return 1;
+}
+
+static int get_stream_id( file_ctx_t *file_ctx, int stream_format )
+{
+    for( int i = 0; i < file_ctx->device->num_input_streams; i++ )
+    {
+        if( file_ctx->device->streams[i]->stream_format == stream_format )
+            return file_ctx->device->streams[i]->input_stream_id;
+    }
+
+    return -1;
+}
+
+/* Hold the chunk back until it is due */
+static void pace_chunk( file_ctx_t *file_ctx )
+{
+    if( file_ctx->first_pts == -1 )
+    {
+        file_ctx->first_pts = file_ctx->pts;
+        file_ctx->start_time = get_wallclock_in_mpeg_ticks();
+    }
+
+    if( file_ctx->pacing == REPLAY_PACING_REALTIME )
+        sleep_mpeg_ticks( file_ctx->start_time + file_ctx->pts - file_ctx->first_pts );
+    else
+    {
+        while( obe_pipeline_full( file_ctx->h ) )
+            usleep( UNPACED_BACKOFF );
+    }
+}
+
+static obe_raw_frame_t *get_raw_frame( file_ctx_t *file_ctx )
+{
+    if( !file_ctx->raw_frame )
+    {
+        file_ctx->raw_frame = new_raw_frame();
+        if( !file_ctx->raw_frame )
+            syslog( LOG_ERR, "Malloc failed\n" );
+    }
+
+    return file_ctx->raw_frame;
+}
+
+static int handle_vanc_line( file_ctx_t *file_ctx )
+{
+    obe_raw_frame_t *raw_frame = NULL;
+    int line, anc_line_stride = FFALIGN( (file_ctx->width * 2 * sizeof(uint16_t)), 16 );
+
+    if( file_ctx->size < 4 + file_ctx->width * 8 / 3 )
+    {
+        syslog( LOG_WARNING, "[file] Truncated VANC line\n" );
+        return 0;
+    }
+
+    line = AV_RL32( file_ctx->buf );
+
+    av_fast_malloc( &file_ctx->anc_buf, &file_ctx->anc_buf_size, anc_line_stride );
+    if( !file_ctx->anc_buf )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        return -1;
+    }
+
+    if( !file_ctx->probe )
+    {
+        raw_frame = get_raw_frame( file_ctx );
+        if( !raw_frame )
+            return -1;
+    }
+
+    file_ctx->unpack_line( (uint32_t*)&file_ctx->buf[4], file_ctx->anc_buf, file_ctx->width );
+
+    return parse_vanc_line( file_ctx->h, &file_ctx->non_display_parser, raw_frame, file_ctx->anc_buf, file_ctx->width, line );
+}
+
+static int handle_video_frame( file_ctx_t *file_ctx )
+{
+    obe_t *h = file_ctx->h;
+    obe_raw_frame_t *raw_frame;
+    obe_image_t *output;
+    int stride = file_ctx->size / file_ctx->coded_height, j;
+
+    raw_frame = get_raw_frame( file_ctx );
+    if( !raw_frame )
+        return -1;
+    file_ctx->raw_frame = NULL;
+
+    /* The cards pad each line to their own stride. The frame is dropped along with its VANC */
+    if( stride < ( file_ctx->width + 5 ) / 6 * 16 || stride * file_ctx->coded_height != file_ctx->size )
+    {
+        syslog( LOG_WARNING, "[file] Invalid video frame size %i\n", file_ctx->size );
+        obe_release_frame( raw_frame );
+        return 0;
+    }
+
+    pace_chunk( file_ctx );
+    if( file_ctx->pacing == REPLAY_PACING_REALTIME )
+        obe_clock_tick( h, file_ctx->pts );
+    else
+        obe_clock_step( h, file_ctx->pts );
+
+    raw_frame->release_data = obe_release_video_data;
+    raw_frame->release_frame = obe_release_frame;
+    raw_frame->arrival_time = obe_mdate();
+
+    output = &raw_frame->alloc_img;
+    output->csp = PIX_FMT_YUV422P10;
+    output->planes = av_pix_fmt_descriptors[output->csp].nb_components;
+    output->width = file_ctx->width;
+    output->height = file_ctx->coded_height;
+    output->format = file_ctx->video_format;
+
+    /* Unpack the same way the cards do, the fields are already interleaved */
+    if( obe_pool_get_image( h->shared->frame_pool, output->plane, output->stride, output->csp, file_ctx->width,
+                            file_ctx->coded_height + 1, 16 ) < 0 )
+        goto fail;
+
+    obe_v210_unpack_frame( &file_ctx->unpacker, file_ctx->buf, NULL, stride, file_ctx->width, file_ctx->coded_height, output );
+
+    raw_frame->timebase_num = file_ctx->timebase_num;
+    raw_frame->timebase_den = file_ctx->timebase_den;
+
+    memcpy( &raw_frame->img, &raw_frame->alloc_img, sizeof(raw_frame->alloc_img) );
+    if( IS_SD( file_ctx->video_format ) )
+    {
+        for( j = 0; first_active_line[j].format != -1; j++ )
+        {
+            if( file_ctx->video_format == first_active_line[j].format )
+                break;
+        }
+
+        raw_frame->img.first_line = first_active_line[j].line;
+        if( file_ctx->video_format == INPUT_VIDEO_FORMAT_NTSC )
+        {
+            raw_frame->img.height = 480;
+            while( raw_frame->img.first_line != NTSC_FIRST_CODED_LINE )
+            {
+                for( int i = 0; i < raw_frame->img.planes; i++ )
+                    raw_frame->img.plane[i] += raw_frame->img.stride[i];
+
+                raw_frame->img.first_line = sdi_next_line( INPUT_VIDEO_FORMAT_NTSC, raw_frame->img.first_line );
+            }
+        }
+    }
+
+    /* If AFD is present and the stream is SD this will be changed in the video filter */
+    raw_frame->sar_width = raw_frame->sar_height = 1;
+    raw_frame->pts = file_ctx->last_video_pts = file_ctx->pts;
+    raw_frame->input_stream_id = get_stream_id( file_ctx, VIDEO_UNCOMPRESSED );
+
+    if( add_to_filter_queue( h, raw_frame ) < 0 )
+        goto fail;
+
+    if( send_vbi_and_ttx( h, &file_ctx->non_display_parser, raw_frame->pts ) < 0 )
+        return -1;
+
+    file_ctx->non_display_parser.num_vbi = 0;
+    file_ctx->non_display_parser.num_anc_vbi = 0;
+    file_ctx->num_frames++;
+
+    return 0;
+
+fail:
+    if( raw_frame->release_data )
+        raw_frame->release_data( raw_frame );
+    obe_release_frame( raw_frame );
+
+    return -1;
+}
+
+static int handle_audio_frame( file_ctx_t *file_ctx )
+{
+    obe_raw_frame_t *raw_frame;
+    int plane_size = file_ctx->size / file_ctx->num_channels;
+
+    if( !plane_size )
+        return 0;
+
+    raw_frame = new_raw_frame();
+    if( !raw_frame )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        return -1;
+    }
+
+    raw_frame->audio_frame.num_samples = plane_size / sizeof(int32_t);
+    raw_frame->audio_frame.num_channels = file_ctx->num_channels;
+    raw_frame->audio_frame.sample_fmt = AV_SAMPLE_FMT_S32P;
+
+    if( obe_alloc_audio_data( raw_frame, file_ctx->num_channels ) < 0 )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        obe_release_frame( raw_frame );
+        return -1;
+    }
+
+    for( int i = 0; i < file_ctx->num_channels; i++ )
+        memcpy( raw_frame->audio_frame.audio_data[i], &file_ctx->buf[i*plane_size], raw_frame->audio_frame.num_samples * sizeof(int32_t) );
+
+    raw_frame->pts = file_ctx->pts;
+    raw_frame->release_data = obe_release_audio_data;
+    raw_frame->release_frame = obe_release_frame;
+    raw_frame->input_stream_id = get_stream_id( file_ctx, AUDIO_PCM );
+
+    pace_chunk( file_ctx );
+
+    if( add_to_filter_queue( file_ctx->h, raw_frame ) < 0 )
+    {
+        raw_frame->release_data( raw_frame );
+        raw_frame->release_frame( raw_frame );
+        return -1;
+    }
+
+    return 0;
+}
+
+static void open_unpacker( file_ctx_t *file_ctx, int num_reserved_frames )
+{
+    if( obe_pool_reserve_images( file_ctx->h->shared->frame_pool, PIX_FMT_YUV422P10, file_ctx->width, file_ctx->coded_height + 1,
+                                 16, num_reserved_frames ) < 0 )
+        syslog( LOG_WARNING, "[file] Could not preallocate video frames\n" );
+
+    obe_v210_unpacker_init( file_ctx->h, &file_ctx->unpacker, file_ctx->width, file_ctx->coded_height );
+}
+
+/* Go back to the first chunk. The next pass starts a frame after the last frame of this one */
+static int rewind_file( file_ctx_t *file_ctx, int64_t frame_duration )
+{
+    if( fseek( file_ctx->fp, CAPTURE_HEADER_SIZE, SEEK_SET ) < 0 )
+    {
+        syslog( LOG_ERR, "[file] Could not rewind %s\n", file_ctx->location );
+        return -1;
+    }
+
+    file_ctx->pts_offset = file_ctx->last_video_pts + frame_duration - file_ctx->file_first_pts;
+
+    return 0;
+}
+
+static void close_file( file_ctx_t *file_ctx )
+{
+    if( file_ctx->fp )
+        fclose( file_ctx->fp );
+
+    obe_v210_unpacker_close( &file_ctx->unpacker );
+
+    if( file_ctx->raw_frame )
+        obe_release_frame( file_ctx->raw_frame );
+
+    av_free( file_ctx->buf );
+    av_free( file_ctx->anc_buf );
+}
+
+static void close_thread( void *handle )
+{
+    struct file_status *status = handle;
+
+    if( status->file_ctx )
+    {
+        close_file( status->file_ctx );
+        free( status->file_ctx );
+    }
+
+    free( status->input );
+}
+
+static void *probe_stream( void *ptr )
+{
+    obe_input_probe_t *probe_ctx = ptr;
+    obe_t *h = probe_ctx->h;
+    obe_input_t *user_opts = &probe_ctx->user_opts;
+    obe_device_t *device;
+    obe_int_input_stream_t *streams[MAX_STREAMS];
+    int cur_stream = 2, ret = 0, has_video = 0;
+    obe_sdi_non_display_data_t *non_display_parser;
+
+    file_ctx_t *file_ctx = calloc( 1, sizeof(*file_ctx) );
+    if( !file_ctx )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        goto finish;
+    }
+
+    non_display_parser = &file_ctx->non_display_parser;
+    file_ctx->location = user_opts->location;
+    file_ctx->probe = non_display_parser->probe = 1;
+    file_ctx->h = h;
+
+    if( open_file( file_ctx ) < 0 )
+        goto finish;
+
+    /* Any VANC services come before the first frame */
+    for( int i = 0; i < PROBE_CHUNKS && !has_video; i++ )
+    {
+        ret = read_chunk( file_ctx );
+        if( ret <= 0 )
+            break;
+
+        if( file_ctx->type == CHUNK_VANC )
+            handle_vanc_line( file_ctx );
+        else if( file_ctx->type == CHUNK_VIDEO )
+            has_video = 1;
+    }
+
+    if( !has_video )
+    {
+        fprintf( stderr, "[file] No video frames found in %s\n", file_ctx->location );
+        goto finish;
+    }
+
+    for( int i = 0; i < 2; i++ )
+    {
+        streams[i] = calloc( 1, sizeof(*streams[i]) );
+        if( !streams[i] )
+            goto finish;
+
+        pthread_mutex_lock( &h->device_list_mutex );
+        streams[i]->input_stream_id = h->cur_input_stream_id++;
+        pthread_mutex_unlock( &h->device_list_mutex );
+
+        if( i == 0 )
+        {
+            streams[i]->stream_type = STREAM_TYPE_VIDEO;
+            streams[i]->stream_format = VIDEO_UNCOMPRESSED;
+            streams[i]->width  = file_ctx->width;
+            streams[i]->height = file_ctx->height;
+            streams[i]->timebase_num = file_ctx->timebase_num;
+            streams[i]->timebase_den = file_ctx->timebase_den;
+            streams[i]->csp    = PIX_FMT_YUV422P10;
+            streams[i]->interlaced = file_ctx->interlaced;
+            streams[i]->tff = 1; /* NTSC is bff in baseband but coded as tff */
+            streams[i]->sar_num = streams[i]->sar_den = 1; /* The user can choose this when encoding */
+
+            if( add_non_display_services( non_display_parser, streams[i], USER_DATA_LOCATION_FRAME ) < 0 )
+                goto finish;
+        }
+        else if( i == 1 )
+        {
+            streams[i]->stream_type = STREAM_TYPE_AUDIO;
+            streams[i]->stream_format = AUDIO_PCM;
+            streams[i]->num_channels  = file_ctx->num_channels;
+            streams[i]->sample_format = AV_SAMPLE_FMT_S32P;
+            streams[i]->sample_rate = file_ctx->sample_rate;
+        }
+    }
+
+    if( non_display_parser->has_vbi_frame )
+    {
+        streams[cur_stream] = calloc( 1, sizeof(*streams[cur_stream]) );
+        if( !streams[cur_stream] )
+            goto finish;
+
+        pthread_mutex_lock( &h->device_list_mutex );
+        streams[cur_stream]->input_stream_id = h->cur_input_stream_id++;
+        pthread_mutex_unlock( &h->device_list_mutex );
+
+        streams[cur_stream]->stream_type = STREAM_TYPE_MISC;
+        streams[cur_stream]->stream_format = VBI_RAW;
+        streams[cur_stream]->vbi_ntsc = file_ctx->video_format == INPUT_VIDEO_FORMAT_NTSC;
+        if( add_non_display_services( non_display_parser, streams[cur_stream], USER_DATA_LOCATION_DVB_STREAM ) < 0 )
+            goto finish;
+        cur_stream++;
+    }
+
+    if( non_display_parser->has_ttx_frame )
+    {
+        streams[cur_stream] = calloc( 1, sizeof(*streams[cur_stream]) );
+        if( !streams[cur_stream] )
+            goto finish;
+
+        pthread_mutex_lock( &h->device_list_mutex );
+        streams[cur_stream]->input_stream_id = h->cur_input_stream_id++;
+        pthread_mutex_unlock( &h->device_list_mutex );
+
+        streams[cur_stream]->stream_type = STREAM_TYPE_MISC;
+        streams[cur_stream]->stream_format = MISC_TELETEXT;
+        if( add_teletext_service( non_display_parser, streams[cur_stream] ) < 0 )
+            goto finish;
+        cur_stream++;
+    }
+
+    if( non_display_parser->num_frame_data )
+        free( non_display_parser->frame_data );
+
+    device = new_device();
+
+    if( !device )
+        goto finish;
+
+    device->num_input_streams = cur_stream;
+    memcpy( device->streams, streams, device->num_input_streams * sizeof(obe_int_input_stream_t**) );
+    device->device_type = INPUT_FILE;
+    memcpy( &device->user_opts, user_opts, sizeof(*user_opts) );
+
+    /* add device */
+    add_device( h, device );
+
+finish:
+    if( file_ctx )
+    {
+        close_file( file_ctx );
+        free( file_ctx );
+    }
+
+    free( probe_ctx );
+
+    return NULL;
+}
+
+static void *open_input( void *ptr )
+{
+    obe_input_params_t *input = ptr;
+    obe_t *h = input->h;
+    obe_device_t *device = input->device;
+    obe_input_t *user_opts = &device->user_opts;
+    file_ctx_t *file_ctx;
+    struct file_status status;
+    int64_t start_time, frame_duration;
+    int ret;
+
+    file_ctx = calloc( 1, sizeof(*file_ctx) );
+    if( !file_ctx )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return NULL;
+    }
+
+    status.input = input;
+    status.file_ctx = file_ctx;
+    pthread_cleanup_push( close_thread, (void*)&status );
+
+    file_ctx->location = user_opts->location;
+    file_ctx->pacing = user_opts->replay_pacing;
+    file_ctx->loop = user_opts->replay_loop;
+    file_ctx->device = device;
+    file_ctx->h = h;
+    file_ctx->non_display_parser.device = device;
+
+    if( open_file( file_ctx ) < 0 )
+        goto end;
+
+    open_unpacker( file_ctx, input->num_reserved_frames );
+
+    start_time = obe_mdate();
+    frame_duration = av_rescale_q( 1, (AVRational){file_ctx->timebase_num, file_ctx->timebase_den}, (AVRational){1, OBE_CLOCK} );
+
+    while( 1 )
+    {
+        ret = read_chunk( file_ctx );
+
+        /* A file without a whole video frame would loop without ever clocking the pipeline */
+        if( !ret && file_ctx->loop && file_ctx->num_frames )
+        {
+            if( rewind_file( file_ctx, frame_duration ) < 0 )
+            {
+                ret = -1;
+                break;
+            }
+            continue;
+        }
+
+        if( ret <= 0 )
+            break;
+
+        if( file_ctx->type == CHUNK_VIDEO )
+            ret = handle_video_frame( file_ctx );
+        else if( file_ctx->type == CHUNK_AUDIO )
+            ret = handle_audio_frame( file_ctx );
+        else if( file_ctx->type == CHUNK_VANC )
+            ret = handle_vanc_line( file_ctx );
+        /* Skip anything else */
+
+        if( ret < 0 )
+            break;
+    }
+
+    if( !ret )
+    {
+        double elapsed = (double)( obe_mdate() - start_time ) / 1000000;
+        fprintf( stderr, "[file] Replayed %"PRIi64" frames in %.2f seconds (%.2f fps)\n", file_ctx->num_frames,
+                 elapsed, elapsed > 0 ? file_ctx->num_frames / elapsed : 0 );
+
+        /* Keep clocking the pipeline for a while so that everything buffered downstream is output, then stop */
+        int64_t drain_end = file_ctx->pts + EOF_DRAIN_TIME * (int64_t)OBE_CLOCK;
+        while( file_ctx->pts < drain_end )
+        {
+            file_ctx->pts += frame_duration;
+            sleep_mpeg_ticks( get_wallclock_in_mpeg_ticks() + frame_duration );
+            obe_clock_step( h, file_ctx->pts );
+        }
+
+        fprintf( stderr, "[file] End of %s, input stopped\n", file_ctx->location );
+    }
+
+end:
+    pthread_cleanup_pop( 1 );
+
+    return NULL;
+}
+
+const obe_input_func_t file_input = { probe_stream, open_input };
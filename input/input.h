@@ -43,6 +43,7 @@ typedef struct
     int num_output_streams;
     obe_output_stream_t *output_streams;
     int audio_samples;
+    int num_reserved_frames; /* raw video frames to preallocate */
 } obe_input_params_t;
 
 //extern const obe_input_func_t lavf_input;
@@ -50,5 +51,6 @@ typedef struct
 extern const obe_input_func_t decklink_input;
 #endif
 extern const obe_input_func_t linsys_sdi_input;
+extern const obe_input_func_t file_input;
 
 #endif
@@ -46,7 +46,7 @@ static int parse_afd( obe_t *h, obe_sdi_non_display_data_t *non_display_data, ob
                       uint16_t *line, int line_number, int len )
 {
     obe_int_frame_data_t *tmp, *frame_data;
-    obe_user_data_t *tmp2, *user_data;
+    obe_user_data_t *user_data;
 
     if( READ_8( line[0] ) != 8 )
     {
@@ -101,35 +101,25 @@ static int parse_afd( obe_t *h, obe_sdi_non_display_data_t *non_display_data, ob
     if( check_active_non_display_data( raw_frame, USER_DATA_AFD ) )
         return 0;
 
-    tmp2 = realloc( raw_frame->user_data, (raw_frame->num_user_data+2) * sizeof(*raw_frame->user_data) );
-    if( !tmp2 )
+    /* Read AFD */
+    user_data = obe_add_user_data( raw_frame, 1 );
+    if( !user_data )
         goto fail;
 
-    raw_frame->user_data = tmp2;
-    user_data = &raw_frame->user_data[raw_frame->num_user_data];
-    raw_frame->num_user_data += 2;
-
-    /* Read AFD */
-    user_data->len = 1;
     user_data->type = USER_DATA_AFD;
     user_data->source = VANC_GENERIC;
-    user_data->data = malloc( user_data->len );
-    if( !user_data->data )
-        goto fail;
-
     user_data->data[0] = READ_8( line[0] );
 
     /* Skip two reserved words */
     line += 2;
-    user_data++;
 
     /* Read Bar Data */
-    user_data->len = 5;
+    user_data = obe_add_user_data( raw_frame, 5 );
+    if( !user_data )
+        goto fail;
+
     user_data->type = USER_DATA_BAR_DATA;
     user_data->source = VANC_GENERIC;
-    user_data->data = malloc( user_data->len );
-    if( !user_data->data )
-        goto fail;
 
     for( int i = 0; i < user_data->len; i++)
         user_data->data[i] = READ_8( line[i] );
@@ -219,7 +209,7 @@ static int parse_cdp( obe_t *h, obe_sdi_non_display_data_t *non_display_data, ob
                       uint16_t *line, int line_number, int len )
 {
     obe_int_frame_data_t *tmp, *frame_data;
-    obe_user_data_t *tmp2, *user_data;
+    obe_user_data_t *user_data;
 
     /* Skip DC word */
     line++;
@@ -253,18 +243,12 @@ static int parse_cdp( obe_t *h, obe_sdi_non_display_data_t *non_display_data, ob
     if( check_active_non_display_data( raw_frame, USER_DATA_CEA_708_CDP ) )
         return 0;
 
-    tmp2 = realloc( raw_frame->user_data, (raw_frame->num_user_data+1) * sizeof(*raw_frame->user_data) );
-    if( !tmp2 )
+    user_data = obe_add_user_data( raw_frame, len );
+    if( !user_data )
         goto fail;
 
-    raw_frame->user_data = tmp2;
-    user_data = &raw_frame->user_data[raw_frame->num_user_data++];
-    user_data->len = len;
     user_data->type = USER_DATA_CEA_708_CDP;
     user_data->source = VANC_GENERIC;
-    user_data->data = malloc( user_data->len );
-    if( !user_data->data )
-        goto fail;
 
     for( int i = 0; i < user_data->len; i++ )
         user_data->data[i] = READ_8( line[i] );
@@ -0,0 +1,135 @@
+/*****************************************************************************
+ * capture.c: recorded SDI captures
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include "common/common.h"
+#include "input/sdi/capture.h"
+
+#include <libavutil/intreadwrite.h>
+
+struct obe_capture_writer_t
+{
+    pthread_mutex_t mutex;
+    FILE *fp;
+    int failed; /* a write failed, the rest of the capture is dropped */
+};
+
+obe_capture_writer_t *obe_open_capture_writer( const char *location, int video_format, int width, int coded_height,
+                                               int timebase_num, int timebase_den, int num_channels, int sample_rate )
+{
+    uint8_t header[CAPTURE_HEADER_SIZE];
+    obe_capture_writer_t *writer = calloc( 1, sizeof(*writer) );
+
+    if( !writer )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return NULL;
+    }
+
+    writer->fp = fopen( location, "wb" );
+    if( !writer->fp )
+    {
+        fprintf( stderr, "[capture] Could not open %s: %s\n", location, strerror( errno ) );
+        free( writer );
+        return NULL;
+    }
+
+    memcpy( header, CAPTURE_MAGIC, 8 );
+    AV_WL32( &header[8],  video_format );
+    AV_WL32( &header[12], width );
+    AV_WL32( &header[16], coded_height );
+    AV_WL32( &header[20], timebase_num );
+    AV_WL32( &header[24], timebase_den );
+    AV_WL32( &header[28], num_channels );
+    AV_WL32( &header[32], sample_rate );
+
+    if( fwrite( header, 1, sizeof(header), writer->fp ) != sizeof(header) )
+    {
+        fprintf( stderr, "[capture] Could not write %s\n", location );
+        fclose( writer->fp );
+        free( writer );
+        return NULL;
+    }
+
+    pthread_mutex_init( &writer->mutex, NULL );
+
+    return writer;
+}
+
+void obe_close_capture_writer( obe_capture_writer_t *writer )
+{
+    if( fclose( writer->fp ) )
+        syslog( LOG_ERR, "[capture] Could not finish the capture: %s\n", strerror( errno ) );
+
+    pthread_mutex_destroy( &writer->mutex );
+    free( writer );
+}
+
+void obe_capture_write( obe_capture_writer_t *writer, const void *data, int size )
+{
+    if( writer->failed )
+        return;
+
+    /* The file input stops at a truncated chunk, so everything up to here can still be replayed */
+    if( fwrite( data, 1, size, writer->fp ) != (size_t)size )
+    {
+        syslog( LOG_ERR, "[capture] Write failed, stopping the capture: %s\n", strerror( errno ) );
+        writer->failed = 1;
+    }
+}
+
+void obe_capture_begin_chunk( obe_capture_writer_t *writer, int type, int size, int64_t pts )
+{
+    uint8_t header[CHUNK_HEADER_SIZE];
+
+    AV_WL32( &header[0], type );
+    AV_WL32( &header[4], size );
+    AV_WL64( &header[8], pts );
+
+    pthread_mutex_lock( &writer->mutex );
+    obe_capture_write( writer, header, sizeof(header) );
+}
+
+void obe_capture_end_chunk( obe_capture_writer_t *writer )
+{
+    pthread_mutex_unlock( &writer->mutex );
+}
+
+void obe_capture_vanc_line( obe_capture_writer_t *writer, int64_t pts, int line, const void *data, int size )
+{
+    uint8_t line_num[4];
+
+    AV_WL32( line_num, line );
+
+    obe_capture_begin_chunk( writer, CHUNK_VANC, sizeof(line_num) + size, pts );
+    obe_capture_write( writer, line_num, sizeof(line_num) );
+    obe_capture_write( writer, data, size );
+    obe_capture_end_chunk( writer );
+}
+
+void obe_capture_audio( obe_capture_writer_t *writer, int64_t pts, uint8_t **planes, int num_channels, int num_samples )
+{
+    int plane_size = num_samples * sizeof(int32_t);
+
+    obe_capture_begin_chunk( writer, CHUNK_AUDIO, num_channels * plane_size, pts );
+    for( int i = 0; i < num_channels; i++ )
+        obe_capture_write( writer, planes[i], plane_size );
+    obe_capture_end_chunk( writer );
+}
@@ -0,0 +1,64 @@
+/*****************************************************************************
+ * capture.h: recorded SDI captures
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef OBE_SDI_CAPTURE_H
+#define OBE_SDI_CAPTURE_H
+
+#include "common/common.h"
+
+/* Written by the dump option of the SDI inputs and replayed by the file input.
+ * A capture is a header followed by chunks. All fields are little-endian.
+ *
+ * header: "OBECAP01" then video format, width, coded height, timebase num, timebase den,
+ *         number of audio channels and sample rate (32 bits each)
+ * chunk:  type and payload size (32 bits each), pts in 27MHz ticks (64 bits), payload
+ *
+ * Video is a v210 frame with the row stride the cards use, fields interleaved.
+ * Audio is one plane of 32-bit samples per channel.
+ * VANC is the line number (32 bits, SMPTE notation) followed by the v210 line.
+ * The VANC lines of a frame come before its video */
+#define CAPTURE_MAGIC       "OBECAP01"
+#define CAPTURE_HEADER_SIZE 36
+#define CHUNK_HEADER_SIZE   16
+#define MAX_CHUNK_SIZE      (64 << 20)
+
+enum capture_chunk_e
+{
+    CHUNK_VIDEO = 1,
+    CHUNK_AUDIO,
+    CHUNK_VANC,
+};
+
+typedef struct obe_capture_writer_t obe_capture_writer_t;
+
+obe_capture_writer_t *obe_open_capture_writer( const char *location, int video_format, int width, int coded_height,
+                                               int timebase_num, int timebase_den, int num_channels, int sample_rate );
+void obe_close_capture_writer( obe_capture_writer_t *writer );
+
+/* A chunk can be written in pieces. The writer is locked from begin to end so chunks from different threads do not mix */
+void obe_capture_begin_chunk( obe_capture_writer_t *writer, int type, int size, int64_t pts );
+void obe_capture_write( obe_capture_writer_t *writer, const void *data, int size );
+void obe_capture_end_chunk( obe_capture_writer_t *writer );
+
+void obe_capture_vanc_line( obe_capture_writer_t *writer, int64_t pts, int line, const void *data, int size );
+void obe_capture_audio( obe_capture_writer_t *writer, int64_t pts, uint8_t **planes, int num_channels, int num_samples );
+
+#endif
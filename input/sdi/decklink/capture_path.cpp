@@ -0,0 +1,164 @@
+/*****************************************************************************
+ * capture_path.cpp: Frames from the Decklink SDK callback to the capture thread
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#define __STDC_FORMAT_MACROS 1
+
+#include <inttypes.h>
+#include <syslog.h>
+
+#include "capture_path.h"
+
+void decklink_capture_path_init( decklink_capture_path_t *path )
+{
+    capture_ring_init( &path->ring );
+    pthread_cond_init( &path->probe_cv, NULL );
+
+    path->probe_success = path->probe_audio = 0;
+    path->probe_video_time = 0;
+    path->format_changed = path->reset_pending = 0;
+    path->time_offset = path->last_stream_time = 0;
+    path->last_frame_time = -1;
+}
+
+void decklink_capture_path_close( decklink_capture_path_t *path )
+{
+    capture_ring_close( &path->ring );
+    pthread_cond_destroy( &path->probe_cv );
+}
+
+void decklink_frame_arrived( decklink_capture_path_t *path, IDeckLinkVideoInputFrame *videoframe,
+                             IDeckLinkAudioInputPacket *audioframe )
+{
+    decklink_capture_t capture;
+    BMDTimeValue stream_time, frame_duration;
+
+    /* The probe only needs one frame but also waits to see audio */
+    if( path->probe && audioframe && !path->probe_audio )
+    {
+        pthread_mutex_lock( &path->ring.mutex );
+        path->probe_audio = 1;
+        pthread_cond_signal( &path->probe_cv );
+        pthread_mutex_unlock( &path->ring.mutex );
+    }
+
+    if( path->probe_success )
+        return;
+
+    if( videoframe )
+    {
+        if( videoframe->GetFlags() & bmdFrameHasNoInputSource )
+        {
+            syslog( LOG_ERR, "Decklink card index %i: No input signal detected", path->card_idx );
+            return;
+        }
+        else if( path->probe )
+            path->probe_success = 1;
+
+        /* use SDI ticks as clock source */
+        videoframe->GetStreamTime( &stream_time, &frame_duration, path->timescale );
+
+        /* The stream time restarts with the new format so carry on from the last frame by the wallclock */
+        if( path->format_changed )
+        {
+            path->time_offset = path->last_stream_time + (path->ops.mdate() - path->last_frame_time) * (path->timescale / 1000000) -
+                                stream_time;
+            path->reset_pending = 1;
+            path->format_changed = 0;
+        }
+
+        if( path->last_frame_time == -1 && !path->probe && !path->ops.check_format( path->ops.opaque ) )
+        {
+            syslog( LOG_WARNING, "Decklink card index %i: Input does not match the probed format", path->card_idx );
+            path->reset_pending = 1;
+        }
+
+        stream_time += path->time_offset;
+        path->last_stream_time = stream_time;
+        path->ops.clock_tick( path->ops.opaque, (int64_t)stream_time );
+
+        if( path->last_frame_time == -1 )
+            path->last_frame_time = path->ops.mdate();
+        else
+        {
+            int64_t cur_frame_time = path->ops.mdate();
+            if( cur_frame_time - path->last_frame_time >= path->max_delay )
+            {
+                syslog( LOG_WARNING, "Decklink card index %i: No frame received for %" PRIi64 " ms", path->card_idx,
+                       (cur_frame_time - path->last_frame_time) / 1000 );
+                path->ops.drop( path->ops.opaque );
+            }
+
+            path->last_frame_time = cur_frame_time;
+        }
+    }
+
+    /* TODO: probe SMPTE 337M audio */
+    if( path->probe )
+        audioframe = NULL;
+
+    /* Audio ahead of the first frame in a new format has no time offset yet */
+    if( path->format_changed )
+        audioframe = NULL;
+
+    if( !videoframe && !audioframe )
+        return;
+
+    capture.videoframe = videoframe;
+    capture.audioframe = audioframe;
+    capture.time_offset = path->time_offset;
+    /* Flag the first queued frame in the new format */
+    capture.reset_obe = videoframe && path->reset_pending;
+
+    /* Everything else happens on the capture thread so the SDK gets its thread back straight away */
+    if( capture_ring_push( &path->ring, &capture ) < 0 )
+    {
+        syslog( LOG_WARNING, "Decklink card index %i: Capture thread is behind, dropping frame", path->card_idx );
+        path->ops.drop( path->ops.opaque );
+        return;
+    }
+
+    if( videoframe )
+        path->reset_pending = 0;
+}
+
+void *decklink_capture_worker( void *ptr )
+{
+    decklink_capture_path_t *path = (decklink_capture_path_t*)ptr;
+    decklink_capture_t capture;
+
+    /* The probe reads its results from the queued frames so finish those first */
+    while( capture_ring_pop( &path->ring, &capture, path->probe ) == 0 )
+    {
+        path->ops.process( path->ops.opaque, &capture );
+        capture_release( &capture );
+
+        pthread_mutex_lock( &path->ring.mutex );
+        capture_ring_done( &path->ring );
+        if( path->probe && capture.videoframe && !path->probe_video_time )
+        {
+            path->probe_video_time = path->ops.mdate();
+            pthread_cond_signal( &path->probe_cv );
+        }
+        pthread_mutex_unlock( &path->ring.mutex );
+    }
+
+    return NULL;
+}
@@ -0,0 +1,84 @@
+/*****************************************************************************
+ * capture_path.h: Frames from the Decklink SDK callback to the capture thread
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef OBE_DECKLINK_CAPTURE_PATH_H
+#define OBE_DECKLINK_CAPTURE_PATH_H
+
+#include "capture_ring.h"
+
+/* What the capture path needs from the rest of the input. Kept to function pointers
+ * so that the path can be driven with mock frames and without a pipeline */
+typedef struct
+{
+    void *opaque;
+
+    /* Wallclock in microseconds */
+    int64_t (*mdate)( void );
+
+    /* Called on the SDK thread */
+    void (*clock_tick)( void *opaque, int64_t stream_time );
+    /* Returns 0 if the first frame is not in the format that was probed */
+    int  (*check_format)( void *opaque );
+    /* Frames were lost so the encoders and mux have to resync */
+    void (*drop)( void *opaque );
+
+    /* Called on the capture thread */
+    void (*process)( void *opaque, const decklink_capture_t *capture );
+} decklink_capture_ops_t;
+
+typedef struct
+{
+    decklink_capture_ring_t ring;
+    decklink_capture_ops_t ops;
+
+    int card_idx;
+    int probe;
+    int64_t timescale;  /* of the stream times, ticks per second */
+    int64_t max_delay;  /* us between frames before the pipeline is told frames were lost */
+
+    /* Probing finishes once a frame has been processed and some audio has arrived.
+     * probe_cv and the probe fields are guarded by the ring mutex */
+    pthread_cond_t probe_cv;
+    int probe_success;
+    int64_t probe_video_time;
+    int probe_audio;
+
+    /* Format changes, only touched on the SDK thread */
+    int format_changed;
+    int reset_pending;
+    int64_t time_offset;
+    int64_t last_stream_time;
+    int64_t last_frame_time; /* -1 until the first frame */
+} decklink_capture_path_t;
+
+/* ops, card_idx, probe, timescale and max_delay are set by the caller */
+void decklink_capture_path_init( decklink_capture_path_t *path );
+/* The capture thread must have exited */
+void decklink_capture_path_close( decklink_capture_path_t *path );
+
+/* Body of IDeckLinkInputCallback::VideoInputFrameArrived */
+void decklink_frame_arrived( decklink_capture_path_t *path, IDeckLinkVideoInputFrame *videoframe,
+                             IDeckLinkAudioInputPacket *audioframe );
+
+/* Capture thread, ptr is the path. Exits once the ring is stopped, after draining it when probing */
+void *decklink_capture_worker( void *ptr );
+
+#endif
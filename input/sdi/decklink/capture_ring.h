@@ -0,0 +1,158 @@
+/*****************************************************************************
+ * capture_ring.h: Packets queued by the Decklink SDK callback for the capture thread
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef OBE_DECKLINK_CAPTURE_RING_H
+#define OBE_DECKLINK_CAPTURE_RING_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "include/DeckLinkAPI.h"
+
+/* Frames held between the SDK callback and the capture thread */
+#define DECKLINK_CAPTURE_FRAMES 8
+
+typedef struct
+{
+    IDeckLinkVideoInputFrame *videoframe;
+    IDeckLinkAudioInputPacket *audioframe;
+    /* Added to the SDK timestamps so the timeline is continuous across a format change */
+    int64_t time_offset;
+    int reset_obe;
+} decklink_capture_t;
+
+/* The SDK callback pushes, a single capture thread pops. The mutex also guards
+ * any state the caller shares between the two threads */
+typedef struct
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cv;
+    pthread_cond_t idle_cv;
+    decklink_capture_t ring[DECKLINK_CAPTURE_FRAMES];
+    int read;
+    int count;
+    int stop;
+    int busy;
+} decklink_capture_ring_t;
+
+static inline void capture_ring_init( decklink_capture_ring_t *ring )
+{
+    pthread_mutex_init( &ring->mutex, NULL );
+    pthread_cond_init( &ring->cv, NULL );
+    pthread_cond_init( &ring->idle_cv, NULL );
+    ring->read = ring->count = ring->stop = ring->busy = 0;
+}
+
+static inline void capture_release( decklink_capture_t *capture )
+{
+    if( capture->videoframe )
+        capture->videoframe->Release();
+    if( capture->audioframe )
+        capture->audioframe->Release();
+}
+
+/* Hands back anything that was never processed. The capture thread must have exited */
+static inline void capture_ring_close( decklink_capture_ring_t *ring )
+{
+    while( ring->count )
+    {
+        capture_release( &ring->ring[ring->read] );
+        ring->read = (ring->read + 1) % DECKLINK_CAPTURE_FRAMES;
+        ring->count--;
+    }
+
+    pthread_mutex_destroy( &ring->mutex );
+    pthread_cond_destroy( &ring->cv );
+    pthread_cond_destroy( &ring->idle_cv );
+}
+
+/* Takes a reference on the packets. Returns -1 without touching them if the capture thread is behind */
+static inline int capture_ring_push( decklink_capture_ring_t *ring, const decklink_capture_t *capture )
+{
+    pthread_mutex_lock( &ring->mutex );
+    if( ring->count == DECKLINK_CAPTURE_FRAMES )
+    {
+        pthread_mutex_unlock( &ring->mutex );
+        return -1;
+    }
+
+    if( capture->videoframe )
+        capture->videoframe->AddRef();
+    if( capture->audioframe )
+        capture->audioframe->AddRef();
+
+    ring->ring[(ring->read + ring->count) % DECKLINK_CAPTURE_FRAMES] = *capture;
+    ring->count++;
+    pthread_cond_signal( &ring->cv );
+    pthread_mutex_unlock( &ring->mutex );
+
+    return 0;
+}
+
+/* Waits for the oldest packet and marks the ring busy until capture_ring_done.
+ * Returns -1 once stopped, after the queued packets if drain is set */
+static inline int capture_ring_pop( decklink_capture_ring_t *ring, decklink_capture_t *capture, int drain )
+{
+    pthread_mutex_lock( &ring->mutex );
+    while( !ring->count && !ring->stop )
+        pthread_cond_wait( &ring->cv, &ring->mutex );
+
+    if( ring->stop && ( !drain || !ring->count ) )
+    {
+        pthread_mutex_unlock( &ring->mutex );
+        return -1;
+    }
+
+    *capture = ring->ring[ring->read];
+    ring->read = (ring->read + 1) % DECKLINK_CAPTURE_FRAMES;
+    ring->count--;
+    ring->busy = 1;
+    pthread_mutex_unlock( &ring->mutex );
+
+    return 0;
+}
+
+/* Called with the mutex held once the popped packet has been released */
+static inline void capture_ring_done( decklink_capture_ring_t *ring )
+{
+    ring->busy = 0;
+    if( !ring->count )
+        pthread_cond_signal( &ring->idle_cv );
+}
+
+static inline void capture_ring_stop( decklink_capture_ring_t *ring )
+{
+    pthread_mutex_lock( &ring->mutex );
+    ring->stop = 1;
+    pthread_cond_signal( &ring->cv );
+    pthread_mutex_unlock( &ring->mutex );
+}
+
+/* Returns once everything queued has been processed */
+static inline void capture_ring_wait_idle( decklink_capture_ring_t *ring )
+{
+    pthread_mutex_lock( &ring->mutex );
+    while( ring->count || ring->busy )
+        pthread_cond_wait( &ring->idle_cv, &ring->mutex );
+    pthread_mutex_unlock( &ring->mutex );
+}
+
+#endif
@@ -27,11 +27,14 @@
 extern "C"
 {
 #include "common/common.h"
+#include "common/affinity.h"
 #include "common/lavc.h"
 #include "input/input.h"
 #include "input/sdi/sdi.h"
 #include "input/sdi/ancillary.h"
 #include "input/sdi/vbi.h"
+#include "input/sdi/unpack.h"
+#include "input/sdi/capture.h"
 #include "input/sdi/x86/sdi.h"
 #include <libavresample/avresample.h>
 #include <libavutil/opt.h>
@@ -39,6 +42,7 @@ extern "C"
 
 #include "include/DeckLinkAPI.h"
 #include "include/DeckLinkAPIDispatch.cpp"
+#include "capture_path.h"
 
 #define DECKLINK_VANC_LINES 100
 
@@ -113,15 +117,17 @@ typedef struct
     int32_t  *audio_probe_buf;
 #endif
 
+    /* Packets queued by the SDK callback for the capture thread, with the probe and format change state */
+    int has_capture_thread;
+    pthread_t capture_thread;
+    decklink_capture_path_t capture_path;
+
     /* Video */
-    AVCodec         *dec;
-    AVCodecContext  *codec;
+    obe_v210_unpacker_t unpacker;
 
     /* Audio */
     AVAudioResampleContext *avr;
 
-    int64_t last_frame_time;
-
     /* VBI */
     int has_setup_vbi;
 
@@ -131,6 +137,16 @@ typedef struct
     void (*blank_line) ( uint16_t *dst, int width );
     obe_sdi_non_display_data_t non_display_parser;
 
+    /* Scratch buffers for the ancillary lines, reused from frame to frame */
+    uint16_t *anc_buf;
+    unsigned int anc_buf_size;
+    uint8_t *vbi_buf;
+    unsigned int vbi_buf_size;
+
+    /* Recording of the signal, opened on the first frame and stopped at a format change */
+    obe_capture_writer_t *dump;
+    int dump_started;
+
     obe_device_t *device;
     obe_t *h;
 } decklink_ctx_t;
@@ -147,10 +163,9 @@ typedef struct
     int video_format;
     int num_channels;
     int probe;
+    int num_reserved_frames;
 
     /* Output */
-    int probe_success;
-
     int width;
     int coded_height;
     int height;
@@ -168,6 +183,8 @@ struct decklink_status
     decklink_opts_t *decklink_opts;
 };
 
+static void change_video_format( decklink_opts_t *decklink_opts, IDeckLinkDisplayMode *p_display_mode, int idx );
+
 static void setup_pixel_funcs( decklink_opts_t *decklink_opts )
 {
     decklink_ctx_t *decklink_ctx = &decklink_opts->decklink_ctx;
@@ -186,11 +203,17 @@ static void setup_pixel_funcs( decklink_opts_t *decklink_opts )
 
         if( cpu_flags & AV_CPU_FLAG_SSE2 )
             decklink_ctx->downscale_line = obe_downscale_line_sse2;
+
+        if( cpu_flags & AV_CPU_FLAG_AVX2 )
+            decklink_ctx->unpack_line = obe_v210_line_to_uyvy_avx2;
     }
     else
     {
         decklink_ctx->unpack_line = obe_v210_line_to_nv20_c;
         decklink_ctx->blank_line = obe_blank_line_nv20_c;
+
+        if( cpu_flags & AV_CPU_FLAG_AVX2 )
+            decklink_ctx->unpack_line = obe_v210_line_to_nv20_avx2;
     }
 }
 
@@ -272,20 +295,20 @@ public:
             BMDDisplayMode mode_id = p_display_mode->GetDisplayMode();
             syslog( LOG_WARNING, "Video input format changed" );
 
-            if( decklink_ctx->last_frame_time == -1 )
+            for( i = 0; video_format_tab[i].obe_name != -1; i++ )
             {
-                for( i = 0; video_format_tab[i].obe_name != -1; i++ )
-                {
-                    if( video_format_tab[i].bmd_name == mode_id )
-                        break;
-                }
+                if( video_format_tab[i].bmd_name == mode_id )
+                    break;
+            }
 
-                if( video_format_tab[i].obe_name == -1 )
-                {
-                    syslog( LOG_WARNING, "Unsupported video format" );
-                    return S_OK;
-                }
+            if( video_format_tab[i].obe_name == -1 )
+            {
+                syslog( LOG_WARNING, "Unsupported video format" );
+                return S_OK;
+            }
 
+            if( decklink_ctx->capture_path.last_frame_time == -1 )
+            {
                 decklink_opts_->video_format = video_format_tab[i].obe_name;
                 decklink_opts_->timebase_num = video_format_tab[i].timebase_num;
                 decklink_opts_->timebase_den = video_format_tab[i].timebase_den;
@@ -298,6 +321,8 @@ public:
                 decklink_ctx->p_input->FlushStreams();
                 decklink_ctx->p_input->StartStreams();
             }
+            else if( !decklink_opts_->probe && video_format_tab[i].obe_name != decklink_opts_->video_format )
+                change_video_format( decklink_opts_, p_display_mode, i );
         }
         return S_OK;
     }
@@ -310,15 +335,16 @@ private:
     decklink_opts_t *decklink_opts_;
 };
 
-HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFrame *videoframe, IDeckLinkAudioInputPacket *audioframe )
+static void process_capture( decklink_opts_t *decklink_opts, const decklink_capture_t *capture )
 {
-    decklink_ctx_t *decklink_ctx = &decklink_opts_->decklink_ctx;
+    IDeckLinkVideoInputFrame *videoframe = capture->videoframe;
+    IDeckLinkAudioInputPacket *audioframe = capture->audioframe;
+    decklink_ctx_t *decklink_ctx = &decklink_opts->decklink_ctx;
     obe_raw_frame_t *raw_frame = NULL;
-    AVPacket pkt;
-    AVFrame *frame = NULL;
+    obe_image_t *output;
     void *frame_bytes, *anc_line;
     obe_t *h = decklink_ctx->h;
-    int finished = 0, ret, num_anc_lines = 0, anc_line_stride,
+    int num_anc_lines = 0, anc_line_stride,
     lines_read = 0, first_line = 0, last_line = 0, line, num_vbi_lines, vii_line;
     uint32_t *frame_ptr;
     uint16_t *anc_buf, *anc_buf_pos;
@@ -327,41 +353,10 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFram
     IDeckLinkVideoFrameAncillary *ancillary;
     BMDTimeValue stream_time, frame_duration;
 
-    if( decklink_opts_->probe_success )
-        return S_OK;
-
-    av_init_packet( &pkt );
-
     if( videoframe )
     {
-        if( videoframe->GetFlags() & bmdFrameHasNoInputSource )
-        {
-            syslog( LOG_ERR, "Decklink card index %i: No input signal detected", decklink_opts_->card_idx );
-            return S_OK;
-        }
-        else if( decklink_opts_->probe )
-            decklink_opts_->probe_success = 1;
-
-        /* use SDI ticks as clock source */
         videoframe->GetStreamTime( &stream_time, &frame_duration, OBE_CLOCK );
-        obe_clock_tick( h, (int64_t)stream_time );
-
-        if( decklink_ctx->last_frame_time == -1 )
-            decklink_ctx->last_frame_time = obe_mdate();
-        else
-        {
-            int64_t cur_frame_time = obe_mdate();
-            if( cur_frame_time - decklink_ctx->last_frame_time >= SDI_MAX_DELAY )
-            {
-                syslog( LOG_WARNING, "Decklink card index %i: No frame received for %"PRIi64" ms", decklink_opts_->card_idx,
-                       (cur_frame_time - decklink_ctx->last_frame_time) / 1000 );
-                pthread_mutex_lock( &h->drop_mutex );
-                h->encoder_drop = h->mux_drop = 1;
-                pthread_mutex_unlock( &h->drop_mutex );
-            }
-
-            decklink_ctx->last_frame_time = cur_frame_time;
-        }
+        stream_time += capture->time_offset;
 
         const int width = videoframe->GetWidth();
         const int height = videoframe->GetHeight();
@@ -369,23 +364,31 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFram
 
         videoframe->GetBytes( &frame_bytes );
 
-        /* TODO: support format switching (rare in SDI) */
+        if( !decklink_opts->probe && !decklink_ctx->dump_started && decklink_ctx->device->user_opts.dump_location )
+        {
+            decklink_ctx->dump = obe_open_capture_writer( decklink_ctx->device->user_opts.dump_location, decklink_opts->video_format,
+                                                          width, decklink_opts->coded_height, decklink_opts->timebase_num,
+                                                          decklink_opts->timebase_den, decklink_opts->num_channels, 48000 );
+            decklink_ctx->dump_started = 1;
+        }
+
         int j;
         for( j = 0; first_active_line[j].format != -1; j++ )
         {
-            if( decklink_opts_->video_format == first_active_line[j].format )
+            if( decklink_opts->video_format == first_active_line[j].format )
                 break;
         }
 
         videoframe->GetAncillaryData( &ancillary );
 
         /* NTSC starts on line 4 */
-        line = decklink_opts_->video_format == INPUT_VIDEO_FORMAT_NTSC ? 4 : 1;
+        line = decklink_opts->video_format == INPUT_VIDEO_FORMAT_NTSC ? 4 : 1;
         anc_line_stride = FFALIGN( (width * 2 * sizeof(uint16_t)), 16 );
 
         /* Overallocate slightly for VANC buffer
          * Some VBI services stray into the active picture so allocate some extra space */
-        anc_buf = anc_buf_pos = (uint16_t*)av_malloc( DECKLINK_VANC_LINES * anc_line_stride );
+        av_fast_malloc( &decklink_ctx->anc_buf, &decklink_ctx->anc_buf_size, DECKLINK_VANC_LINES * anc_line_stride );
+        anc_buf = anc_buf_pos = decklink_ctx->anc_buf;
         if( !anc_buf )
         {
             syslog( LOG_ERR, "Malloc failed\n" );
@@ -398,7 +401,11 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFram
              * Some buggy decklink cards will randomly refuse access to a particular line so
              * work around this issue by blanking the line */
             if( ancillary->GetBufferForVerticalBlankingLine( line, &anc_line ) == S_OK )
+            {
                 decklink_ctx->unpack_line( (uint32_t*)anc_line, anc_buf_pos, width );
+                if( decklink_ctx->dump )
+                    obe_capture_vanc_line( decklink_ctx->dump, stream_time, line, anc_line, stride );
+            }
             else
                 decklink_ctx->blank_line( anc_buf_pos, width );
 
@@ -410,7 +417,7 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFram
             last_line = line;
 
             lines_read++;
-            line = sdi_next_line( decklink_opts_->video_format, line );
+            line = sdi_next_line( decklink_opts->video_format, line );
 
             if( line == first_active_line[j].line )
                 break;
@@ -418,7 +425,7 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFram
 
         ancillary->Release();
 
-        if( !decklink_opts_->probe )
+        if( !decklink_opts->probe )
         {
             raw_frame = new_raw_frame();
             if( !raw_frame )
@@ -435,23 +442,24 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFram
             anc_buf_pos += anc_line_stride / 2;
         }
 
-        if( IS_SD( decklink_opts_->video_format ) && first_line != last_line )
+        if( IS_SD( decklink_opts->video_format ) && first_line != last_line )
         {
             /* Add a some VBI lines to the ancillary buffer */
             frame_ptr = (uint32_t*)frame_bytes;
 
             /* NTSC starts from line 283 so add an extra line */
-            num_vbi_lines = NUM_ACTIVE_VBI_LINES + ( decklink_opts_->video_format == INPUT_VIDEO_FORMAT_NTSC );
+            num_vbi_lines = NUM_ACTIVE_VBI_LINES + ( decklink_opts->video_format == INPUT_VIDEO_FORMAT_NTSC );
             for( int i = 0; i < num_vbi_lines; i++ )
             {
                 decklink_ctx->unpack_line( frame_ptr, anc_buf_pos, width );
                 anc_buf_pos += anc_line_stride / 2;
                 frame_ptr += stride / 4;
-                last_line = sdi_next_line( decklink_opts_->video_format, last_line );
+                last_line = sdi_next_line( decklink_opts->video_format, last_line );
             }
             num_anc_lines += num_vbi_lines;
 
-            vbi_buf = (uint8_t*)av_malloc( width * 2 * num_anc_lines );
+            av_fast_malloc( &decklink_ctx->vbi_buf, &decklink_ctx->vbi_buf_size, width * 2 * num_anc_lines );
+            vbi_buf = decklink_ctx->vbi_buf;
             if( !vbi_buf )
             {
                 syslog( LOG_ERR, "Malloc failed\n" );
@@ -464,7 +472,7 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFram
 
             /* Handle Video Index information */
             int tmp_line = first_line;
-            vii_line = decklink_opts_->video_format == INPUT_VIDEO_FORMAT_NTSC ? NTSC_VIDEO_INDEX_LINE : PAL_VIDEO_INDEX_LINE;
+            vii_line = decklink_opts->video_format == INPUT_VIDEO_FORMAT_NTSC ? NTSC_VIDEO_INDEX_LINE : PAL_VIDEO_INDEX_LINE;
             while( tmp_line < vii_line )
             {
                 anc_buf_pos += anc_line_stride / 2;
@@ -478,9 +486,9 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFram
             {
                 vbi_raw_decoder_init( &decklink_ctx->non_display_parser.vbi_decoder );
 
-                decklink_ctx->non_display_parser.ntsc = decklink_opts_->video_format == INPUT_VIDEO_FORMAT_NTSC;
+                decklink_ctx->non_display_parser.ntsc = decklink_opts->video_format == INPUT_VIDEO_FORMAT_NTSC;
                 decklink_ctx->non_display_parser.vbi_decoder.start[0] = first_line;
-                decklink_ctx->non_display_parser.vbi_decoder.start[1] = sdi_next_line( decklink_opts_->video_format, first_line );
+                decklink_ctx->non_display_parser.vbi_decoder.start[1] = sdi_next_line( decklink_opts->video_format, first_line );
                 decklink_ctx->non_display_parser.vbi_decoder.count[0] = last_line - decklink_ctx->non_display_parser.vbi_decoder.start[1] + 1;
                 decklink_ctx->non_display_parser.vbi_decoder.count[1] = decklink_ctx->non_display_parser.vbi_decoder.count[0];
 
@@ -492,52 +500,41 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFram
 
             if( decode_vbi( h, &decklink_ctx->non_display_parser, vbi_buf, raw_frame ) < 0 )
                 goto fail;
-
-            av_free( vbi_buf );
         }
 
-        av_free( anc_buf );
-
-        if( !decklink_opts_->probe )
+        if( !decklink_opts->probe )
         {
-            frame = avcodec_alloc_frame();
-            if( !frame )
-            {
-                syslog( LOG_ERR, "[decklink]: Could not allocate video frame\n" );
-                goto end;
-            }
-            decklink_ctx->codec->width = width;
-            decklink_ctx->codec->height = height;
+            raw_frame->release_data = obe_release_video_data;
+            raw_frame->release_frame = obe_release_frame;
 
-            pkt.data = (uint8_t*)frame_bytes;
-            pkt.size = stride * height;
+            output = &raw_frame->alloc_img;
+            output->csp = PIX_FMT_YUV422P10;
+            output->planes = av_pix_fmt_descriptors[output->csp].nb_components;
+            output->width = width;
+            output->height = height;
+            output->format = decklink_opts->video_format;
 
-            ret = avcodec_decode_video2( decklink_ctx->codec, frame, &finished, &pkt );
-            if( ret < 0 || !finished )
+            /* Unpack straight from the card's buffer into a pooled frame */
+            if( obe_pool_get_image( h->shared->frame_pool, output->plane, output->stride, output->csp, width, height + 1, 16 ) < 0 )
+                goto fail;
+
+            obe_v210_unpack_frame( &decklink_ctx->unpacker, (const uint8_t*)frame_bytes, NULL, stride, width, height, output );
+
+            if( decklink_ctx->dump )
             {
-                syslog( LOG_ERR, "[decklink]: Could not decode video frame\n" );
-                goto end;
+                obe_capture_begin_chunk( decklink_ctx->dump, CHUNK_VIDEO, stride * height, stream_time );
+                obe_capture_write( decklink_ctx->dump, frame_bytes, stride * height );
+                obe_capture_end_chunk( decklink_ctx->dump );
             }
 
-            raw_frame->release_data = obe_release_video_data;
-            raw_frame->release_frame = obe_release_frame;
-
-            memcpy( raw_frame->alloc_img.stride, frame->linesize, sizeof(raw_frame->alloc_img.stride) );
-            memcpy( raw_frame->alloc_img.plane, frame->data, sizeof(raw_frame->alloc_img.plane) );
-            avcodec_free_frame( &frame );
-            raw_frame->alloc_img.csp = (int)decklink_ctx->codec->pix_fmt;
-            raw_frame->alloc_img.planes = av_pix_fmt_descriptors[raw_frame->alloc_img.csp].nb_components;
-            raw_frame->alloc_img.width = width;
-            raw_frame->alloc_img.height = height;
-            raw_frame->alloc_img.format = decklink_opts_->video_format;
-            raw_frame->timebase_num = decklink_opts_->timebase_num;
-            raw_frame->timebase_den = decklink_opts_->timebase_den;
+            raw_frame->timebase_num = decklink_opts->timebase_num;
+            raw_frame->timebase_den = decklink_opts->timebase_den;
 
             memcpy( &raw_frame->img, &raw_frame->alloc_img, sizeof(raw_frame->alloc_img) );
-            if( IS_SD( decklink_opts_->video_format ) )
+            if( IS_SD( decklink_opts->video_format ) )
             {
                 raw_frame->img.first_line = first_active_line[j].line;
-                if( decklink_opts_->video_format == INPUT_VIDEO_FORMAT_NTSC )
+                if( decklink_opts->video_format == INPUT_VIDEO_FORMAT_NTSC )
                 {
                     raw_frame->img.height = 480;
                     while( raw_frame->img.first_line != NTSC_FIRST_CODED_LINE )
@@ -553,6 +550,7 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFram
             /* If AFD is present and the stream is SD this will be changed in the video filter */
             raw_frame->sar_width = raw_frame->sar_height = 1;
             raw_frame->pts = stream_time;
+            raw_frame->reset_obe = capture->reset_obe;
 
             for( int i = 0; i < decklink_ctx->device->num_input_streams; i++ )
             {
@@ -571,9 +569,7 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFram
         }
     }
 
-    /* TODO: probe SMPTE 337M audio */
-
-    if( audioframe && !decklink_opts_->probe )
+    if( audioframe )
     {
         audioframe->GetBytes( &frame_bytes );
         raw_frame = new_raw_frame();
@@ -584,26 +580,29 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFram
         }
 
         raw_frame->audio_frame.num_samples = audioframe->GetSampleFrameCount();
-        raw_frame->audio_frame.num_channels = decklink_opts_->num_channels;
+        raw_frame->audio_frame.num_channels = decklink_opts->num_channels;
         raw_frame->audio_frame.sample_fmt = AV_SAMPLE_FMT_S32P;
 
-        if( av_samples_alloc( raw_frame->audio_frame.audio_data, &raw_frame->audio_frame.linesize, decklink_opts_->num_channels,
-                              raw_frame->audio_frame.num_samples, (AVSampleFormat)raw_frame->audio_frame.sample_fmt, 0 ) < 0 )
+        if( obe_alloc_audio_data( raw_frame, decklink_opts->num_channels ) < 0 )
         {
             syslog( LOG_ERR, "Malloc failed\n" );
-            return -1;
+            return;
         }
 
         if( avresample_convert( decklink_ctx->avr, raw_frame->audio_frame.audio_data, raw_frame->audio_frame.linesize,
                                 raw_frame->audio_frame.num_samples, (uint8_t**)&frame_bytes, 0, raw_frame->audio_frame.num_samples ) < 0 )
         {
             syslog( LOG_ERR, "[decklink] Sample format conversion failed\n" );
-            return -1;
+            return;
         }
 
         BMDTimeValue packet_time;
         audioframe->GetPacketTime( &packet_time, OBE_CLOCK );
-        raw_frame->pts = packet_time;
+        raw_frame->pts = packet_time + capture->time_offset;
+
+        if( decklink_ctx->dump )
+            obe_capture_audio( decklink_ctx->dump, raw_frame->pts, raw_frame->audio_frame.audio_data,
+                               raw_frame->audio_frame.num_channels, raw_frame->audio_frame.num_samples );
         raw_frame->release_data = obe_release_audio_data;
         raw_frame->release_frame = obe_release_frame;
         for( int i = 0; i < decklink_ctx->device->num_input_streams; i++ )
@@ -617,12 +616,7 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFram
     }
 
 end:
-    if( frame )
-        avcodec_free_frame( &frame );
-
-    av_free_packet( &pkt );
-
-    return S_OK;
+    return;
 
 fail:
 
@@ -631,6 +625,162 @@ fail:
         raw_frame->release_data( raw_frame );
         raw_frame->release_frame( raw_frame );
     }
+}
+
+/* Capture path hooks */
+static int64_t capture_mdate( void )
+{
+    return obe_mdate();
+}
+
+static void capture_clock_tick( void *opaque, int64_t stream_time )
+{
+    decklink_opts_t *decklink_opts = (decklink_opts_t*)opaque;
+
+    obe_clock_tick( decklink_opts->decklink_ctx.h, stream_time );
+}
+
+static int capture_check_format( void *opaque )
+{
+    decklink_opts_t *decklink_opts = (decklink_opts_t*)opaque;
+    decklink_ctx_t *decklink_ctx = &decklink_opts->decklink_ctx;
+
+    if( sdi_matches_probed_format( decklink_ctx->device, decklink_opts->width, decklink_opts->height, decklink_opts->timebase_num,
+                                   decklink_opts->timebase_den, decklink_opts->interlaced ) )
+        return 1;
+
+    remove_probe_cache( decklink_ctx->device );
+    return 0;
+}
+
+static void capture_drop( void *opaque )
+{
+    obe_t *h = ((decklink_opts_t*)opaque)->decklink_ctx.h;
+
+    pthread_mutex_lock( &h->drop_mutex );
+    h->encoder_drop = h->mux_drop = 1;
+    pthread_mutex_unlock( &h->drop_mutex );
+}
+
+static void capture_process( void *opaque, const decklink_capture_t *capture )
+{
+    process_capture( (decklink_opts_t*)opaque, capture );
+}
+
+static int start_capture_thread( decklink_opts_t *decklink_opts )
+{
+    decklink_ctx_t *decklink_ctx = &decklink_opts->decklink_ctx;
+    decklink_capture_path_t *capture_path = &decklink_ctx->capture_path;
+
+    capture_path->ops.opaque = decklink_opts;
+    capture_path->ops.mdate = capture_mdate;
+    capture_path->ops.clock_tick = capture_clock_tick;
+    capture_path->ops.check_format = capture_check_format;
+    capture_path->ops.drop = capture_drop;
+    capture_path->ops.process = capture_process;
+    capture_path->card_idx = decklink_opts->card_idx;
+    capture_path->probe = decklink_opts->probe;
+    capture_path->timescale = OBE_CLOCK;
+    capture_path->max_delay = SDI_MAX_DELAY;
+    decklink_capture_path_init( capture_path );
+
+    if( obe_thread_create( decklink_ctx->h, OBE_STAGE_INPUT, &decklink_ctx->capture_thread, decklink_capture_worker, capture_path ) )
+    {
+        decklink_capture_path_close( capture_path );
+        return -1;
+    }
+    decklink_ctx->has_capture_thread = 1;
+
+    return 0;
+}
+
+/* Must be called once the SDK has stopped calling back */
+static void stop_capture_thread( decklink_ctx_t *decklink_ctx )
+{
+    if( !decklink_ctx->has_capture_thread )
+        return;
+
+    capture_ring_stop( &decklink_ctx->capture_path.ring );
+    pthread_join( decklink_ctx->capture_thread, NULL );
+
+    decklink_capture_path_close( &decklink_ctx->capture_path );
+    decklink_ctx->has_capture_thread = 0;
+}
+
+/* Returns once the first frame has been processed and audio has arrived, or the probe has timed out */
+static void wait_probe( decklink_ctx_t *decklink_ctx )
+{
+    decklink_capture_path_t *capture_path = &decklink_ctx->capture_path;
+    int64_t deadline = obe_mdate() + MAX_PROBE_TIME * 1000000LL;
+    struct timespec ts;
+
+    pthread_mutex_lock( &capture_path->ring.mutex );
+    while( !capture_path->probe_video_time || !capture_path->probe_audio )
+    {
+        if( capture_path->probe_video_time )
+            deadline = FFMIN( deadline, capture_path->probe_video_time + PROBE_AUDIO_WAIT );
+
+        if( obe_mdate() >= deadline )
+            break;
+
+        obe_timeout_to_timespec( deadline - obe_mdate(), &ts );
+        pthread_cond_timedwait( &capture_path->probe_cv, &capture_path->ring.mutex, &ts );
+    }
+    pthread_mutex_unlock( &capture_path->ring.mutex );
+}
+
+/* The signal has changed format mid-stream. Only the unpacker is rebuilt here, the video filter and
+ * encoders follow when they see the first frame in the new format. Audio, mux and outputs carry on */
+static void change_video_format( decklink_opts_t *decklink_opts, IDeckLinkDisplayMode *p_display_mode, int idx )
+{
+    decklink_ctx_t *decklink_ctx = &decklink_opts->decklink_ctx;
+
+    decklink_ctx->p_input->PauseStreams();
+
+    /* Let the capture thread finish with the frames in the old format */
+    capture_ring_wait_idle( &decklink_ctx->capture_path.ring );
+
+    if( decklink_ctx->has_setup_vbi )
+    {
+        vbi_raw_decoder_destroy( &decklink_ctx->non_display_parser.vbi_decoder );
+        decklink_ctx->has_setup_vbi = 0;
+    }
+
+    /* A capture holds a single format */
+    if( decklink_ctx->dump )
+    {
+        syslog( LOG_WARNING, "[decklink] Format changed, stopping the capture to %s\n", decklink_ctx->device->user_opts.dump_location );
+        obe_close_capture_writer( decklink_ctx->dump );
+        decklink_ctx->dump = NULL;
+    }
+
+    decklink_opts->video_format = video_format_tab[idx].obe_name;
+    decklink_opts->timebase_num = video_format_tab[idx].timebase_num;
+    decklink_opts->timebase_den = video_format_tab[idx].timebase_den;
+
+    get_format_opts( decklink_opts, p_display_mode );
+    setup_pixel_funcs( decklink_opts );
+
+    obe_v210_unpacker_close( &decklink_ctx->unpacker );
+    obe_v210_unpacker_init( decklink_ctx->h, &decklink_ctx->unpacker, decklink_opts->width, decklink_opts->coded_height );
+
+    if( obe_pool_reserve_images( decklink_ctx->h->shared->frame_pool, PIX_FMT_YUV422P10, decklink_opts->width,
+                                 decklink_opts->coded_height + 1, 16, decklink_opts->num_reserved_frames ) < 0 )
+        syslog( LOG_WARNING, "[decklink] Could not preallocate video frames\n" );
+
+    syslog( LOG_INFO, "Decklink card index %i: Switched to %ix%i", decklink_opts->card_idx, decklink_opts->width,
+            decklink_opts->height );
+
+    decklink_ctx->capture_path.format_changed = 1;
+
+    decklink_ctx->p_input->EnableVideoInput( p_display_mode->GetDisplayMode(), bmdFormat10BitYUV, bmdVideoInputEnableFormatDetection );
+    decklink_ctx->p_input->FlushStreams();
+    decklink_ctx->p_input->StartStreams();
+}
+
+HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFrame *videoframe, IDeckLinkAudioInputPacket *audioframe )
+{
+    decklink_frame_arrived( &decklink_opts_->decklink_ctx.capture_path, videoframe, audioframe );
 
     return S_OK;
 }
@@ -643,10 +793,12 @@ static void close_card( decklink_opts_t *decklink_opts )
         decklink_ctx->p_config->Release();
 
     if( decklink_ctx->p_input )
-    {
         decklink_ctx->p_input->StopStreams();
+
+    stop_capture_thread( decklink_ctx );
+
+    if( decklink_ctx->p_input )
         decklink_ctx->p_input->Release();
-    }
 
     if( decklink_ctx->p_card )
         decklink_ctx->p_card->Release();
@@ -654,11 +806,7 @@ static void close_card( decklink_opts_t *decklink_opts )
     if( decklink_ctx->p_delegate )
         decklink_ctx->p_delegate->Release();
 
-    if( decklink_ctx->codec )
-    {
-        avcodec_close( decklink_ctx->codec );
-        av_free( decklink_ctx->codec );
-    }
+    obe_v210_unpacker_close( &decklink_ctx->unpacker );
 
     if( IS_SD( decklink_opts->video_format ) )
         vbi_raw_decoder_destroy( &decklink_ctx->non_display_parser.vbi_decoder );
@@ -666,6 +814,14 @@ static void close_card( decklink_opts_t *decklink_opts )
     if( decklink_ctx->avr )
         avresample_free( &decklink_ctx->avr );
 
+    av_freep( &decklink_ctx->anc_buf );
+    av_freep( &decklink_ctx->vbi_buf );
+
+    if( decklink_ctx->dump )
+    {
+        obe_close_capture_writer( decklink_ctx->dump );
+        decklink_ctx->dump = NULL;
+    }
 }
 
 static int open_card( decklink_opts_t *decklink_opts )
@@ -685,33 +841,6 @@ static int open_card( decklink_opts_t *decklink_opts )
     IDeckLinkIterator *decklink_iterator = NULL;
     HRESULT result;
 
-    avcodec_register_all();
-    decklink_ctx->dec = avcodec_find_decoder( AV_CODEC_ID_V210 );
-    if( !decklink_ctx->dec )
-    {
-        fprintf( stderr, "[decklink] Could not find v210 decoder\n" );
-        goto finish;
-    }
-
-    decklink_ctx->codec = avcodec_alloc_context3( decklink_ctx->dec );
-    if( !decklink_ctx->codec )
-    {
-        fprintf( stderr, "[decklink] Could not allocate AVCodecContext\n" );
-        goto finish;
-    }
-
-    decklink_ctx->codec->get_buffer = obe_get_buffer;
-    decklink_ctx->codec->release_buffer = obe_release_buffer;
-    decklink_ctx->codec->reget_buffer = obe_reget_buffer;
-    decklink_ctx->codec->flags |= CODEC_FLAG_EMU_EDGE;
-
-    /* TODO: setup custom strides */
-    if( avcodec_open2( decklink_ctx->codec, decklink_ctx->dec, NULL ) < 0 )
-    {
-        fprintf( stderr, "[decklink] Could not open libavcodec\n" );
-        goto finish;
-    }
-
     decklink_iterator = CreateDeckLinkIteratorInstance();
     if( !decklink_iterator )
     {
@@ -915,6 +1044,12 @@ static int open_card( decklink_opts_t *decklink_opts )
 
     if( !decklink_opts->probe )
     {
+        if( obe_pool_reserve_images( decklink_ctx->h->shared->frame_pool, PIX_FMT_YUV422P10, decklink_opts->width,
+                                     decklink_opts->coded_height + 1, 16, decklink_opts->num_reserved_frames ) < 0 )
+            syslog( LOG_WARNING, "[decklink] Could not preallocate video frames\n" );
+
+        obe_v210_unpacker_init( decklink_ctx->h, &decklink_ctx->unpacker, decklink_opts->width, decklink_opts->coded_height );
+
         decklink_ctx->avr = avresample_alloc_context();
         if( !decklink_ctx->avr )
         {
@@ -937,6 +1072,13 @@ static int open_card( decklink_opts_t *decklink_opts )
         }
     }
 
+    if( start_capture_thread( decklink_opts ) < 0 )
+    {
+        fprintf( stderr, "[decklink] Could not create capture thread\n" );
+        ret = -1;
+        goto finish;
+    }
+
     decklink_ctx->p_delegate = new DeckLinkCaptureDelegate( decklink_opts );
     decklink_ctx->p_input->SetCallback( decklink_ctx->p_delegate );
 
@@ -1010,16 +1152,15 @@ static void *probe_stream( void *ptr )
 
     decklink_ctx = &decklink_opts->decklink_ctx;
     decklink_ctx->h = h;
-    decklink_ctx->last_frame_time = -1;
 
     if( open_card( decklink_opts ) < 0 )
         goto finish;
 
-    sleep( 1 );
+    wait_probe( decklink_ctx );
 
     close_card( decklink_opts );
 
-    if( !decklink_opts->probe_success )
+    if( !decklink_ctx->capture_path.probe_success )
     {
         fprintf( stderr, "[decklink] No valid frames received - check connection and input format\n" );
         goto finish;
@@ -1152,12 +1293,12 @@ static void *open_input( void *ptr )
     decklink_opts->video_conn = user_opts->video_connection;
     decklink_opts->audio_conn = user_opts->audio_connection;
     decklink_opts->video_format = user_opts->video_format;
+    decklink_opts->num_reserved_frames = input->num_reserved_frames;
 
     decklink_ctx = &decklink_opts->decklink_ctx;
 
     decklink_ctx->device = device;
     decklink_ctx->h = h;
-    decklink_ctx->last_frame_time = -1;
 
     non_display_parser = &decklink_ctx->non_display_parser;
     non_display_parser->device = device;
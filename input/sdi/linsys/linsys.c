@@ -33,6 +33,7 @@
 #include <errno.h>
 
 #include "common/common.h"
+#include "common/affinity.h"
 #include "common/lavc.h"
 #include "common/linsys/util.h"
 #include "include/sdi.h"
@@ -42,9 +43,12 @@
 #include "input/sdi/sdi.h"
 #include "input/sdi/ancillary.h"
 #include "input/sdi/vbi.h"
+#include "input/sdi/unpack.h"
+#include "input/sdi/capture.h"
 #include "input/sdi/x86/sdi.h"
 
 #include <libavutil/mathematics.h>
+#include <libavutil/intreadwrite.h>
 #include <libavutil/bswap.h>
 #include <libavresample/avresample.h>
 #include <libavutil/opt.h>
@@ -60,11 +64,30 @@
 #define SDIAUDIO_SAMPLESIZE_FILE "/sys/class/sdiaudio/sdiaudiorx%u/sample_size"
 #define SDIAUDIO_CHANNELS_FILE  "/sys/class/sdiaudio/sdiaudiorx%u/channels"
 #define READ_TIMEOUT            10000
-#define NB_VBUFFERS             2
+#define NB_VBUFFERS             8
+/* Buffers the capture thread can hold while they are unpacked. The rest stay with the card */
+#define MAX_HELD_VBUFFERS       (NB_VBUFFERS - 2)
 #define NB_ABUFFERS             2
 #define LINSYS_VANC_LINES       100
 #define LINSYS_NTSC_TOP_LINES   6
 
+/* A buffer dump holds the card's buffers as they were dequeued so that the frame handler can be tested
+ * and benchmarked without the card. All fields are little-endian.
+ *
+ * header: "OBELSY01" then the card's video standard, VANC flag, video and audio buffer sizes (32 bits each)
+ * record: BUFFER_VIDEO or BUFFER_AUDIO (32 bits) then one buffer */
+#define BUFFER_DUMP_MAGIC       "OBELSY01"
+#define BUFFER_DUMP_HEADER_SIZE 24
+
+enum buffer_dump_e
+{
+    BUFFER_VIDEO = 1,
+    BUFFER_AUDIO,
+};
+
+/* How long an unpaced replay backs off while the pipeline is full (us) */
+#define UNPACED_BACKOFF 1000
+
 struct obe_to_linsys_video
 {
     int obe_name;
@@ -121,6 +144,22 @@ const static struct linsys_audio_channels audio_channels_tab[] =
     { -1, -1 },
 };
 
+/* A captured v210 frame. Card buffers stay dequeued until the last reference is dropped,
+ * recorded buffer dumps supply their own release */
+typedef struct linsys_vbuffer_t linsys_vbuffer_t;
+
+struct linsys_vbuffer_t
+{
+    uint8_t *data;
+    int     refcount;
+    int64_t pts;
+    int64_t arrival_time;
+    int     reset_obe;
+
+    void    (*release)( linsys_vbuffer_t *vbuffer );
+    void    *opaque;
+};
+
 typedef struct
 {
     /* video device reader */
@@ -136,9 +175,31 @@ typedef struct
     int          coded_height;
     int64_t      v_counter;
     AVRational   v_timebase;
+    /* The video clock carries on from here after a format change */
+    int64_t      v_clock_base;
+    int64_t      last_v_clock;
+    int          reset_pending;
 
     obe_raw_frame_t *raw_frame;
-    void (*unpack_line) ( const uint32_t *src, uint16_t *y, uint16_t *u, uint16_t *v, int width );
+    obe_v210_unpacker_t unpacker;
+
+    /* Dequeued card buffers, indexed by buffer. The driver takes them back in order so the capture
+     * thread requeues from requeue_vbuffer as each one is unpacked */
+    linsys_vbuffer_t held_vbuffers[NB_VBUFFERS];
+    unsigned int requeue_vbuffer;
+    int          num_held_vbuffers;
+    int          wake_pipe[2];
+
+    /* Video processing thread */
+    int          has_video_thread;
+    pthread_t    video_thread;
+    pthread_mutex_t video_mutex;
+    pthread_cond_t video_cv;
+    linsys_vbuffer_t *pending_vbuffers[NB_VBUFFERS];
+    int          pending_read;
+    int          num_pending_vbuffers;
+    int          video_stop;
+    int          video_error;
 
     /* audio device reader */
     int          afd;
@@ -153,6 +214,10 @@ typedef struct
 
     int64_t      last_frame_time;
 
+    /* Probing finishes once a frame has been processed and some audio has arrived */
+    int64_t      probe_video_time;
+    int          probe_audio;
+
 #if 0
     int          probe_buf_len;
     int32_t      *audio_probe_buf;
@@ -166,6 +231,23 @@ typedef struct
     void (*downscale_line) ( uint16_t *src, uint8_t *dst, int lines );
     obe_sdi_non_display_data_t non_display_parser;
 
+    /* Scratch buffers for the ancillary lines, reused from frame to frame */
+    uint16_t *anc_buf;
+    unsigned int anc_buf_size;
+    uint8_t *vbi_buf;
+    unsigned int vbi_buf_size;
+
+    /* Recording of the signal, opened on the first frame and stopped at a format change */
+    obe_capture_writer_t *dump;
+
+    /* Buffer dumps. A replay stands in for the card and its buffers are released like the card's */
+    FILE         *buffer_dump;
+    FILE         *replay_fp;
+    int64_t      num_replay_frames;
+    int64_t      num_replay_released;
+    int64_t      replay_start;
+    uint8_t      *replay_abuffer;
+
     obe_device_t *device;
     obe_t *h;
 } linsys_ctx_t;
@@ -179,6 +261,9 @@ typedef struct
     int num_channels;
     int probe;
     int audio_samples;
+    int num_reserved_frames;
+    int replay;
+    int pacing;
 
     /* Output */
     int video_format;
@@ -202,46 +287,6 @@ struct linsys_status
 
 #define MAXLEN 256
 
-#define READ_PIXELS(a, b, c)         \
-    do {                             \
-        val  = av_le2ne32(*src++);   \
-        *a++ =  val & 0x3FF;         \
-        *b++ = (val >> 10) & 0x3FF;  \
-        *c++ = (val >> 20) & 0x3FF;  \
-    } while (0)
-
-static inline void obe_decode_line( linsys_ctx_t *linsys_ctx, const uint32_t *src, uint16_t *y, uint16_t *u, uint16_t *v )
-{
-    uint32_t val = 0;
-    int w;
-
-    w = (linsys_ctx->width / 6) * 6;
-    linsys_ctx->unpack_line( src, y, u, v, w );
-
-    y += w;
-    u += w >> 1;
-    v += w >> 1;
-    src += (w << 1) / 3;
-
-   if( w < linsys_ctx->width - 1 )
-   {
-       READ_PIXELS(u, y, v);
-
-       val  = av_le2ne32(*src++);
-       *y++ =  val & 0x3FF;
-   }
-
-   if( w < linsys_ctx->width - 3 )
-   {
-       *u++ = (val >> 10) & 0x3FF;
-       *y++ = (val >> 20) & 0x3FF;
-
-       val  = av_le2ne32(*src++);
-       *v++ =  val & 0x3FF;
-       *y++ = (val >> 10) & 0x3FF;
-   }
-}
-
 static ssize_t write_ul_sysfs( const char *fmt, unsigned int card_idx, unsigned int buf )
 {
     char filename[MAXLEN], data[MAXLEN];
@@ -261,9 +306,15 @@ static ssize_t write_ul_sysfs( const char *fmt, unsigned int card_idx, unsigned
     return ret;
 }
 
-static void close_card( linsys_opts_t *linsys_opts )
+static void stop_video_thread( linsys_ctx_t *linsys_ctx );
+static int find_video_format( unsigned int standard );
+
+static void close_video( linsys_ctx_t *linsys_ctx )
 {
-    linsys_ctx_t *linsys_ctx = &linsys_opts->linsys_ctx;
+    /* The processing thread may still hold a card buffer */
+    stop_video_thread( linsys_ctx );
+    obe_v210_unpacker_close( &linsys_ctx->unpacker );
+    linsys_ctx->num_held_vbuffers = 0;
 
     if( linsys_ctx->vbuffers )
     {
@@ -271,8 +322,44 @@ static void close_card( linsys_opts_t *linsys_opts )
             munmap( linsys_ctx->vbuffers[i], linsys_ctx->vbuffer_size );
 
         free( linsys_ctx->vbuffers );
+        linsys_ctx->vbuffers = NULL;
     }
     close( linsys_ctx->vfd );
+}
+
+static void close_dump( linsys_ctx_t *linsys_ctx )
+{
+    if( linsys_ctx->dump )
+    {
+        obe_close_capture_writer( linsys_ctx->dump );
+        linsys_ctx->dump = NULL;
+    }
+}
+
+static void close_buffer_dump( linsys_ctx_t *linsys_ctx )
+{
+    if( linsys_ctx->buffer_dump )
+    {
+        if( fclose( linsys_ctx->buffer_dump ) )
+            syslog( LOG_ERR, "[linsys-sdi] Could not finish the buffer dump: %s\n", strerror( errno ) );
+        linsys_ctx->buffer_dump = NULL;
+    }
+}
+
+static void close_card( linsys_opts_t *linsys_opts )
+{
+    linsys_ctx_t *linsys_ctx = &linsys_opts->linsys_ctx;
+
+    close_video( linsys_ctx );
+    close_dump( linsys_ctx );
+    close_buffer_dump( linsys_ctx );
+
+    if( linsys_ctx->replay_fp )
+    {
+        fclose( linsys_ctx->replay_fp );
+        linsys_ctx->replay_fp = NULL;
+    }
+    av_freep( &linsys_ctx->replay_abuffer );
 
     if( linsys_ctx->abuffers )
     {
@@ -285,9 +372,112 @@ static void close_card( linsys_opts_t *linsys_opts )
 
     if( linsys_ctx->avr )
         avresample_free( &linsys_ctx->avr );
+
+    av_freep( &linsys_ctx->anc_buf );
+    av_freep( &linsys_ctx->vbi_buf );
+}
+
+/* The card delivers interlaced frames one field after the other */
+static void get_fields( linsys_opts_t *linsys_opts, uint8_t *data, uint8_t **v210_src_f1, uint8_t **v210_src_f2 )
+{
+    linsys_ctx_t *linsys_ctx = &linsys_opts->linsys_ctx;
+
+    int k;
+    for( k = 0; field_start_lines[k].format != -1; k++ )
+    {
+        if( linsys_opts->video_format == field_start_lines[k].format )
+            break;
+    }
+
+    *v210_src_f1 = *v210_src_f2 = data;
+
+    /* If we can only access the active frame in NTSC mode then swap the field order */
+    if( !linsys_ctx->has_vanc && linsys_opts->video_format == INPUT_VIDEO_FORMAT_NTSC )
+        *v210_src_f1 += (linsys_ctx->coded_height / 2) * linsys_ctx->stride;
+    else if( linsys_ctx->has_vanc )
+        *v210_src_f2 += (field_start_lines[k].field_two - field_start_lines[k].line) * linsys_ctx->stride;
+    else
+        /* All non-VANC resolutions have an even height */
+        *v210_src_f2 += (linsys_ctx->coded_height / 2) * linsys_ctx->stride;
+}
+
+/* Row of the frame once the fields are interleaved */
+static uint8_t *frame_row( linsys_opts_t *linsys_opts, uint8_t *v210_src_f1, uint8_t *v210_src_f2, int row )
+{
+    if( !linsys_opts->interlaced )
+        return v210_src_f1 + row * linsys_opts->linsys_ctx.stride;
+
+    return ( row & 1 ? v210_src_f2 : v210_src_f1 ) + (row >> 1) * linsys_opts->linsys_ctx.stride;
+}
+
+/* Runs before the video worker starts so that both threads see the capture and no audio is missed */
+static void open_dump( linsys_opts_t *linsys_opts )
+{
+    linsys_ctx_t *linsys_ctx = &linsys_opts->linsys_ctx;
+    const char *location = linsys_ctx->device->user_opts.dump_location;
+
+    /* Without VANC the card puts the junk lines below the picture, the replay expects them above */
+    if( !linsys_ctx->has_vanc && linsys_opts->video_format == INPUT_VIDEO_FORMAT_NTSC )
+    {
+        syslog( LOG_WARNING, "[linsys-sdi] NTSC can only be captured with VANC, not capturing to %s\n", location );
+        return;
+    }
+
+    linsys_ctx->dump = obe_open_capture_writer( location, linsys_opts->video_format, linsys_ctx->width,
+                                                video_format_tab[find_video_format( linsys_ctx->standard )].height,
+                                                linsys_opts->timebase_num, linsys_opts->timebase_den,
+                                                linsys_opts->num_channels, linsys_opts->sample_rate );
+}
+
+/* Writes the frame as the Decklink input sees it: the lines before the active picture as VANC, then the
+ * active picture with the fields interleaved */
+static void dump_video_frame( linsys_opts_t *linsys_opts, linsys_vbuffer_t *vbuffer )
+{
+    linsys_ctx_t *linsys_ctx = &linsys_opts->linsys_ctx;
+    uint8_t *v210_src_f1, *v210_src_f2;
+    int i, j, row = 0, line, height;
+
+    i = find_video_format( linsys_ctx->standard );
+    height = video_format_tab[i].height;
+
+    if( linsys_opts->interlaced )
+        get_fields( linsys_opts, vbuffer->data, &v210_src_f1, &v210_src_f2 );
+    else
+        v210_src_f1 = v210_src_f2 = vbuffer->data;
+
+    if( linsys_ctx->has_vanc )
+    {
+        for( j = 0; first_active_line[j].format != -1; j++ )
+        {
+            if( linsys_opts->video_format == first_active_line[j].format )
+                break;
+        }
+
+        if( linsys_opts->video_format == INPUT_VIDEO_FORMAT_NTSC )
+        {
+            row = LINSYS_NTSC_TOP_LINES;
+            line = 4;
+        }
+        else
+            line = 1;
+
+        while( line != first_active_line[j].line )
+        {
+            obe_capture_vanc_line( linsys_ctx->dump, vbuffer->pts, line, frame_row( linsys_opts, v210_src_f1, v210_src_f2, row ), linsys_ctx->stride );
+            line = sdi_next_line( linsys_opts->video_format, line );
+            row++;
+        }
+    }
+
+    height = FFMIN( height, linsys_ctx->coded_height - row );
+
+    obe_capture_begin_chunk( linsys_ctx->dump, CHUNK_VIDEO, height * linsys_ctx->stride, vbuffer->pts );
+    for( int r = row; r < row + height; r++ )
+        obe_capture_write( linsys_ctx->dump, frame_row( linsys_opts, v210_src_f1, v210_src_f2, r ), linsys_ctx->stride );
+    obe_capture_end_chunk( linsys_ctx->dump );
 }
 
-static int handle_video_frame( linsys_opts_t *linsys_opts, uint8_t *data )
+static int handle_video_frame( linsys_opts_t *linsys_opts, linsys_vbuffer_t *vbuffer )
 {
     linsys_ctx_t *linsys_ctx = &linsys_opts->linsys_ctx;
     obe_t *h = linsys_ctx->h;
@@ -296,33 +486,15 @@ static int handle_video_frame( linsys_opts_t *linsys_opts, uint8_t *data )
     uint16_t *anc_buf = NULL, *anc_buf_pos = NULL;
     uint16_t *y_src, *u_src, *v_src;
     uint8_t *vbi_buf;
-    int64_t pts, sdi_clock;
+    int64_t pts;
 
     obe_image_t *output;
 
     if( linsys_ctx->non_display_parser.has_probed )
         return 0;
 
-    /* use SDI ticks as clock source */
-    sdi_clock = av_rescale_q( linsys_ctx->v_counter, linsys_ctx->v_timebase, (AVRational){1, OBE_CLOCK} );
-    obe_clock_tick( h, sdi_clock );
-
-    if( linsys_ctx->last_frame_time == -1 )
-        linsys_ctx->last_frame_time = obe_mdate();
-    else
-    {
-        int64_t cur_frame_time = obe_mdate();
-        if( cur_frame_time - linsys_ctx->last_frame_time >= SDI_MAX_DELAY )
-        {
-            syslog( LOG_WARNING, "Linsys card index %i: No frame received for %"PRIi64" ms", linsys_opts->card_idx,
-                   (cur_frame_time - linsys_ctx->last_frame_time) / 1000 );
-            pthread_mutex_lock( &h->drop_mutex );
-            h->encoder_drop = h->mux_drop = 1;
-            pthread_mutex_unlock( &h->drop_mutex );
-        }
-
-        linsys_ctx->last_frame_time = cur_frame_time;
-    }
+    if( linsys_ctx->dump )
+        dump_video_frame( linsys_opts, vbuffer );
 
     int j;
     for( j = 0; first_active_line[j].format != -1; j++ )
@@ -342,76 +514,30 @@ static int handle_video_frame( linsys_opts_t *linsys_opts, uint8_t *data )
 
     raw_frame->release_data = obe_release_video_data;
     raw_frame->release_frame = obe_release_frame;
-    raw_frame->arrival_time = linsys_ctx->last_frame_time;
+    raw_frame->arrival_time = vbuffer->arrival_time;
 
     output->csp = PIX_FMT_YUV422P10;
     output->planes = av_pix_fmt_descriptors[output->csp].nb_components;
     output->width = linsys_ctx->width;
     output->height = linsys_opts->height;
 
-    if( av_image_fill_linesizes( output->stride, output->csp, output->width ) < 0 )
-        goto fail;
-
-    if( av_image_alloc( output->plane, output->stride, linsys_ctx->width, linsys_ctx->coded_height + 1, PIX_FMT_YUV422P10, 16 ) < 0 )
+    if( obe_pool_get_image( h->shared->frame_pool, output->plane, output->stride, output->csp, linsys_ctx->width,
+                            linsys_ctx->coded_height + 1, 16 ) < 0 )
         goto fail;
 
-    uint16_t *y_dst = (uint16_t*)output->plane[0];
-    uint16_t *u_dst = (uint16_t*)output->plane[1];
-    uint16_t *v_dst = (uint16_t*)output->plane[2];
-
     /* Interleave fields */
     if( linsys_opts->interlaced )
     {
         uint8_t *v210_src_f1, *v210_src_f2;
 
-        int k;
-        for( k = 0; field_start_lines[k].format != -1; k++ )
-        {
-            if( linsys_opts->video_format == field_start_lines[k].format )
-                break;
-        }
-
-        v210_src_f1 = v210_src_f2 = data;
-
-        /* If we can only access the active frame in NTSC mode then swap the field order */
-        if( !linsys_ctx->has_vanc && linsys_opts->video_format == INPUT_VIDEO_FORMAT_NTSC )
-            v210_src_f1 += (linsys_ctx->coded_height / 2) * linsys_ctx->stride;
-        else if( linsys_ctx->has_vanc )
-            v210_src_f2 += (field_start_lines[k].field_two - field_start_lines[k].line) * linsys_ctx->stride;
-        else
-            /* All non-VANC resolutions have an even height */
-            v210_src_f2 += (linsys_ctx->coded_height / 2) * linsys_ctx->stride;
-
-        for( int i = 0; i < linsys_ctx->coded_height; i++ )
-        {
-            if( !(i & 1) )
-            {
-                obe_decode_line( linsys_ctx, (const uint32_t*)v210_src_f1, y_dst, u_dst, v_dst );
-                v210_src_f1 += linsys_ctx->stride;
-            }
-            else
-            {
-                obe_decode_line( linsys_ctx, (const uint32_t*)v210_src_f2, y_dst, u_dst, v_dst );
-                v210_src_f2 += linsys_ctx->stride;
-            }
+        get_fields( linsys_opts, vbuffer->data, &v210_src_f1, &v210_src_f2 );
 
-            y_dst += output->stride[0] / 2;
-            u_dst += output->stride[1] / 2;
-            v_dst += output->stride[2] / 2;
-        }
+        obe_v210_unpack_frame( &linsys_ctx->unpacker, v210_src_f1, v210_src_f2, linsys_ctx->stride, linsys_ctx->width,
+                               linsys_ctx->coded_height, output );
     }
     else
-    {
-        for( int i = 0; i < linsys_ctx->coded_height; i++ )
-        {
-            obe_decode_line( linsys_ctx, (const uint32_t*)data, y_dst, u_dst, v_dst );
-
-            data += linsys_ctx->stride;
-            y_dst += output->stride[0] / 2;
-            u_dst += output->stride[1] / 2;
-            v_dst += output->stride[2] / 2;
-        }
-    }
+        obe_v210_unpack_frame( &linsys_ctx->unpacker, vbuffer->data, NULL, linsys_ctx->stride, linsys_ctx->width,
+                               linsys_ctx->coded_height, output );
 
     anc_line_stride = FFALIGN( (linsys_ctx->width * 2 * sizeof(uint16_t)), 16 );
 
@@ -434,7 +560,8 @@ static int handle_video_frame( linsys_opts_t *linsys_opts, uint8_t *data )
 
         /* Overallocate slightly for VANC buffer
          * Some VBI services stray into the active picture so allocate some extra space */
-        anc_buf = anc_buf_pos = av_malloc( LINSYS_VANC_LINES * anc_line_stride );
+        av_fast_malloc( &linsys_ctx->anc_buf, &linsys_ctx->anc_buf_size, LINSYS_VANC_LINES * anc_line_stride );
+        anc_buf = anc_buf_pos = linsys_ctx->anc_buf;
         if( !anc_buf )
         {
             syslog( LOG_ERR, "Malloc failed\n" );
@@ -476,7 +603,8 @@ static int handle_video_frame( linsys_opts_t *linsys_opts, uint8_t *data )
             }
 
             /* Only the first two lines can be probed for VBI data */
-            anc_buf = anc_buf_pos = av_malloc( NUM_ACTIVE_VBI_LINES * anc_line_stride );
+            av_fast_malloc( &linsys_ctx->anc_buf, &linsys_ctx->anc_buf_size, NUM_ACTIVE_VBI_LINES * anc_line_stride );
+            anc_buf = anc_buf_pos = linsys_ctx->anc_buf;
             if( !anc_buf )
             {
                 syslog( LOG_ERR, "Malloc failed\n" );
@@ -501,7 +629,8 @@ static int handle_video_frame( linsys_opts_t *linsys_opts, uint8_t *data )
             last_line = sdi_next_line( linsys_opts->video_format, last_line );
         }
 
-        vbi_buf = av_malloc( linsys_ctx->width * 2 * num_anc_lines );
+        av_fast_malloc( &linsys_ctx->vbi_buf, &linsys_ctx->vbi_buf_size, linsys_ctx->width * 2 * num_anc_lines );
+        vbi_buf = linsys_ctx->vbi_buf;
         if( !vbi_buf )
         {
             syslog( LOG_ERR, "Malloc failed\n" );
@@ -545,12 +674,8 @@ static int handle_video_frame( linsys_opts_t *linsys_opts, uint8_t *data )
 
         if( decode_vbi( h, &linsys_ctx->non_display_parser, vbi_buf, raw_frame ) < 0 )
             goto fail;
-
-        av_free( vbi_buf );
     }
 
-    av_free( anc_buf );
-
     if( linsys_opts->probe )
     {
         raw_frame->release_data( raw_frame );
@@ -613,7 +738,8 @@ static int handle_video_frame( linsys_opts_t *linsys_opts, uint8_t *data )
 
         /* If AFD is present and the stream is SD this will be changed in the video filter */
         raw_frame->sar_width = raw_frame->sar_height = 1;
-        raw_frame->pts = pts = av_rescale_q( linsys_ctx->v_counter++, linsys_ctx->v_timebase, (AVRational){1, OBE_CLOCK} );
+        raw_frame->pts = pts = vbuffer->pts;
+        raw_frame->reset_obe = vbuffer->reset_obe;
 
         if( add_to_filter_queue( h, raw_frame ) < 0 )
             goto fail;
@@ -652,8 +778,7 @@ static int handle_audio_frame( linsys_opts_t *linsys_opts, uint8_t *data )
     raw_frame->audio_frame.num_channels = linsys_opts->num_channels;
     raw_frame->audio_frame.sample_fmt = AV_SAMPLE_FMT_S32P;
 
-    if( av_samples_alloc( raw_frame->audio_frame.audio_data, &raw_frame->audio_frame.linesize, linsys_opts->num_channels,
-                          raw_frame->audio_frame.num_samples, raw_frame->audio_frame.sample_fmt, 0 ) < 0 )
+    if( obe_alloc_audio_data( raw_frame, linsys_opts->num_channels ) < 0 )
     {
         syslog( LOG_ERR, "Malloc failed\n" );
         return -1;
@@ -670,6 +795,10 @@ static int handle_audio_frame( linsys_opts_t *linsys_opts, uint8_t *data )
     raw_frame->pts = av_rescale_q( linsys_ctx->a_counter, linsys_ctx->a_timebase, (AVRational){1, OBE_CLOCK} );
     linsys_ctx->a_counter += raw_frame->audio_frame.num_samples;
 
+    if( linsys_ctx->dump )
+        obe_capture_audio( linsys_ctx->dump, raw_frame->pts, raw_frame->audio_frame.audio_data,
+                           raw_frame->audio_frame.num_channels, raw_frame->audio_frame.num_samples );
+
     raw_frame->release_data = obe_release_audio_data;
     raw_frame->release_frame = obe_release_frame;
     for( int i = 0; i < linsys_ctx->device->num_input_streams; i++ )
@@ -688,145 +817,865 @@ static int handle_audio_frame( linsys_opts_t *linsys_opts, uint8_t *data )
     return 0;
 }
 
-static int capture_data( linsys_opts_t *linsys_opts )
+static void release_card_vbuffer( linsys_vbuffer_t *vbuffer )
 {
-    struct pollfd pfd[2];
-    linsys_ctx_t *linsys_ctx = &linsys_opts->linsys_ctx;
+    linsys_ctx_t *linsys_ctx = vbuffer->opaque;
+    const uint8_t wake = 0;
 
-    pfd[0].fd = linsys_ctx->vfd;
-    pfd[0].events = POLLIN | POLLPRI;
+    if( !__atomic_sub_fetch( &vbuffer->refcount, 1, __ATOMIC_ACQ_REL ) )
+    {
+        /* The capture thread does the requeue so that it owns every ioctl */
+        if( write( linsys_ctx->wake_pipe[1], &wake, 1 ) < 0 )
+            syslog( LOG_WARNING, "[linsys-sdivideo] could not wake capture thread %s", strerror( errno ) );
+    }
+}
 
-    pfd[1].fd = linsys_ctx->afd;
-    pfd[1].events = POLLIN | POLLPRI;
+static void release_replay_vbuffer( linsys_vbuffer_t *vbuffer )
+{
+    linsys_ctx_t *linsys_ctx = vbuffer->opaque;
+    const uint8_t wake = 0;
 
-    if( poll( pfd, 2, READ_TIMEOUT ) < 0 )
+    if( !__atomic_sub_fetch( &vbuffer->refcount, 1, __ATOMIC_ACQ_REL ) )
     {
-        syslog( LOG_ERR, "couldn't poll(): %s", strerror( errno ) );
-        return -1;
+        av_free( vbuffer->data );
+        free( vbuffer );
+
+        __atomic_add_fetch( &linsys_ctx->num_replay_released, 1, __ATOMIC_ACQ_REL );
+        if( write( linsys_ctx->wake_pipe[1], &wake, 1 ) < 0 )
+            syslog( LOG_WARNING, "[linsys-sdivideo] could not wake capture thread %s", strerror( errno ) );
     }
+}
 
-    /* TODO: card-idx these messages */
+static void *video_worker( void *ptr )
+{
+    linsys_opts_t *linsys_opts = ptr;
+    linsys_ctx_t *linsys_ctx = &linsys_opts->linsys_ctx;
+    linsys_vbuffer_t *vbuffer;
 
-    if( pfd[0].revents & POLLPRI )
+    while( 1 )
     {
-        unsigned int val;
+        pthread_mutex_lock( &linsys_ctx->video_mutex );
+        while( !linsys_ctx->num_pending_vbuffers && !linsys_ctx->video_stop )
+            pthread_cond_wait( &linsys_ctx->video_cv, &linsys_ctx->video_mutex );
 
-        if( ioctl( linsys_ctx->vfd, SDIVIDEO_IOC_RXGETEVENTS, &val ) < 0 )
-            syslog( LOG_WARNING, "[linsys-sdivideo] could not SDIVIDEO_IOC_RXGETEVENTS %s", strerror( errno ) );
-        else
+        /* The probe reads its results from the pending frames so finish them first */
+        if( linsys_ctx->video_stop && ( !linsys_opts->probe || !linsys_ctx->num_pending_vbuffers ) )
         {
-            if( val & SDIVIDEO_EVENT_RX_BUFFER )
-                syslog( LOG_WARNING, "[linsys-sdivideo] driver receive buffer queue overrun \n" );
-            if( val & SDIVIDEO_EVENT_RX_FIFO )
-                syslog( LOG_WARNING, "[linsys-sdivideo] onboard receive FIFO overrun \n");
-            if( val & SDIVIDEO_EVENT_RX_CARRIER )
-                syslog( LOG_WARNING, "[linsys-sdivideo] carrier status change \n");
-            if( val & SDIVIDEO_EVENT_RX_DATA )
-                syslog( LOG_WARNING, "[linsys-sdivideo] data status change \n");
-            if( val & SDIVIDEO_EVENT_RX_STD )
-            {
-                /* TODO: support format switching (rare in SDI) */
-                syslog( LOG_WARNING, "[linsys-sdivideo] format change \n");
-            }
+            pthread_mutex_unlock( &linsys_ctx->video_mutex );
+            break;
         }
-    }
 
-    if( pfd[1].revents & POLLPRI )
-    {
-        unsigned int val;
+        vbuffer = linsys_ctx->pending_vbuffers[linsys_ctx->pending_read];
+        linsys_ctx->pending_read = (linsys_ctx->pending_read + 1) % NB_VBUFFERS;
+        linsys_ctx->num_pending_vbuffers--;
+        pthread_mutex_unlock( &linsys_ctx->video_mutex );
 
-        if( ioctl( linsys_ctx->afd, SDIAUDIO_IOC_RXGETEVENTS, &val ) < 0 )
-            syslog( LOG_WARNING, "[linsys-sdiaudio] could not SDIAUDIO_IOC_RXGETEVENTS %s", strerror( errno ) );
-        else
+        if( handle_video_frame( linsys_opts, vbuffer ) < 0 )
         {
-            if( val & SDIAUDIO_EVENT_RX_BUFFER )
-                syslog( LOG_WARNING, "[linsys-sdiaudio] driver receive buffer queue overrun \n" );
-            if( val & SDIAUDIO_EVENT_RX_FIFO )
-                syslog( LOG_WARNING, "[linsys-sdiaudio] onboard receive FIFO overrun \n");
-            if( val & SDIAUDIO_EVENT_RX_CARRIER )
-                syslog( LOG_WARNING, "[linsys-sdiaudio] carrier status change \n");
-            if( val & SDIAUDIO_EVENT_RX_DATA )
-                syslog( LOG_WARNING, "[linsys-sdiaudio] data status change");
+            pthread_mutex_lock( &linsys_ctx->video_mutex );
+            linsys_ctx->video_error = 1;
+            pthread_mutex_unlock( &linsys_ctx->video_mutex );
         }
+
+        vbuffer->release( vbuffer );
     }
 
-    if( pfd[0].revents & POLLIN )
-    {
-        if( ioctl( linsys_ctx->vfd, SDIVIDEO_IOC_DQBUF, linsys_ctx->current_vbuffer ) < 0 )
-        {
-            syslog( LOG_WARNING, "[linsys-sdivideo] couldn't SDIVIDEO_IOC_DQBUF %s", strerror( errno ) );
-            return -1;
-        }
+    return NULL;
+}
 
-        if( handle_video_frame( linsys_opts, linsys_ctx->vbuffers[linsys_ctx->current_vbuffer] ) < 0 )
-            return -1;
+static int start_video_thread( linsys_opts_t *linsys_opts )
+{
+    linsys_ctx_t *linsys_ctx = &linsys_opts->linsys_ctx;
 
-        if( ioctl( linsys_ctx->vfd, SDIVIDEO_IOC_QBUF, linsys_ctx->current_vbuffer ) < 0 )
-        {
-            syslog( LOG_WARNING, "[linsys-sdivideo] couldn't SDIVIDEO_IOC_QBUF %s", strerror( errno ) );
-            return -1;
-        }
+    if( pipe( linsys_ctx->wake_pipe ) < 0 )
+        return -1;
 
-        linsys_ctx->current_vbuffer++;
-        linsys_ctx->current_vbuffer %= linsys_ctx->num_vbuffers;
-    }
+    pthread_mutex_init( &linsys_ctx->video_mutex, NULL );
+    pthread_cond_init( &linsys_ctx->video_cv, NULL );
+    linsys_ctx->pending_read = linsys_ctx->num_pending_vbuffers = 0;
+    linsys_ctx->video_stop = linsys_ctx->video_error = linsys_ctx->num_held_vbuffers = 0;
+    linsys_ctx->requeue_vbuffer = linsys_ctx->current_vbuffer;
 
-    if( pfd[1].revents & POLLIN  )
+    if( obe_thread_create( linsys_ctx->h, OBE_STAGE_INPUT, &linsys_ctx->video_thread, video_worker, linsys_opts ) )
     {
-        if( ioctl( linsys_ctx->afd, SDIAUDIO_IOC_DQBUF, linsys_ctx->current_abuffer ) < 0 )
-        {
-            syslog( LOG_WARNING, "[linsys-sdiaudio] couldn't SDIAUDIO_IOC_DQBUF %s", strerror( errno ) );
-            return -1;
-        }
+        pthread_mutex_destroy( &linsys_ctx->video_mutex );
+        pthread_cond_destroy( &linsys_ctx->video_cv );
+        close( linsys_ctx->wake_pipe[0] );
+        close( linsys_ctx->wake_pipe[1] );
+        return -1;
+    }
+    linsys_ctx->has_video_thread = 1;
 
-        if( !linsys_opts->probe && handle_audio_frame( linsys_opts, linsys_ctx->abuffers[linsys_ctx->current_abuffer] ) < 0 )
-            return -1;
+    return 0;
+}
 
-        if( ioctl( linsys_ctx->afd, SDIAUDIO_IOC_QBUF, linsys_ctx->current_abuffer ) < 0 )
-        {
-            syslog( LOG_WARNING, "[linsys-sdiaudio] couldn't SDIAUDIO_IOC_QBUF %s", strerror( errno ) );
-            return -1;
-        }
+static void stop_video_thread( linsys_ctx_t *linsys_ctx )
+{
+    if( !linsys_ctx->has_video_thread )
+        return;
 
-        linsys_ctx->current_abuffer++;
-        linsys_ctx->current_abuffer %= linsys_ctx->num_abuffers;
+    pthread_mutex_lock( &linsys_ctx->video_mutex );
+    linsys_ctx->video_stop = 1;
+    pthread_cond_signal( &linsys_ctx->video_cv );
+    pthread_mutex_unlock( &linsys_ctx->video_mutex );
+
+    pthread_join( linsys_ctx->video_thread, NULL );
+
+    /* Drop the frames that were never processed */
+    while( linsys_ctx->num_pending_vbuffers )
+    {
+        linsys_vbuffer_t *vbuffer = linsys_ctx->pending_vbuffers[linsys_ctx->pending_read];
+        vbuffer->release( vbuffer );
+        linsys_ctx->pending_read = (linsys_ctx->pending_read + 1) % NB_VBUFFERS;
+        linsys_ctx->num_pending_vbuffers--;
     }
 
-    return 0;
+    pthread_mutex_destroy( &linsys_ctx->video_mutex );
+    pthread_cond_destroy( &linsys_ctx->video_cv );
+    close( linsys_ctx->wake_pipe[0] );
+    close( linsys_ctx->wake_pipe[1] );
+    linsys_ctx->has_video_thread = 0;
 }
 
-static int open_card( linsys_opts_t *linsys_opts )
+/* Runs on the capture thread as soon as a buffer is dequeued. The caller sets the data and release */
+static void queue_video_frame( linsys_opts_t *linsys_opts, linsys_vbuffer_t *vbuffer )
 {
     linsys_ctx_t *linsys_ctx = &linsys_opts->linsys_ctx;
-    int          ret = 0, i, aligned_width, cpu_flags;
-    const int    page_size = getpagesize();
-    unsigned int bufmemsize, sample_rate;
-    unsigned long int vanc;
-    char vdev[MAXLEN], adev[MAXLEN], vanc_file[MAXLEN];
-
-    /* TODO: get rid of linsys utilities */
+    obe_t *h = linsys_ctx->h;
+    int64_t sdi_clock;
 
-    snprintf( vdev, sizeof(vdev), SDIVIDEO_DEVICE, linsys_opts->card_idx );
-    vdev[sizeof(vdev) - 1] = '\0';
-    if ( (linsys_ctx->vfd = open( vdev, O_RDONLY )) < 0 )
+    if( linsys_ctx->last_frame_time == -1 && !linsys_opts->probe &&
+        !sdi_matches_probed_format( linsys_ctx->device, linsys_opts->width, linsys_opts->height, linsys_opts->timebase_num,
+                                    linsys_opts->timebase_den, linsys_opts->interlaced ) )
     {
-        fprintf( stderr, "[linsys-sdivideo] couldn't open device %s \n", vdev );
-        goto finish;
+        syslog( LOG_WARNING, "Linsys card index %i: Input does not match the probed format", linsys_opts->card_idx );
+        linsys_ctx->reset_pending = 1;
+        remove_probe_cache( linsys_ctx->device );
     }
 
-    /* Wait for standard to settle down */
-    while ( 1 )
+    /* The new format counts from zero so carry on from the last frame by the wallclock */
+    if( linsys_ctx->reset_pending && linsys_ctx->last_frame_time != -1 )
     {
-        struct pollfd pfd[1];
+        linsys_ctx->v_clock_base = linsys_ctx->last_v_clock + (obe_mdate() - linsys_ctx->last_frame_time) * (OBE_CLOCK / 1000000);
+        linsys_ctx->v_counter = 0;
+    }
 
-        pfd[0].fd = linsys_ctx->vfd;
-        pfd[0].events = POLLIN | POLLPRI;
+    /* use SDI ticks as clock source */
+    sdi_clock = linsys_ctx->v_clock_base + av_rescale_q( linsys_ctx->v_counter, linsys_ctx->v_timebase, (AVRational){1, OBE_CLOCK} );
+    linsys_ctx->last_v_clock = sdi_clock;
+    /* An unpaced replay runs ahead of the wallclock */
+    if( linsys_opts->replay && linsys_opts->pacing != REPLAY_PACING_REALTIME )
+        obe_clock_step( h, sdi_clock );
+    else
+        obe_clock_tick( h, sdi_clock );
 
-        if( poll( pfd, 1, READ_TIMEOUT ) < 0 )
+    if( linsys_ctx->last_frame_time == -1 )
+        linsys_ctx->last_frame_time = obe_mdate();
+    else
+    {
+        int64_t cur_frame_time = obe_mdate();
+        /* A replay only stalls when the pipeline is full */
+        if( cur_frame_time - linsys_ctx->last_frame_time >= SDI_MAX_DELAY && !linsys_opts->replay )
         {
-            fprintf( stderr, "[linsys-sdivideo] could not poll(): %s \n", vdev );
-            ret = -1;
-            goto finish;
+            syslog( LOG_WARNING, "Linsys card index %i: No frame received for %"PRIi64" ms", linsys_opts->card_idx,
+                   (cur_frame_time - linsys_ctx->last_frame_time) / 1000 );
+            pthread_mutex_lock( &h->drop_mutex );
+            h->encoder_drop = h->mux_drop = 1;
+            pthread_mutex_unlock( &h->drop_mutex );
+        }
+
+        linsys_ctx->last_frame_time = cur_frame_time;
+    }
+
+    vbuffer->refcount = 1;
+    vbuffer->pts = sdi_clock;
+    vbuffer->arrival_time = linsys_ctx->last_frame_time;
+    vbuffer->reset_obe = linsys_ctx->reset_pending;
+    linsys_ctx->reset_pending = 0;
+
+    if( !linsys_opts->probe )
+        linsys_ctx->v_counter++;
+
+    /* There are never more frames in flight than buffers */
+    pthread_mutex_lock( &linsys_ctx->video_mutex );
+    linsys_ctx->pending_vbuffers[(linsys_ctx->pending_read + linsys_ctx->num_pending_vbuffers) % NB_VBUFFERS] = vbuffer;
+    linsys_ctx->num_pending_vbuffers++;
+    pthread_cond_signal( &linsys_ctx->video_cv );
+    pthread_mutex_unlock( &linsys_ctx->video_mutex );
+}
+
+static int change_video_format( linsys_opts_t *linsys_opts );
+
+/* Recording happens on the capture thread so it is only meant for test material */
+static void write_buffer_dump( linsys_ctx_t *linsys_ctx, int type, const uint8_t *data, int size )
+{
+    uint8_t record[4];
+
+    AV_WL32( record, type );
+
+    if( fwrite( record, 1, sizeof(record), linsys_ctx->buffer_dump ) != sizeof(record) ||
+        fwrite( data, 1, size, linsys_ctx->buffer_dump ) != (size_t)size )
+    {
+        syslog( LOG_ERR, "[linsys-sdi] Buffer dump write failed, stopping the dump: %s\n", strerror( errno ) );
+        close_buffer_dump( linsys_ctx );
+    }
+}
+
+static int open_buffer_dump( linsys_opts_t *linsys_opts, const char *location )
+{
+    linsys_ctx_t *linsys_ctx = &linsys_opts->linsys_ctx;
+    uint8_t header[BUFFER_DUMP_HEADER_SIZE];
+
+    linsys_ctx->buffer_dump = fopen( location, "wb" );
+    if( !linsys_ctx->buffer_dump )
+    {
+        fprintf( stderr, "[linsys-sdi] Could not open %s: %s\n", location, strerror( errno ) );
+        return -1;
+    }
+
+    memcpy( header, BUFFER_DUMP_MAGIC, 8 );
+    AV_WL32( &header[8],  linsys_ctx->standard );
+    AV_WL32( &header[12], linsys_ctx->has_vanc );
+    AV_WL32( &header[16], linsys_ctx->vbuffer_size );
+    AV_WL32( &header[20], linsys_ctx->abuffer_size );
+
+    if( fwrite( header, 1, sizeof(header), linsys_ctx->buffer_dump ) != sizeof(header) )
+    {
+        fprintf( stderr, "[linsys-sdi] Could not write %s\n", location );
+        close_buffer_dump( linsys_ctx );
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Replayed buffers in flight between the replay and the video worker */
+static int replay_vbuffers_in_flight( linsys_ctx_t *linsys_ctx )
+{
+    return linsys_ctx->num_replay_frames - __atomic_load_n( &linsys_ctx->num_replay_released, __ATOMIC_ACQUIRE );
+}
+
+static int wait_video_worker( linsys_ctx_t *linsys_ctx )
+{
+    struct pollfd pfd;
+    uint8_t wake[16];
+    int video_error;
+
+    pfd.fd = linsys_ctx->wake_pipe[0];
+    pfd.events = POLLIN;
+
+    if( poll( &pfd, 1, READ_TIMEOUT ) < 0 )
+    {
+        syslog( LOG_ERR, "couldn't poll(): %s", strerror( errno ) );
+        return -1;
+    }
+
+    if( ( pfd.revents & POLLIN ) && read( linsys_ctx->wake_pipe[0], wake, sizeof(wake) ) < 0 )
+        syslog( LOG_WARNING, "[linsys-sdivideo] could not read wake pipe %s", strerror( errno ) );
+
+    pthread_mutex_lock( &linsys_ctx->video_mutex );
+    video_error = linsys_ctx->video_error;
+    pthread_mutex_unlock( &linsys_ctx->video_mutex );
+
+    return video_error ? -1 : 0;
+}
+
+/* Waits for the worker to finish every frame so that the timing covers all of them */
+static int finish_replay( linsys_opts_t *linsys_opts )
+{
+    linsys_ctx_t *linsys_ctx = &linsys_opts->linsys_ctx;
+    double elapsed;
+
+    while( replay_vbuffers_in_flight( linsys_ctx ) )
+    {
+        if( wait_video_worker( linsys_ctx ) < 0 )
+            return -1;
+    }
+
+    if( !linsys_opts->probe && linsys_ctx->num_replay_frames )
+    {
+        elapsed = (double)( get_wallclock_in_mpeg_ticks() - linsys_ctx->replay_start ) / OBE_CLOCK;
+        fprintf( stderr, "[linsys-sdi] Replayed %"PRIi64" frames in %.2f seconds (%.2f fps)\n", linsys_ctx->num_replay_frames,
+                 elapsed, elapsed > 0 ? linsys_ctx->num_replay_frames / elapsed : 0 );
+    }
+
+    return -1;
+}
+
+/* Stands in for capture_data when replaying a buffer dump. The frames go through the same queue and worker
+ * as the card's and no more than MAX_HELD_VBUFFERS are in flight. Returns -1 at the end of the dump */
+static int replay_data( linsys_opts_t *linsys_opts )
+{
+    linsys_ctx_t *linsys_ctx = &linsys_opts->linsys_ctx;
+    linsys_vbuffer_t *vbuffer;
+    uint8_t record[4];
+
+    if( fread( record, 1, sizeof(record), linsys_ctx->replay_fp ) != sizeof(record) )
+        return finish_replay( linsys_opts );
+
+    if( AV_RL32( record ) == BUFFER_AUDIO )
+    {
+        if( fread( linsys_ctx->replay_abuffer, 1, linsys_ctx->abuffer_size, linsys_ctx->replay_fp ) != linsys_ctx->abuffer_size )
+            return finish_replay( linsys_opts );
+
+        if( linsys_opts->probe )
+            linsys_ctx->probe_audio = 1;
+        else if( handle_audio_frame( linsys_opts, linsys_ctx->replay_abuffer ) < 0 )
+            return -1;
+
+        return 0;
+    }
+    else if( AV_RL32( record ) != BUFFER_VIDEO )
+    {
+        syslog( LOG_WARNING, "[linsys-sdi] Invalid buffer dump record\n" );
+        return finish_replay( linsys_opts );
+    }
+
+    while( replay_vbuffers_in_flight( linsys_ctx ) >= MAX_HELD_VBUFFERS )
+    {
+        if( wait_video_worker( linsys_ctx ) < 0 )
+            return -1;
+    }
+
+    /* The probe finishes once the first frame has been unpacked */
+    if( linsys_opts->probe && !linsys_ctx->probe_video_time && __atomic_load_n( &linsys_ctx->num_replay_released, __ATOMIC_ACQUIRE ) )
+        linsys_ctx->probe_video_time = obe_mdate();
+
+    vbuffer = calloc( 1, sizeof(*vbuffer) );
+    if( !vbuffer )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        return -1;
+    }
+
+    vbuffer->data = av_malloc( linsys_ctx->vbuffer_size );
+    if( !vbuffer->data )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        free( vbuffer );
+        return -1;
+    }
+
+    if( fread( vbuffer->data, 1, linsys_ctx->vbuffer_size, linsys_ctx->replay_fp ) != linsys_ctx->vbuffer_size )
+    {
+        av_free( vbuffer->data );
+        free( vbuffer );
+        return finish_replay( linsys_opts );
+    }
+
+    if( !linsys_ctx->num_replay_frames )
+        linsys_ctx->replay_start = get_wallclock_in_mpeg_ticks();
+
+    if( !linsys_opts->probe )
+    {
+        /* Hold the frame back until it is due */
+        if( linsys_opts->pacing == REPLAY_PACING_REALTIME )
+            sleep_mpeg_ticks( linsys_ctx->replay_start + av_rescale_q( linsys_ctx->num_replay_frames, linsys_ctx->v_timebase,
+                                                                       (AVRational){1, OBE_CLOCK} ) );
+        else
+        {
+            while( obe_pipeline_full( linsys_ctx->h ) )
+                usleep( UNPACED_BACKOFF );
+        }
+    }
+
+    vbuffer->release = release_replay_vbuffer;
+    vbuffer->opaque = linsys_ctx;
+    linsys_ctx->num_replay_frames++;
+
+    queue_video_frame( linsys_opts, vbuffer );
+
+    return 0;
+}
+
+static int capture_data( linsys_opts_t *linsys_opts )
+{
+    struct pollfd pfd[3];
+    linsys_ctx_t *linsys_ctx = &linsys_opts->linsys_ctx;
+    linsys_vbuffer_t *vbuffer;
+    int video_error;
+
+    /* Give the buffers back to the card in order once they have been unpacked */
+    while( linsys_ctx->num_held_vbuffers &&
+           !__atomic_load_n( &linsys_ctx->held_vbuffers[linsys_ctx->requeue_vbuffer].refcount, __ATOMIC_ACQUIRE ) )
+    {
+        if( ioctl( linsys_ctx->vfd, SDIVIDEO_IOC_QBUF, linsys_ctx->requeue_vbuffer ) < 0 )
+        {
+            syslog( LOG_WARNING, "[linsys-sdivideo] couldn't SDIVIDEO_IOC_QBUF %s", strerror( errno ) );
+            return -1;
+        }
+
+        linsys_ctx->requeue_vbuffer++;
+        linsys_ctx->requeue_vbuffer %= linsys_ctx->num_vbuffers;
+        linsys_ctx->num_held_vbuffers--;
+
+        if( linsys_opts->probe && !linsys_ctx->probe_video_time )
+            linsys_ctx->probe_video_time = obe_mdate();
+    }
+
+    pthread_mutex_lock( &linsys_ctx->video_mutex );
+    video_error = linsys_ctx->video_error;
+    pthread_mutex_unlock( &linsys_ctx->video_mutex );
+
+    if( video_error )
+        return -1;
+
+    /* Leave the card enough buffers to capture into while the worker catches up */
+    pfd[0].fd = linsys_ctx->vfd;
+    pfd[0].events = linsys_ctx->num_held_vbuffers == MAX_HELD_VBUFFERS ? POLLPRI : POLLIN | POLLPRI;
+
+    pfd[1].fd = linsys_ctx->afd;
+    pfd[1].events = POLLIN | POLLPRI;
+
+    pfd[2].fd = linsys_ctx->wake_pipe[0];
+    pfd[2].events = POLLIN;
+
+    if( poll( pfd, 3, READ_TIMEOUT ) < 0 )
+    {
+        syslog( LOG_ERR, "couldn't poll(): %s", strerror( errno ) );
+        return -1;
+    }
+
+    if( pfd[2].revents & POLLIN )
+    {
+        uint8_t wake[16];
+
+        if( read( linsys_ctx->wake_pipe[0], wake, sizeof(wake) ) < 0 )
+            syslog( LOG_WARNING, "[linsys-sdivideo] could not read wake pipe %s", strerror( errno ) );
+    }
+
+    /* TODO: card-idx these messages */
+
+    if( pfd[0].revents & POLLPRI )
+    {
+        unsigned int val;
+
+        if( ioctl( linsys_ctx->vfd, SDIVIDEO_IOC_RXGETEVENTS, &val ) < 0 )
+            syslog( LOG_WARNING, "[linsys-sdivideo] could not SDIVIDEO_IOC_RXGETEVENTS %s", strerror( errno ) );
+        else
+        {
+            if( val & SDIVIDEO_EVENT_RX_BUFFER )
+                syslog( LOG_WARNING, "[linsys-sdivideo] driver receive buffer queue overrun \n" );
+            if( val & SDIVIDEO_EVENT_RX_FIFO )
+                syslog( LOG_WARNING, "[linsys-sdivideo] onboard receive FIFO overrun \n");
+            if( val & SDIVIDEO_EVENT_RX_CARRIER )
+                syslog( LOG_WARNING, "[linsys-sdivideo] carrier status change \n");
+            if( val & SDIVIDEO_EVENT_RX_DATA )
+                syslog( LOG_WARNING, "[linsys-sdivideo] data status change \n");
+            if( val & SDIVIDEO_EVENT_RX_STD )
+            {
+                syslog( LOG_WARNING, "[linsys-sdivideo] format change \n");
+
+                /* The video device is reopened so anything it polled is stale */
+                if( !linsys_opts->probe )
+                    return change_video_format( linsys_opts );
+            }
+        }
+    }
+
+    if( pfd[1].revents & POLLPRI )
+    {
+        unsigned int val;
+
+        if( ioctl( linsys_ctx->afd, SDIAUDIO_IOC_RXGETEVENTS, &val ) < 0 )
+            syslog( LOG_WARNING, "[linsys-sdiaudio] could not SDIAUDIO_IOC_RXGETEVENTS %s", strerror( errno ) );
+        else
+        {
+            if( val & SDIAUDIO_EVENT_RX_BUFFER )
+                syslog( LOG_WARNING, "[linsys-sdiaudio] driver receive buffer queue overrun \n" );
+            if( val & SDIAUDIO_EVENT_RX_FIFO )
+                syslog( LOG_WARNING, "[linsys-sdiaudio] onboard receive FIFO overrun \n");
+            if( val & SDIAUDIO_EVENT_RX_CARRIER )
+                syslog( LOG_WARNING, "[linsys-sdiaudio] carrier status change \n");
+            if( val & SDIAUDIO_EVENT_RX_DATA )
+                syslog( LOG_WARNING, "[linsys-sdiaudio] data status change");
+        }
+    }
+
+    if( pfd[0].revents & POLLIN )
+    {
+        if( ioctl( linsys_ctx->vfd, SDIVIDEO_IOC_DQBUF, linsys_ctx->current_vbuffer ) < 0 )
+        {
+            syslog( LOG_WARNING, "[linsys-sdivideo] couldn't SDIVIDEO_IOC_DQBUF %s", strerror( errno ) );
+            return -1;
+        }
+
+        vbuffer = &linsys_ctx->held_vbuffers[linsys_ctx->current_vbuffer];
+        vbuffer->data = linsys_ctx->vbuffers[linsys_ctx->current_vbuffer];
+        if( linsys_ctx->buffer_dump )
+            write_buffer_dump( linsys_ctx, BUFFER_VIDEO, vbuffer->data, linsys_ctx->vbuffer_size );
+        vbuffer->release = release_card_vbuffer;
+        vbuffer->opaque = linsys_ctx;
+        linsys_ctx->num_held_vbuffers++;
+
+        linsys_ctx->current_vbuffer++;
+        linsys_ctx->current_vbuffer %= linsys_ctx->num_vbuffers;
+
+        queue_video_frame( linsys_opts, vbuffer );
+    }
+
+    if( pfd[1].revents & POLLIN  )
+    {
+        if( ioctl( linsys_ctx->afd, SDIAUDIO_IOC_DQBUF, linsys_ctx->current_abuffer ) < 0 )
+        {
+            syslog( LOG_WARNING, "[linsys-sdiaudio] couldn't SDIAUDIO_IOC_DQBUF %s", strerror( errno ) );
+            return -1;
+        }
+
+        if( linsys_ctx->buffer_dump )
+            write_buffer_dump( linsys_ctx, BUFFER_AUDIO, linsys_ctx->abuffers[linsys_ctx->current_abuffer], linsys_ctx->abuffer_size );
+
+        if( linsys_opts->probe )
+            linsys_ctx->probe_audio = 1;
+        else if( handle_audio_frame( linsys_opts, linsys_ctx->abuffers[linsys_ctx->current_abuffer] ) < 0 )
+            return -1;
+
+        if( ioctl( linsys_ctx->afd, SDIAUDIO_IOC_QBUF, linsys_ctx->current_abuffer ) < 0 )
+        {
+            syslog( LOG_WARNING, "[linsys-sdiaudio] couldn't SDIAUDIO_IOC_QBUF %s", strerror( errno ) );
+            return -1;
+        }
+
+        linsys_ctx->current_abuffer++;
+        linsys_ctx->current_abuffer %= linsys_ctx->num_abuffers;
+    }
+
+    return 0;
+}
+
+static int find_video_format( unsigned int standard )
+{
+    int i;
+
+    for( i = 0; video_format_tab[i].obe_name != -1; i++ )
+    {
+        if( video_format_tab[i].linsys_name == standard )
+            return i;
+    }
+
+    return -1;
+}
+
+/* Set up for the standard the card has detected */
+static int setup_video_format( linsys_opts_t *linsys_opts )
+{
+    linsys_ctx_t *linsys_ctx = &linsys_opts->linsys_ctx;
+    int i, aligned_width, cpu_flags = av_get_cpu_flags();
+
+    if( (i = find_video_format( linsys_ctx->standard )) < 0 )
+        return -1;
+
+    linsys_opts->video_format = video_format_tab[i].obe_name;
+    linsys_opts->width = linsys_ctx->width = video_format_tab[i].width;
+    linsys_opts->height = linsys_ctx->coded_height = video_format_tab[i].height;
+    /* Ignore any 6 junk lines */
+    if( linsys_opts->video_format == INPUT_VIDEO_FORMAT_NTSC )
+        linsys_opts->height = 480;
+
+    linsys_opts->timebase_num = video_format_tab[i].timebase_num;
+    linsys_opts->timebase_den = video_format_tab[i].timebase_den;
+    linsys_opts->interlaced = IS_INTERLACED( linsys_opts->video_format );
+    linsys_opts->tff = linsys_opts->interlaced ? video_format_tab[i].tff : 0;
+
+    linsys_ctx->v_timebase.num = linsys_opts->timebase_num;
+    linsys_ctx->v_timebase.den = linsys_opts->timebase_den;
+
+    aligned_width = ((linsys_opts->width + 47) / 48) * 48;
+    linsys_ctx->stride = aligned_width * 8 / 3;
+    linsys_ctx->vbuffer_size = linsys_ctx->coded_height * linsys_ctx->stride;
+
+    /* Setup VBI and VANC pack functions */
+    if( IS_SD( linsys_opts->video_format ) )
+    {
+        linsys_ctx->pack_line = obe_yuv422p10_line_to_uyvy_c;
+        linsys_ctx->downscale_line = obe_downscale_line_c;
+
+        if( cpu_flags & AV_CPU_FLAG_MMX )
+            linsys_ctx->downscale_line = obe_downscale_line_mmx;
+
+        if( cpu_flags & AV_CPU_FLAG_SSE2 )
+            linsys_ctx->downscale_line = obe_downscale_line_sse2;
+    }
+    else
+        linsys_ctx->pack_line = obe_yuv422p10_line_to_nv20_c;
+
+    return 0;
+}
+
+/* Increase the buffer size if VANC is being included and make the v210 decoder act on the full frame */
+static void add_vanc_lines( linsys_ctx_t *linsys_ctx )
+{
+    int i = find_video_format( linsys_ctx->standard );
+
+    if( linsys_ctx->has_vanc )
+    {
+        linsys_ctx->vbuffer_size += (video_format_tab[i].total_height - video_format_tab[i].height) * linsys_ctx->stride;
+        linsys_ctx->coded_height = video_format_tab[i].total_height;
+    }
+}
+
+/* Size and map the video buffers for the current format and start unpacking */
+static int open_video( linsys_opts_t *linsys_opts )
+{
+    linsys_ctx_t *linsys_ctx = &linsys_opts->linsys_ctx;
+    const int    page_size = getpagesize();
+    unsigned int bufmemsize;
+    char vdev[MAXLEN];
+
+    add_vanc_lines( linsys_ctx );
+
+    linsys_ctx->num_vbuffers = NB_VBUFFERS;
+
+    if( write_ul_sysfs( SDIVIDEO_BUFFERS_FILE, linsys_opts->card_idx, linsys_ctx->num_vbuffers ) < 0 )
+    {
+        fprintf( stderr, "[linsys-sdi] could not write NB_VBUFFERS \n");
+        return -1;
+    }
+
+    if( write_ul_sysfs( SDIVIDEO_BUFSIZE_FILE, linsys_opts->card_idx, linsys_ctx->vbuffer_size ) < 0 )
+    {
+        fprintf( stderr, "[linsys-sdi] could not write video buffer size \n");
+        return -1;
+    }
+
+    snprintf( vdev, sizeof(vdev), SDIVIDEO_DEVICE, linsys_opts->card_idx );
+    vdev[sizeof(vdev) - 1] = '\0';
+    if( (linsys_ctx->vfd = open( vdev, O_RDONLY )) < 0 )
+    {
+        fprintf( stderr, "[linsys-sdi] couldn't open device %s \n", vdev );
+        return -1;
+    }
+
+    linsys_ctx->current_vbuffer = 0;
+    bufmemsize = ((linsys_ctx->vbuffer_size + page_size - 1) / page_size) * page_size;
+
+    linsys_ctx->vbuffers = malloc( linsys_ctx->num_vbuffers * sizeof(uint8_t*) );
+    if( !linsys_ctx->vbuffers )
+    {
+        fprintf( stderr, "malloc failed \n" );
+        return -1;
+    }
+
+    for( unsigned int j = 0; j < linsys_ctx->num_vbuffers; j++ )
+    {
+        if( (linsys_ctx->vbuffers[j] = mmap( NULL, linsys_ctx->vbuffer_size, PROT_READ, MAP_SHARED,
+                                             linsys_ctx->vfd, j * bufmemsize )) == MAP_FAILED )
+        {
+            fprintf( stderr, "could not mmap video buffer %u \n", j );
+            return -1;
+        }
+    }
+
+    obe_v210_unpacker_init( linsys_ctx->h, &linsys_ctx->unpacker, linsys_ctx->width, linsys_ctx->coded_height );
+
+    if( start_video_thread( linsys_opts ) < 0 )
+    {
+        fprintf( stderr, "[linsys-sdi] could not create video thread \n" );
+        return -1;
+    }
+
+    return 0;
+}
+
+/* The signal has changed format mid-stream. The video device is reopened for the new standard while audio
+ * carries on. The first frame in the new format is flagged so the video filter and encoders follow */
+static int change_video_format( linsys_opts_t *linsys_opts )
+{
+    linsys_ctx_t *linsys_ctx = &linsys_opts->linsys_ctx;
+    obe_t *h = linsys_ctx->h;
+    unsigned int standard;
+
+    if( ioctl( linsys_ctx->vfd, SDIVIDEO_IOC_RXGETVIDSTATUS, &standard ) < 0 )
+    {
+        syslog( LOG_WARNING, "[linsys-sdivideo] could not SDIVIDEO_IOC_RXGETVIDSTATUS %s", strerror( errno ) );
+        return 0;
+    }
+
+    if( standard == linsys_ctx->standard )
+        return 0;
+
+    if( find_video_format( standard ) < 0 )
+    {
+        syslog( LOG_WARNING, "[linsys-sdivideo] Unsupported video format\n" );
+        return 0;
+    }
+
+    close_video( linsys_ctx );
+
+    /* A capture holds a single format */
+    if( linsys_ctx->dump )
+    {
+        syslog( LOG_WARNING, "[linsys-sdi] Format changed, stopping the capture to %s\n", linsys_ctx->device->user_opts.dump_location );
+        close_dump( linsys_ctx );
+    }
+
+    if( linsys_ctx->buffer_dump )
+    {
+        syslog( LOG_WARNING, "[linsys-sdi] Format changed, stopping the buffer dump\n" );
+        close_buffer_dump( linsys_ctx );
+    }
+
+    if( linsys_ctx->has_setup_vbi )
+    {
+        vbi_raw_decoder_destroy( &linsys_ctx->non_display_parser.vbi_decoder );
+        linsys_ctx->has_setup_vbi = 0;
+    }
+
+    linsys_ctx->standard = standard;
+    setup_video_format( linsys_opts );
+    if( open_video( linsys_opts ) < 0 )
+    {
+        syslog( LOG_ERR, "[linsys-sdivideo] Could not reopen video device for the new format\n" );
+        return -1;
+    }
+
+    if( obe_pool_reserve_images( h->shared->frame_pool, PIX_FMT_YUV422P10, linsys_ctx->width, linsys_ctx->coded_height + 1, 16,
+                                 linsys_opts->num_reserved_frames ) < 0 )
+        syslog( LOG_WARNING, "[linsys-sdi] Could not preallocate video frames\n" );
+
+    syslog( LOG_INFO, "Linsys card index %i: Switched to %ix%i", linsys_opts->card_idx, linsys_opts->width, linsys_opts->height );
+    linsys_ctx->reset_pending = 1;
+
+    return 0;
+}
+
+static int open_resampler( linsys_opts_t *linsys_opts )
+{
+    linsys_ctx_t *linsys_ctx = &linsys_opts->linsys_ctx;
+
+    linsys_ctx->avr = avresample_alloc_context();
+    if( !linsys_ctx->avr )
+    {
+        fprintf( stderr, "[linsys-sdiaudio] couldn't setup sample rate conversion \n" );
+        return -1;
+    }
+
+    /* Give libavresample a made up channel map */
+    av_opt_set_int( linsys_ctx->avr, "in_channel_layout",   (1 << linsys_opts->num_channels) - 1, 0 );
+    av_opt_set_int( linsys_ctx->avr, "in_sample_fmt",       AV_SAMPLE_FMT_S32, 0 );
+    av_opt_set_int( linsys_ctx->avr, "in_sample_rate",      48000, 0 );
+    av_opt_set_int( linsys_ctx->avr, "out_channel_layout",  (1 << linsys_opts->num_channels) - 1, 0 );
+    av_opt_set_int( linsys_ctx->avr, "out_sample_fmt",      AV_SAMPLE_FMT_S32P, 0 );
+
+    if( avresample_open( linsys_ctx->avr ) < 0 )
+    {
+        fprintf( stderr, "Could not open AVResample\n" );
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Opens a buffer dump in place of the card */
+static int open_replay( linsys_opts_t *linsys_opts, const char *location )
+{
+    linsys_ctx_t *linsys_ctx = &linsys_opts->linsys_ctx;
+    uint8_t header[BUFFER_DUMP_HEADER_SIZE];
+    unsigned int vbuffer_size;
+    int ret = -1;
+
+    /* There is no device to close */
+    linsys_ctx->vfd = linsys_ctx->afd = -1;
+    linsys_opts->replay = 1;
+
+    linsys_ctx->replay_fp = fopen( location, "rb" );
+    if( !linsys_ctx->replay_fp )
+    {
+        fprintf( stderr, "[linsys-sdi] Could not open %s: %s\n", location, strerror( errno ) );
+        goto finish;
+    }
+
+    if( fread( header, 1, sizeof(header), linsys_ctx->replay_fp ) != sizeof(header) || memcmp( header, BUFFER_DUMP_MAGIC, 8 ) )
+    {
+        fprintf( stderr, "[linsys-sdi] %s is not a buffer dump\n", location );
+        goto finish;
+    }
+
+    linsys_ctx->standard = AV_RL32( &header[8] );
+    linsys_ctx->has_vanc = !!AV_RL32( &header[12] );
+    vbuffer_size = AV_RL32( &header[16] );
+    linsys_ctx->abuffer_size = AV_RL32( &header[20] );
+
+    if( setup_video_format( linsys_opts ) < 0 )
+    {
+        fprintf( stderr, "[linsys-sdivideo] Unsupported video format\n" );
+        goto finish;
+    }
+    add_vanc_lines( linsys_ctx );
+
+    if( vbuffer_size != linsys_ctx->vbuffer_size || !linsys_ctx->abuffer_size ||
+        linsys_ctx->abuffer_size % ( linsys_opts->num_channels * sizeof(int32_t) ) )
+    {
+        fprintf( stderr, "[linsys-sdi] %s has invalid buffer sizes\n", location );
+        goto finish;
+    }
+
+    linsys_opts->sample_rate = 48000;
+    linsys_ctx->a_timebase.num = 1;
+    linsys_ctx->a_timebase.den = linsys_opts->sample_rate;
+
+    linsys_ctx->replay_abuffer = av_malloc( linsys_ctx->abuffer_size );
+    if( !linsys_ctx->replay_abuffer )
+    {
+        fprintf( stderr, "malloc failed \n" );
+        goto finish;
+    }
+
+    if( !linsys_opts->probe && open_resampler( linsys_opts ) < 0 )
+        goto finish;
+
+    if( !linsys_opts->probe && linsys_ctx->device->user_opts.dump_location )
+        open_dump( linsys_opts );
+
+    obe_v210_unpacker_init( linsys_ctx->h, &linsys_ctx->unpacker, linsys_ctx->width, linsys_ctx->coded_height );
+
+    if( start_video_thread( linsys_opts ) < 0 )
+    {
+        fprintf( stderr, "[linsys-sdi] could not create video thread \n" );
+        goto finish;
+    }
+
+    ret = 0;
+
+finish:
+    if( ret )
+        close_card( linsys_opts );
+
+    return ret;
+}
+
+static int open_card( linsys_opts_t *linsys_opts )
+{
+    linsys_ctx_t *linsys_ctx = &linsys_opts->linsys_ctx;
+    int          ret = 0;
+    const int    page_size = getpagesize();
+    unsigned int bufmemsize, sample_rate;
+    unsigned long int vanc;
+    char vdev[MAXLEN], adev[MAXLEN], vanc_file[MAXLEN];
+
+    /* TODO: get rid of linsys utilities */
+
+    snprintf( vdev, sizeof(vdev), SDIVIDEO_DEVICE, linsys_opts->card_idx );
+    vdev[sizeof(vdev) - 1] = '\0';
+    if ( (linsys_ctx->vfd = open( vdev, O_RDONLY )) < 0 )
+    {
+        fprintf( stderr, "[linsys-sdivideo] couldn't open device %s \n", vdev );
+        goto finish;
+    }
+
+    /* Wait for standard to settle down */
+    while ( 1 )
+    {
+        struct pollfd pfd[1];
+
+        pfd[0].fd = linsys_ctx->vfd;
+        pfd[0].events = POLLIN | POLLPRI;
+
+        if( poll( pfd, 1, READ_TIMEOUT ) < 0 )
+        {
+            fprintf( stderr, "[linsys-sdivideo] could not poll(): %s \n", vdev );
+            ret = -1;
+            goto finish;
         }
 
         if( pfd[0].revents & POLLPRI )
@@ -861,65 +1710,13 @@ static int open_card( linsys_opts_t *linsys_opts )
         goto finish;
     }
 
-    for( i = 0; video_format_tab[i].obe_name != -1; i++ )
-    {
-        if( video_format_tab[i].linsys_name == linsys_ctx->standard )
-            break;
-    }
-
-    if( video_format_tab[i].obe_name == -1 )
+    if( setup_video_format( linsys_opts ) < 0 )
     {
         fprintf( stderr, "[linsys-sdivideo] Unsupported video format\n" );
         ret = -1;
         goto finish;
     }
 
-    linsys_opts->video_format = video_format_tab[i].obe_name;
-    linsys_opts->width = linsys_ctx->width = video_format_tab[i].width;
-    linsys_opts->height = linsys_ctx->coded_height = video_format_tab[i].height;
-    /* Ignore any 6 junk lines */
-    if( linsys_opts->video_format == INPUT_VIDEO_FORMAT_NTSC )
-        linsys_opts->height = 480;
-
-    linsys_opts->timebase_num = video_format_tab[i].timebase_num;
-    linsys_opts->timebase_den = video_format_tab[i].timebase_den;
-    linsys_opts->interlaced = IS_INTERLACED( linsys_opts->video_format );
-    if( linsys_opts->interlaced )
-        linsys_opts->tff = video_format_tab[i].tff;
-
-    linsys_ctx->v_timebase.num = linsys_opts->timebase_num;
-    linsys_ctx->v_timebase.den = linsys_opts->timebase_den;
-
-    aligned_width = ((linsys_opts->width + 47) / 48) * 48;
-    linsys_ctx->stride = aligned_width * 8 / 3;
-    linsys_ctx->vbuffer_size = linsys_ctx->coded_height * linsys_ctx->stride;
-
-    cpu_flags = av_get_cpu_flags();
-
-    /* Setup unpack functions */
-    linsys_ctx->unpack_line = obe_v210_planar_unpack_c;
-
-    if( cpu_flags & AV_CPU_FLAG_SSSE3 )
-        linsys_ctx->unpack_line = obe_v210_planar_unpack_aligned_ssse3;
-
-    if( cpu_flags & AV_CPU_FLAG_AVX )
-        linsys_ctx->unpack_line = obe_v210_planar_unpack_aligned_avx;
-
-    /* Setup VBI and VANC pack functions */
-    if( IS_SD( linsys_opts->video_format ) )
-    {
-        linsys_ctx->pack_line = obe_yuv422p10_line_to_uyvy_c;
-        linsys_ctx->downscale_line = obe_downscale_line_c;
-
-        if( cpu_flags & AV_CPU_FLAG_MMX )
-            linsys_ctx->downscale_line = obe_downscale_line_mmx;
-
-        if( cpu_flags & AV_CPU_FLAG_SSE2 )
-            linsys_ctx->downscale_line = obe_downscale_line_sse2;
-    }
-    else
-        linsys_ctx->pack_line = obe_yuv422p10_line_to_nv20_c;
-
     close( linsys_ctx->vfd );
 
     /* First open the audio for synchronization reasons */
@@ -991,28 +1788,10 @@ static int open_card( linsys_opts_t *linsys_opts )
         goto finish;
     }
 
-    if( !linsys_opts->probe )
+    if( !linsys_opts->probe && open_resampler( linsys_opts ) < 0 )
     {
-        linsys_ctx->avr = avresample_alloc_context();
-        if( !linsys_ctx->avr )
-        {
-            fprintf( stderr, "[linsys-sdiaudio] couldn't setup sample rate conversion \n" );
-            ret = -1;
-            goto finish;
-        }
-
-        /* Give libavresample a made up channel map */
-        av_opt_set_int( linsys_ctx->avr, "in_channel_layout",   (1 << linsys_opts->num_channels) - 1, 0 );
-        av_opt_set_int( linsys_ctx->avr, "in_sample_fmt",       AV_SAMPLE_FMT_S32, 0 );
-        av_opt_set_int( linsys_ctx->avr, "in_sample_rate",      48000, 0 );
-        av_opt_set_int( linsys_ctx->avr, "out_channel_layout",  (1 << linsys_opts->num_channels) - 1, 0 );
-        av_opt_set_int( linsys_ctx->avr, "out_sample_fmt",      AV_SAMPLE_FMT_S32P, 0 );
-
-        if( avresample_open( linsys_ctx->avr ) < 0 )
-        {
-            fprintf( stderr, "Could not open AVResample\n" );
-            goto finish;
-        }
+        ret = -1;
+        goto finish;
     }
 
     if( (linsys_ctx->afd = open( adev, O_RDONLY )) < 0 )
@@ -1059,58 +1838,15 @@ static int open_card( linsys_opts_t *linsys_opts )
     if( util_strtoul( vanc_file, &vanc ) > 0 )
         linsys_ctx->has_vanc = !!vanc;
 
-    /* Increase the buffer size if VANC is being included and make the v210 decoder act on the full frame */
-    if( linsys_ctx->has_vanc )
-    {
-        linsys_ctx->vbuffer_size += (video_format_tab[i].total_height - video_format_tab[i].height) * linsys_ctx->stride;
-        linsys_ctx->coded_height = video_format_tab[i].total_height;
-    }
-
-    linsys_ctx->num_vbuffers = NB_VBUFFERS;
-
-    if( write_ul_sysfs( SDIVIDEO_BUFFERS_FILE, linsys_opts->card_idx, linsys_ctx->num_vbuffers ) < 0 )
-    {
-        fprintf( stderr, "[linsys-sdi] could not write NB_VBUFFERS \n");
-        ret = -1;
-        goto finish;
-    }
-
-    if( write_ul_sysfs( SDIVIDEO_BUFSIZE_FILE, linsys_opts->card_idx, linsys_ctx->vbuffer_size ) < 0 )
-    {
-        fprintf( stderr, "[linsys-sdi] could not write video buffer size \n");
-        ret = -1;
-        goto finish;
-    }
-
-    if( (linsys_ctx->vfd = open( vdev, O_RDONLY )) < 0 )
-    {
-        fprintf( stderr, "[linsys-sdi] couldn't open device %s \n", vdev );
-        ret = -1;
-        goto finish;
-    }
-
-    linsys_ctx->current_vbuffer = 0;
-    bufmemsize = ((linsys_ctx->vbuffer_size + page_size - 1) / page_size) * page_size;
+    if( !linsys_opts->probe && linsys_ctx->device->user_opts.dump_location )
+        open_dump( linsys_opts );
 
-    linsys_ctx->vbuffers = malloc( linsys_ctx->num_vbuffers * sizeof(uint8_t*) );
-    if( !linsys_ctx->vbuffers )
+    if( open_video( linsys_opts ) < 0 )
     {
-        fprintf( stderr, "malloc failed \n" );
         ret = -1;
         goto finish;
     }
 
-    for( unsigned int j = 0; j < linsys_ctx->num_vbuffers; j++ )
-    {
-        if( (linsys_ctx->vbuffers[j] = mmap( NULL, linsys_ctx->vbuffer_size, PROT_READ, MAP_SHARED,
-                                             linsys_ctx->vfd, j * bufmemsize )) == MAP_FAILED )
-        {
-            fprintf( stderr, "could not mmap video buffer %u \n", j );
-            ret = -1;
-            goto finish;
-        }
-    }
-
 finish:
     if( ret )
         close_card( linsys_opts );
@@ -1151,14 +1887,16 @@ static void *probe_stream( void *ptr )
     linsys_opts.num_channels = 8;
     linsys_opts.audio_samples = 2000; /* not important yet when probing */
 
-    if( open_card( &linsys_opts ) < 0 )
+    if( user_opts->location ? open_replay( &linsys_opts, user_opts->location ) < 0 : open_card( &linsys_opts ) < 0 )
         return NULL;
 
-    int64_t start = obe_mdate();
-    while( 1 )
+    int64_t deadline = obe_mdate() + MAX_PROBE_TIME * 1000000LL;
+    while( !linsys_opts.linsys_ctx.probe_video_time || !linsys_opts.linsys_ctx.probe_audio )
     {
-        capture_data( &linsys_opts );
-        if( obe_mdate() - start >= 1000000 )
+        if( linsys_opts.linsys_ctx.probe_video_time )
+            deadline = FFMIN( deadline, linsys_opts.linsys_ctx.probe_video_time + PROBE_AUDIO_WAIT );
+
+        if( obe_mdate() >= deadline || ( linsys_opts.replay ? replay_data( &linsys_opts ) : capture_data( &linsys_opts ) ) < 0 )
             break;
     }
 
@@ -1265,6 +2003,8 @@ static void *open_input( void *ptr )
     linsys_opts->num_channels = 8;
     linsys_opts->card_idx = user_opts->card_idx;
     linsys_opts->audio_samples = input->audio_samples;
+    linsys_opts->num_reserved_frames = input->num_reserved_frames;
+    linsys_opts->pacing = user_opts->replay_pacing;
 
     linsys_ctx = &linsys_opts->linsys_ctx;
 
@@ -1277,12 +2017,19 @@ static void *open_input( void *ptr )
 
     /* TODO: wait for encoder */
 
-    if( open_card( linsys_opts ) < 0 )
+    if( user_opts->location ? open_replay( linsys_opts, user_opts->location ) < 0 : open_card( linsys_opts ) < 0 )
         return NULL;
 
+    if( user_opts->buffer_dump_location && !linsys_opts->replay )
+        open_buffer_dump( linsys_opts, user_opts->buffer_dump_location );
+
+    if( obe_pool_reserve_images( h->shared->frame_pool, PIX_FMT_YUV422P10, linsys_ctx->width, linsys_ctx->coded_height + 1, 16,
+                                 linsys_opts->num_reserved_frames ) < 0 )
+        syslog( LOG_WARNING, "[linsys-sdi] Could not preallocate video frames\n" );
+
     while( 1 )
     {
-        if( capture_data( linsys_opts ) < 0 )
+        if( ( linsys_opts->replay ? replay_data( linsys_opts ) : capture_data( linsys_opts ) ) < 0 )
             break;
     }
 
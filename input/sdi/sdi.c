@@ -276,6 +276,22 @@ int add_teletext_service( obe_sdi_non_display_data_t *non_display_data, obe_int_
     return 0;
 }
 
+/* The probed streams can come from the probe cache, so the first frame is checked against them */
+int sdi_matches_probed_format( obe_device_t *device, int width, int height, int timebase_num, int timebase_den, int interlaced )
+{
+    obe_int_input_stream_t *stream;
+
+    for( int i = 0; i < device->num_input_streams; i++ )
+    {
+        stream = device->streams[i];
+        if( stream->stream_type == STREAM_TYPE_VIDEO )
+            return stream->width == width && stream->height == height && stream->timebase_num == timebase_num &&
+                   stream->timebase_den == timebase_den && stream->interlaced == interlaced;
+    }
+
+    return 1;
+}
+
 /* FIXME: these functions don't include the centre line */
 int sdi_next_line( int format, int line_smpte )
 {
@@ -125,6 +125,7 @@ int check_probed_non_display_data( obe_sdi_non_display_data_t *non_display_data,
 int check_active_non_display_data( obe_raw_frame_t *raw_frame, int type );
 int check_user_selected_non_display_data( obe_t *h, int type, int location );
 int add_teletext_service( obe_sdi_non_display_data_t *non_display_data, obe_int_input_stream_t *stream );
+int sdi_matches_probed_format( obe_device_t *device, int width, int height, int timebase_num, int timebase_den, int interlaced );
 int sdi_next_line( int format, int line_smpte );
 
 #endif
@@ -0,0 +1,227 @@
+/*****************************************************************************
+ * unpack.c: v210 to planar unpacking
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include "common/common.h"
+#include "common/affinity.h"
+#include "input/sdi/unpack.h"
+#include "input/sdi/x86/sdi.h"
+#include <libavutil/bswap.h>
+#include <libavutil/cpu.h>
+
+#define READ_PIXELS(a, b, c)         \
+    do {                             \
+        val  = av_le2ne32(*src++);   \
+        *a++ =  val & 0x3FF;         \
+        *b++ = (val >> 10) & 0x3FF;  \
+        *c++ = (val >> 20) & 0x3FF;  \
+    } while (0)
+
+/* The SIMD kernels store two luma samples and one chroma sample past the last group they unpack.
+ * This lands on the following line before it is unpacked, except on the last line of a band
+ * where it would overwrite the start of another band, so the final group there is unpacked in C */
+static void unpack_line( obe_v210_unpacker_t *unpacker, const uint32_t *src, uint16_t *y, uint16_t *u, uint16_t *v, int band_end )
+{
+    uint32_t val = 0;
+    int w, simd_w;
+
+    w = (unpacker->width / 6) * 6;
+    simd_w = band_end ? FFMAX( w - 6, 0 ) : w;
+
+    if( simd_w )
+        unpacker->unpack_line( src, y, u, v, simd_w );
+
+    if( simd_w < w )
+        obe_v210_planar_unpack_c( src + ((simd_w << 1) / 3), y + simd_w, u + (simd_w >> 1), v + (simd_w >> 1), w - simd_w );
+
+    y += w;
+    u += w >> 1;
+    v += w >> 1;
+    src += (w << 1) / 3;
+
+    if( w < unpacker->width - 1 )
+    {
+        READ_PIXELS(u, y, v);
+
+        val  = av_le2ne32(*src++);
+        *y++ =  val & 0x3FF;
+    }
+
+    if( w < unpacker->width - 3 )
+    {
+        *u++ = (val >> 10) & 0x3FF;
+        *y++ = (val >> 20) & 0x3FF;
+
+        val  = av_le2ne32(*src++);
+        *v++ =  val & 0x3FF;
+        *y++ = (val >> 10) & 0x3FF;
+    }
+}
+
+static void unpack_band( obe_v210_unpacker_t *unpacker, int index )
+{
+    obe_image_t *img = unpacker->img;
+    const uint8_t *src;
+    int first = index * unpacker->height / unpacker->num_bands;
+    int last = (index + 1) * unpacker->height / unpacker->num_bands;
+
+    for( int i = first; i < last; i++ )
+    {
+        if( unpacker->src[1] )
+            src = unpacker->src[i & 1] + (i >> 1) * unpacker->src_stride;
+        else
+            src = unpacker->src[0] + i * unpacker->src_stride;
+
+        unpack_line( unpacker, (const uint32_t*)src, (uint16_t*)(img->plane[0] + i * img->stride[0]),
+                     (uint16_t*)(img->plane[1] + i * img->stride[1]), (uint16_t*)(img->plane[2] + i * img->stride[2]),
+                     i == last - 1 && index < unpacker->num_bands - 1 );
+    }
+}
+
+static void *unpack_band_thread( void *ptr )
+{
+    obe_v210_band_t *band = ptr;
+    obe_v210_unpacker_t *unpacker = band->unpacker;
+    int job = 0;
+
+    pthread_mutex_lock( &unpacker->mutex );
+    while( 1 )
+    {
+        while( unpacker->job == job && !unpacker->cancel )
+            pthread_cond_wait( &unpacker->start_cv, &unpacker->mutex );
+
+        if( unpacker->cancel )
+            break;
+
+        job = unpacker->job;
+        pthread_mutex_unlock( &unpacker->mutex );
+
+        unpack_band( unpacker, band->index );
+
+        pthread_mutex_lock( &unpacker->mutex );
+        if( !--unpacker->bands_left )
+            pthread_cond_signal( &unpacker->done_cv );
+    }
+    pthread_mutex_unlock( &unpacker->mutex );
+
+    return NULL;
+}
+
+void obe_v210_unpacker_init( obe_t *h, obe_v210_unpacker_t *unpacker, int width, int height )
+{
+    int cpu_flags = av_get_cpu_flags();
+    int num_bands;
+
+    unpacker->unpack_line_aligned = unpacker->unpack_line_unaligned = obe_v210_planar_unpack_c;
+
+    if( cpu_flags & AV_CPU_FLAG_SSSE3 )
+    {
+        unpacker->unpack_line_aligned = obe_v210_planar_unpack_aligned_ssse3;
+        unpacker->unpack_line_unaligned = obe_v210_planar_unpack_unaligned_ssse3;
+    }
+
+    if( cpu_flags & AV_CPU_FLAG_AVX )
+    {
+        unpacker->unpack_line_aligned = obe_v210_planar_unpack_aligned_avx;
+        unpacker->unpack_line_unaligned = obe_v210_planar_unpack_unaligned_avx;
+    }
+
+    if( cpu_flags & AV_CPU_FLAG_AVX2 )
+        unpacker->unpack_line_aligned = unpacker->unpack_line_unaligned = obe_v210_planar_unpack_avx2;
+
+    pthread_mutex_init( &unpacker->mutex, NULL );
+    pthread_cond_init( &unpacker->start_cv, NULL );
+    pthread_cond_init( &unpacker->done_cv, NULL );
+    unpacker->job = unpacker->bands_left = unpacker->cancel = 0;
+
+    num_bands = (width * height + V210_BAND_PIXELS - 1) / V210_BAND_PIXELS;
+    num_bands = FFMAX( FFMIN( num_bands, V210_MAX_BANDS ), 1 );
+
+    unpacker->num_bands = 1;
+    for( int i = 1; i < num_bands; i++ )
+    {
+        obe_v210_band_t *band = &unpacker->bands[i];
+
+        band->unpacker = unpacker;
+        band->index = i;
+        if( obe_thread_create( h, OBE_STAGE_INPUT, &band->thread, unpack_band_thread, band ) )
+        {
+            syslog( LOG_WARNING, "Could not create unpack thread, using %i bands\n", unpacker->num_bands );
+            break;
+        }
+        unpacker->num_bands++;
+    }
+}
+
+void obe_v210_unpack_frame( obe_v210_unpacker_t *unpacker, const uint8_t *field_one, const uint8_t *field_two, int src_stride,
+                            int width, int height, obe_image_t *img )
+{
+    unpacker->unpack_line = unpacker->unpack_line_unaligned;
+    if( !(((uintptr_t)field_one | (uintptr_t)field_two | src_stride) & 15) )
+        unpacker->unpack_line = unpacker->unpack_line_aligned;
+
+    unpacker->src[0] = field_one;
+    unpacker->src[1] = field_two;
+    unpacker->src_stride = src_stride;
+    unpacker->width = width;
+    unpacker->height = height;
+    unpacker->img = img;
+
+    if( unpacker->num_bands > 1 )
+    {
+        pthread_mutex_lock( &unpacker->mutex );
+        unpacker->job++;
+        unpacker->bands_left = unpacker->num_bands - 1;
+        pthread_cond_broadcast( &unpacker->start_cv );
+        pthread_mutex_unlock( &unpacker->mutex );
+    }
+
+    unpack_band( unpacker, 0 );
+
+    if( unpacker->num_bands > 1 )
+    {
+        pthread_mutex_lock( &unpacker->mutex );
+        while( unpacker->bands_left )
+            pthread_cond_wait( &unpacker->done_cv, &unpacker->mutex );
+        pthread_mutex_unlock( &unpacker->mutex );
+    }
+}
+
+void obe_v210_unpacker_close( obe_v210_unpacker_t *unpacker )
+{
+    /* Never initialised */
+    if( !unpacker->num_bands )
+        return;
+
+    pthread_mutex_lock( &unpacker->mutex );
+    unpacker->cancel = 1;
+    pthread_cond_broadcast( &unpacker->start_cv );
+    pthread_mutex_unlock( &unpacker->mutex );
+
+    for( int i = 1; i < unpacker->num_bands; i++ )
+        pthread_join( unpacker->bands[i].thread, NULL );
+
+    pthread_mutex_destroy( &unpacker->mutex );
+    pthread_cond_destroy( &unpacker->start_cv );
+    pthread_cond_destroy( &unpacker->done_cv );
+    unpacker->num_bands = 0;
+}
@@ -0,0 +1,73 @@
+/*****************************************************************************
+ * unpack.h: v210 to planar unpacking
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef OBE_SDI_UNPACK_H
+#define OBE_SDI_UNPACK_H
+
+#include "common/common.h"
+
+/* Frames are split into one row band per this many pixels so HD is unpacked on the calling thread */
+#define V210_BAND_PIXELS (1920*1088)
+#define V210_MAX_BANDS   4
+
+typedef struct obe_v210_unpacker_t obe_v210_unpacker_t;
+
+typedef struct
+{
+    obe_v210_unpacker_t *unpacker;
+    int index;
+    pthread_t thread;
+} obe_v210_band_t;
+
+struct obe_v210_unpacker_t
+{
+    void (*unpack_line_aligned) ( const uint32_t *src, uint16_t *y, uint16_t *u, uint16_t *v, int width );
+    void (*unpack_line_unaligned) ( const uint32_t *src, uint16_t *y, uint16_t *u, uint16_t *v, int width );
+
+    /* Band zero is unpacked by the caller, the rest by worker threads */
+    int num_bands;
+    obe_v210_band_t bands[V210_MAX_BANDS];
+
+    pthread_mutex_t mutex;
+    pthread_cond_t  start_cv;
+    pthread_cond_t  done_cv;
+    int job;
+    int bands_left;
+    int cancel;
+
+    /* Current frame */
+    void (*unpack_line) ( const uint32_t *src, uint16_t *y, uint16_t *u, uint16_t *v, int width );
+    const uint8_t *src[2];
+    int src_stride;
+    int width;
+    int height;
+    obe_image_t *img;
+};
+
+void obe_v210_unpacker_init( obe_t *h, obe_v210_unpacker_t *unpacker, int width, int height );
+/* field_two is NULL for a frame stored as interleaved lines, otherwise the lines alternate between the two fields */
+void obe_v210_unpack_frame( obe_v210_unpacker_t *unpacker, const uint8_t *field_one, const uint8_t *field_two, int src_stride,
+                            int width, int height, obe_image_t *img );
+void obe_v210_unpacker_close( obe_v210_unpacker_t *unpacker );
+
+#endif
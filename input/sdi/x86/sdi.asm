@@ -6,6 +6,14 @@ v210_mask: times 4 dd 0x3ff
 v210_mult: dw 64,4,64,4,64,4,64,4
 v210_luma_shuf: db 8,9,0,1,2,3,12,13,4,5,6,7,-1,-1,-1,-1
 v210_chroma_shuf: db 0,1,8,9,6,7,-1,-1,2,3,4,5,12,13,-1,-1
+v210_nv20_chroma_shuf: db 0,1,2,3,8,9,4,5,6,7,12,13,-1,-1,-1,-1
+v210_lane_perm: dd 0,1,2,4,5,6,3,7
+
+; Gather the three samples of each dword in order for uyvy
+v210_uyvy_shuf_a: times 2 db 0,1,2,3,-1,-1,4,5,6,7,-1,-1,8,9,10,11
+v210_uyvy_shuf_b: times 2 db -1,-1,-1,-1,0,1,-1,-1,-1,-1,4,5,-1,-1,-1,-1
+v210_uyvy_shuf_c: times 2 db -1,-1,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1
+v210_uyvy_shuf_d: times 2 db 8,9,-1,-1,-1,-1,12,13,-1,-1,-1,-1,-1,-1,-1,-1
 
 SECTION .text
 
@@ -86,3 +94,202 @@ INIT_XMM ssse3
 v210_planar_unpack aligned
 INIT_XMM avx
 v210_planar_unpack aligned
+
+; The AVX2 versions work on 12 pixels per iteration, 6 in each 128-bit lane.
+; Everything is VEX encoded by hand so the upper halves are never left dirty
+; across a legacy SSE instruction.
+
+; Unpack v210 in %1 into luma in %3 and chroma in %2 for each lane
+; %4 = v210_mult, %5 = v210_mask, %6 = v210_luma_shuf
+%macro V210_UNPACK 6
+    vpmullw  %2, %1, %4
+    vpsrld   %1, %1, 10
+    vpsrlw   %2, %2, 6         ; u0 v0 y1 y2 v1 u2 y4 y5
+    vpand    %1, %1, %5        ; y0 __ u1 __ y3 __ v2 __
+    vshufps  %3, %2, %1, 0x8d  ; y1 y2 y4 y5 y0 __ y3 __
+    vpshufb  %3, %3, %6        ; y0 y1 y2 y3 y4 y5 __ __
+    vshufps  %2, %2, %1, 0xd8  ; u0 v0 v1 u2 u1 __ v2 __
+%endmacro
+
+; Unpack v210 in %1 into uyvy in %3 (8 samples) and %6 (4 samples) for each lane
+; %2 is clobbered, %4 = v210_mult, %5 = v210_mask
+%macro V210_UYVY 6
+    vpmullw  %2, %1, %4
+    vpsrld   %1, %1, 10
+    vpsrlw   %2, %2, 6         ; first and third sample of each dword
+    vpand    %1, %1, %5        ; second sample of each dword
+    vpslld   %1, %1, 16
+    vpblendw %1, %2, %1, 0xaa  ; first and second sample of each dword
+    vpsrld   %2, %2, 16        ; third sample of each dword
+    vpshufb  %3, %1, [v210_uyvy_shuf_a]
+    vpshufb  %6, %2, [v210_uyvy_shuf_b]
+    vpor     %3, %3, %6
+    vpshufb  %1, %1, [v210_uyvy_shuf_c]
+    vpshufb  %2, %2, [v210_uyvy_shuf_d]
+    vpor     %6, %1, %2
+%endmacro
+
+INIT_YMM avx2
+
+; v210_planar_unpack(const uint32_t *src, uint16_t *y, uint16_t *u, uint16_t *v, int width)
+; Like the 128-bit versions this stores two luma and one chroma sample past the end
+cglobal v210_planar_unpack, 5, 5, 7
+    movsxdifnidn r4, r4d
+    lea    r1, [r1+2*r4]
+    add    r2, r4
+    add    r3, r4
+    neg    r4
+
+    vbroadcasti128 m3, [v210_mult]
+    vbroadcasti128 m4, [v210_mask]
+    vbroadcasti128 m5, [v210_luma_shuf]
+    vbroadcasti128 m6, [v210_chroma_shuf]
+    cmp    r4, -12
+    jg     .tail
+.loop
+    vmovdqu m0, [r0]
+    V210_UNPACK m0, m1, m2, m3, m4, m5
+    vpshufb m1, m1, m6         ; u0 u1 u2 __ v0 v1 v2 __
+
+    ; The second lane overwrites the spare samples stored from the first
+    vmovdqu [r1+2*r4], xmm2
+    vextracti128 [r1+2*r4+12], m2, 1
+    vmovq   [r2+r4], xmm1
+    vmovhps [r3+r4], xmm1
+    vextracti128 xmm1, m1, 1
+    vmovq   [r2+r4+6], xmm1
+    vmovhps [r3+r4+6], xmm1
+
+    add    r0, mmsize
+    add    r4, 12
+    jz     .end
+    cmp    r4, -12
+    jle    .loop
+.tail
+    ; Six pixels left
+    vmovdqu xmm0, [r0]
+    V210_UNPACK xmm0, xmm1, xmm2, xmm3, xmm4, xmm5
+    vpshufb xmm1, xmm1, xmm6
+    vmovdqu [r1+2*r4], xmm2
+    vmovq   [r2+r4], xmm1
+    vmovhps [r3+r4], xmm1
+.end
+    RET
+
+; v210_line_to_nv20(uint32_t *src, uint16_t *dst, int width)
+; Unlike the planar unpack nothing is stored past either half of the line
+cglobal v210_line_to_nv20, 3, 4, 8
+    movsxdifnidn r2, r2d
+    lea    r3, [r1+2*r2]
+
+    vbroadcasti128 m3, [v210_mult]
+    vbroadcasti128 m4, [v210_mask]
+    vbroadcasti128 m5, [v210_luma_shuf]
+    vbroadcasti128 m6, [v210_nv20_chroma_shuf]
+    vmovdqu m7, [v210_lane_perm]
+    sub    r2, 12
+    jl     .tail
+.loop
+    vmovdqu m0, [r0]
+    V210_UNPACK m0, m1, m2, m3, m4, m5
+    vpshufb m1, m1, m6         ; u0 v0 u1 v1 u2 v2 __ __
+    vpermd  m2, m7, m2         ; move the 12 samples of each into the low 24 bytes
+    vpermd  m1, m7, m1
+
+    vmovdqu [r1], xmm2
+    vextracti128 xmm2, m2, 1
+    vmovq   [r1+16], xmm2
+    vmovdqu [r3], xmm1
+    vextracti128 xmm1, m1, 1
+    vmovq   [r3+16], xmm1
+
+    add    r0, mmsize
+    add    r1, 24
+    add    r3, 24
+    sub    r2, 12
+    jge    .loop
+.tail
+    add    r2, 12
+    jz     .end
+    vmovdqu xmm0, [r0]
+    V210_UNPACK xmm0, xmm1, xmm2, xmm3, xmm4, xmm5
+    vpshufb xmm1, xmm1, xmm6
+    cmp    r2, 6
+    jl     .partial
+
+    vmovq   [r1], xmm2
+    vpextrd [r1+8], xmm2, 2
+    vmovq   [r3], xmm1
+    vpextrd [r3+8], xmm1, 2
+
+    add    r0, 16
+    add    r1, 12
+    add    r3, 12
+    sub    r2, 6
+    jz     .end
+    vmovdqu xmm0, [r0]
+    V210_UNPACK xmm0, xmm1, xmm2, xmm3, xmm4, xmm5
+    vpshufb xmm1, xmm1, xmm6
+.partial
+    ; Two or four pixels left
+    cmp    r2, 2
+    jg     .four
+    vmovd   [r1], xmm2
+    vmovd   [r3], xmm1
+    RET
+.four
+    vmovq   [r1], xmm2
+    vmovq   [r3], xmm1
+.end
+    RET
+
+; v210_line_to_uyvy(uint32_t *src, uint16_t *dst, int width)
+cglobal v210_line_to_uyvy, 3, 3, 6
+    movsxdifnidn r2, r2d
+
+    vbroadcasti128 m3, [v210_mult]
+    vbroadcasti128 m4, [v210_mask]
+    sub    r2, 12
+    jl     .tail
+.loop
+    vmovdqu m0, [r0]
+    V210_UYVY m0, m1, m2, m3, m4, m5
+
+    vmovdqu [r1], xmm2
+    vmovq   [r1+16], xmm5
+    vextracti128 [r1+24], m2, 1
+    vextracti128 xmm5, m5, 1
+    vmovq   [r1+40], xmm5
+
+    add    r0, mmsize
+    add    r1, 48
+    sub    r2, 12
+    jge    .loop
+.tail
+    ; Up to ten pixels left, a group of six and then two or four
+    add    r2, 12
+    jz     .end
+    vmovdqu xmm0, [r0]
+    V210_UYVY xmm0, xmm1, xmm2, xmm3, xmm4, xmm5
+    cmp    r2, 6
+    jl     .partial
+
+    vmovdqu [r1], xmm2
+    vmovq   [r1+16], xmm5
+
+    add    r0, 16
+    add    r1, 24
+    sub    r2, 6
+    jz     .end
+    vmovdqu xmm0, [r0]
+    V210_UYVY xmm0, xmm1, xmm2, xmm3, xmm4, xmm5
+.partial
+    ; Two or four pixels left
+    cmp    r2, 2
+    jg     .four
+    vmovq   [r1], xmm2
+    RET
+.four
+    vmovdqu [r1], xmm2
+.end
+    RET
@@ -24,6 +24,11 @@
 #ifndef OBE_X86_SDI
 #define OBE_X86_SDI
 
+/* Older libavutil cannot detect AVX2 so the flag is never set there */
+#ifndef AV_CPU_FLAG_AVX2
+#define AV_CPU_FLAG_AVX2 0x8000
+#endif
+
 void obe_downscale_line_mmx( uint16_t *src, uint8_t *dst, int lines );
 void obe_downscale_line_sse2( uint16_t *src, uint8_t *dst, int lines );
 
@@ -35,4 +40,10 @@ void obe_v210_planar_unpack_unaligned_avx( const uint32_t *src, uint16_t *y, uin
 void obe_v210_planar_unpack_aligned_ssse3( const uint32_t *src, uint16_t *y, uint16_t *u, uint16_t *v, int width );
 void obe_v210_planar_unpack_aligned_avx( const uint32_t *src, uint16_t *y, uint16_t *u, uint16_t *v, int width );
 
+/* Aligned and unaligned loads are equally fast on AVX2 hardware */
+void obe_v210_planar_unpack_avx2( const uint32_t *src, uint16_t *y, uint16_t *u, uint16_t *v, int width );
+
+void obe_v210_line_to_nv20_avx2( uint32_t *src, uint16_t *dst, int width );
+void obe_v210_line_to_uyvy_avx2( uint32_t *src, uint16_t *dst, int width );
+
 #endif
@@ -23,42 +23,21 @@
 
 #include <libavutil/mathematics.h>
 #include <libavutil/intreadwrite.h>
-#include <libavutil/fifo.h>
-#include <libavutil/buffer.h>
 #include "common/common.h"
 
 static void *start_smoothing( void *ptr )
 {
     obe_t *h = ptr;
-    int num_muxed_data = 0, buffer_complete = 0;
+    int num_muxed_data = 0, buffer_complete = 0, num_packets, first_packet, num_carried = 0;
     int64_t start_clock = -1, start_pcr, end_pcr, temporal_vbv_size = 0, cur_pcr;
-    obe_muxed_data_t **muxed_data = NULL, *start_data, *end_data;
-    AVFifoBuffer *fifo_data = NULL, *fifo_pcr = NULL;
-    AVBufferRef **output_buffers = NULL;
-
-    struct sched_param param = {0};
-    param.sched_priority = 99;
-    pthread_setschedparam( pthread_self(), SCHED_FIFO, &param );
+    obe_muxed_data_t **muxed_data = NULL, *start_data, *end_data, *page, *carry_page = NULL;
+    obe_ts_slice_t *slice;
 
     /* This thread buffers one VBV worth of frames */
-    fifo_data = av_fifo_alloc( TS_PACKETS_SIZE );
-    if( !fifo_data )
-    {
-        fprintf( stderr, "[mux-smoothing] Could not allocate data fifo" );
-        return NULL;
-    }
-
-    fifo_pcr = av_fifo_alloc( 7 * sizeof(int64_t) );
-    if( !fifo_pcr )
-    {
-        fprintf( stderr, "[mux-smoothing] Could not allocate pcr fifo" );
-        return NULL;
-    }
-
-    output_buffers = malloc( h->num_outputs * sizeof(*output_buffers) );
-    if( !output_buffers )
+    muxed_data = malloc( h->mux_smoothing_queue.capacity * sizeof(*muxed_data) );
+    if( !muxed_data )
     {
-        fprintf( stderr, "[mux-smoothing] Could not allocate output buffers" );
+        fprintf( stderr, "[mux-smoothing] Could not allocate muxed data batch\n" );
         return NULL;
     }
 
@@ -83,18 +62,9 @@ static void *start_smoothing( void *ptr )
 
     while( 1 )
     {
-        pthread_mutex_lock( &h->mux_smoothing_queue.mutex );
-
-        while( h->mux_smoothing_queue.size == num_muxed_data && !h->cancel_mux_smoothing_thread )
-            pthread_cond_wait( &h->mux_smoothing_queue.in_cv, &h->mux_smoothing_queue.mutex );
-
-        if( h->cancel_mux_smoothing_thread )
-        {
-            pthread_mutex_unlock( &h->mux_smoothing_queue.mutex );
+        num_muxed_data = obe_queue_wait( &h->mux_smoothing_queue, num_muxed_data, &h->cancel_mux_smoothing_thread );
+        if( num_muxed_data < 0 )
             break;
-        }
-
-        num_muxed_data = h->mux_smoothing_queue.size;
 
         /* Refill the buffer after a drop */
         pthread_mutex_lock( &h->drop_mutex );
@@ -102,8 +72,9 @@ static void *start_smoothing( void *ptr )
         {
             syslog( LOG_INFO, "Mux smoothing buffer reset\n" );
             h->mux_drop = 0;
-            av_fifo_reset( fifo_data );
-            av_fifo_reset( fifo_pcr );
+            if( carry_page )
+                destroy_muxed_data( carry_page );
+            carry_page = NULL;
             buffer_complete = 0;
             start_clock = -1;
         }
@@ -111,8 +82,8 @@ static void *start_smoothing( void *ptr )
 
         if( !buffer_complete )
         {
-            start_data = h->mux_smoothing_queue.queue[0];
-            end_data = h->mux_smoothing_queue.queue[num_muxed_data-1];
+            start_data = QUEUE_ITEM( &h->mux_smoothing_queue, 0 );
+            end_data = QUEUE_ITEM( &h->mux_smoothing_queue, num_muxed_data-1 );
 
             start_pcr = start_data->pcr_list[0];
             end_pcr = end_data->pcr_list[(end_data->len / 188)-1];
@@ -122,91 +93,79 @@ static void *start_smoothing( void *ptr )
                 start_clock = -1;
             }
             else
-            {
-                pthread_mutex_unlock( &h->mux_smoothing_queue.mutex );
                 continue;
-            }
         }
 
         //printf("\n mux smoothed frames %i \n", num_muxed_data );
 
-        muxed_data = malloc( num_muxed_data * sizeof(*muxed_data) );
-        if( !muxed_data )
-        {
-            pthread_mutex_unlock( &h->mux_smoothing_queue.mutex );
-            syslog( LOG_ERR, "Malloc failed\n" );
-            return NULL;
-        }
-        memcpy( muxed_data, h->mux_smoothing_queue.queue, num_muxed_data * sizeof(*muxed_data) );
-        pthread_mutex_unlock( &h->mux_smoothing_queue.mutex );
+        num_muxed_data = obe_queue_drain( &h->mux_smoothing_queue, (void**)muxed_data );
 
         for( int i = 0; i < num_muxed_data; i++ )
         {
-            if( av_fifo_realloc2( fifo_data, av_fifo_size( fifo_data ) + muxed_data[i]->len ) < 0 )
-            {
-                syslog( LOG_ERR, "Malloc failed\n" );
-                return NULL;
-            }
-
-            av_fifo_generic_write( fifo_data, muxed_data[i]->data, muxed_data[i]->len, NULL );
+            page = muxed_data[i];
+            num_packets = page->len / 188;
+            first_packet = 0;
 
-            if( av_fifo_realloc2( fifo_pcr, av_fifo_size( fifo_pcr ) + ((muxed_data[i]->len * sizeof(int64_t)) / 188) ) < 0 )
+            /* Packets left over from the previous page go in its headroom so that every slice is contiguous */
+            if( carry_page )
             {
-                syslog( LOG_ERR, "Malloc failed\n" );
-                return NULL;
+                first_packet = -num_carried;
+                memcpy( &page->data[first_packet*188], &carry_page->data[carry_page->len - num_carried*188], num_carried*188 );
+                memcpy( &page->pcr_list[first_packet], &carry_page->pcr_list[carry_page->len/188 - num_carried], num_carried*sizeof(int64_t) );
+                destroy_muxed_data( carry_page );
+                carry_page = NULL;
             }
 
-            av_fifo_generic_write( fifo_pcr, muxed_data[i]->pcr_list, (muxed_data[i]->len * sizeof(int64_t)) / 188, NULL );
-
-            remove_from_queue( &h->mux_smoothing_queue );
-            destroy_muxed_data( muxed_data[i] );
-        }
-
-        free( muxed_data );
-        muxed_data = NULL;
-        num_muxed_data = 0;
-
-        while( av_fifo_size( fifo_data ) >= TS_PACKETS_SIZE )
-        {
-            output_buffers[0] = av_buffer_alloc( TS_PACKETS_SIZE + 7 * sizeof(int64_t) );
-            av_fifo_generic_read( fifo_pcr, output_buffers[0]->data, 7 * sizeof(int64_t), NULL );
-            av_fifo_generic_read( fifo_data, &output_buffers[0]->data[7 * sizeof(int64_t)], TS_PACKETS_SIZE, NULL );
-
-            for( int i = 1; i < h->num_outputs; i++ )
+            for( ; num_packets - first_packet >= TS_SLICE_PACKETS; first_packet += TS_SLICE_PACKETS )
             {
-                output_buffers[i] = av_buffer_ref( output_buffers[0] );
-                if( !output_buffers[i] )
+                slice = &page->slices[page->num_slices++];
+                slice->page = page;
+                slice->data = &page->data[first_packet*188];
+                slice->pcr = cur_pcr = page->pcr_list[first_packet];
+
+                if( start_clock != -1 )
                 {
-                    syslog( LOG_ERR, "Malloc failed\n" );
-                    return NULL;
+                    sleep_input_clock( h, cur_pcr - start_pcr + start_clock );
                 }
-            }
-
-            cur_pcr = AV_RN64( output_buffers[0]->data );
 
-            if( start_clock != -1 )
-            {
-                sleep_input_clock( h, cur_pcr - start_pcr + start_clock );
-            }
+                if( start_clock == -1 )
+                {
+                    start_clock = get_input_clock_in_mpeg_ticks( h );
+                    start_pcr = cur_pcr;
+                }
 
-            if( start_clock == -1 )
-            {
-                start_clock = get_input_clock_in_mpeg_ticks( h );
-                start_pcr = cur_pcr;
+                /* Every output holds a reference to the page */
+                for( int j = 0; j < h->num_outputs; j++ )
+                {
+                    obe_ref_muxed_data( page );
+                    if( add_to_queue( &h->outputs[j]->queue, slice ) < 0 )
+                    {
+                        destroy_muxed_data( page );
+                        goto end;
+                    }
+                }
             }
 
-            for( int i = 0; i < h->num_outputs; i++ )
-            {
-                if( add_to_queue( &h->outputs[i]->queue, output_buffers[i] ) < 0 )
-                    return NULL;
-                output_buffers[i] = NULL;
-            }
+            num_carried = num_packets - first_packet;
+            if( num_carried )
+                carry_page = page;
+            else
+                destroy_muxed_data( page );
+            muxed_data[i] = NULL;
         }
+
+        num_muxed_data = 0;
     }
 
-    av_fifo_free( fifo_data );
-    av_fifo_free( fifo_pcr );
-    free( output_buffers );
+end:
+    for( int i = 0; i < num_muxed_data; i++ )
+    {
+        if( muxed_data[i] )
+            destroy_muxed_data( muxed_data[i] );
+    }
+    if( carry_page )
+        destroy_muxed_data( carry_page );
+    free( muxed_data );
 
     return NULL;
 }
@@ -63,16 +63,6 @@ static const int avc_profiles[][2] =
     { 0, 0 },
 };
 
-static obe_output_stream_t *get_output_mux_stream( obe_mux_params_t *mux_params, int output_stream_id )
-{
-    for( int i = 0; i < mux_params->num_output_streams; i++ )
-    {
-        if( mux_params->output_streams[i].output_stream_id == output_stream_id )
-            return &mux_params->output_streams[i];
-    }
-    return NULL;
-}
-
 static void encoder_wait( obe_t *h, int output_stream_id )
 {
     /* Wait for encoder to be ready */
@@ -109,10 +99,6 @@ void *open_muxer( void *ptr )
     char *service_name = "OBE Service";
     char *provider_name = "Open Broadcast Encoder";
 
-    struct sched_param param = {0};
-    param.sched_priority = 99;
-    pthread_setschedparam( pthread_self(), SCHED_RR, &param );
-
     // TODO sanity check the options
 
     params.ts_type = mux_opts->ts_type;
@@ -146,11 +132,10 @@ void *open_muxer( void *ptr )
 
     if( mux_opts->passthrough )
     {
-        /* TODO lock when we can add multiple devices */
-        params.ts_id = h->devices[0]->ts_id;
-        program.program_num = h->devices[0]->program_num;
-        program.pmt_pid = h->devices[0]->pmt_pid;
-        program.pcr_pid = h->devices[0]->pcr_pid;
+        params.ts_id = mux_params->device->ts_id;
+        program.program_num = mux_params->device->program_num;
+        program.pmt_pid = mux_params->device->pmt_pid;
+        program.pcr_pid = mux_params->device->pcr_pid;
     }
     else
     {
@@ -211,9 +196,11 @@ void *open_muxer( void *ptr )
         {
             encoder_wait( h, output_stream->output_stream_id );
 
-            width = output_stream->avc_param.i_width;
-            height = output_stream->avc_param.i_height;
-            video_pid = stream->pid;
+            /* With several video streams the first one carries the PCR */
+            if( !video_pid )
+                video_pid = stream->pid;
+            width = MAX( width, output_stream->avc_param.i_width );
+            height = MAX( height, output_stream->avc_param.i_height );
         }
         else if( stream_format == AUDIO_MP2 )
             stream->audio_frame_size = (double)MP2_NUM_SAMPLES * 90000LL * output_stream->ts_opts.frames_per_pes / input_stream->sample_rate;
@@ -400,7 +387,7 @@ void *open_muxer( void *ptr )
         {
             for( int i = 0; i < h->mux_queue.size; i++ )
             {
-                coded_frame = h->mux_queue.queue[i];
+                coded_frame = QUEUE_ITEM( &h->mux_queue, i );
                 if( coded_frame->is_video )
                 {
                     video_found = 1;
@@ -440,8 +427,8 @@ void *open_muxer( void *ptr )
         num_frames = 0;
         for( int i = 0; i < h->mux_queue.size; i++ )
         {
-            coded_frame = h->mux_queue.queue[i];
-            output_stream = get_output_mux_stream( mux_params, coded_frame->output_stream_id );
+            coded_frame = QUEUE_ITEM( &h->mux_queue, i );
+            output_stream = get_output_stream( h, coded_frame->output_stream_id );
             // FIXME name
             int64_t rescaled_dts = coded_frame->pts - first_video_pts + first_video_real_pts;
             if( coded_frame->is_video )
@@ -451,7 +438,7 @@ void *open_muxer( void *ptr )
 
             if( rescaled_dts <= video_dts )
             {
-                frames[num_frames].opaque = h->mux_queue.queue[i];
+                frames[num_frames].opaque = QUEUE_ITEM( &h->mux_queue, i );
                 frames[num_frames].size = coded_frame->len;
                 frames[num_frames].data = coded_frame->data;
                 frames[num_frames].pid = output_stream->ts_opts.pid;
@@ -485,21 +472,15 @@ void *open_muxer( void *ptr )
 
         if( len )
         {
-            muxed_data = new_muxed_data( len );
+            muxed_data = new_muxed_data( h, len );
             if( !muxed_data )
             {
                 syslog( LOG_ERR, "Malloc failed\n" );
                 goto end;
             }
 
+            /* libmpegts owns its output buffer so this is the only copy before the outputs */
             memcpy( muxed_data->data, output, len );
-            muxed_data->pcr_list = malloc( (len / 188) * sizeof(int64_t) );
-            if( !muxed_data->pcr_list )
-            {
-                syslog( LOG_ERR, "Malloc failed\n" );
-                destroy_muxed_data( muxed_data );
-                goto end;
-            }
             memcpy( muxed_data->pcr_list, pcr_list, (len / 188) * sizeof(int64_t) );
             add_to_queue( &h->mux_smoothing_queue, muxed_data );
         }
@@ -23,6 +23,7 @@
 
 #include "common/common.h"
 #include "common/lavc.h"
+#include "common/affinity.h"
 #include "input/input.h"
 #include "filters/video/video.h"
 #include "filters/audio/audio.h"
@@ -31,6 +32,10 @@
 #include "mux/mux.h"
 #include "output/output.h"
 
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
 /** Utilities **/
 int64_t obe_mdate( void )
 {
@@ -39,6 +44,17 @@ int64_t obe_mdate( void )
     return (int64_t)ts_current.tv_sec * 1000000 + (int64_t)ts_current.tv_nsec / 1000;
 }
 
+/* pthread_cond_timedwait takes an absolute CLOCK_REALTIME deadline */
+void obe_timeout_to_timespec( int64_t usecs, struct timespec *ts )
+{
+    int64_t nsecs;
+
+    clock_gettime( CLOCK_REALTIME, ts );
+    nsecs = ts->tv_nsec + MAX( usecs, 0 ) * 1000;
+    ts->tv_sec += nsecs / 1000000000;
+    ts->tv_nsec = nsecs % 1000000000;
+}
+
 /** Create/Destroy **/
 /* Input device */
 obe_device_t *new_device( void )
@@ -62,6 +78,8 @@ void destroy_device( obe_device_t *device )
         free( device->probed_streams );
     if( device->location )
         free( device->location );
+    if( device->probe_cache_file )
+        free( device->probe_cache_file );
     free( device );
 }
 
@@ -76,103 +94,236 @@ obe_raw_frame_t *new_raw_frame( void )
         return NULL;
     }
 
+    raw_frame->mem_tag = obe_mem_alloc( sizeof(*raw_frame) );
+
     return raw_frame;
 }
 
+/* Shared raw frame
+ * The child references the parent's image and has a copy of its user data in its own arena. The parent's data is
+ * released with the last reference; its owner holds the first one (refcount starts at 1) */
+static void release_shared_data( void *ptr )
+{
+    obe_raw_frame_t *raw_frame = ptr;
+
+    obe_unref_raw_frame( raw_frame->shared_parent );
+    raw_frame->shared_parent = NULL;
+}
+
+obe_raw_frame_t *obe_share_raw_frame( obe_raw_frame_t *raw_frame )
+{
+    obe_raw_frame_t *child = new_raw_frame();
+    if( !child )
+        return NULL;
+
+    int mem_tag = child->mem_tag;
+    memcpy( child, raw_frame, sizeof(*child) );
+    child->mem_tag = mem_tag;
+    child->audio_frame.alloc_size = 0;
+    child->refcount = 0;
+    memset( &child->arena, 0, sizeof(child->arena) );
+    child->user_data = NULL;
+    child->num_user_data = child->max_user_data = 0;
+
+    for( int i = 0; i < raw_frame->num_user_data; i++ )
+    {
+        obe_user_data_t *user_data = obe_add_user_data( child, raw_frame->user_data[i].len );
+        if( !user_data )
+            goto fail;
+
+        uint8_t *data = user_data->data;
+        memcpy( user_data, &raw_frame->user_data[i], sizeof(*user_data) );
+        user_data->data = data;
+        memcpy( user_data->data, raw_frame->user_data[i].data, user_data->len );
+    }
+
+    __atomic_add_fetch( &raw_frame->refcount, 1, __ATOMIC_RELAXED );
+    child->shared_parent = raw_frame;
+    child->release_data = release_shared_data;
+    child->release_frame = obe_release_frame;
+
+    return child;
+
+fail:
+    syslog( LOG_ERR, "Malloc failed\n" );
+    obe_release_frame( child );
+    return NULL;
+}
+
+void obe_unref_raw_frame( obe_raw_frame_t *raw_frame )
+{
+    if( !__atomic_sub_fetch( &raw_frame->refcount, 1, __ATOMIC_ACQ_REL ) )
+    {
+        raw_frame->release_data( raw_frame );
+        raw_frame->release_frame( raw_frame );
+    }
+}
+
 /* Coded frame */
-obe_coded_frame_t *new_coded_frame( int output_stream_id, int len )
+/* Coded frames come from the coded frame pool and go back to it when destroyed */
+obe_coded_frame_t *new_coded_frame( obe_t *h, int output_stream_id, int len )
 {
-    obe_coded_frame_t *coded_frame = calloc( 1, sizeof(*coded_frame) );
+    obe_coded_frame_t *coded_frame = obe_pool_get_coded_frame( h->shared->coded_pool, len );
     if( !coded_frame )
         return NULL;
 
     coded_frame->output_stream_id = output_stream_id;
-    coded_frame->len = len;
-    coded_frame->data = malloc( len );
-    if( !coded_frame->data )
-    {
-        syslog( LOG_ERR, "Malloc failed\n" );
-        free( coded_frame );
-        return NULL;
-    }
 
     return coded_frame;
 }
 
 void destroy_coded_frame( obe_coded_frame_t *coded_frame )
 {
-    free( coded_frame->data );
-    free( coded_frame );
+    obe_pool_put_coded_frame( coded_frame );
 }
 
+/* Video planes always come from the frame pool */
 void obe_release_video_data( void *ptr )
 {
      obe_raw_frame_t *raw_frame = ptr;
-     av_freep( &raw_frame->alloc_img.plane[0] );
+     if( raw_frame->alloc_img.plane[0] )
+         obe_pool_unref_image( raw_frame->alloc_img.plane[0] );
+     raw_frame->alloc_img.plane[0] = NULL;
+}
+
+/* Sample buffers owned by the frame. num_samples and sample_fmt must be set */
+int obe_alloc_audio_data( obe_raw_frame_t *raw_frame, int num_channels )
+{
+    obe_audio_frame_t *audio_frame = &raw_frame->audio_frame;
+    int size = av_samples_alloc( audio_frame->audio_data, &audio_frame->linesize, num_channels,
+                                 audio_frame->num_samples, audio_frame->sample_fmt, 0 );
+    if( size < 0 )
+        return -1;
+
+    audio_frame->alloc_size = size;
+    obe_mem_alloc( size );
+
+    return 0;
 }
 
 void obe_release_audio_data( void *ptr )
 {
      obe_raw_frame_t *raw_frame = ptr;
+     obe_mem_free( raw_frame->mem_tag, raw_frame->audio_frame.alloc_size );
+     raw_frame->audio_frame.alloc_size = 0;
      av_freep( &raw_frame->audio_frame.audio_data[0] );
 }
 
 void obe_release_frame( void *ptr )
 {
      obe_raw_frame_t *raw_frame = ptr;
-     for( int i = 0; i < raw_frame->num_user_data; i++ )
-         free( raw_frame->user_data[i].data );
-     free( raw_frame->user_data );
+     obe_arena_free( &raw_frame->arena );
+     obe_mem_free( raw_frame->mem_tag, sizeof(*raw_frame) );
      free( raw_frame );
 }
 
 /* Muxed data */
-obe_muxed_data_t *new_muxed_data( int len )
+/* A page is one block from the coded frame pool: header, slice list, PCRs and packets,
+ * with headroom in front of the PCRs and packets for the previous page's tail */
+static int muxed_data_size( int len )
+{
+    int num_packets = len / 188 + TS_SLICE_PACKETS - 1;
+    int num_slices = num_packets / TS_SLICE_PACKETS + 1;
+
+    return sizeof(obe_muxed_data_t) + num_slices * sizeof(obe_ts_slice_t) + num_packets * ( sizeof(int64_t) + 188 );
+}
+
+obe_muxed_data_t *new_muxed_data( obe_t *h, int len )
 {
-    obe_muxed_data_t *muxed_data = calloc( 1, sizeof(*muxed_data) );
+    int num_slices = ( len / 188 + TS_SLICE_PACKETS - 1 ) / TS_SLICE_PACKETS + 1;
+    obe_muxed_data_t *muxed_data = obe_pool_get_block( h->shared->coded_pool, muxed_data_size( len ) );
     if( !muxed_data )
         return NULL;
 
     muxed_data->len = len;
-    muxed_data->data = malloc( len );
-    if( !muxed_data->data )
-    {
-        syslog( LOG_ERR, "Malloc failed\n" );
-        free( muxed_data );
-        return NULL;
-    }
+    muxed_data->refcount = 1;
+    muxed_data->num_slices = 0;
+    muxed_data->slices = (obe_ts_slice_t*)(muxed_data + 1);
+    muxed_data->pcr_list = (int64_t*)(muxed_data->slices + num_slices) + TS_SLICE_PACKETS - 1;
+    muxed_data->data = (uint8_t*)(muxed_data->pcr_list + len / 188) + ( TS_SLICE_PACKETS - 1 ) * 188;
 
     return muxed_data;
 }
 
-void destroy_muxed_data( obe_muxed_data_t *muxed_data )
+void obe_ref_muxed_data( obe_muxed_data_t *muxed_data )
 {
-    if( muxed_data->pcr_list )
-        free( muxed_data->pcr_list );
+    __atomic_add_fetch( &muxed_data->refcount, 1, __ATOMIC_RELAXED );
+}
 
-    free( muxed_data->data );
-    free( muxed_data );
+void destroy_muxed_data( obe_muxed_data_t *muxed_data )
+{
+    if( !__atomic_sub_fetch( &muxed_data->refcount, 1, __ATOMIC_ACQ_REL ) )
+        obe_pool_put_block( muxed_data );
 }
 
 /** Add/Remove misc **/
 void add_device( obe_t *h, obe_device_t *device )
 {
+    device->numa_node = obe_detect_numa_node( device );
+    if( device->numa_node >= 0 )
+        syslog( LOG_INFO, "Capture card is on NUMA node %i\n", device->numa_node );
+
     pthread_mutex_lock( &h->device_list_mutex );
     h->devices[h->num_devices++] = device;
     pthread_mutex_unlock( &h->device_list_mutex );
 }
 
 /** Add/Remove from queues */
-void obe_init_queue( obe_queue_t *queue )
+static void queue_futex_wait( int *addr, int val )
 {
+    syscall( SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0 );
+}
+
+static void queue_futex_wake( int *addr )
+{
+    syscall( SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0 );
+}
+
+/* Only enter the kernel if the consumer is parked (or when forced) */
+static void spsc_wake( obe_queue_t *queue, int force )
+{
+    __atomic_thread_fence( __ATOMIC_SEQ_CST );
+    if( force || __atomic_load_n( &queue->consumer_parked, __ATOMIC_RELAXED ) )
+    {
+        __atomic_add_fetch( &queue->wake_seq, 1, __ATOMIC_RELEASE );
+        queue_futex_wake( &queue->wake_seq );
+    }
+}
+
+int obe_init_queue( obe_queue_t *queue, int capacity, int spsc )
+{
+    int size = 1;
+
+    while( size < capacity )
+        size <<= 1;
+
+    queue->queue = calloc( size, sizeof(*queue->queue) );
+    if( !queue->queue )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return -1;
+    }
+    queue->capacity = size;
+    queue->head = queue->size = queue->tail = 0;
+    queue->spsc = spsc;
+    queue->consumer_parked = queue->wake_seq = 0;
+    queue->high_water = size;
+    queue->shed_policy = OBE_SHED_DROP_NEWEST;
+    queue->drop_item = NULL;
+    queue->num_shed = NULL;
+
     pthread_mutex_init( &queue->mutex, NULL );
     pthread_cond_init( &queue->in_cv, NULL );
     pthread_cond_init( &queue->out_cv, NULL );
+
+    return 0;
 }
 
 void obe_destroy_queue( obe_queue_t *queue )
 {
     free( queue->queue );
+    queue->queue = NULL;
+    queue->capacity = queue->head = queue->size = 0;
 
     pthread_mutex_unlock( &queue->mutex );
     pthread_mutex_destroy( &queue->mutex );
@@ -180,19 +331,143 @@ void obe_destroy_queue( obe_queue_t *queue )
     pthread_cond_destroy( &queue->out_cv );
 }
 
-int add_to_queue( obe_queue_t *queue, void *item )
+/* Remove the i-th oldest item, moving whichever side of the ring is shorter. The queue mutex must be held */
+static void remove_queue_index( obe_queue_t *queue, int i )
 {
-    void **tmp;
+    if( i < queue->size / 2 )
+    {
+        for( int j = i; j > 0; j-- )
+            QUEUE_ITEM( queue, j ) = QUEUE_ITEM( queue, j-1 );
+        queue->head = (queue->head + 1) & (queue->capacity - 1);
+    }
+    else
+    {
+        for( int j = i; j < queue->size - 1; j++ )
+            QUEUE_ITEM( queue, j ) = QUEUE_ITEM( queue, j+1 );
+    }
+
+    queue->size--;
+}
+
+/* Wait until the queue holds more than num_items items.
+ * Returns the number of items or -1 if *cancel was set */
+int obe_queue_wait( obe_queue_t *queue, int num_items, int *cancel )
+{
+    int size, seq;
+
+    if( queue->spsc )
+    {
+        while( 1 )
+        {
+            seq = __atomic_load_n( &queue->wake_seq, __ATOMIC_ACQUIRE );
+            size = __atomic_load_n( &queue->size, __ATOMIC_ACQUIRE );
+            if( size > num_items || __atomic_load_n( cancel, __ATOMIC_ACQUIRE ) )
+                break;
+
+            /* Recheck after parking so a concurrent push either sees us parked or we see its item */
+            __atomic_store_n( &queue->consumer_parked, 1, __ATOMIC_RELAXED );
+            __atomic_thread_fence( __ATOMIC_SEQ_CST );
+            size = __atomic_load_n( &queue->size, __ATOMIC_ACQUIRE );
+            if( size <= num_items && !__atomic_load_n( cancel, __ATOMIC_ACQUIRE ) )
+                queue_futex_wait( &queue->wake_seq, seq );
+            __atomic_store_n( &queue->consumer_parked, 0, __ATOMIC_RELAXED );
+        }
+
+        return __atomic_load_n( cancel, __ATOMIC_ACQUIRE ) ? -1 : size;
+    }
 
     pthread_mutex_lock( &queue->mutex );
-    tmp = realloc( queue->queue, sizeof(*queue->queue) * (queue->size+1) );
-    if( !tmp )
+    while( queue->size <= num_items && !*cancel )
+        pthread_cond_wait( &queue->in_cv, &queue->mutex );
+
+    size = *cancel ? -1 : queue->size;
+    pthread_mutex_unlock( &queue->mutex );
+
+    return size;
+}
+
+/* Set the consumer's cancel flag and wake it up */
+void obe_queue_cancel( obe_queue_t *queue, int *cancel )
+{
+    pthread_mutex_lock( &queue->mutex );
+    __atomic_store_n( cancel, 1, __ATOMIC_RELEASE );
+    pthread_cond_signal( &queue->in_cv );
+    pthread_mutex_unlock( &queue->mutex );
+
+    if( queue->spsc )
+        spsc_wake( queue, 1 );
+}
+
+void obe_set_queue_shedding( obe_queue_t *queue, int high_water, int shed_policy, void (*drop_item)( void *item ), int64_t *num_shed )
+{
+    queue->high_water = high_water > 0 ? MIN( high_water, queue->capacity ) : queue->capacity;
+    queue->shed_policy = shed_policy;
+    queue->drop_item = drop_item;
+    queue->num_shed = num_shed;
+}
+
+int obe_queue_above_high_water( obe_queue_t *queue )
+{
+    return __atomic_load_n( &queue->size, __ATOMIC_ACQUIRE ) >= queue->high_water;
+}
+
+void obe_queue_count_shed( obe_queue_t *queue, int num_items )
+{
+    int64_t total = num_items;
+
+    if( queue->num_shed )
+        total = __atomic_add_fetch( queue->num_shed, num_items, __ATOMIC_RELAXED );
+
+    /* Don't flood the log while overloaded */
+    if( total == num_items || total / 100 != (total - num_items) / 100 )
+        syslog( LOG_WARNING, "Overloaded queue shed %i items (%"PRIi64" in total)\n", num_items, total );
+}
+
+/* Limit the producer may fill the queue to */
+static int queue_limit( obe_queue_t *queue )
+{
+    return queue->drop_item && queue->shed_policy == OBE_SHED_DROP_NEWEST ? queue->high_water : queue->capacity;
+}
+
+static int shed_newest( obe_queue_t *queue, void *item )
+{
+    if( !queue->drop_item )
     {
-        syslog( LOG_ERR, "Malloc failed\n" );
+        syslog( LOG_ERR, "Queue full (%i items)\n", queue->capacity );
         return -1;
     }
-    queue->queue = tmp;
-    queue->queue[queue->size++] = item;
+
+    queue->drop_item( item );
+    obe_queue_count_shed( queue, 1 );
+
+    return 0;
+}
+
+/* Returns 0 if the item was queued or shed and -1 if the queue is full and has no drop_item */
+int add_to_queue( obe_queue_t *queue, void *item )
+{
+    if( queue->spsc )
+    {
+        if( __atomic_load_n( &queue->size, __ATOMIC_ACQUIRE ) >= queue_limit( queue ) )
+            return shed_newest( queue, item );
+
+        queue->queue[queue->tail] = item;
+        queue->tail = (queue->tail + 1) & (queue->capacity - 1);
+        __atomic_add_fetch( &queue->size, 1, __ATOMIC_RELEASE );
+        spsc_wake( queue, 0 );
+
+        return 0;
+    }
+
+    pthread_mutex_lock( &queue->mutex );
+    if( queue->size >= queue_limit( queue ) )
+    {
+        pthread_mutex_unlock( &queue->mutex );
+        return shed_newest( queue, item );
+    }
+
+    QUEUE_ITEM( queue, queue->size ) = item;
+    queue->size++;
 
     pthread_cond_signal( &queue->in_cv );
     pthread_mutex_unlock( &queue->mutex );
@@ -202,19 +477,20 @@ int add_to_queue( obe_queue_t *queue, void *item )
 
 int remove_from_queue( obe_queue_t *queue )
 {
-    void **tmp;
+    if( queue->spsc )
+    {
+        /* The slot may be reused by the producer as soon as size drops */
+        queue->head = (queue->head + 1) & (queue->capacity - 1);
+        __atomic_sub_fetch( &queue->size, 1, __ATOMIC_RELEASE );
+        return 0;
+    }
 
     pthread_mutex_lock( &queue->mutex );
-    if( queue->size > 1 )
-        memmove( &queue->queue[0], &queue->queue[1], sizeof(*queue->queue) * (queue->size-1) );
-    tmp = realloc( queue->queue, sizeof(*queue->queue) * (queue->size-1) );
-    queue->size--;
-    if( !tmp && queue->size )
+    if( queue->size )
     {
-        syslog( LOG_ERR, "Malloc failed\n" );
-        return -1;
+        queue->head = (queue->head + 1) & (queue->capacity - 1);
+        queue->size--;
     }
-    queue->queue = tmp;
 
     pthread_cond_signal( &queue->out_cv );
     pthread_mutex_unlock( &queue->mutex );
@@ -222,24 +498,65 @@ int remove_from_queue( obe_queue_t *queue )
     return 0;
 }
 
-int remove_item_from_queue( obe_queue_t *queue, void *item )
+/* Called by the consumer: with OBE_SHED_DROP_OLDEST drop the oldest items above the high-water mark.
+ * Returns the number of items dropped */
+int obe_queue_shed( obe_queue_t *queue )
+{
+    int num_shed = 0;
+
+    if( queue->shed_policy != OBE_SHED_DROP_OLDEST || !queue->drop_item )
+        return 0;
+
+    while( __atomic_load_n( &queue->size, __ATOMIC_ACQUIRE ) > queue->high_water )
+    {
+        queue->drop_item( QUEUE_ITEM( queue, 0 ) );
+        remove_from_queue( queue );
+        num_shed++;
+    }
+
+    if( num_shed )
+        obe_queue_count_shed( queue, num_shed );
+
+    return num_shed;
+}
+
+/* Move every pending item into batch, which must hold queue->capacity items.
+ * Returns the number of items taken */
+int obe_queue_drain( obe_queue_t *queue, void **batch )
 {
-    void **tmp;
+    int size, first;
+
+    if( !queue->spsc )
+        pthread_mutex_lock( &queue->mutex );
 
+    size = queue->spsc ? __atomic_load_n( &queue->size, __ATOMIC_ACQUIRE ) : queue->size;
+
+    /* At most two copies because the ring may wrap */
+    first = MIN( size, queue->capacity - queue->head );
+    memcpy( batch, &queue->queue[queue->head], first * sizeof(*batch) );
+    memcpy( &batch[first], queue->queue, (size - first) * sizeof(*batch) );
+    queue->head = (queue->head + size) & (queue->capacity - 1);
+
+    if( queue->spsc )
+        __atomic_sub_fetch( &queue->size, size, __ATOMIC_RELEASE );
+    else
+    {
+        queue->size = 0;
+        pthread_cond_signal( &queue->out_cv );
+        pthread_mutex_unlock( &queue->mutex );
+    }
+
+    return size;
+}
+
+int remove_item_from_queue( obe_queue_t *queue, void *item )
+{
     pthread_mutex_lock( &queue->mutex );
     for( int i = 0; i < queue->size; i++ )
     {
-        if( queue->queue[i] == item )
+        if( QUEUE_ITEM( queue, i ) == item )
         {
-            memmove( &queue->queue[i], &queue->queue[i+1], sizeof(*queue->queue) * (queue->size-1-i) );
-            tmp = realloc( queue->queue, sizeof(*queue->queue) * (queue->size-1) );
-            queue->size--;
-            if( !tmp && queue->size )
-            {
-                syslog( LOG_ERR, "Malloc failed\n" );
-                return -1;
-            }
-            queue->queue = tmp;
+            remove_queue_index( queue, i );
             break;
         }
     }
@@ -253,24 +570,35 @@ int remove_item_from_queue( obe_queue_t *queue, void *item )
 /* Filter queue */
 int add_to_filter_queue( obe_t *h, obe_raw_frame_t *raw_frame )
 {
-    obe_filter_t *filter = NULL;
+    obe_graph_t *graph = &h->graph;
+    obe_graph_edge_t *edge;
+    int id = raw_frame->input_stream_id;
+
+    if( id < 0 || id >= graph->num_input_ids || graph->filter_edges[id] < 0 )
+        return -1;
 
+    edge = &graph->edges[graph->filter_edges[id]];
+    __atomic_add_fetch( &edge->num_items, 1, __ATOMIC_RELAXED );
+
+    return add_to_queue( graph->nodes[edge->dst].queue, raw_frame );
+}
+
+/* Unpaced replay waits for the raw frame queues to drain to half their high-water mark so that nothing is shed */
+int obe_pipeline_full( obe_t *h )
+{
     for( int i = 0; i < h->num_filters; i++ )
     {
-        for( int j = 0; j < h->filters[i]->num_stream_ids; j++ )
-        {
-            if( h->filters[i]->stream_id_list[j] == raw_frame->input_stream_id )
-            {
-                filter = h->filters[i];
-                break;
-            }
-        }
+        if( __atomic_load_n( &h->filters[i]->queue.size, __ATOMIC_ACQUIRE ) * 2 >= h->filters[i]->queue.high_water )
+            return 1;
     }
 
-    if( !filter )
-        return -1;
+    for( int i = 0; i < h->num_encoders; i++ )
+    {
+        if( __atomic_load_n( &h->encoders[i]->queue.size, __ATOMIC_ACQUIRE ) * 2 >= h->encoders[i]->queue.high_water )
+            return 1;
+    }
 
-    return add_to_queue( &filter->queue, raw_frame );
+    return 0;
 }
 
 static void destroy_filter( obe_filter_t *filter )
@@ -279,7 +607,7 @@ static void destroy_filter( obe_filter_t *filter )
     pthread_mutex_lock( &filter->queue.mutex );
     for( int i = 0; i < filter->queue.size; i++ )
     {
-        raw_frame = filter->queue.queue[i];
+        raw_frame = QUEUE_ITEM( &filter->queue, i );
         raw_frame->release_data( raw_frame );
         raw_frame->release_frame( raw_frame );
     }
@@ -293,21 +621,16 @@ static void destroy_filter( obe_filter_t *filter )
 /* Encode queue */
 int add_to_encode_queue( obe_t *h, obe_raw_frame_t *raw_frame, int output_stream_id )
 {
-    obe_encoder_t *encoder = NULL;
+    obe_graph_t *graph = &h->graph;
+    obe_graph_edge_t *edge;
 
-    for( int i = 0; i < h->num_encoders; i++ )
-    {
-        if( h->encoders[i]->output_stream_id == output_stream_id )
-        {
-            encoder = h->encoders[i];
-            break;
-        }
-    }
-
-    if( !encoder )
+    if( output_stream_id < 0 || output_stream_id >= graph->num_output_ids || graph->encoder_edges[output_stream_id] < 0 )
         return -1;
 
-    return add_to_queue( &encoder->queue, raw_frame );
+    edge = &graph->edges[graph->encoder_edges[output_stream_id]];
+    __atomic_add_fetch( &edge->num_items, 1, __ATOMIC_RELAXED );
+
+    return add_to_queue( graph->nodes[edge->dst].queue, raw_frame );
 }
 
 static void destroy_encoder( obe_encoder_t *encoder )
@@ -316,7 +639,7 @@ static void destroy_encoder( obe_encoder_t *encoder )
     pthread_mutex_lock( &encoder->queue.mutex );
     for( int i = 0; i < encoder->queue.size; i++ )
     {
-        raw_frame = encoder->queue.queue[i];
+        raw_frame = QUEUE_ITEM( &encoder->queue, i );
         raw_frame->release_data( raw_frame );
         raw_frame->release_frame( raw_frame );
     }
@@ -335,7 +658,7 @@ static void destroy_enc_smoothing( obe_queue_t *queue )
     pthread_mutex_lock( &queue->mutex );
     for( int i = 0; i < queue->size; i++ )
     {
-        coded_frame = queue->queue[i];
+        coded_frame = QUEUE_ITEM( queue, i );
         destroy_coded_frame( coded_frame );
     }
 
@@ -346,7 +669,7 @@ static void destroy_mux( obe_t *h )
 {
     pthread_mutex_lock( &h->mux_queue.mutex );
     for( int i = 0; i < h->mux_queue.size; i++ )
-        destroy_coded_frame( h->mux_queue.queue[i] );
+        destroy_coded_frame( QUEUE_ITEM( &h->mux_queue, i ) );
 
     obe_destroy_queue( &h->mux_queue );
 
@@ -362,7 +685,7 @@ static void destroy_mux_smoothing( obe_queue_t *queue )
     pthread_mutex_lock( &queue->mutex );
     for( int i = 0; i < queue->size; i++ )
     {
-        muxed_data = queue->queue[i];
+        muxed_data = QUEUE_ITEM( queue, i );
         destroy_muxed_data( muxed_data );
     }
 
@@ -371,35 +694,150 @@ static void destroy_mux_smoothing( obe_queue_t *queue )
 
 int remove_early_frames( obe_t *h, int64_t pts )
 {
-    void **tmp;
     for( int i = 0; i < h->mux_queue.size; i++ )
     {
-        obe_coded_frame_t *frame = h->mux_queue.queue[i];
+        obe_coded_frame_t *frame = QUEUE_ITEM( &h->mux_queue, i );
         if( !frame->is_video && frame->pts < pts )
         {
             destroy_coded_frame( frame );
-            memmove( &h->mux_queue.queue[i], &h->mux_queue.queue[i+1], sizeof(*h->mux_queue.queue) * (h->mux_queue.size-1-i) );
-            tmp = realloc( h->mux_queue.queue, sizeof(*h->mux_queue.queue) * (h->mux_queue.size-1) );
-            h->mux_queue.size--;
+            remove_queue_index( &h->mux_queue, i );
             i--;
-            if( !tmp && h->mux_queue.size )
-            {
-                syslog( LOG_ERR, "Malloc failed\n" );
-                return -1;
-            }
-            h->mux_queue.queue = tmp;
         }
     }
 
     return 0;
 }
 
+/* Overload shedding */
+static void drop_raw_frame( void *item )
+{
+    obe_raw_frame_t *raw_frame = item;
+    raw_frame->release_data( raw_frame );
+    raw_frame->release_frame( raw_frame );
+}
+
+static void drop_coded_frame( void *item )
+{
+    destroy_coded_frame( item );
+}
+
+static void drop_muxed_data( void *item )
+{
+    destroy_muxed_data( item );
+}
+
+static void drop_ts_slice( void *item )
+{
+    obe_ts_slice_t *slice = item;
+    destroy_muxed_data( slice->page );
+}
+
+static void setup_shedding( obe_t *h, int stage, obe_queue_t *queue, void (*drop_item)( void *item ), int default_high_water )
+{
+    int high_water = h->high_water[stage] ? h->high_water[stage] : default_high_water;
+
+    obe_set_queue_shedding( queue, high_water, h->shed_policy[stage], drop_item, &h->num_shed[stage] );
+}
+
+/* Pool warm-up. A queue left at its default high-water mark is only expected to hold a few items */
+#define RESERVE_QUEUE_ITEMS 4
+
+static int queue_reserve( obe_t *h, int stage, int capacity )
+{
+    return h->high_water[stage] ? MIN( h->high_water[stage], capacity ) : RESERVE_QUEUE_ITEMS;
+}
+
+/* Roughly the number of pictures x264 holds before returning the first one */
+static int x264_delayed_frames( x264_param_t *param )
+{
+    int threads = param->i_threads > 0 ? param->i_threads : sysconf( _SC_NPROCESSORS_ONLN ) * 3 / 2;
+
+    return param->i_bframe + param->rc.i_lookahead + MAX( param->i_sync_lookahead, 0 ) + ( param->b_sliced_threads ? 1 : threads );
+}
+
+/* Preallocate and prefault coded frames and TS pages sized from the rate control and mux settings.
+ * Returns the number of raw video frames the input should reserve, and in num_filtered_frames
+ * the number each video filter rung should reserve */
+static int reserve_pools( obe_t *h, int *num_filtered_frames )
+{
+    obe_coded_pool_t *coded_pool = h->shared->coded_pool;
+    obe_int_input_stream_t *input_stream;
+    int num_coded_frames = 0, page_size = 0, failed = 0;
+
+    *num_filtered_frames = 0;
+
+    for( int i = 0; i < h->num_output_streams; i++ )
+    {
+        obe_output_stream_t *stream = &h->output_streams[i];
+        if( stream->stream_action != STREAM_ENCODE || stream->stream_format != VIDEO_AVC )
+            continue;
+
+        x264_param_t *param = &stream->avc_param;
+        /* Filtered frames wait in the encoder queue and then inside x264 */
+        int filtered_frames = queue_reserve( h, OBE_STAGE_VIDEO_ENCODER, FRAME_QUEUE_CAPACITY ) + x264_delayed_frames( param );
+        *num_filtered_frames = MAX( *num_filtered_frames, filtered_frames );
+
+        if( param->rc.i_vbv_max_bitrate <= 0 || !param->i_fps_num || !param->i_fps_den )
+            continue;
+
+        /* Coded frames wait in encoder smoothing for up to the duration of the VBV buffer */
+        int64_t rate = (int64_t)param->rc.i_vbv_max_bitrate * param->i_fps_den;
+        int coded_frames = ( (int64_t)param->rc.i_vbv_buffer_size * param->i_fps_num + rate - 1 ) / rate +
+                           queue_reserve( h, OBE_STAGE_MUX, FRAME_QUEUE_CAPACITY );
+        int frame_size = (int64_t)param->rc.i_vbv_max_bitrate * 125 * param->i_fps_den / param->i_fps_num;
+        num_coded_frames = MAX( num_coded_frames, coded_frames );
+
+        failed |= obe_pool_reserve_blocks( coded_pool, 2 * frame_size, coded_frames ) < 0;
+        /* A couple of frames as large as the VBV buffer for IDRs */
+        failed |= obe_pool_reserve_blocks( coded_pool, param->rc.i_vbv_buffer_size * 125, 2 ) < 0;
+
+        /* The muxer writes about a frame's worth of the mux rate into each page */
+        page_size = MAX( page_size, (int64_t)h->mux_opts.ts_muxrate * param->i_fps_den / ( 8 * param->i_fps_num ) );
+    }
+
+    /* An audio PES lasts at least as long as a video frame so this many are plenty */
+    for( int i = 0; i < h->num_output_streams; i++ )
+    {
+        obe_output_stream_t *stream = &h->output_streams[i];
+        if( stream->stream_action != STREAM_ENCODE || stream->stream_format == VIDEO_AVC )
+            continue;
+
+        /* Same sizes as the audio encoders ask for */
+        if( stream->stream_format == AUDIO_MP2 )
+        {
+            input_stream = get_input_stream( h, stream->input_stream_id );
+            if( input_stream && input_stream->sample_rate )
+                failed |= obe_pool_reserve_blocks( coded_pool, stream->ts_opts.frames_per_pes * ( MP2_NUM_SAMPLES * 125 * stream->bitrate /
+                                                   input_stream->sample_rate + 1 ), num_coded_frames ) < 0;
+        }
+        else if( stream->stream_format == AUDIO_AC_3 || stream->stream_format == AUDIO_E_AC_3 || stream->stream_format == AUDIO_AAC )
+            failed |= obe_pool_reserve_blocks( coded_pool, stream->ts_opts.frames_per_pes * FF_MIN_BUFFER_SIZE, num_coded_frames ) < 0;
+    }
+
+    /* Pages are held by mux smoothing and then by the outputs as slices */
+    if( page_size )
+    {
+        failed |= obe_pool_reserve_blocks( coded_pool, muxed_data_size( FFALIGN( page_size, 188 ) ), num_coded_frames +
+                                           queue_reserve( h, OBE_STAGE_MUX_SMOOTHING, MUXED_QUEUE_CAPACITY ) +
+                                           queue_reserve( h, OBE_STAGE_OUTPUT, MUXED_QUEUE_CAPACITY ) ) < 0;
+    }
+
+    if( failed )
+        syslog( LOG_WARNING, "Could not preallocate coded frame and TS page pools\n" );
+
+    /* Captured frames wait in the filter queue. One more for the one being filtered */
+    return queue_reserve( h, OBE_STAGE_VIDEO_FILTER, FRAME_QUEUE_CAPACITY ) + 1;
+}
+
 /* Output queue */
 static void destroy_output( obe_output_t *output )
 {
     pthread_mutex_lock( &output->queue.mutex );
     for( int i = 0; i < output->queue.size; i++ )
-        av_buffer_unref( output->queue.queue[i] );
+    {
+        obe_ts_slice_t *slice = QUEUE_ITEM( &output->queue, i );
+        destroy_muxed_data( slice->page );
+    }
 
     obe_destroy_queue( &output->queue );
     free( output );
@@ -409,6 +847,10 @@ static void destroy_output( obe_output_t *output )
 /* Input stream */
 obe_int_input_stream_t *get_input_stream( obe_t *h, int input_stream_id )
 {
+    /* Streams are only scanned before obe_start() */
+    if( h->graph.input_streams )
+        return input_stream_id >= 0 && input_stream_id < h->graph.num_input_ids ? h->graph.input_streams[input_stream_id] : NULL;
+
     for( int j = 0; j < h->devices[0]->num_input_streams; j++ )
     {
         if( h->devices[0]->streams[j]->input_stream_id == input_stream_id )
@@ -420,17 +862,18 @@ obe_int_input_stream_t *get_input_stream( obe_t *h, int input_stream_id )
 /* Encoder */
 obe_encoder_t *get_encoder( obe_t *h, int output_stream_id )
 {
-    for( int i = 0; i < h->num_encoders; i++ )
-    {
-        if( h->encoders[i]->output_stream_id == output_stream_id )
-            return h->encoders[i];
-    }
-    return NULL;
+    if( output_stream_id < 0 || output_stream_id >= h->graph.num_output_ids )
+        return NULL;
+
+    return h->graph.encoders[output_stream_id];
 }
 
 /* Output */
 obe_output_stream_t *get_output_stream( obe_t *h, int output_stream_id )
 {
+    if( h->graph.output_streams )
+        return output_stream_id >= 0 && output_stream_id < h->graph.num_output_ids ? h->graph.output_streams[output_stream_id] : NULL;
+
     for( int i = 0; i < h->num_output_streams; i++ )
     {
         if( h->output_streams[i].output_stream_id == output_stream_id )
@@ -449,6 +892,35 @@ obe_output_stream_t *get_output_stream_by_format( obe_t *h, int format )
     return NULL;
 }
 
+static obe_t *new_channel( obe_shared_t *shared )
+{
+    obe_t *h;
+
+    pthread_mutex_lock( &shared->mutex );
+    if( shared->num_channels == MAX_CHANNELS_PER_PROCESS )
+    {
+        pthread_mutex_unlock( &shared->mutex );
+        fprintf( stderr, "No more channels allowed \n" );
+        return NULL;
+    }
+
+    h = calloc( 1, sizeof(*h) );
+    if( !h )
+    {
+        pthread_mutex_unlock( &shared->mutex );
+        fprintf( stderr, "Malloc failed\n" );
+        return NULL;
+    }
+
+    h->shared = shared;
+    shared->channels[shared->num_channels++] = h;
+    pthread_mutex_unlock( &shared->mutex );
+
+    pthread_mutex_init( &h->device_list_mutex, NULL );
+
+    return h;
+}
+
 obe_t *obe_setup( void )
 {
     openlog( "obe", LOG_NDELAY | LOG_PID, LOG_USER );
@@ -459,22 +931,61 @@ obe_t *obe_setup( void )
         return NULL;
     }
 
-    obe_t *h = calloc( 1, sizeof(*h) );
-    if( !h )
+    obe_shared_t *shared = calloc( 1, sizeof(*shared) );
+    if( !shared )
     {
         fprintf( stderr, "Malloc failed\n" );
         return NULL;
     }
 
-    pthread_mutex_init( &h->device_list_mutex, NULL );
+    pthread_mutex_init( &shared->mutex, NULL );
+
+    shared->frame_pool = obe_new_frame_pool();
+    shared->coded_pool = obe_new_coded_pool();
+    if( !shared->frame_pool || !shared->coded_pool )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        goto fail;
+    }
+
+    obe_t *h = new_channel( shared );
+    if( !h )
+        goto fail;
+
+    obe_default_rt_profile( &h->rt_opts );
+    h->shed_policy[OBE_STAGE_VIDEO_FILTER] = OBE_SHED_DROP_OLDEST;
+    h->shed_policy[OBE_STAGE_VIDEO_ENCODER] = OBE_SHED_DROP_OLDEST;
 
     if( av_lockmgr_register( obe_lavc_lockmgr ) < 0 )
     {
         fprintf( stderr, "Could not register lavc lock manager\n" );
         free( h );
-        return NULL;
+        goto fail;
     }
 
+    return h;
+
+fail:
+    if( shared->frame_pool )
+        obe_destroy_frame_pool( shared->frame_pool );
+    if( shared->coded_pool )
+        obe_destroy_coded_pool( shared->coded_pool );
+    free( shared );
+
+    return NULL;
+}
+
+obe_t *obe_setup_channel( obe_t *parent )
+{
+    obe_t *h = new_channel( parent->shared );
+    if( !h )
+        return NULL;
+
+    h->obe_system = parent->obe_system;
+    memcpy( &h->rt_opts, &parent->rt_opts, sizeof(h->rt_opts) );
+    memcpy( h->shed_policy, parent->shed_policy, sizeof(h->shed_policy) );
+    memcpy( h->high_water, parent->high_water, sizeof(h->high_water) );
+
     return h;
 }
 
@@ -491,52 +1002,94 @@ int obe_set_config( obe_t *h, int system_type )
     return 0;
 }
 
-/* TODO handle error conditions */
-int64_t get_wallclock_in_mpeg_ticks( void )
+int obe_set_stage_affinity( obe_t *h, int stage, const char *cpu_list )
 {
-    struct timespec ts;
-    clock_gettime( CLOCK_MONOTONIC, &ts );
+    if( stage < OBE_STAGE_INPUT || stage >= OBE_NUM_STAGES )
+    {
+        fprintf( stderr, "Invalid pipeline stage\n" );
+        return -1;
+    }
+
+    if( obe_check_cpu_list( cpu_list ) < 0 )
+    {
+        fprintf( stderr, "Invalid cpu list \"%s\"\n", cpu_list );
+        return -1;
+    }
 
-    return ((int64_t)ts.tv_sec * (int64_t)27000000) + (int64_t)(ts.tv_nsec * 27 / 1000);
+    char *new_cpus = strdup( cpu_list );
+    if( !new_cpus )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return -1;
+    }
+
+    /* Other channels read the cpu lists to work out the unreserved cpus */
+    pthread_mutex_lock( &h->shared->mutex );
+    free( h->stage_cpus[stage] );
+    h->stage_cpus[stage] = new_cpus;
+    pthread_mutex_unlock( &h->shared->mutex );
+
+    return 0;
 }
 
-void sleep_mpeg_ticks( int64_t i_time )
+int obe_set_rt_profile( obe_t *h, obe_rt_opts_t *rt_opts )
 {
-    struct timespec ts;
-    ts.tv_sec = i_time / 27000000;
-    ts.tv_nsec = ((i_time % 27000000) * 1000) / 27;
+    for( int i = 0; i < OBE_NUM_STAGES; i++ )
+    {
+        if( rt_opts->priority[i] < 0 || rt_opts->priority[i] > 99 )
+        {
+            fprintf( stderr, "Invalid real-time priority\n" );
+            return -1;
+        }
+    }
+
+    if( rt_opts->heap_reserve < 0 )
+    {
+        fprintf( stderr, "Invalid heap reserve\n" );
+        return -1;
+    }
+
+    memcpy( &h->rt_opts, rt_opts, sizeof(*rt_opts) );
 
-    clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, &ts );
+    return 0;
 }
 
-void obe_clock_tick( obe_t *h, int64_t value )
+void obe_get_rt_profile( obe_t *h, obe_rt_opts_t *rt_opts )
 {
-    /* Use this signal as the SDI clocksource */
-    pthread_mutex_lock( &h->obe_clock_mutex );
-    h->obe_clock_last_pts = value;
-    h->obe_clock_last_wallclock = get_wallclock_in_mpeg_ticks();
-    pthread_mutex_unlock( &h->obe_clock_mutex );
-    pthread_cond_broadcast( &h->obe_clock_cv );
+    memcpy( rt_opts, &h->rt_opts, sizeof(*rt_opts) );
 }
 
-int64_t get_input_clock_in_mpeg_ticks( obe_t *h )
+int obe_set_overload_policy( obe_t *h, int stage, int shed_policy, int high_water )
 {
-    int64_t value;
-    pthread_mutex_lock( &h->obe_clock_mutex );
-    value = h->obe_clock_last_pts + ( get_wallclock_in_mpeg_ticks() - h->obe_clock_last_wallclock );
-    pthread_mutex_unlock( &h->obe_clock_mutex );
+    int valid;
 
-    return value;
-}
+    if( stage <= OBE_STAGE_INPUT || stage >= OBE_NUM_STAGES || high_water < 0 )
+    {
+        fprintf( stderr, "Invalid overload stage or high-water mark\n" );
+        return -1;
+    }
 
-void sleep_input_clock( obe_t *h, int64_t i_time )
-{
-    int64_t wallclock_time;
-    pthread_mutex_lock( &h->obe_clock_mutex );
-    wallclock_time = ( i_time - h->obe_clock_last_pts ) + h->obe_clock_last_wallclock;
-    pthread_mutex_unlock( &h->obe_clock_mutex );
+    if( shed_policy == OBE_SHED_DROP_NEWEST )
+        valid = 1;
+    else if( shed_policy == OBE_SHED_DROP_OLDEST )
+        valid = stage == OBE_STAGE_VIDEO_FILTER || stage == OBE_STAGE_VIDEO_ENCODER;
+    else if( shed_policy == OBE_SHED_DROP_NON_REF )
+        valid = stage == OBE_STAGE_ENC_SMOOTHING || stage == OBE_STAGE_MUX;
+    else if( shed_policy == OBE_SHED_SPEEDCONTROL_RESET )
+        valid = stage == OBE_STAGE_VIDEO_ENCODER;
+    else
+        valid = 0;
 
-    sleep_mpeg_ticks( wallclock_time );
+    if( !valid )
+    {
+        fprintf( stderr, "Overload policy not supported by the %s stage\n", obe_stage_name( stage ) );
+        return -1;
+    }
+
+    h->shed_policy[stage] = shed_policy;
+    h->high_water[stage] = high_water;
+
+    return 0;
 }
 
 int get_non_display_location( int type )
@@ -575,13 +1128,252 @@ static int __pthread_join( pthread_t thread, void **retval )
     return -1;
 }
 
+/* Probe cache
+ * The last successful probe of each card is kept in the probe cache directory. A probe with the same
+ * input options takes its streams from there without opening the card, and the input flags its first
+ * frame as a format change and removes the cache if the signal no longer matches */
+#define PROBE_CACHE_VERSION 2
+
+static int probe_cache_path( obe_input_t *input_device, char *path, int len )
+{
+    const char *name;
+
+    /* Files, including Linsys buffer dumps, are quick to probe */
+    if( input_device->input_type == INPUT_DEVICE_DECKLINK )
+        name = "decklink";
+    else if( input_device->input_type == INPUT_DEVICE_LINSYS_SDI && !input_device->location )
+        name = "linsys";
+    else
+        return -1;
+
+    if( snprintf( path, len, "%s/%s-%i.probe", input_device->probe_cache, name, input_device->card_idx ) >= len )
+        return -1;
+
+    return 0;
+}
+
+/* The first frame only confirms the video format. The audio layout comes from the card options, but VBI,
+ * teletext and VANC services depend on what the signal carries, so a probe that found any is not cached */
+static int probe_cache_confirmable( obe_device_t *device )
+{
+    obe_int_input_stream_t *stream;
+
+    for( int i = 0; i < device->num_input_streams; i++ )
+    {
+        stream = device->streams[i];
+        if( stream->stream_type == STREAM_TYPE_MISC || stream->num_frame_data || stream->frame_data )
+            return 0;
+    }
+
+    return 1;
+}
+
+static void write_probe_cache( obe_input_t *input_device, obe_device_t *device )
+{
+    char path[PATH_MAX], tmp_path[PATH_MAX+4];
+    obe_int_input_stream_t *stream;
+    FILE *fp;
+    int err;
+
+    if( !input_device->probe_cache || probe_cache_path( input_device, path, sizeof(path) ) < 0 )
+        return;
+
+    /* Whatever was cached before is stale now */
+    if( !probe_cache_confirmable( device ) )
+    {
+        unlink( path );
+        return;
+    }
+
+    snprintf( tmp_path, sizeof(tmp_path), "%s.tmp", path );
+    fp = fopen( tmp_path, "w" );
+    if( !fp )
+    {
+        fprintf( stderr, "Could not write probe cache \"%s\": %s\n", tmp_path, strerror( errno ) );
+        return;
+    }
+
+    fprintf( fp, "obe-probe %i\n", PROBE_CACHE_VERSION );
+    fprintf( fp, "input %i %i %i %i %i\n", input_device->input_type, input_device->card_idx, input_device->video_format,
+             input_device->video_connection, input_device->audio_connection );
+    fprintf( fp, "streams %i\n", device->num_input_streams );
+
+    for( int i = 0; i < device->num_input_streams; i++ )
+    {
+        stream = device->streams[i];
+        fprintf( fp, "stream %i %i %i %i %i %i %i %i %i %i %i %i %i %i\n", stream->stream_type, stream->stream_format,
+                 stream->csp, stream->width, stream->height, stream->sar_num, stream->sar_den, stream->interlaced, stream->tff,
+                 stream->timebase_num, stream->timebase_den, stream->num_channels, stream->sample_format, stream->sample_rate );
+    }
+
+    err = ferror( fp );
+    if( fclose( fp ) || err || rename( tmp_path, path ) < 0 )
+    {
+        fprintf( stderr, "Could not write probe cache \"%s\"\n", path );
+        unlink( tmp_path );
+        return;
+    }
+
+    device->probe_cache_file = strdup( path );
+}
+
+/* Called by the input when its first frame does not match the probed format, so the next probe opens the card */
+void remove_probe_cache( obe_device_t *device )
+{
+    if( device->probe_cache_file && unlink( device->probe_cache_file ) < 0 && errno != ENOENT )
+        syslog( LOG_WARNING, "Could not remove probe cache \"%s\": %s\n", device->probe_cache_file, strerror( errno ) );
+}
+
+static obe_device_t *read_probe_cache( obe_t *h, obe_input_t *input_device )
+{
+    char path[PATH_MAX];
+    obe_device_t *device = NULL;
+    obe_int_input_stream_t *stream;
+    FILE *fp;
+    int version, input_type, card_idx, video_format, video_connection, audio_connection, num_streams;
+
+    if( !input_device->probe_cache || probe_cache_path( input_device, path, sizeof(path) ) < 0 )
+        return NULL;
+
+    /* Nothing cached yet */
+    fp = fopen( path, "r" );
+    if( !fp )
+        return NULL;
+
+    if( fscanf( fp, "obe-probe %i ", &version ) != 1 || version != PROBE_CACHE_VERSION ||
+        fscanf( fp, "input %i %i %i %i %i ", &input_type, &card_idx, &video_format, &video_connection, &audio_connection ) != 5 ||
+        fscanf( fp, "streams %i ", &num_streams ) != 1 || num_streams < 1 || num_streams > MAX_STREAMS )
+        goto fail;
+
+    if( input_type != input_device->input_type || card_idx != input_device->card_idx || video_format != input_device->video_format ||
+        video_connection != input_device->video_connection || audio_connection != input_device->audio_connection )
+    {
+        fclose( fp );
+        return NULL;
+    }
+
+    device = new_device();
+    if( !device )
+        goto fail;
+
+    for( int i = 0; i < num_streams; i++ )
+    {
+        stream = calloc( 1, sizeof(*stream) );
+        if( !stream )
+            goto fail;
+        device->streams[device->num_input_streams++] = stream;
+
+        if( fscanf( fp, "stream %i %i %i %i %i %i %i %i %i %i %i %i %i %i ", &stream->stream_type, &stream->stream_format,
+                    &stream->csp, &stream->width, &stream->height, &stream->sar_num, &stream->sar_den, &stream->interlaced, &stream->tff,
+                    &stream->timebase_num, &stream->timebase_den, &stream->num_channels, &stream->sample_format, &stream->sample_rate ) != 14 )
+            goto fail;
+    }
+
+    fclose( fp );
+
+    pthread_mutex_lock( &h->device_list_mutex );
+    for( int i = 0; i < device->num_input_streams; i++ )
+        device->streams[i]->input_stream_id = h->cur_input_stream_id++;
+    pthread_mutex_unlock( &h->device_list_mutex );
+
+    device->device_type = input_device->input_type;
+    memcpy( &device->user_opts, input_device, sizeof(*input_device) );
+    device->user_opts.location = NULL;
+    device->probe_cache_file = strdup( path );
+
+    return device;
+
+fail:
+    fprintf( stderr, "Invalid probe cache \"%s\", probing \n", path );
+    fclose( fp );
+    if( device )
+        destroy_device( device );
+
+    return NULL;
+}
+
+/* Wakes up obe_probe_device as soon as the input has finished probing */
+typedef struct
+{
+    void* (*probe_input)( void *ptr );
+    obe_input_probe_t *args;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cv;
+    int done;
+} obe_probe_wait_t;
+
+static void *probe_thread( void *ptr )
+{
+    obe_probe_wait_t *probe_wait = ptr;
+
+    probe_wait->probe_input( probe_wait->args );
+
+    pthread_mutex_lock( &probe_wait->mutex );
+    probe_wait->done = 1;
+    pthread_cond_signal( &probe_wait->cv );
+    pthread_mutex_unlock( &probe_wait->mutex );
+
+    return NULL;
+}
+
+static int copy_probed_streams( obe_device_t *device, obe_input_program_t *program )
+{
+    obe_int_input_stream_t *stream_in;
+    obe_input_stream_t *stream_out;
+
+    // TODO metadata etc
+    program->num_streams = device->num_input_streams;
+    program->streams = calloc( program->num_streams, sizeof(*program->streams) );
+    if( !program->streams )
+    {
+        fprintf( stderr, "Malloc failed \n" );
+        return -1;
+    }
+
+    device->probed_streams = program->streams;
+
+    for( int i = 0; i < program->num_streams; i++ )
+    {
+        stream_in = device->streams[i];
+        stream_out = &program->streams[i];
+
+        stream_out->input_stream_id = stream_in->input_stream_id;
+        stream_out->stream_type = stream_in->stream_type;
+        stream_out->stream_format = stream_in->stream_format;
+
+        stream_out->bitrate = stream_in->bitrate;
+
+        stream_out->num_frame_data = stream_in->num_frame_data;
+        stream_out->frame_data = stream_in->frame_data;
+
+        if( stream_in->stream_type == STREAM_TYPE_VIDEO )
+        {
+            memcpy( &stream_out->csp, &stream_in->csp, offsetof( obe_input_stream_t, timebase_num ) - offsetof( obe_input_stream_t, csp ) );
+            stream_out->timebase_num = stream_in->timebase_num;
+            stream_out->timebase_den = stream_in->timebase_den;
+        }
+        else if( stream_in->stream_type == STREAM_TYPE_AUDIO )
+        {
+            memcpy( &stream_out->channel_layout, &stream_in->channel_layout,
+            offsetof( obe_input_stream_t, bitrate ) - offsetof( obe_input_stream_t, channel_layout ) );
+            stream_out->aac_is_latm = stream_in->is_latm;
+        }
+
+        memcpy( stream_out->lang_code, stream_in->lang_code, 4 );
+    }
+
+    return 0;
+}
+
 int obe_probe_device( obe_t *h, obe_input_t *input_device, obe_input_program_t *program )
 {
     pthread_t thread;
     void *ret_ptr;
-    obe_int_input_stream_t *stream_in;
-    obe_input_stream_t *stream_out;
     obe_input_probe_t *args = NULL;
+    obe_probe_wait_t probe_wait;
+    obe_device_t *device;
+    struct timespec ts;
 
     obe_input_func_t  input;
 
@@ -614,16 +1406,33 @@ int obe_probe_device( obe_t *h, obe_input_t *input_device, obe_input_program_t *
 #endif
     else if( input_device->input_type == INPUT_DEVICE_LINSYS_SDI )
         input = linsys_sdi_input;
+    else if( input_device->input_type == INPUT_FILE )
+        input = file_input;
     else
     {
         fprintf( stderr, "Invalid input device \n" );
         return -1;
     }
 
-    if( input_device->input_type == INPUT_URL && !input_device->location )
-    {
-        fprintf( stderr, "Invalid input location\n" );
-        return -1;
+    if( ( input_device->input_type == INPUT_URL || input_device->input_type == INPUT_FILE ) && !input_device->location )
+    {
+        fprintf( stderr, "Invalid input location\n" );
+        return -1;
+    }
+
+    if( obe_validate_input_params( input_device ) < 0 )
+        return -1;
+
+    device = read_probe_cache( h, input_device );
+    if( device )
+    {
+        if( input_device->input_type == INPUT_DEVICE_LINSYS_SDI )
+            printf( "Using cached probe of Linsys card %i \n", input_device->card_idx );
+        else
+            printf( "Using cached probe of Decklink card %i \n", input_device->card_idx );
+
+        add_device( h, device );
+        return copy_probed_streams( device, program );
     }
 
     args = malloc( sizeof(*args) );
@@ -647,12 +1456,17 @@ int obe_probe_device( obe_t *h, obe_input_t *input_device, obe_input_program_t *
         strcpy( args->user_opts.location, input_device->location );
     }
 
-    if( obe_validate_input_params( input_device ) < 0 )
-        goto fail;
+    probe_wait.probe_input = input.probe_input;
+    probe_wait.args = args;
+    probe_wait.done = 0;
+    pthread_mutex_init( &probe_wait.mutex, NULL );
+    pthread_cond_init( &probe_wait.cv, NULL );
 
-    if( pthread_create( &thread, NULL, input.probe_input, (void*)args ) < 0 )
+    if( pthread_create( &thread, NULL, probe_thread, &probe_wait ) < 0 )
     {
         fprintf( stderr, "Couldn't create probe thread \n" );
+        pthread_mutex_destroy( &probe_wait.mutex );
+        pthread_cond_destroy( &probe_wait.cv );
         goto fail;
     }
 
@@ -665,18 +1479,26 @@ int obe_probe_device( obe_t *h, obe_input_t *input_device, obe_input_program_t *
 
     printf( "Timeout %i seconds \n", probe_time );
 
-    while( i++ < probe_time )
+    /* The inputs give up on their own after MAX_PROBE_TIME so allow them to close the card first */
+    pthread_mutex_lock( &probe_wait.mutex );
+    while( !probe_wait.done && i++ <= probe_time )
     {
-        sleep( 1 );
-        fprintf( stderr, "." );
+        obe_timeout_to_timespec( 1000000, &ts );
+        while( !probe_wait.done && pthread_cond_timedwait( &probe_wait.cv, &probe_wait.mutex, &ts ) != ETIMEDOUT )
+            ;
 
-        if( pthread_kill( thread, 0 ) == ESRCH )
-            break;
+        if( !probe_wait.done )
+            fprintf( stderr, "." );
     }
+    pthread_mutex_unlock( &probe_wait.mutex );
 
-    __pthread_cancel( thread );
+    if( !probe_wait.done )
+        __pthread_cancel( thread );
     __pthread_join( thread, &ret_ptr );
 
+    pthread_mutex_destroy( &probe_wait.mutex );
+    pthread_cond_destroy( &probe_wait.cv );
+
     cur_devices = h->num_devices;
 
     if( prev_devices == cur_devices )
@@ -686,48 +1508,9 @@ int obe_probe_device( obe_t *h, obe_input_t *input_device, obe_input_program_t *
         return -1;
     }
 
-    // TODO metadata etc
-    program->num_streams = h->devices[h->num_devices-1]->num_input_streams;
-    program->streams = calloc( program->num_streams, sizeof(*program->streams) );
-    if( !program->streams )
-    {
-        fprintf( stderr, "Malloc failed \n" );
-        return -1;
-    }
-
-    h->devices[h->num_devices-1]->probed_streams = program->streams;
-
-    for( i = 0; i < program->num_streams; i++ )
-    {
-        stream_in = h->devices[h->num_devices-1]->streams[i];
-        stream_out = &program->streams[i];
-
-        stream_out->input_stream_id = stream_in->input_stream_id;
-        stream_out->stream_type = stream_in->stream_type;
-        stream_out->stream_format = stream_in->stream_format;
-
-        stream_out->bitrate = stream_in->bitrate;
-
-        stream_out->num_frame_data = stream_in->num_frame_data;
-        stream_out->frame_data = stream_in->frame_data;
-
-        if( stream_in->stream_type == STREAM_TYPE_VIDEO )
-        {
-            memcpy( &stream_out->csp, &stream_in->csp, offsetof( obe_input_stream_t, timebase_num ) - offsetof( obe_input_stream_t, csp ) );
-            stream_out->timebase_num = stream_in->timebase_num;
-            stream_out->timebase_den = stream_in->timebase_den;
-        }
-        else if( stream_in->stream_type == STREAM_TYPE_AUDIO )
-        {
-            memcpy( &stream_out->channel_layout, &stream_in->channel_layout,
-            offsetof( obe_input_stream_t, bitrate ) - offsetof( obe_input_stream_t, channel_layout ) );
-            stream_out->aac_is_latm = stream_in->is_latm;
-        }
-
-        memcpy( stream_out->lang_code, stream_in->lang_code, 4 );
-    }
+    write_probe_cache( input_device, h->devices[h->num_devices-1] );
 
-    return 0;
+    return copy_probed_streams( h->devices[h->num_devices-1], program );
 
 fail:
     if( args )
@@ -740,6 +1523,40 @@ fail:
     return -1;
 }
 
+/* Derive the VUI colour description from the frame rate and resolution. Also used when the input changes format */
+void obe_set_avc_colorimetry( x264_param_t *param )
+{
+    if( ( param->i_fps_num == 25 || param->i_fps_num == 50 ) && param->i_fps_den == 1 )
+    {
+        param->vui.i_vidformat = 1; // PAL
+        param->vui.i_colorprim = 5; // BT.470-2 bg
+        param->vui.i_transfer  = 5; // BT.470-2 bg
+        param->vui.i_colmatrix = 5; // BT.470-2 bg
+    }
+    else if( ( param->i_fps_num == 30000 || param->i_fps_num == 60000 ) && param->i_fps_den == 1001 )
+    {
+        param->vui.i_vidformat = 2; // NTSC
+        param->vui.i_colorprim = 6; // BT.601-6
+        param->vui.i_transfer  = 6; // BT.601-6
+        param->vui.i_colmatrix = 6; // BT.601-6
+    }
+    else
+    {
+        param->vui.i_vidformat = 5; // undefined
+        param->vui.i_colorprim = 2; // undefined
+        param->vui.i_transfer  = 2; // undefined
+        param->vui.i_colmatrix = 2; // undefined
+    }
+
+    /* Change to BT.709 for HD resolutions */
+    if( param->i_width >= 1280 && param->i_height >= 720 )
+    {
+        param->vui.i_colorprim = 1;
+        param->vui.i_transfer  = 1;
+        param->vui.i_colmatrix = 1;
+    }
+}
+
 int obe_populate_avc_encoder_params( obe_t *h, int input_stream_id, x264_param_t *param )
 {
     obe_int_input_stream_t *stream = get_input_stream( h, input_stream_id );
@@ -794,36 +1611,11 @@ int obe_populate_avc_encoder_params( obe_t *h, int input_stream_id, x264_param_t
     param->vui.i_overscan = 2;
 
     if( ( param->i_fps_num == 25 || param->i_fps_num == 50 ) && param->i_fps_den == 1 )
-    {
-        param->vui.i_vidformat = 1; // PAL
-        param->vui.i_colorprim = 5; // BT.470-2 bg
-        param->vui.i_transfer  = 5; // BT.470-2 bg
-        param->vui.i_colmatrix = 5; // BT.470-2 bg
         param->i_keyint_max = param->i_fps_num == 50 ? 48 : 24;
-    }
     else if( ( param->i_fps_num == 30000 || param->i_fps_num == 60000 ) && param->i_fps_den == 1001 )
-    {
-        param->vui.i_vidformat = 2; // NTSC
-        param->vui.i_colorprim = 6; // BT.601-6
-        param->vui.i_transfer  = 6; // BT.601-6
-        param->vui.i_colmatrix = 6; // BT.601-6
         param->i_keyint_max = param->i_fps_num / 1000;
-    }
-    else
-    {
-        param->vui.i_vidformat = 5; // undefined
-        param->vui.i_colorprim = 2; // undefined
-        param->vui.i_transfer  = 2; // undefined
-        param->vui.i_colmatrix = 2; // undefined
-    }
 
-    /* Change to BT.709 for HD resolutions */
-    if( param->i_width >= 1280 && param->i_height >= 720 )
-    {
-        param->vui.i_colorprim = 1;
-        param->vui.i_transfer  = 1;
-        param->vui.i_colmatrix = 1;
-    }
+    obe_set_avc_colorimetry( param );
 
     x264_param_apply_profile( param, X264_BIT_DEPTH == 10 ? "high10" : "high" );
     param->i_nal_hrd = X264_NAL_HRD_FAKE_VBR;
@@ -946,6 +1738,212 @@ int obe_setup_output( obe_t *h, obe_output_opts_t *output_opts )
     return 0;
 }
 
+/** Pipeline graph **/
+/* Allocate the graph and the stream lookup tables. Encoders are added to the tables as they are created */
+static int init_graph( obe_t *h )
+{
+    obe_graph_t *graph = &h->graph;
+    obe_device_t *device = h->devices[0];
+    int max_nodes = 1 + device->num_input_streams + h->num_output_streams + 3 + h->num_outputs;
+
+    for( int i = 0; i < device->num_input_streams; i++ )
+        graph->num_input_ids = MAX( graph->num_input_ids, device->streams[i]->input_stream_id + 1 );
+    for( int i = 0; i < h->num_output_streams; i++ )
+        graph->num_output_ids = MAX( graph->num_output_ids, h->output_streams[i].output_stream_id + 1 );
+
+    /* Input to filter and filter to encoder edges per input stream, one edge out of every other node */
+    int max_edges = device->num_input_streams * (1 + h->num_output_streams) + h->num_output_streams + 2 + h->num_outputs;
+
+    graph->nodes = calloc( max_nodes, sizeof(*graph->nodes) );
+    graph->edges = calloc( max_edges, sizeof(*graph->edges) );
+    graph->input_streams = calloc( graph->num_input_ids, sizeof(*graph->input_streams) );
+    graph->filter_edges = malloc( graph->num_input_ids * sizeof(*graph->filter_edges) );
+    graph->output_streams = calloc( graph->num_output_ids, sizeof(*graph->output_streams) );
+    graph->encoders = calloc( graph->num_output_ids, sizeof(*graph->encoders) );
+    graph->encoder_edges = malloc( graph->num_output_ids * sizeof(*graph->encoder_edges) );
+    if( !graph->nodes || !graph->edges || !graph->input_streams || !graph->filter_edges ||
+        !graph->output_streams || !graph->encoders || !graph->encoder_edges )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return -1;
+    }
+
+    for( int i = 0; i < graph->num_input_ids; i++ )
+        graph->filter_edges[i] = -1;
+    for( int i = 0; i < graph->num_output_ids; i++ )
+        graph->encoder_edges[i] = -1;
+
+    for( int i = 0; i < device->num_input_streams; i++ )
+        graph->input_streams[device->streams[i]->input_stream_id] = device->streams[i];
+    for( int i = 0; i < h->num_output_streams; i++ )
+        graph->output_streams[h->output_streams[i].output_stream_id] = &h->output_streams[i];
+
+    return 0;
+}
+
+static void add_graph_node( obe_t *h, int stage, pthread_t *thread, int *cancel, obe_queue_t *queue )
+{
+    obe_graph_node_t *node = &h->graph.nodes[h->graph.num_nodes++];
+
+    node->stage = stage;
+    node->thread = thread;
+    node->cancel = cancel;
+    node->queue = queue;
+}
+
+static int find_graph_node( obe_graph_t *graph, obe_queue_t *queue )
+{
+    for( int i = 0; i < graph->num_nodes; i++ )
+    {
+        if( graph->nodes[i].queue == queue )
+            return i;
+    }
+    return -1;
+}
+
+static int add_graph_edge( obe_graph_t *graph, int src, int dst )
+{
+    if( src < 0 || dst < 0 )
+        return -1;
+
+    graph->edges[graph->num_edges].src = src;
+    graph->edges[graph->num_edges].dst = dst;
+
+    return graph->num_edges++;
+}
+
+/* Connect the nodes once every thread but the input has been created */
+static void build_graph_edges( obe_t *h, int input_node )
+{
+    obe_graph_t *graph = &h->graph;
+    int filter_node, encoder_node, edge, stream_type, mux_node, mux_smoothing_node;
+
+    mux_node = find_graph_node( graph, &h->mux_queue );
+    mux_smoothing_node = find_graph_node( graph, &h->mux_smoothing_queue );
+
+    for( int i = 0; i < h->num_filters; i++ )
+    {
+        filter_node = find_graph_node( graph, &h->filters[i]->queue );
+        stream_type = -1;
+
+        for( int j = 0; j < h->filters[i]->num_stream_ids; j++ )
+        {
+            int id = h->filters[i]->stream_id_list[j];
+            graph->filter_edges[id] = add_graph_edge( graph, input_node, filter_node );
+            stream_type = graph->input_streams[id]->stream_type;
+        }
+
+        /* Video filters feed every video encoder and audio filters every audio encoder */
+        for( int j = 0; j < h->num_encoders; j++ )
+        {
+            if( h->encoders[j]->is_video != ( stream_type == STREAM_TYPE_VIDEO ) )
+                continue;
+
+            encoder_node = find_graph_node( graph, &h->encoders[j]->queue );
+            edge = add_graph_edge( graph, filter_node, encoder_node );
+            if( graph->encoder_edges[h->encoders[j]->output_stream_id] < 0 )
+                graph->encoder_edges[h->encoders[j]->output_stream_id] = edge;
+        }
+    }
+
+    for( int i = 0; i < h->num_encoders; i++ )
+    {
+        encoder_node = find_graph_node( graph, &h->encoders[i]->queue );
+        if( h->encoders[i]->is_video && h->obe_system == OBE_SYSTEM_TYPE_GENERIC )
+            add_graph_edge( graph, encoder_node, find_graph_node( graph, &h->enc_smoothing_queue ) );
+        else
+            add_graph_edge( graph, encoder_node, mux_node );
+    }
+
+    if( h->obe_system == OBE_SYSTEM_TYPE_GENERIC )
+        add_graph_edge( graph, find_graph_node( graph, &h->enc_smoothing_queue ), mux_node );
+
+    add_graph_edge( graph, mux_node, mux_smoothing_node );
+
+    for( int i = 0; i < h->num_outputs; i++ )
+        add_graph_edge( graph, mux_smoothing_node, find_graph_node( graph, &h->outputs[i]->queue ) );
+}
+
+/* Stop the threads stage by stage from the input downstream */
+static void stop_graph( obe_t *h )
+{
+    obe_graph_t *graph = &h->graph;
+    void *ret_ptr;
+
+    for( int stage = 0; stage < OBE_NUM_STAGES; stage++ )
+    {
+        int found = 0;
+
+        for( int i = 0; i < graph->num_nodes; i++ )
+        {
+            obe_graph_node_t *node = &graph->nodes[i];
+            if( node->stage != stage )
+                continue;
+
+            if( node->cancel )
+                obe_queue_cancel( node->queue, node->cancel );
+
+            /* wake smoothing in case it is waiting for a clock tick */
+            if( stage == OBE_STAGE_ENC_SMOOTHING )
+                obe_clock_wake( h, 1 );
+
+            /* The input and outputs could be blocking on the OS so have to cancel the thread too */
+            if( !node->cancel || stage == OBE_STAGE_OUTPUT )
+                __pthread_cancel( *node->thread );
+            __pthread_join( *node->thread, &ret_ptr );
+            found = 1;
+        }
+
+        if( found )
+            fprintf( stderr, "%s cancelled \n", obe_stage_name( stage ) );
+    }
+}
+
+static void print_graph_stats( obe_t *h )
+{
+    obe_graph_t *graph = &h->graph;
+
+    for( int i = 0; i < graph->num_edges; i++ )
+    {
+        obe_graph_edge_t *edge = &graph->edges[i];
+        if( edge->num_items )
+            fprintf( stderr, "%s -> %s: %"PRIi64" frames \n", obe_stage_name( graph->nodes[edge->src].stage ),
+                     obe_stage_name( graph->nodes[edge->dst].stage ), edge->num_items );
+    }
+
+    for( int i = 0; i < OBE_NUM_STAGES; i++ )
+    {
+        if( h->num_shed[i] )
+            fprintf( stderr, "%s shed %"PRIi64" frames \n", obe_stage_name( i ), h->num_shed[i] );
+    }
+}
+
+static void destroy_graph( obe_graph_t *graph )
+{
+    free( graph->nodes );
+    free( graph->edges );
+    free( graph->input_streams );
+    free( graph->filter_edges );
+    free( graph->output_streams );
+    free( graph->encoders );
+    free( graph->encoder_edges );
+    memset( graph, 0, sizeof(*graph) );
+}
+
+/* Number of filters which will be created for a stream type */
+static int count_filtered_streams( obe_t *h, int stream_type )
+{
+    int count = 0;
+
+    for( int i = 0; i < h->devices[0]->num_input_streams; i++ )
+    {
+        if( h->devices[0]->streams[i] && h->devices[0]->streams[i]->stream_type == stream_type )
+            count++;
+    }
+
+    return count;
+}
+
 int obe_start( obe_t *h )
 {
     obe_int_input_stream_t  *input_stream;
@@ -959,18 +1957,31 @@ int obe_start( obe_t *h )
     obe_output_func_t output;
 
     int num_samples = 0;
+    int num_reserved_frames, num_filtered_frames;
+    int spsc;
 
     /* TODO: a lot of sanity checks */
-    /* TODO: decide upon thread priorities */
+
+    obe_apply_rt_profile( h );
 
     /* Setup mutexes and cond vars */
     pthread_mutex_init( &h->devices[0]->device_mutex, NULL );
     pthread_mutex_init( &h->drop_mutex, NULL );
-    obe_init_queue( &h->enc_smoothing_queue );
-    obe_init_queue( &h->mux_queue );
-    obe_init_queue( &h->mux_smoothing_queue );
-    pthread_mutex_init( &h->obe_clock_mutex, NULL );
-    pthread_cond_init( &h->obe_clock_cv, NULL );
+    obe_init_clock( &h->clock );
+
+    if( init_graph( h ) < 0 )
+        goto fail;
+
+    /* The mux queue has a producer per encoder and the encoder smoothing queue is
+     * inspected by the video encoder so both stay locked. Mux smoothing has one producer and one consumer */
+    if( obe_init_queue( &h->enc_smoothing_queue, FRAME_QUEUE_CAPACITY, 0 ) < 0 ||
+        obe_init_queue( &h->mux_queue, FRAME_QUEUE_CAPACITY, 0 ) < 0 ||
+        obe_init_queue( &h->mux_smoothing_queue, MUXED_QUEUE_CAPACITY, 1 ) < 0 )
+        goto fail;
+
+    setup_shedding( h, OBE_STAGE_ENC_SMOOTHING, &h->enc_smoothing_queue, drop_coded_frame, 0 );
+    setup_shedding( h, OBE_STAGE_MUX, &h->mux_queue, drop_coded_frame, 0 );
+    setup_shedding( h, OBE_STAGE_MUX_SMOOTHING, &h->mux_smoothing_queue, drop_muxed_data, 0 );
 
     if( h->devices[0]->device_type == INPUT_URL )
     {
@@ -984,6 +1995,8 @@ int obe_start( obe_t *h )
 #endif
     else if( h->devices[0]->device_type == INPUT_DEVICE_LINSYS_SDI )
         input = linsys_sdi_input;
+    else if( h->devices[0]->device_type == INPUT_FILE )
+        input = file_input;
     else
     {
         fprintf( stderr, "Invalid input device \n" );
@@ -993,14 +2006,17 @@ int obe_start( obe_t *h )
     /* Open Output Threads */
     for( int i = 0; i < h->num_outputs; i++ )
     {
-        obe_init_queue( &h->outputs[i]->queue );
+        if( obe_init_queue( &h->outputs[i]->queue, MUXED_QUEUE_CAPACITY, 1 ) < 0 )
+            goto fail;
+        setup_shedding( h, OBE_STAGE_OUTPUT, &h->outputs[i]->queue, drop_ts_slice, 0 );
         output = ip_output;
 
-        if( pthread_create( &h->outputs[i]->output_thread, NULL, output.open_output, (void*)h->outputs[i] ) < 0 )
+        if( obe_thread_create( h, OBE_STAGE_OUTPUT, &h->outputs[i]->output_thread, output.open_output, (void*)h->outputs[i] ) < 0 )
         {
             fprintf( stderr, "Couldn't create output thread \n" );
             goto fail;
         }
+        add_graph_node( h, OBE_STAGE_OUTPUT, &h->outputs[i]->output_thread, &h->outputs[i]->cancel_thread, &h->outputs[i]->queue );
     }
 
     /* Open Encoder Threads */
@@ -1014,8 +2030,20 @@ int obe_start( obe_t *h )
                 fprintf( stderr, "Malloc failed \n" );
                 goto fail;
             }
-            obe_init_queue( &h->encoders[h->num_encoders]->queue );
+            /* Lock-free if only one filter feeds this encoder */
+            if( h->output_streams[i].stream_format == VIDEO_AVC )
+                spsc = count_filtered_streams( h, STREAM_TYPE_VIDEO ) <= 1;
+            else
+                spsc = count_filtered_streams( h, STREAM_TYPE_AUDIO ) <= 1;
+
+            if( obe_init_queue( &h->encoders[h->num_encoders]->queue, FRAME_QUEUE_CAPACITY, spsc ) < 0 )
+                goto fail;
+            if( h->output_streams[i].stream_format == VIDEO_AVC )
+                setup_shedding( h, OBE_STAGE_VIDEO_ENCODER, &h->encoders[h->num_encoders]->queue, drop_raw_frame, RAW_VIDEO_HIGH_WATER );
+            else
+                setup_shedding( h, OBE_STAGE_AUDIO_ENCODER, &h->encoders[h->num_encoders]->queue, drop_raw_frame, 0 );
             h->encoders[h->num_encoders]->output_stream_id = h->output_streams[i].output_stream_id;
+            h->graph.encoders[h->output_streams[i].output_stream_id] = h->encoders[h->num_encoders];
 
             if( h->output_streams[i].stream_format == VIDEO_AVC )
             {
@@ -1037,11 +2065,13 @@ int obe_start( obe_t *h )
                 h->encoders[h->num_encoders]->is_video = 1;
 
                 memcpy( &vid_enc_params->avc_param, &h->output_streams[i].avc_param, sizeof(x264_param_t) );
-                if( pthread_create( &h->encoders[h->num_encoders]->encoder_thread, NULL, x264_encoder.start_encoder, (void*)vid_enc_params ) < 0 )
+                if( obe_thread_create( h, OBE_STAGE_VIDEO_ENCODER, &h->encoders[h->num_encoders]->encoder_thread, x264_encoder.start_encoder, (void*)vid_enc_params ) < 0 )
                 {
                     fprintf( stderr, "Couldn't create encode thread \n" );
                     goto fail;
                 }
+                add_graph_node( h, OBE_STAGE_VIDEO_ENCODER, &h->encoders[h->num_encoders]->encoder_thread,
+                                &h->encoders[h->num_encoders]->cancel_thread, &h->encoders[h->num_encoders]->queue );
             }
             else if( h->output_streams[i].stream_format == AUDIO_AC_3 || h->output_streams[i].stream_format == AUDIO_E_AC_3 ||
                      h->output_streams[i].stream_format == AUDIO_AAC  || h->output_streams[i].stream_format == AUDIO_MP2 )
@@ -1086,33 +2116,40 @@ int obe_start( obe_t *h )
                 else
                     h->output_streams[i].ts_opts.frames_per_pes = aud_enc_params->frames_per_pes = 1;
 
-                if( pthread_create( &h->encoders[h->num_encoders]->encoder_thread, NULL, audio_encoder.start_encoder, (void*)aud_enc_params ) < 0 )
+                if( obe_thread_create( h, OBE_STAGE_AUDIO_ENCODER, &h->encoders[h->num_encoders]->encoder_thread, audio_encoder.start_encoder, (void*)aud_enc_params ) < 0 )
                 {
                     fprintf( stderr, "Couldn't create encode thread \n" );
                     goto fail;
                 }
+                add_graph_node( h, OBE_STAGE_AUDIO_ENCODER, &h->encoders[h->num_encoders]->encoder_thread,
+                                &h->encoders[h->num_encoders]->cancel_thread, &h->encoders[h->num_encoders]->queue );
             }
 
             h->num_encoders++;
         }
     }
 
+    /* Everything the pipeline allocates per frame is known now so fill the pools before the first frame arrives */
+    num_reserved_frames = reserve_pools( h, &num_filtered_frames );
+
     if( h->obe_system == OBE_SYSTEM_TYPE_GENERIC )
     {
         /* Open Encoder Smoothing Thread */
-        if( pthread_create( &h->enc_smoothing_thread, NULL, enc_smoothing.start_smoothing, (void*)h ) < 0 )
+        if( obe_thread_create( h, OBE_STAGE_ENC_SMOOTHING, &h->enc_smoothing_thread, enc_smoothing.start_smoothing, (void*)h ) < 0 )
         {
             fprintf( stderr, "Couldn't create encoder smoothing thread \n" );
             goto fail;
         }
+        add_graph_node( h, OBE_STAGE_ENC_SMOOTHING, &h->enc_smoothing_thread, &h->cancel_enc_smoothing_thread, &h->enc_smoothing_queue );
     }
 
     /* Open Mux Smoothing Thread */
-    if( pthread_create( &h->mux_smoothing_thread, NULL, mux_smoothing.start_smoothing, (void*)h ) < 0 )
+    if( obe_thread_create( h, OBE_STAGE_MUX_SMOOTHING, &h->mux_smoothing_thread, mux_smoothing.start_smoothing, (void*)h ) < 0 )
     {
         fprintf( stderr, "Couldn't create mux smoothing thread \n" );
         goto fail;
     }
+    add_graph_node( h, OBE_STAGE_MUX_SMOOTHING, &h->mux_smoothing_thread, &h->cancel_mux_smoothing_thread, &h->mux_smoothing_queue );
 
 
     /* Open Mux Thread */
@@ -1127,11 +2164,12 @@ int obe_start( obe_t *h )
     mux_params->num_output_streams = h->num_output_streams;
     mux_params->output_streams = h->output_streams;
 
-    if( pthread_create( &h->mux_thread, NULL, ts_muxer.open_muxer, (void*)mux_params ) < 0 )
+    if( obe_thread_create( h, OBE_STAGE_MUX, &h->mux_thread, ts_muxer.open_muxer, (void*)mux_params ) < 0 )
     {
         fprintf( stderr, "Couldn't create mux thread \n" );
         goto fail;
     }
+    add_graph_node( h, OBE_STAGE_MUX, &h->mux_thread, &h->cancel_mux_thread, &h->mux_queue );
 
     /* Open Filter Thread */
     for( int i = 0; i < h->devices[0]->num_input_streams; i++ )
@@ -1143,7 +2181,14 @@ int obe_start( obe_t *h )
             if( !h->filters[h->num_filters] )
                 goto fail;
 
-            obe_init_queue( &h->filters[h->num_filters]->queue );
+            /* Each filter is fed by the single input thread */
+            if( obe_init_queue( &h->filters[h->num_filters]->queue, FRAME_QUEUE_CAPACITY, h->num_devices == 1 ) < 0 )
+                goto fail;
+
+            if( input_stream->stream_type == STREAM_TYPE_VIDEO )
+                setup_shedding( h, OBE_STAGE_VIDEO_FILTER, &h->filters[h->num_filters]->queue, drop_raw_frame, RAW_VIDEO_HIGH_WATER );
+            else
+                setup_shedding( h, OBE_STAGE_AUDIO_FILTER, &h->filters[h->num_filters]->queue, drop_raw_frame, 0 );
 
             h->filters[h->num_filters]->num_stream_ids = 1;
             h->filters[h->num_filters]->stream_id_list = malloc( sizeof(*h->filters[h->num_filters]->stream_id_list) );
@@ -1167,13 +2212,16 @@ int obe_start( obe_t *h )
                 vid_filter_params->h = h;
                 vid_filter_params->filter = h->filters[h->num_filters];
                 vid_filter_params->input_stream = input_stream;
-                vid_filter_params->target_csp = h->output_streams[i].avc_param.i_csp & X264_CSP_MASK;
+                vid_filter_params->num_input_frames = num_reserved_frames;
+                vid_filter_params->num_reserved_frames = num_filtered_frames;
 
-                if( pthread_create( &h->filters[h->num_filters]->filter_thread, NULL, video_filter.start_filter, vid_filter_params ) < 0 )
+                if( obe_thread_create( h, OBE_STAGE_VIDEO_FILTER, &h->filters[h->num_filters]->filter_thread, video_filter.start_filter, vid_filter_params ) < 0 )
                 {
                     fprintf( stderr, "Couldn't create video filter thread \n" );
                     goto fail;
                 }
+                add_graph_node( h, OBE_STAGE_VIDEO_FILTER, &h->filters[h->num_filters]->filter_thread,
+                                &h->filters[h->num_filters]->cancel_thread, &h->filters[h->num_filters]->queue );
             }
             else
             {
@@ -1187,11 +2235,13 @@ int obe_start( obe_t *h )
                 aud_filter_params->h = h;
                 aud_filter_params->filter = h->filters[h->num_filters];
 
-                if( pthread_create( &h->filters[h->num_filters]->filter_thread, NULL, audio_filter.start_filter, aud_filter_params ) < 0 )
+                if( obe_thread_create( h, OBE_STAGE_AUDIO_FILTER, &h->filters[h->num_filters]->filter_thread, audio_filter.start_filter, aud_filter_params ) < 0 )
                 {
                     fprintf( stderr, "Couldn't create filter thread \n" );
                     goto fail;
                 }
+                add_graph_node( h, OBE_STAGE_AUDIO_FILTER, &h->filters[h->num_filters]->filter_thread,
+                                &h->filters[h->num_filters]->cancel_thread, &h->filters[h->num_filters]->queue );
             }
 
             h->num_filters++;
@@ -1212,13 +2262,20 @@ int obe_start( obe_t *h )
     input_params->num_output_streams = h->num_output_streams;
     input_params->output_streams = h->output_streams;
     input_params->audio_samples = num_samples;
+    input_params->num_reserved_frames = num_reserved_frames;
+
+    /* Routing tables must be complete before the input starts producing frames */
+    add_graph_node( h, OBE_STAGE_INPUT, &h->devices[0]->device_thread, NULL, NULL );
+    build_graph_edges( h, h->graph.num_nodes - 1 );
 
-    if( pthread_create( &h->devices[0]->device_thread, NULL, input.open_input, (void*)input_params ) < 0 )
+    if( obe_thread_create( h, OBE_STAGE_INPUT, &h->devices[0]->device_thread, input.open_input, (void*)input_params ) < 0 )
     {
         fprintf( stderr, "Couldn't create input thread \n" );
         goto fail;
     }
 
+    obe_print_rt_report( h );
+
     h->is_active = 1;
 
     return 0;
@@ -1232,91 +2289,9 @@ fail:
 
 void obe_close( obe_t *h )
 {
-    void *ret_ptr;
-
     fprintf( stderr, "closing obe \n" );
 
-    /* Cancel input thread */
-    for( int i = 0; i < h->num_devices; i++ )
-    {
-        __pthread_cancel( h->devices[i]->device_thread );
-        __pthread_join( h->devices[i]->device_thread, &ret_ptr );
-    }
-
-    fprintf( stderr, "input cancelled \n" );
-
-    /* Cancel filter threads */
-    for( int i = 0; i < h->num_filters; i++ )
-    {
-        pthread_mutex_lock( &h->filters[i]->queue.mutex );
-        h->filters[i]->cancel_thread = 1;
-        pthread_cond_signal( &h->filters[i]->queue.in_cv );
-        pthread_mutex_unlock( &h->filters[i]->queue.mutex );
-        __pthread_join( h->filters[i]->filter_thread, &ret_ptr );
-    }
-
-    fprintf( stderr, "filters cancelled \n" );
-
-    /* Cancel encoder threads */
-    for( int i = 0; i < h->num_encoders; i++ )
-    {
-        pthread_mutex_lock( &h->encoders[i]->queue.mutex );
-        h->encoders[i]->cancel_thread = 1;
-        pthread_cond_signal( &h->encoders[i]->queue.in_cv );
-        pthread_mutex_unlock( &h->encoders[i]->queue.mutex );
-        __pthread_join( h->encoders[i]->encoder_thread, &ret_ptr );
-    }
-
-    fprintf( stderr, "encoders cancelled \n" );
-
-    /* Cancel encoder smoothing thread */
-    if ( h->obe_system == OBE_SYSTEM_TYPE_GENERIC )
-    {
-        pthread_mutex_lock( &h->enc_smoothing_queue.mutex );
-        h->cancel_enc_smoothing_thread = 1;
-        pthread_cond_signal( &h->enc_smoothing_queue.in_cv );
-        pthread_mutex_unlock( &h->enc_smoothing_queue.mutex );
-        /* send a clock tick in case smoothing is waiting for one */
-        pthread_mutex_lock( &h->obe_clock_mutex );
-        pthread_cond_broadcast( &h->obe_clock_cv );
-        pthread_mutex_unlock( &h->obe_clock_mutex );
-        if ( h->enc_smoothing_thread )
-            __pthread_join( h->enc_smoothing_thread, &ret_ptr );
-    }
-
-    fprintf( stderr, "encoder smoothing cancelled \n" );
-
-    /* Cancel mux thread */
-    pthread_mutex_lock( &h->mux_queue.mutex );
-    h->cancel_mux_thread = 1;
-    pthread_cond_signal( &h->mux_queue.in_cv );
-    pthread_mutex_unlock( &h->mux_queue.mutex );
-    __pthread_join( h->mux_thread, &ret_ptr );
-
-    fprintf( stderr, "mux cancelled \n" );
-
-    /* Cancel mux smoothing thread */
-    pthread_mutex_lock( &h->mux_smoothing_queue.mutex );
-    h->cancel_mux_smoothing_thread = 1;
-    pthread_cond_signal( &h->mux_smoothing_queue.in_cv );
-    pthread_mutex_unlock( &h->mux_smoothing_queue.mutex );
-    __pthread_join( h->mux_smoothing_thread, &ret_ptr );
-
-    fprintf( stderr, "mux smoothing cancelled \n" );
-
-    /* Cancel output threads */
-    for( int i = 0; i < h->num_outputs; i++ )
-    {
-        pthread_mutex_lock( &h->outputs[i]->queue.mutex );
-        h->outputs[i]->cancel_thread = 1;
-        pthread_cond_signal( &h->outputs[i]->queue.in_cv );
-        pthread_mutex_unlock( &h->outputs[i]->queue.mutex );
-        /* could be blocking on OS so have to cancel thread too */
-        __pthread_cancel( h->outputs[i]->output_thread );
-        __pthread_join( h->outputs[i]->output_thread, &ret_ptr );
-    }
-
-    fprintf( stderr, "output thread cancelled \n" );
+    stop_graph( h );
 
     /* Destroy devices */
     for( int i = 0; i < h->num_devices; i++ )
@@ -1355,11 +2330,47 @@ void obe_close( obe_t *h )
 
     fprintf( stderr, "output destroyed \n" );
 
+    print_graph_stats( h );
+    obe_print_clock_stats( h );
+    obe_print_mem_stats();
+    destroy_graph( &h->graph );
+
     free( h->output_streams );
+
+    /* The last channel of the process takes the shared state with it */
+    obe_shared_t *shared = h->shared;
+    int last_channel;
+
+    pthread_mutex_lock( &shared->mutex );
+    for( int i = 0; i < shared->num_channels; i++ )
+    {
+        if( shared->channels[i] == h )
+        {
+            memmove( &shared->channels[i], &shared->channels[i+1], (shared->num_channels-1-i) * sizeof(*shared->channels) );
+            shared->num_channels--;
+            break;
+        }
+    }
+    last_channel = !shared->num_channels;
+    pthread_mutex_unlock( &shared->mutex );
+
+    /* Other channels read the cpu lists until this one has left the list */
+    for( int i = 0; i < OBE_NUM_STAGES; i++ )
+        free( h->stage_cpus[i] );
     /* TODO: free other things */
 
-    /* Destroy lock manager */
-    av_lockmgr_register( NULL );
+    if( last_channel )
+    {
+        /* Destroy lock manager */
+        av_lockmgr_register( NULL );
+
+        obe_destroy_frame_pool( shared->frame_pool );
+        obe_destroy_coded_pool( shared->coded_pool );
+        pthread_mutex_destroy( &shared->mutex );
+        free( shared );
+
+        obe_print_leak_report();
+    }
 
     free( h );
     h = NULL;
@@ -37,6 +37,15 @@ typedef struct obe_t obe_t;
 /**** Initialisation Function ****/
 obe_t *obe_setup( void );
 
+/**** Channels ****/
+/* A channel is one input device and everything encoded from it. Each obe_t is a channel with its own
+ * clock domain, drop state and pipeline so channels are probed, configured, started and closed separately.
+ *
+ * obe_setup_channel() adds a channel to the process of parent. It copies the real-time profile and
+ * overload policy of parent, stage cpu lists are per channel so that channels can be kept apart.
+ * Up to eight channels can run in one process. */
+obe_t *obe_setup_channel( obe_t *parent );
+
 /**** OBE configuration function */
 enum obe_system_type_e
 {
@@ -47,6 +56,66 @@ enum obe_system_type_e
 
 int obe_set_config( obe_t *h, int system_type );
 
+/**** Thread placement ****/
+enum obe_stage_e
+{
+    OBE_STAGE_INPUT,
+    OBE_STAGE_VIDEO_FILTER,
+    OBE_STAGE_AUDIO_FILTER,
+    OBE_STAGE_VIDEO_ENCODER, /* x264's thread pool inherits this placement */
+    OBE_STAGE_AUDIO_ENCODER,
+    OBE_STAGE_ENC_SMOOTHING,
+    OBE_STAGE_MUX,
+    OBE_STAGE_MUX_SMOOTHING,
+    OBE_STAGE_OUTPUT,
+    OBE_NUM_STAGES,
+};
+
+/* cpu_list is a list of cpus and ranges e.g. "0-3:8" (':' and ',' are both separators)
+ * If the input stage has no cpus set it is placed on the capture card's NUMA node when known */
+int obe_set_stage_affinity( obe_t *h, int stage, const char *cpu_list );
+
+/**** Real-time profile ****/
+typedef struct
+{
+    /* Real-time priority of each stage (1-99) or 0 to leave the stage at normal priority.
+     * The mux runs SCHED_RR and every other stage SCHED_FIFO */
+    int priority[OBE_NUM_STAGES];
+
+    /* Lock all current and future memory and keep the heap from being returned to the kernel */
+    int lock_memory;
+    /* Heap to prefault at startup in megabytes (requires lock_memory) */
+    int heap_reserve;
+
+    /* Keep stage threads without cpus of their own, and the threads they create, off the cpus given to pinned stages */
+    int isolate_cpus;
+
+    /* Back raw frames, filter images, coded frames and TS pages with 2 MB huge pages.
+     * Reserved huge pages (vm.nr_hugepages) are used first, then transparent huge pages */
+    int huge_pages;
+} obe_rt_opts_t;
+
+/* The profile is applied by obe_start() which prints a report of what was obtained.
+ * By default the smoothing, mux and output stages run at priority 99 and memory is not locked */
+int obe_set_rt_profile( obe_t *h, obe_rt_opts_t *rt_opts );
+/* Fetch the current profile, e.g. the defaults to change before calling obe_set_rt_profile */
+void obe_get_rt_profile( obe_t *h, obe_rt_opts_t *rt_opts );
+
+/**** Overload shedding ****/
+/* Each stage's input queue has a high-water mark and a policy for what to do above it.
+ * Shed frames are counted per stage */
+enum obe_shed_policy_e
+{
+    OBE_SHED_DROP_NEWEST,        /* Refuse new items (all stages except input) */
+    OBE_SHED_DROP_OLDEST,        /* Drop the oldest raw video frames (video filter and video encoder) */
+    OBE_SHED_DROP_NON_REF,       /* Drop non-reference coded video frames (encoder smoothing and mux) */
+    OBE_SHED_SPEEDCONTROL_RESET, /* Reset x264 speedcontrol without dropping (video encoder) */
+};
+
+/* high_water is in items, 0 for the default. By default raw video is dropped oldest-first
+ * above RAW_VIDEO_HIGH_WATER frames and other queues only refuse items when full */
+int obe_set_overload_policy( obe_t *h, int stage, int shed_policy, int high_water );
+
 enum input_video_connection_e
 {
     INPUT_VIDEO_CONNECTION_SDI,
@@ -95,20 +164,46 @@ enum input_type_e
     INPUT_URL,
     INPUT_DEVICE_DECKLINK,
     INPUT_DEVICE_LINSYS_SDI,
+    INPUT_FILE,               /* Replay of a recorded SDI capture */
 //    INPUT_DEVICE_V4L2,
 //    INPUT_DEVICE_ASI,
 };
 
+enum replay_pacing_e
+{
+    REPLAY_PACING_REALTIME, /* Frames are released at their original times and clock the pipeline */
+    REPLAY_PACING_NONE,     /* As fast as the pipeline accepts them, for benchmarking */
+};
+
 typedef struct
 {
     int input_type;
-    char *location;
+    char *location; /* Linsys input: replay a buffer dump from here instead of the card */
 
     int card_idx;
 
     int video_format;
     int video_connection;
     int audio_connection;
+
+    /* The NUMA node is detected from Linsys cards unless has_numa_node is set.
+     * Decklink cards are not detected and need it set */
+    int has_numa_node;
+    int numa_node;
+
+    int replay_pacing; /* File input and Linsys buffer dump replays */
+    int replay_loop;   /* File input: start again from the beginning at the end of the file */
+
+    /* SDI inputs record the signal to this file in the format the file input replays. NULL to disable */
+    char *dump_location;
+
+    /* Linsys input: record the card's buffers to this file so that the input can replay them without the card. NULL to disable */
+    char *buffer_dump_location;
+
+    /* Directory holding the last successful probe of each card. A later probe with the same options
+     * uses it instead of waiting for the signal. Signals carrying VBI, teletext or VANC services are
+     * always probed. NULL to always probe */
+    char *probe_cache;
 } obe_input_t;
 
 /**** Stream Formats ****/
@@ -521,6 +616,39 @@ int obe_setup_output( obe_t *h, obe_output_opts_t *output_opts );
 int obe_start( obe_t *h );
 int obe_stop( obe_t *h );
 
+/**** Recovered clock ****/
+typedef struct
+{
+    int     locked;        /* the estimate has settled */
+    double  drift_ppm;     /* input clock rate relative to CLOCK_MONOTONIC */
+    double  jitter_us;     /* mean deviation of input frames from the estimated clock */
+    double  max_jitter_us;
+    int64_t num_ticks;
+    int64_t num_resets;    /* discontinuities in the input clock */
+} obe_clock_stats_t;
+
+int obe_get_clock_stats( obe_t *h, obe_clock_stats_t *stats );
+
+/**** Memory accounting ****/
+/* Frames, sample buffers, coded frames and TS pages are charged to the stage that allocated them
+ * until they are released. Memory allocated outside the pipeline threads is charged to OBE_MEM_OTHER
+ * and idle buffers kept on the pools' free lists to OBE_MEM_POOL.
+ * The pools are shared between channels so the counters are process-wide, not per obe_t */
+#define OBE_MEM_OTHER    OBE_NUM_STAGES
+#define OBE_MEM_POOL     (OBE_NUM_STAGES+1)
+#define OBE_MEM_NUM_TAGS (OBE_NUM_STAGES+2)
+
+typedef struct
+{
+    int64_t bytes;          /* currently held */
+    int64_t peak_bytes;
+    int64_t num_allocs;
+    double  allocs_per_sec; /* since the previous query */
+} obe_mem_stats_t;
+
+int obe_get_mem_stats( int tag, obe_mem_stats_t *stats );
+const char *obe_get_mem_tag_name( int tag );
+
 void obe_close( obe_t *h );
 
 #endif
@@ -50,6 +50,9 @@ typedef struct
     obe_output_stream_t *output_streams;
     obe_mux_opts_t mux_opts;
     obe_output_opts_t output;
+    obe_rt_opts_t rt_opts;
+    int shed_policy[OBE_NUM_STAGES];
+    int high_water[OBE_NUM_STAGES];
     int avc_profile;
 } obecli_ctx_t;
 
@@ -63,12 +66,14 @@ static int running = 0;
 static int system_type_value = OBE_SYSTEM_TYPE_GENERIC;
 
 static const char * const system_types[]             = { "generic", "lowestlatency", "lowlatency", 0 };
-static const char * const input_types[]              = { "url", "decklink", "linsys-sdi", 0 };
+static const char * const input_types[]              = { "url", "decklink", "linsys-sdi", "file", 0 };
+static const char * const shed_policies[]            = { "drop-newest", "drop-oldest", "drop-non-ref", "speedcontrol-reset", 0 };
 static const char * const input_video_formats[]      = { "pal", "ntsc", "720p50", "720p59.94", "720p60", "1080i50", "1080i59.94", "1080i60",
                                                          "1080p23.98", "1080p24", "1080p25", "1080p29.97", "1080p30", "1080p50", "1080p59.94",
                                                          "1080p60", 0 };
 static const char * const input_video_connections[]  = { "sdi", "hdmi", "optical-sdi", "component", "composite", "s-video", 0 };
 static const char * const input_audio_connections[]  = { "embedded", "aes-ebu", "analogue", 0 };
+static const char * const replay_pacings[]           = { "realtime", "none", 0 };
 static const char * const ttx_locations[]            = { "dvb-ttx", "dvb-vbi", "both", 0 };
 static const char * const stream_actions[]           = { "passthrough", "encode", 0 };
 static const char * const encode_formats[]           = { "", "avc", "", "", "mp2", "ac3", "e-ac3", "aac", 0 };
@@ -81,10 +86,18 @@ static const char * const mp2_modes[]                = { "auto", "stereo", "join
 static const char * const channel_maps[]             = { "", "mono", "stereo", "5.0", "5.1", 0 };
 static const char * const mono_channels[]            = { "left", "right", 0 };
 static const char * const output_modules[]           = { "udp", "rtp", "linsys-asi", 0 };
-static const char * const addable_streams[]          = { "audio", "ttx" };
-
-static const char * system_opts[] = { "system-type", NULL };
-static const char * input_opts[]  = { "location", "card-idx", "video-format", "video-connection", "audio-connection", NULL };
+static const char * const addable_streams[]          = { "audio", "ttx", "video", 0 };
+
+static const char * system_opts[] = { "system-type", "input-cpus", "video-filter-cpus", "audio-filter-cpus", "video-encoder-cpus",
+                                      "audio-encoder-cpus", "enc-smoothing-cpus", "mux-cpus", "mux-smoothing-cpus", "output-cpus",
+                                      "input-priority", "video-filter-priority", "audio-filter-priority", "video-encoder-priority",
+                                      "audio-encoder-priority", "enc-smoothing-priority", "mux-priority", "mux-smoothing-priority",
+                                      "output-priority", "lock-memory", "heap-reserve", "isolate-cpus", "huge-pages",
+                                      "video-filter-shed", "video-encoder-shed", "enc-smoothing-shed", "mux-shed",
+                                      "video-filter-high-water", "video-encoder-high-water", "enc-smoothing-high-water", "mux-high-water", NULL };
+static const int overload_stages[] = { OBE_STAGE_VIDEO_FILTER, OBE_STAGE_VIDEO_ENCODER, OBE_STAGE_ENC_SMOOTHING, OBE_STAGE_MUX };
+#define NUM_OVERLOAD_STAGES 4
+static const char * input_opts[]  = { "location", "card-idx", "video-format", "video-connection", "audio-connection", "numa-node", "pacing", "probe-cache", "dump", "loop", "buffer-dump", NULL };
 static const char * add_opts[] =    { "type" };
 /* TODO: split the stream options into general options, video options, ts options */
 static const char * stream_opts[] = { "action", "format",
@@ -92,7 +105,7 @@ static const char * stream_opts[] = { "action", "format",
                                       "vbv-maxrate", "vbv-bufsize", "bitrate",
                                       "profile", "level", "keyint", "lookahead", "threads", "bframes", "b-pyramid", "weightp",
                                       "interlaced", "tff", "frame-packing", "csp", "filler", "intra-refresh", "aspect-ratio",
-                                      "width", "max-refs",
+                                      "width", "height", "max-refs",
 
                                       /* Audio options */
                                       "sdi-audio-pair", "channel-map", "mono-channel",
@@ -411,7 +424,24 @@ static int add_stream( char *command, obecli_command_t *child )
 
     memset( &cli.output_streams[output_stream_id], 0, sizeof(*cli.output_streams) );
 
-    if( !strcasecmp( type, addable_streams[0] ) ) /* Audio */
+    if( !strcasecmp( type, addable_streams[2] ) ) /* Video (ABR rung) */
+    {
+        /* Start from the settings of the first video stream. The new rung shares its capture */
+        for( int i = 0; i < cli.num_output_streams; i++ )
+        {
+            int input_stream_id = cli.output_streams[i].input_stream_id;
+            if( i != output_stream_id && input_stream_id >= 0 &&
+                cli.program.streams[input_stream_id].stream_type == STREAM_TYPE_VIDEO )
+            {
+                memcpy( &cli.output_streams[output_stream_id], &cli.output_streams[i], sizeof(*cli.output_streams) );
+                cli.output_streams[output_stream_id].stream_action = STREAM_ENCODE;
+                cli.output_streams[output_stream_id].stream_format = VIDEO_AVC;
+                cli.output_streams[output_stream_id].ts_opts.pid = 0;
+                break;
+            }
+        }
+    }
+    else if( !strcasecmp( type, addable_streams[0] ) ) /* Audio */
     {
         cli.output_streams[output_stream_id].input_stream_id = 1; /* FIXME when more stream types are allowed */
         cli.output_streams[output_stream_id].sdi_audio_pair = 1;
@@ -491,6 +521,47 @@ static int set_obe( char *command, obecli_command_t *child )
             obe_set_config( cli.h, system_type_value );
         }
 
+        /* The cpu list and priority options follow system-type in the same order as enum obe_stage_e */
+        for( int i = 0; i < OBE_NUM_STAGES; i++ )
+        {
+            char *cpu_list = obe_get_option( system_opts[i+1], opts );
+            FAIL_IF_ERROR( cpu_list && obe_set_stage_affinity( cli.h, i, cpu_list ) < 0,
+                           "Invalid %s\n", system_opts[i+1] );
+
+            char *priority = obe_get_option( system_opts[OBE_NUM_STAGES+i+1], opts );
+            cli.rt_opts.priority[i] = obe_otoi( priority, cli.rt_opts.priority[i] );
+        }
+
+        char *lock_memory  = obe_get_option( system_opts[2*OBE_NUM_STAGES+1], opts );
+        char *heap_reserve = obe_get_option( system_opts[2*OBE_NUM_STAGES+2], opts );
+        char *isolate_cpus = obe_get_option( system_opts[2*OBE_NUM_STAGES+3], opts );
+        char *huge_pages   = obe_get_option( system_opts[2*OBE_NUM_STAGES+4], opts );
+
+        cli.rt_opts.lock_memory  = obe_otob( lock_memory, cli.rt_opts.lock_memory );
+        cli.rt_opts.heap_reserve = obe_otoi( heap_reserve, cli.rt_opts.heap_reserve );
+        cli.rt_opts.isolate_cpus = obe_otob( isolate_cpus, cli.rt_opts.isolate_cpus );
+        cli.rt_opts.huge_pages   = obe_otob( huge_pages, cli.rt_opts.huge_pages );
+
+        FAIL_IF_ERROR( obe_set_rt_profile( cli.h, &cli.rt_opts ) < 0, "Invalid real-time profile\n" );
+
+        for( int i = 0; i < NUM_OVERLOAD_STAGES; i++ )
+        {
+            char *shed_policy = obe_get_option( system_opts[2*OBE_NUM_STAGES+5+i], opts );
+            char *high_water  = obe_get_option( system_opts[2*OBE_NUM_STAGES+5+NUM_OVERLOAD_STAGES+i], opts );
+            int stage = overload_stages[i];
+
+            FAIL_IF_ERROR( shed_policy && ( check_enum_value( shed_policy, shed_policies ) < 0 ),
+                           "Invalid %s\n", system_opts[2*OBE_NUM_STAGES+5+i] );
+
+            if( shed_policy )
+                parse_enum_value( shed_policy, shed_policies, &cli.shed_policy[stage] );
+            cli.high_water[stage] = obe_otoi( high_water, cli.high_water[stage] );
+
+            if( shed_policy || high_water )
+                FAIL_IF_ERROR( obe_set_overload_policy( cli.h, stage, cli.shed_policy[stage], cli.high_water[stage] ) < 0,
+                               "Invalid overload policy\n" );
+        }
+
         obe_free_string_array( opts );
     }
 
@@ -518,6 +589,12 @@ static int set_input( char *command, obecli_command_t *child )
         char *video_format = obe_get_option( input_opts[2], opts );
         char *video_connection = obe_get_option( input_opts[3], opts );
         char *audio_connection = obe_get_option( input_opts[4], opts );
+        char *numa_node    = obe_get_option( input_opts[5], opts );
+        char *pacing       = obe_get_option( input_opts[6], opts );
+        char *probe_cache  = obe_get_option( input_opts[7], opts );
+        char *dump         = obe_get_option( input_opts[8], opts );
+        char *loop         = obe_get_option( input_opts[9], opts );
+        char *buffer_dump  = obe_get_option( input_opts[10], opts );
 
         FAIL_IF_ERROR( video_format && ( check_enum_value( video_format, input_video_formats ) < 0 ),
                        "Invalid video format\n" );
@@ -528,6 +605,9 @@ static int set_input( char *command, obecli_command_t *child )
         FAIL_IF_ERROR( audio_connection && ( check_enum_value( audio_connection, input_audio_connections ) < 0 ),
                        "Invalid audio connection\n" );
 
+        FAIL_IF_ERROR( pacing && ( check_enum_value( pacing, replay_pacings ) < 0 ),
+                       "Invalid pacing\n" );
+
         if( location )
         {
              if( cli.input.location )
@@ -538,13 +618,52 @@ static int set_input( char *command, obecli_command_t *child )
              strcpy( cli.input.location, location );
         }
 
+        if( probe_cache )
+        {
+             if( cli.input.probe_cache )
+                 free( cli.input.probe_cache );
+
+             cli.input.probe_cache = malloc( strlen( probe_cache ) + 1 );
+             FAIL_IF_ERROR( !cli.input.probe_cache, "malloc failed\n" );
+             strcpy( cli.input.probe_cache, probe_cache );
+        }
+
+        if( dump )
+        {
+             if( cli.input.dump_location )
+                 free( cli.input.dump_location );
+
+             cli.input.dump_location = malloc( strlen( dump ) + 1 );
+             FAIL_IF_ERROR( !cli.input.dump_location, "malloc failed\n" );
+             strcpy( cli.input.dump_location, dump );
+        }
+
+        if( buffer_dump )
+        {
+             if( cli.input.buffer_dump_location )
+                 free( cli.input.buffer_dump_location );
+
+             cli.input.buffer_dump_location = malloc( strlen( buffer_dump ) + 1 );
+             FAIL_IF_ERROR( !cli.input.buffer_dump_location, "malloc failed\n" );
+             strcpy( cli.input.buffer_dump_location, buffer_dump );
+        }
+
         cli.input.card_idx = obe_otoi( card_idx, cli.input.card_idx );
+        if( numa_node )
+        {
+            /* A negative node goes back to detecting it */
+            cli.input.numa_node = obe_otoi( numa_node, -1 );
+            cli.input.has_numa_node = cli.input.numa_node >= 0;
+        }
         if( video_format )
             parse_enum_value( video_format, input_video_formats, &cli.input.video_format );
         if( video_connection )
             parse_enum_value( video_connection, input_video_connections, &cli.input.video_connection );
         if( audio_connection )
             parse_enum_value( audio_connection, input_audio_connections, &cli.input.audio_connection );
+        if( pacing )
+            parse_enum_value( pacing, replay_pacings, &cli.input.replay_pacing );
+        cli.input.replay_loop = obe_otob( loop, cli.input.replay_loop );
 
         obe_free_string_array( opts );
     }
@@ -614,24 +733,25 @@ static int set_stream( char *command, obecli_command_t *child )
             char *intra_refresh = obe_get_option( stream_opts[18], opts );
             char *aspect_ratio = obe_get_option( stream_opts[19], opts );
             char *width = obe_get_option( stream_opts[20], opts );
-            char *max_refs = obe_get_option( stream_opts[21], opts );
+            char *height = obe_get_option( stream_opts[21], opts );
+            char *max_refs = obe_get_option( stream_opts[22], opts );
 
             /* Audio Options */
-            char *sdi_audio_pair = obe_get_option( stream_opts[22], opts );
-            char *channel_map    = obe_get_option( stream_opts[23], opts );
-            char *mono_channel   = obe_get_option( stream_opts[24], opts );
+            char *sdi_audio_pair = obe_get_option( stream_opts[23], opts );
+            char *channel_map    = obe_get_option( stream_opts[24], opts );
+            char *mono_channel   = obe_get_option( stream_opts[25], opts );
 
             /* AAC options */
-            char *aac_profile = obe_get_option( stream_opts[25], opts );
-            char *aac_encap   = obe_get_option( stream_opts[26], opts );
+            char *aac_profile = obe_get_option( stream_opts[26], opts );
+            char *aac_encap   = obe_get_option( stream_opts[27], opts );
 
             /* MP2 options */
-            char *mp2_mode    = obe_get_option( stream_opts[27], opts );
+            char *mp2_mode    = obe_get_option( stream_opts[28], opts );
 
             /* NB: remap these and the ttx values below if more encoding options are added - TODO: split them up */
-            char *pid         = obe_get_option( stream_opts[28], opts );
-            char *lang        = obe_get_option( stream_opts[29], opts );
-            char *audio_type  = obe_get_option( stream_opts[30], opts );
+            char *pid         = obe_get_option( stream_opts[29], opts );
+            char *lang        = obe_get_option( stream_opts[30], opts );
+            char *audio_type  = obe_get_option( stream_opts[31], opts );
 
             if( input_stream->stream_type == STREAM_TYPE_VIDEO )
             {
@@ -661,15 +781,17 @@ static int set_stream( char *command, obecli_command_t *child )
                     }
                 }
 
-                if( width )
+                if( width || height )
                 {
                     int i_width = obe_otoi( width, avc_param->i_width );
-                    while( allowed_resolutions[i][0] && ( allowed_resolutions[i][1] != avc_param->i_height ||
+                    int i_height = obe_otoi( height, avc_param->i_height );
+                    while( allowed_resolutions[i][0] && ( allowed_resolutions[i][1] != i_height ||
                            allowed_resolutions[i][0] != i_width ) )
                        i++;
 
                     FAIL_IF_ERROR( !allowed_resolutions[i][0], "Invalid resolution. \n" );
                     avc_param->i_width = i_width;
+                    avc_param->i_height = i_height;
                 }
 
                 /* Set it to encode by default */
@@ -812,10 +934,10 @@ static int set_stream( char *command, obecli_command_t *child )
                      output_stream->stream_format == VBI_RAW )
             {
                 /* NB: remap these if more encoding options are added - TODO: split them up */
-                char *ttx_lang = obe_get_option( stream_opts[32], opts );
-                char *ttx_type = obe_get_option( stream_opts[33], opts );
-                char *ttx_mag  = obe_get_option( stream_opts[34], opts );
-                char *ttx_page = obe_get_option( stream_opts[35], opts );
+                char *ttx_lang = obe_get_option( stream_opts[33], opts );
+                char *ttx_type = obe_get_option( stream_opts[34], opts );
+                char *ttx_mag  = obe_get_option( stream_opts[35], opts );
+                char *ttx_page = obe_get_option( stream_opts[36], opts );
 
                 FAIL_IF_ERROR( ttx_type && ( check_enum_value( ttx_type, teletext_types ) < 0 ),
                                "Invalid Teletext type\n" );
@@ -844,10 +966,10 @@ static int set_stream( char *command, obecli_command_t *child )
                 if( output_stream->stream_format == VBI_RAW )
                 {
                     obe_dvb_vbi_opts_t *vbi_opts = &cli.output_streams[output_stream_id].dvb_vbi_opts;
-                    char *vbi_ttx = obe_get_option( stream_opts[36], opts );
-                    char *vbi_inv_ttx = obe_get_option( stream_opts[37], opts );
-                    char *vbi_vps  = obe_get_option( stream_opts[38], opts );
-                    char *vbi_wss = obe_get_option( stream_opts[39], opts );
+                    char *vbi_ttx = obe_get_option( stream_opts[37], opts );
+                    char *vbi_inv_ttx = obe_get_option( stream_opts[38], opts );
+                    char *vbi_vps  = obe_get_option( stream_opts[39], opts );
+                    char *vbi_wss = obe_get_option( stream_opts[40], opts );
 
                     vbi_opts->ttx = obe_otob( vbi_ttx, vbi_opts->ttx );
                     vbi_opts->inverted_ttx = obe_otob( vbi_inv_ttx, vbi_opts->inverted_ttx );
@@ -1008,6 +1130,38 @@ static int show_bitdepth( char *command, obecli_command_t *child )
     return 0;
 }
 
+static int show_clock( char *command, obecli_command_t *child )
+{
+    obe_clock_stats_t stats;
+
+    FAIL_IF_ERROR( !running, "Encoder not running\n" );
+
+    obe_get_clock_stats( cli.h, &stats );
+
+    printf( "Input clock: %s \n", stats.locked ? "locked" : "locking" );
+    printf( "       drift:  %.2f ppm \n", stats.drift_ppm );
+    printf( "       jitter: %.1f us (max %.1f us) \n", stats.jitter_us, stats.max_jitter_us );
+    printf( "       ticks:  %"PRIi64" (%"PRIi64" discontinuities) \n", stats.num_ticks, stats.num_resets );
+
+    return 0;
+}
+
+static int show_memory( char *command, obecli_command_t *child )
+{
+    obe_mem_stats_t stats;
+
+    FAIL_IF_ERROR( !running, "Encoder not running\n" );
+
+    printf( "Memory:  %-18s %12s %12s %12s \n", "stage", "in use (kB)", "peak (kB)", "allocs/s" );
+    for( int i = 0; i < OBE_MEM_NUM_TAGS; i++ )
+    {
+        obe_get_mem_stats( i, &stats );
+        printf( "         %-18s %12"PRIi64" %12"PRIi64" %12.1f \n", obe_get_mem_tag_name( i ), stats.bytes >> 10, stats.peak_bytes >> 10, stats.allocs_per_sec );
+    }
+
+    return 0;
+}
+
 static int show_decoders( char *command, obecli_command_t *child )
 {
     printf( "\nSupported Decoders: \n" );
@@ -1363,6 +1517,24 @@ static int stop_encode( char *command, obecli_command_t *child )
         cli.input.location = NULL;
     }
 
+    if( cli.input.probe_cache )
+    {
+        free( cli.input.probe_cache );
+        cli.input.probe_cache = NULL;
+    }
+
+    if( cli.input.dump_location )
+    {
+        free( cli.input.dump_location );
+        cli.input.dump_location = NULL;
+    }
+
+    if( cli.input.buffer_dump_location )
+    {
+        free( cli.input.buffer_dump_location );
+        cli.input.buffer_dump_location = NULL;
+    }
+
     if( cli.mux_opts.service_name )
     {
         free( cli.mux_opts.service_name );
@@ -1489,6 +1661,9 @@ int main( int argc, char **argv )
     }
 
     cli.avc_profile = -1;
+    obe_get_rt_profile( cli.h, &cli.rt_opts );
+    cli.shed_policy[OBE_STAGE_VIDEO_FILTER] = OBE_SHED_DROP_OLDEST;
+    cli.shed_policy[OBE_STAGE_VIDEO_ENCODER] = OBE_SHED_DROP_OLDEST;
 
     printf( "\nOpen Broadcast Encoder command line interface.\n" );
     printf( "Version 1.0 \n" );
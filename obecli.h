@@ -51,6 +51,8 @@ static int set_output( char *command, obecli_command_t *child );
 static int set_outputs( char *command, obecli_command_t *child );
 
 static int show_bitdepth( char *command, obecli_command_t *child );
+static int show_clock( char *command, obecli_command_t *child );
+static int show_memory( char *command, obecli_command_t *child );
 static int show_decoders( char *command, obecli_command_t *child );
 static int show_encoders( char *command, obecli_command_t *child );
 static int show_help( char *command, obecli_command_t *child );
@@ -124,11 +126,13 @@ static obecli_command_t remove_commands[] =
 static obecli_command_t show_commands[] =
 {
     { "bitdepth", "",  "Show AVC encoder bit depth", show_bitdepth, NULL },
+    { "clock",    "",  "Show input clock statistics", show_clock,   NULL },
     { "decoders", "",  "Show supported decoders",    show_decoders, NULL },
     { "encoders", "",  "Show supported encoders",    show_encoders, NULL },
     //{ "filters",  "",  "Show supported filters",   show_filters, NULL },
     { "input",    "streams",  "Show input streams",  show_input,   NULL },
     { "inputs",   "",  "Show supported inputs",      show_inputs,   NULL },
+    { "memory",   "",  "Show memory held by each stage", show_memory, NULL },
     { "muxers",   "",  "Show supported muxers",      show_muxers,   NULL },
     { "output",   "streams",  "Show output streams", show_output,   NULL },
     { "outputs",  "",  "Show supported outputs",     show_outputs,  NULL },
@@ -167,6 +171,7 @@ static const obecli_input_name_t input_names[] =
     { INPUT_URL,             "URL",      "URL (includes UDP and RTP)",             "libavformat" },
     { INPUT_DEVICE_DECKLINK, "Decklink", "Blackmagic Design Decklink input",       "internal" },
     { INPUT_DEVICE_DECKLINK, "Linsys SDI", "Linear Systems (DVEO) SDI card input", "internal" },
+    { INPUT_FILE,            "File",     "Replay of a recorded SDI capture",       "internal" },
     { 0, 0, 0 },
 };
 
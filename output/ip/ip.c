@@ -57,6 +57,10 @@ struct ip_status
 {
     obe_output_t *output;
     hnd_t *ip_handle;
+    obe_ts_slice_t ***muxed_data;
+    /* The slices from cur_muxed_data to num_muxed_data have not been sent yet */
+    int num_muxed_data;
+    int cur_muxed_data;
 };
 
 static int rtp_open( hnd_t *p_handle, obe_udp_opts_t *udp_opts )
@@ -173,8 +177,14 @@ static void close_output( void *handle )
     }
     if( status->output->output_dest.target  )
         free( status->output->output_dest.target );
-
-    pthread_mutex_unlock( &status->output->queue.mutex );
+    /* Release the rest of the batch if we were cancelled while sending it */
+    for( int i = status->cur_muxed_data; i < status->num_muxed_data; i++ )
+        destroy_muxed_data( (*status->muxed_data)[i]->page );
+    free( *status->muxed_data );
+
+    /* A locked queue is held if we were cancelled inside obe_queue_wait */
+    if( !status->output->queue.spsc )
+        pthread_mutex_unlock( &status->output->queue.mutex );
 }
 
 static void *open_output( void *ptr )
@@ -183,18 +193,23 @@ static void *open_output( void *ptr )
     obe_output_dest_t *output_dest = &output->output_dest;
     struct ip_status status;
     hnd_t ip_handle = NULL;
-    int num_muxed_data = 0;
-    AVBufferRef **muxed_data;
+    obe_ts_slice_t **muxed_data = NULL;
     obe_udp_opts_t udp_opts;
 
-    struct sched_param param = {0};
-    param.sched_priority = 99;
-    pthread_setschedparam( pthread_self(), SCHED_FIFO, &param );
-
     status.output = output;
     status.ip_handle = &ip_handle;
+    status.muxed_data = &muxed_data;
+    status.num_muxed_data = status.cur_muxed_data = 0;
     pthread_cleanup_push( close_output, (void*)&status );
 
+    /* Private batch which the whole queue is drained into */
+    muxed_data = malloc( output->queue.capacity * sizeof(*muxed_data) );
+    if( !muxed_data )
+    {
+        fprintf( stderr, "[ip] malloc failed" );
+        return NULL;
+    }
+
     udp_populate_opts( &udp_opts, output_dest->target );
 
     if( output_dest->type == OUTPUT_RTP )
@@ -213,52 +228,31 @@ static void *open_output( void *ptr )
 
     while( 1 )
     {
-        pthread_mutex_lock( &output->queue.mutex );
-        while( !output->queue.size && !output->cancel_thread )
-        {
-            /* Often this cond_wait is not because of an underflow */
-            pthread_cond_wait( &output->queue.in_cv, &output->queue.mutex );
-        }
-
-        if( output->cancel_thread )
-        {
-            pthread_mutex_unlock( &output->queue.mutex );
+        /* Often this wait is not because of an underflow */
+        if( obe_queue_wait( &output->queue, 0, &output->cancel_thread ) < 0 )
             break;
-        }
 
-        num_muxed_data = output->queue.size;
-
-        muxed_data = malloc( num_muxed_data * sizeof(*muxed_data) );
-        if( !muxed_data )
-        {
-            pthread_mutex_unlock( &output->queue.mutex );
-            syslog( LOG_ERR, "Malloc failed\n" );
-            return NULL;
-        }
-        memcpy( muxed_data, output->queue.queue, num_muxed_data * sizeof(*muxed_data) );
-        pthread_mutex_unlock( &output->queue.mutex );
+        status.num_muxed_data = obe_queue_drain( &output->queue, (void**)muxed_data );
 
-//        printf("\n START %i \n", num_muxed_data );
+//        printf("\n START %i \n", status.num_muxed_data );
 
-        for( int i = 0; i < num_muxed_data; i++ )
+        for( status.cur_muxed_data = 0; status.cur_muxed_data < status.num_muxed_data; status.cur_muxed_data++ )
         {
+            int i = status.cur_muxed_data;
+
             if( output_dest->type == OUTPUT_RTP )
             {
-                if( write_rtp_pkt( ip_handle, &muxed_data[i]->data[7*sizeof(int64_t)], TS_PACKETS_SIZE, AV_RN64( muxed_data[i]->data ) ) < 0 )
+                if( write_rtp_pkt( ip_handle, muxed_data[i]->data, TS_PACKETS_SIZE, muxed_data[i]->pcr ) < 0 )
                     syslog( LOG_ERR, "[rtp] Failed to write RTP packet\n" );
             }
             else
             {
-                if( udp_write( ip_handle, &muxed_data[i]->data[7*sizeof(int64_t)], TS_PACKETS_SIZE ) < 0 )
+                if( udp_write( ip_handle, muxed_data[i]->data, TS_PACKETS_SIZE ) < 0 )
                     syslog( LOG_ERR, "[udp] Failed to write UDP packet\n" );
             }
 
-            remove_from_queue( &output->queue );
-            av_buffer_unref( &muxed_data[i] );
+            destroy_muxed_data( muxed_data[i]->page );
         }
-
-        free( muxed_data );
-        muxed_data = NULL;
     }
 
     pthread_cleanup_pop( 1 );
@@ -0,0 +1,536 @@
+/*****************************************************************************
+ * capture_path_test.cpp: Drives the Decklink capture path with mock frames
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+/* Runs the SDK callback body and the capture thread from decklink.cpp with mock frames.
+ * Needs neither a card nor the SDK library, only the interface headers:
+ *     make test */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "input/sdi/decklink/capture_path.h"
+
+#define NUM_FRAMES     200
+#define TIMESCALE      27000000
+#define FRAME_DURATION 1080000 /* 27MHz ticks at 25fps */
+#define FRAME_TIME     40000   /* us at 25fps */
+#define MAX_DELAY      50000
+
+static int failed;
+
+#define CHECK( cond, ... ) \
+do { \
+    if( !(cond) ) \
+    { \
+        fprintf( stderr, "FAIL %s:%i: ", __func__, __LINE__ ); \
+        fprintf( stderr, __VA_ARGS__ ); \
+        fprintf( stderr, "\n" ); \
+        failed = 1; \
+    } \
+} while( 0 )
+
+class MockVideoFrame : public IDeckLinkVideoInputFrame
+{
+public:
+    MockVideoFrame() : ref_(1), idx_(0), time_idx_(0), flags_(bmdFrameFlagDefault) {}
+
+    void SetIndex( int idx ) { idx_ = time_idx_ = idx; }
+    /* The stream time restarts after a format change */
+    void SetTimeIndex( int time_idx ) { time_idx_ = time_idx; }
+    void SetFlags( BMDFrameFlags flags ) { flags_ = flags; }
+    int GetIndex( void ) { return idx_; }
+    int GetRefCount( void ) { return __atomic_load_n( &ref_, __ATOMIC_SEQ_CST ); }
+
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface( REFIID iid, LPVOID *ppv ) { return E_NOINTERFACE; }
+    virtual ULONG STDMETHODCALLTYPE AddRef( void ) { return __atomic_add_fetch( &ref_, 1, __ATOMIC_SEQ_CST ); }
+    /* The test owns the frames, so the count never reaching zero is not a leak */
+    virtual ULONG STDMETHODCALLTYPE Release( void ) { return __atomic_sub_fetch( &ref_, 1, __ATOMIC_SEQ_CST ); }
+
+    virtual long GetWidth( void ) { return 1920; }
+    virtual long GetHeight( void ) { return 1080; }
+    virtual long GetRowBytes( void ) { return 5120; }
+    virtual BMDPixelFormat GetPixelFormat( void ) { return bmdFormat10BitYUV; }
+    virtual BMDFrameFlags GetFlags( void ) { return flags_; }
+    virtual HRESULT GetBytes( void **buffer ) { *buffer = NULL; return E_FAIL; }
+    virtual HRESULT GetTimecode( BMDTimecodeFormat format, IDeckLinkTimecode **timecode ) { return E_FAIL; }
+    virtual HRESULT GetAncillaryData( IDeckLinkVideoFrameAncillary **ancillary ) { return E_FAIL; }
+
+    virtual HRESULT GetStreamTime( BMDTimeValue *frameTime, BMDTimeValue *frameDuration, BMDTimeScale timeScale )
+    {
+        *frameTime = (BMDTimeValue)time_idx_ * FRAME_DURATION;
+        *frameDuration = FRAME_DURATION;
+        return S_OK;
+    }
+    virtual HRESULT GetHardwareReferenceTimestamp( BMDTimeScale timeScale, BMDTimeValue *frameTime, BMDTimeValue *frameDuration )
+    {
+        return GetStreamTime( frameTime, frameDuration, timeScale );
+    }
+
+    virtual ~MockVideoFrame() {}
+
+private:
+    int ref_;
+    int idx_;
+    int time_idx_;
+    BMDFrameFlags flags_;
+};
+
+class MockAudioPacket : public IDeckLinkAudioInputPacket
+{
+public:
+    MockAudioPacket() : ref_(1), idx_(0) {}
+
+    void SetIndex( int idx ) { idx_ = idx; }
+    int GetIndex( void ) { return idx_; }
+    int GetRefCount( void ) { return __atomic_load_n( &ref_, __ATOMIC_SEQ_CST ); }
+
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface( REFIID iid, LPVOID *ppv ) { return E_NOINTERFACE; }
+    virtual ULONG STDMETHODCALLTYPE AddRef( void ) { return __atomic_add_fetch( &ref_, 1, __ATOMIC_SEQ_CST ); }
+    virtual ULONG STDMETHODCALLTYPE Release( void ) { return __atomic_sub_fetch( &ref_, 1, __ATOMIC_SEQ_CST ); }
+
+    virtual long GetSampleFrameCount( void ) { return 1920; }
+    virtual HRESULT GetBytes( void **buffer ) { *buffer = NULL; return E_FAIL; }
+    virtual HRESULT GetPacketTime( BMDTimeValue *packetTime, BMDTimeScale timeScale )
+    {
+        *packetTime = (BMDTimeValue)idx_ * FRAME_DURATION;
+        return S_OK;
+    }
+
+    virtual ~MockAudioPacket() {}
+
+private:
+    int ref_;
+    int idx_;
+};
+
+static MockVideoFrame video_frames[NUM_FRAMES];
+static MockAudioPacket audio_packets[NUM_FRAMES];
+
+/* The callback's wallclock, advanced by the test */
+static int64_t mock_time;
+
+static void init_frames( void )
+{
+    for( int i = 0; i < NUM_FRAMES; i++ )
+    {
+        video_frames[i].SetIndex( i );
+        video_frames[i].SetFlags( bmdFrameFlagDefault );
+        audio_packets[i].SetIndex( i );
+    }
+}
+
+static void check_released( const char *name )
+{
+    for( int i = 0; i < NUM_FRAMES; i++ )
+    {
+        CHECK( video_frames[i].GetRefCount() == 1, "%s: video frame %i has %i references", name, i, video_frames[i].GetRefCount() );
+        CHECK( audio_packets[i].GetRefCount() == 1, "%s: audio packet %i has %i references", name, i, audio_packets[i].GetRefCount() );
+    }
+}
+
+typedef struct
+{
+    decklink_capture_path_t path;
+    pthread_t thread;
+    int has_thread;
+    int delay; /* us per packet, to make the callback outrun the capture thread */
+    int format_matches;
+
+    /* Written by the capture thread */
+    int num_received;
+    int received[NUM_FRAMES];
+    int64_t pts[NUM_FRAMES];
+    int reset_obe[NUM_FRAMES];
+    int num_audio;
+    int audio_mismatch;
+
+    /* Written by the callback */
+    int num_ticks;
+    int ticks_backwards;
+    int64_t last_tick;
+    int num_drops;
+    int num_format_checks;
+} harness_t;
+
+static int64_t mock_mdate( void )
+{
+    return __atomic_load_n( &mock_time, __ATOMIC_SEQ_CST );
+}
+
+static void mock_clock_tick( void *opaque, int64_t stream_time )
+{
+    harness_t *harness = (harness_t*)opaque;
+
+    if( harness->num_ticks && stream_time <= harness->last_tick )
+        harness->ticks_backwards = 1;
+    harness->last_tick = stream_time;
+    harness->num_ticks++;
+}
+
+static int mock_check_format( void *opaque )
+{
+    harness_t *harness = (harness_t*)opaque;
+
+    harness->num_format_checks++;
+    return harness->format_matches;
+}
+
+static void mock_drop( void *opaque )
+{
+    ((harness_t*)opaque)->num_drops++;
+}
+
+/* Stands in for process_capture */
+static void mock_process( void *opaque, const decklink_capture_t *capture )
+{
+    harness_t *harness = (harness_t*)opaque;
+    BMDTimeValue frame_time, frame_duration;
+
+    if( capture->videoframe )
+    {
+        MockVideoFrame *videoframe = (MockVideoFrame*)capture->videoframe;
+
+        videoframe->GetStreamTime( &frame_time, &frame_duration, TIMESCALE );
+        harness->received[harness->num_received] = videoframe->GetIndex();
+        harness->pts[harness->num_received] = frame_time + capture->time_offset;
+        harness->reset_obe[harness->num_received] = capture->reset_obe;
+        harness->num_received++;
+
+        if( capture->audioframe && ((MockAudioPacket*)capture->audioframe)->GetIndex() != videoframe->GetIndex() )
+            harness->audio_mismatch = 1;
+    }
+
+    if( capture->audioframe )
+        harness->num_audio++;
+
+    if( harness->delay )
+        usleep( harness->delay );
+}
+
+static void start_harness( harness_t *harness, int probe, int delay, int with_thread )
+{
+    memset( harness, 0, sizeof(*harness) );
+    harness->delay = delay;
+    harness->format_matches = 1;
+
+    harness->path.ops.opaque = harness;
+    harness->path.ops.mdate = mock_mdate;
+    harness->path.ops.clock_tick = mock_clock_tick;
+    harness->path.ops.check_format = mock_check_format;
+    harness->path.ops.drop = mock_drop;
+    harness->path.ops.process = mock_process;
+    harness->path.probe = probe;
+    harness->path.timescale = TIMESCALE;
+    harness->path.max_delay = MAX_DELAY;
+    decklink_capture_path_init( &harness->path );
+
+    __atomic_store_n( &mock_time, 1000000, __ATOMIC_SEQ_CST );
+
+    if( with_thread )
+    {
+        pthread_create( &harness->thread, NULL, decklink_capture_worker, &harness->path );
+        harness->has_thread = 1;
+    }
+}
+
+static void stop_harness( harness_t *harness )
+{
+    capture_ring_stop( &harness->path.ring );
+    if( harness->has_thread )
+        pthread_join( harness->thread, NULL );
+    decklink_capture_path_close( &harness->path );
+}
+
+/* One SDK callback, a frame period after the previous one */
+static void frame_arrived( harness_t *harness, int idx, int with_video, int with_audio )
+{
+    __atomic_add_fetch( &mock_time, FRAME_TIME, __ATOMIC_SEQ_CST );
+    decklink_frame_arrived( &harness->path, with_video ? &video_frames[idx] : NULL, with_audio ? &audio_packets[idx] : NULL );
+}
+
+/* A capture thread that keeps up receives everything, in order, with the clock ticked per frame */
+static void test_ordering( void )
+{
+    harness_t harness;
+
+    start_harness( &harness, 0, 0, 1 );
+
+    for( int i = 0; i < NUM_FRAMES; i++ )
+    {
+        frame_arrived( &harness, i, 1, i % 3 == 0 );
+        /* Never let the ring fill so every frame is expected */
+        if( i % (DECKLINK_CAPTURE_FRAMES / 2) == 0 )
+            capture_ring_wait_idle( &harness.path.ring );
+    }
+
+    capture_ring_wait_idle( &harness.path.ring );
+    stop_harness( &harness );
+
+    CHECK( harness.num_received == NUM_FRAMES, "received %i of %i frames", harness.num_received, NUM_FRAMES );
+    for( int i = 0; i < harness.num_received; i++ )
+    {
+        CHECK( harness.received[i] == i, "frame %i arrived in position %i", harness.received[i], i );
+        CHECK( !harness.reset_obe[i], "frame %i flagged a reset", harness.received[i] );
+        if( i )
+            CHECK( harness.pts[i] == harness.pts[i-1] + FRAME_DURATION, "frame %i pts %lli after %lli", harness.received[i],
+                   (long long)harness.pts[i], (long long)harness.pts[i-1] );
+    }
+    CHECK( harness.num_audio == (NUM_FRAMES + 2) / 3, "received %i audio packets", harness.num_audio );
+    CHECK( !harness.audio_mismatch, "audio was paired with the wrong frame" );
+    CHECK( harness.num_ticks == NUM_FRAMES && !harness.ticks_backwards, "clock ticked %i times%s", harness.num_ticks,
+           harness.ticks_backwards ? ", backwards" : "" );
+    CHECK( !harness.num_drops, "%i drops without falling behind", harness.num_drops );
+    CHECK( harness.num_format_checks == 1, "format checked %i times", harness.num_format_checks );
+    check_released( __func__ );
+
+    printf( "ordering: %i frames in order\n", harness.num_received );
+}
+
+/* A slow capture thread makes the callback drop frames rather than block, and the frames that
+ * get through are still in order */
+static void test_slow_consumer( void )
+{
+    harness_t harness;
+
+    start_harness( &harness, 0, 2000, 1 );
+
+    for( int i = 0; i < NUM_FRAMES; i++ )
+    {
+        frame_arrived( &harness, i, 1, 1 );
+        usleep( 200 );
+    }
+
+    capture_ring_wait_idle( &harness.path.ring );
+    stop_harness( &harness );
+
+    CHECK( harness.num_drops > 0, "a capture thread 10x slower than the callback dropped nothing" );
+    CHECK( harness.num_received + harness.num_drops == NUM_FRAMES, "received %i and dropped %i of %i frames",
+           harness.num_received, harness.num_drops, NUM_FRAMES );
+    for( int i = 1; i < harness.num_received; i++ )
+        CHECK( harness.received[i] > harness.received[i-1], "frame %i arrived after frame %i", harness.received[i],
+               harness.received[i-1] );
+    CHECK( !harness.audio_mismatch, "audio was paired with the wrong frame" );
+    CHECK( harness.num_ticks == NUM_FRAMES, "clock ticked %i times, dropped frames still tick", harness.num_ticks );
+    check_released( __func__ );
+
+    printf( "slow consumer: %i frames received, %i dropped\n", harness.num_received, harness.num_drops );
+}
+
+/* Frames without a signal are neither queued nor clocked */
+static void test_no_signal( void )
+{
+    harness_t harness;
+
+    start_harness( &harness, 0, 0, 1 );
+
+    for( int i = 0; i < 4; i++ )
+        video_frames[i].SetFlags( bmdFrameHasNoInputSource );
+
+    for( int i = 0; i < 8; i++ )
+        frame_arrived( &harness, i, 1, 0 );
+
+    capture_ring_wait_idle( &harness.path.ring );
+    stop_harness( &harness );
+    init_frames();
+
+    CHECK( harness.num_received == 4 && harness.received[0] == 4, "received %i frames starting at %i", harness.num_received,
+           harness.num_received ? harness.received[0] : -1 );
+    CHECK( harness.num_ticks == 4, "clock ticked %i times", harness.num_ticks );
+    check_released( __func__ );
+
+    printf( "no signal: frames without a signal skipped\n" );
+}
+
+/* After a format change the stream time restarts. Timestamps carry on by the wallclock, audio ahead of
+ * the first new frame is dropped and only that frame asks for a reset */
+static void test_format_change( void )
+{
+    harness_t harness;
+    int64_t gap = 3 * FRAME_TIME;
+
+    start_harness( &harness, 0, 0, 1 );
+
+    /* Keep the ring from filling so that the only drop is for the gap */
+    for( int i = 0; i < 10; i++ )
+    {
+        frame_arrived( &harness, i, 1, 1 );
+        capture_ring_wait_idle( &harness.path.ring );
+    }
+
+    /* What change_video_format does on the SDK thread */
+    capture_ring_wait_idle( &harness.path.ring );
+    harness.path.format_changed = 1;
+
+    frame_arrived( &harness, 10, 0, 1 );
+    __atomic_add_fetch( &mock_time, gap - 2 * FRAME_TIME, __ATOMIC_SEQ_CST );
+
+    for( int i = 11; i < 20; i++ )
+    {
+        video_frames[i].SetTimeIndex( i - 11 );
+        frame_arrived( &harness, i, 1, 1 );
+        capture_ring_wait_idle( &harness.path.ring );
+    }
+
+    capture_ring_wait_idle( &harness.path.ring );
+    stop_harness( &harness );
+    init_frames();
+
+    CHECK( harness.num_received == 19, "received %i of 19 frames", harness.num_received );
+    CHECK( harness.num_audio == 19, "received %i audio packets, the one before the new format should be dropped", harness.num_audio );
+    for( int i = 0; i < harness.num_received; i++ )
+        CHECK( harness.reset_obe[i] == (harness.received[i] == 11), "frame %i reset flag %i", harness.received[i], harness.reset_obe[i] );
+    if( harness.num_received == 19 )
+    {
+        CHECK( harness.pts[10] - harness.pts[9] == gap * (TIMESCALE / 1000000), "pts jumped %lli over a %lli us gap",
+               (long long)(harness.pts[10] - harness.pts[9]), (long long)gap );
+        for( int i = 11; i < harness.num_received; i++ )
+            CHECK( harness.pts[i] == harness.pts[i-1] + FRAME_DURATION, "frame %i pts %lli after %lli", harness.received[i],
+                   (long long)harness.pts[i], (long long)harness.pts[i-1] );
+    }
+    CHECK( !harness.ticks_backwards, "clock went backwards" );
+    CHECK( harness.num_drops == 1, "%i drops for one gap longer than the maximum delay", harness.num_drops );
+    check_released( __func__ );
+
+    printf( "format change: timestamps continue and the first new frame resets\n" );
+}
+
+/* A first frame that does not match the probe asks for a reset */
+static void test_probe_mismatch( void )
+{
+    harness_t harness;
+
+    start_harness( &harness, 0, 0, 1 );
+    harness.format_matches = 0;
+
+    for( int i = 0; i < 3; i++ )
+        frame_arrived( &harness, i, 1, 0 );
+
+    capture_ring_wait_idle( &harness.path.ring );
+    stop_harness( &harness );
+
+    CHECK( harness.num_format_checks == 1, "format checked %i times", harness.num_format_checks );
+    CHECK( harness.num_received == 3 && harness.reset_obe[0] && !harness.reset_obe[1] && !harness.reset_obe[2],
+           "only the first frame should reset" );
+    check_released( __func__ );
+
+    printf( "probe mismatch: first frame resets\n" );
+}
+
+/* The probe takes one frame and no audio, notes that audio arrived and drains what it queued */
+static void test_probe( void )
+{
+    harness_t harness;
+
+    start_harness( &harness, 1, 20000, 1 );
+
+    frame_arrived( &harness, 0, 0, 1 );
+    for( int i = 1; i < 6; i++ )
+        frame_arrived( &harness, i, 1, 1 );
+
+    /* The probe stops straight away, the capture thread still finishes the frame */
+    stop_harness( &harness );
+
+    CHECK( harness.path.probe_success && harness.path.probe_audio, "probe success %i audio %i", harness.path.probe_success,
+           harness.path.probe_audio );
+    CHECK( harness.num_received == 1 && harness.received[0] == 1, "probe processed %i frames", harness.num_received );
+    CHECK( harness.num_audio == 0, "probe queued %i audio packets", harness.num_audio );
+    CHECK( harness.path.probe_video_time, "probe video time not set" );
+    CHECK( !harness.num_format_checks, "probe checked against itself" );
+    check_released( __func__ );
+
+    printf( "probe: one frame drained, audio seen\n" );
+}
+
+/* A full ring refuses packets without taking a reference, and closing without draining hands back
+ * every queued reference */
+static void test_backpressure( void )
+{
+    harness_t harness;
+    int i;
+
+    start_harness( &harness, 0, 0, 0 );
+
+    for( i = 0; i < DECKLINK_CAPTURE_FRAMES + 4; i++ )
+    {
+        frame_arrived( &harness, i, 1, 1 );
+
+        if( i < DECKLINK_CAPTURE_FRAMES )
+            CHECK( video_frames[i].GetRefCount() == 2 && audio_packets[i].GetRefCount() == 2, "frame %i was not queued", i );
+        else
+            CHECK( video_frames[i].GetRefCount() == 1 && audio_packets[i].GetRefCount() == 1, "refused frame %i took a reference", i );
+    }
+
+    CHECK( harness.num_drops == 4, "%i drops for 4 refused frames", harness.num_drops );
+
+    stop_harness( &harness );
+    check_released( __func__ );
+
+    printf( "backpressure: %i accepted, 4 refused, queued references released\n", DECKLINK_CAPTURE_FRAMES );
+}
+
+/* A format change waits for the packet being processed, not just for the ring to empty */
+static void test_wait_idle( void )
+{
+    harness_t harness;
+    int num_received;
+
+    start_harness( &harness, 0, 50000, 1 );
+
+    for( int i = 0; i < 3; i++ )
+        frame_arrived( &harness, i, 1, 0 );
+
+    capture_ring_wait_idle( &harness.path.ring );
+
+    pthread_mutex_lock( &harness.path.ring.mutex );
+    num_received = harness.num_received;
+    pthread_mutex_unlock( &harness.path.ring.mutex );
+    CHECK( num_received == 3, "idle with %i of 3 frames done", num_received );
+
+    stop_harness( &harness );
+    check_released( __func__ );
+
+    printf( "wait idle: returned after the last frame was released\n" );
+}
+
+int main( void )
+{
+    init_frames();
+
+    test_ordering();
+    test_slow_consumer();
+    test_no_signal();
+    test_format_change();
+    test_probe_mismatch();
+    test_probe();
+    test_backpressure();
+    test_wait_idle();
+
+    if( failed )
+    {
+        fprintf( stderr, "capture path test failed\n" );
+        return 1;
+    }
+
+    printf( "capture path test passed\n" );
+    return 0;
+}